@@ -0,0 +1,7815 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  // copy_file_range, fallocate, sync_file_range
+#endif
+#include "libpng-loader-utils.h"
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__))
+#define UTIL_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define UTIL_TARGET_AVX2
+#define UTIL_TARGET_F16C
+#define UTIL_TARGET_PCLMUL
+#else
+#include <cpuid.h>
+#define UTIL_TARGET_AVX2 __attribute__((target("avx2")))
+#define UTIL_TARGET_F16C __attribute__((target("avx,f16c")))
+#define UTIL_TARGET_PCLMUL __attribute__((target("pclmul,sse4.1")))
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define UTIL_NEON
+#include <arm_neon.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define UTIL_COPY_FILE_RANGE
+#endif
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// ------ Byte order and checksums ------
+
+static png_uint_32 util_load_be32(const png_byte *p) {
+    return ((png_uint_32)p[0] << 24) | ((png_uint_32)p[1] << 16) |
+           ((png_uint_32)p[2] << 8) | (png_uint_32)p[3];
+}
+
+static void util_store_be32(png_byte *p, png_uint_32 v) {
+    p[0] = (png_byte)(v >> 24);
+    p[1] = (png_byte)(v >> 16);
+    p[2] = (png_byte)(v >> 8);
+    p[3] = (png_byte)v;
+}
+
+static const png_uint_32 util_crc_table[256] = {
+    0x00000000U, 0x77073096U, 0xee0e612cU, 0x990951baU, 0x076dc419U, 0x706af48fU,
+    0xe963a535U, 0x9e6495a3U, 0x0edb8832U, 0x79dcb8a4U, 0xe0d5e91eU, 0x97d2d988U,
+    0x09b64c2bU, 0x7eb17cbdU, 0xe7b82d07U, 0x90bf1d91U, 0x1db71064U, 0x6ab020f2U,
+    0xf3b97148U, 0x84be41deU, 0x1adad47dU, 0x6ddde4ebU, 0xf4d4b551U, 0x83d385c7U,
+    0x136c9856U, 0x646ba8c0U, 0xfd62f97aU, 0x8a65c9ecU, 0x14015c4fU, 0x63066cd9U,
+    0xfa0f3d63U, 0x8d080df5U, 0x3b6e20c8U, 0x4c69105eU, 0xd56041e4U, 0xa2677172U,
+    0x3c03e4d1U, 0x4b04d447U, 0xd20d85fdU, 0xa50ab56bU, 0x35b5a8faU, 0x42b2986cU,
+    0xdbbbc9d6U, 0xacbcf940U, 0x32d86ce3U, 0x45df5c75U, 0xdcd60dcfU, 0xabd13d59U,
+    0x26d930acU, 0x51de003aU, 0xc8d75180U, 0xbfd06116U, 0x21b4f4b5U, 0x56b3c423U,
+    0xcfba9599U, 0xb8bda50fU, 0x2802b89eU, 0x5f058808U, 0xc60cd9b2U, 0xb10be924U,
+    0x2f6f7c87U, 0x58684c11U, 0xc1611dabU, 0xb6662d3dU, 0x76dc4190U, 0x01db7106U,
+    0x98d220bcU, 0xefd5102aU, 0x71b18589U, 0x06b6b51fU, 0x9fbfe4a5U, 0xe8b8d433U,
+    0x7807c9a2U, 0x0f00f934U, 0x9609a88eU, 0xe10e9818U, 0x7f6a0dbbU, 0x086d3d2dU,
+    0x91646c97U, 0xe6635c01U, 0x6b6b51f4U, 0x1c6c6162U, 0x856530d8U, 0xf262004eU,
+    0x6c0695edU, 0x1b01a57bU, 0x8208f4c1U, 0xf50fc457U, 0x65b0d9c6U, 0x12b7e950U,
+    0x8bbeb8eaU, 0xfcb9887cU, 0x62dd1ddfU, 0x15da2d49U, 0x8cd37cf3U, 0xfbd44c65U,
+    0x4db26158U, 0x3ab551ceU, 0xa3bc0074U, 0xd4bb30e2U, 0x4adfa541U, 0x3dd895d7U,
+    0xa4d1c46dU, 0xd3d6f4fbU, 0x4369e96aU, 0x346ed9fcU, 0xad678846U, 0xda60b8d0U,
+    0x44042d73U, 0x33031de5U, 0xaa0a4c5fU, 0xdd0d7cc9U, 0x5005713cU, 0x270241aaU,
+    0xbe0b1010U, 0xc90c2086U, 0x5768b525U, 0x206f85b3U, 0xb966d409U, 0xce61e49fU,
+    0x5edef90eU, 0x29d9c998U, 0xb0d09822U, 0xc7d7a8b4U, 0x59b33d17U, 0x2eb40d81U,
+    0xb7bd5c3bU, 0xc0ba6cadU, 0xedb88320U, 0x9abfb3b6U, 0x03b6e20cU, 0x74b1d29aU,
+    0xead54739U, 0x9dd277afU, 0x04db2615U, 0x73dc1683U, 0xe3630b12U, 0x94643b84U,
+    0x0d6d6a3eU, 0x7a6a5aa8U, 0xe40ecf0bU, 0x9309ff9dU, 0x0a00ae27U, 0x7d079eb1U,
+    0xf00f9344U, 0x8708a3d2U, 0x1e01f268U, 0x6906c2feU, 0xf762575dU, 0x806567cbU,
+    0x196c3671U, 0x6e6b06e7U, 0xfed41b76U, 0x89d32be0U, 0x10da7a5aU, 0x67dd4accU,
+    0xf9b9df6fU, 0x8ebeeff9U, 0x17b7be43U, 0x60b08ed5U, 0xd6d6a3e8U, 0xa1d1937eU,
+    0x38d8c2c4U, 0x4fdff252U, 0xd1bb67f1U, 0xa6bc5767U, 0x3fb506ddU, 0x48b2364bU,
+    0xd80d2bdaU, 0xaf0a1b4cU, 0x36034af6U, 0x41047a60U, 0xdf60efc3U, 0xa867df55U,
+    0x316e8eefU, 0x4669be79U, 0xcb61b38cU, 0xbc66831aU, 0x256fd2a0U, 0x5268e236U,
+    0xcc0c7795U, 0xbb0b4703U, 0x220216b9U, 0x5505262fU, 0xc5ba3bbeU, 0xb2bd0b28U,
+    0x2bb45a92U, 0x5cb36a04U, 0xc2d7ffa7U, 0xb5d0cf31U, 0x2cd99e8bU, 0x5bdeae1dU,
+    0x9b64c2b0U, 0xec63f226U, 0x756aa39cU, 0x026d930aU, 0x9c0906a9U, 0xeb0e363fU,
+    0x72076785U, 0x05005713U, 0x95bf4a82U, 0xe2b87a14U, 0x7bb12baeU, 0x0cb61b38U,
+    0x92d28e9bU, 0xe5d5be0dU, 0x7cdcefb7U, 0x0bdbdf21U, 0x86d3d2d4U, 0xf1d4e242U,
+    0x68ddb3f8U, 0x1fda836eU, 0x81be16cdU, 0xf6b9265bU, 0x6fb077e1U, 0x18b74777U,
+    0x88085ae6U, 0xff0f6a70U, 0x66063bcaU, 0x11010b5cU, 0x8f659effU, 0xf862ae69U,
+    0x616bffd3U, 0x166ccf45U, 0xa00ae278U, 0xd70dd2eeU, 0x4e048354U, 0x3903b3c2U,
+    0xa7672661U, 0xd06016f7U, 0x4969474dU, 0x3e6e77dbU, 0xaed16a4aU, 0xd9d65adcU,
+    0x40df0b66U, 0x37d83bf0U, 0xa9bcae53U, 0xdebb9ec5U, 0x47b2cf7fU, 0x30b5ffe9U,
+    0xbdbdf21cU, 0xcabac28aU, 0x53b39330U, 0x24b4a3a6U, 0xbad03605U, 0xcdd70693U,
+    0x54de5729U, 0x23d967bfU, 0xb3667a2eU, 0xc4614ab8U, 0x5d681b02U, 0x2a6f2b94U,
+    0xb40bbe37U, 0xc30c8ea1U, 0x5a05df1bU, 0x2d02ef8dU,
+};
+
+// CRC-32 used by PNG chunks. Pass 0 as crc for a new checksum.
+static png_uint_32 util_crc32(png_uint_32 crc, const png_byte *data, size_t size) {
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = util_crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#define UTIL_ADLER_BASE 65521U
+#define UTIL_ADLER_NMAX 5552
+
+// Adler-32 used by zlib streams. Pass 1 as adler for a new checksum.
+static png_uint_32 util_adler32(png_uint_32 adler, const png_byte *data, size_t size) {
+    png_uint_32 a = adler & 0xffff;
+    png_uint_32 b = adler >> 16;
+    while (size > 0) {
+        size_t n = size < UTIL_ADLER_NMAX ? size : UTIL_ADLER_NMAX;
+        size -= n;
+        while (n--) {
+            a += *data++;
+            b += a;
+        }
+        a %= UTIL_ADLER_BASE;
+        b %= UTIL_ADLER_BASE;
+    }
+    return (b << 16) | a;
+}
+
+// Adler-32 of A followed by B, from the checksums of A and B and the size of B.
+static png_uint_32 util_adler32_combine(png_uint_32 adler1, png_uint_32 adler2, size_t size2) {
+    png_uint_32 rem = (png_uint_32)(size2 % UTIL_ADLER_BASE);
+    png_uint_32 sum1 = adler1 & 0xffff;
+    png_uint_32 sum2 = (rem * sum1) % UTIL_ADLER_BASE;
+    sum1 += (adler2 & 0xffff) + UTIL_ADLER_BASE - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + UTIL_ADLER_BASE - rem;
+    if (sum1 >= UTIL_ADLER_BASE) sum1 -= UTIL_ADLER_BASE;
+    if (sum1 >= UTIL_ADLER_BASE) sum1 -= UTIL_ADLER_BASE;
+    if (sum2 >= (UTIL_ADLER_BASE << 1)) sum2 -= (UTIL_ADLER_BASE << 1);
+    if (sum2 >= UTIL_ADLER_BASE) sum2 -= UTIL_ADLER_BASE;
+    return (sum2 << 16) | sum1;
+}
+
+// XXH64, a fast non-cryptographic hash. Used for pixel digests.
+#define UTIL_XXH_P1 0x9E3779B185EBCA87ULL
+#define UTIL_XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define UTIL_XXH_P3 0x165667B19E3779F9ULL
+#define UTIL_XXH_P4 0x85EBCA77C2B2AE63ULL
+#define UTIL_XXH_P5 0x27D4EB2F165667C5ULL
+
+typedef struct util_xxh64 {
+    unsigned long long v[4];
+    unsigned long long seed;
+    unsigned long long total;
+    png_byte buf[32];
+    size_t buffered;
+} util_xxh64;
+
+static unsigned long long util_load_le64(const png_byte *p) {
+    unsigned long long v = 0;
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static unsigned long long util_rotl64(unsigned long long v, int r) {
+    return (v << r) | (v >> (64 - r));
+}
+
+static unsigned long long util_xxh64_round(unsigned long long acc, unsigned long long input) {
+    acc += input * UTIL_XXH_P2;
+    return util_rotl64(acc, 31) * UTIL_XXH_P1;
+}
+
+static unsigned long long util_xxh64_merge(unsigned long long acc, unsigned long long v) {
+    acc ^= util_xxh64_round(0, v);
+    return acc * UTIL_XXH_P1 + UTIL_XXH_P4;
+}
+
+static void util_xxh64_init_seed(util_xxh64 *h, unsigned long long seed) {
+    h->v[0] = seed + UTIL_XXH_P1 + UTIL_XXH_P2;
+    h->v[1] = seed + UTIL_XXH_P2;
+    h->v[2] = seed;
+    h->v[3] = seed - UTIL_XXH_P1;
+    h->seed = seed;
+    h->total = 0;
+    h->buffered = 0;
+}
+
+static void util_xxh64_init(util_xxh64 *h) {
+    util_xxh64_init_seed(h, 0);
+}
+
+static void util_xxh64_update(util_xxh64 *h, const png_byte *data, size_t size) {
+    h->total += size;
+    if (h->buffered + size < 32) {
+        memcpy(h->buf + h->buffered, data, size);
+        h->buffered += size;
+        return;
+    }
+    if (h->buffered > 0) {
+        size_t n = 32 - h->buffered;
+        memcpy(h->buf + h->buffered, data, n);
+        for (int i = 0; i < 4; i++)
+            h->v[i] = util_xxh64_round(h->v[i], util_load_le64(h->buf + i * 8));
+        data += n;
+        size -= n;
+        h->buffered = 0;
+    }
+    for (; size >= 32; data += 32, size -= 32) {
+        for (int i = 0; i < 4; i++)
+            h->v[i] = util_xxh64_round(h->v[i], util_load_le64(data + i * 8));
+    }
+    memcpy(h->buf, data, size);
+    h->buffered = size;
+}
+
+static unsigned long long util_xxh64_digest(const util_xxh64 *h) {
+    unsigned long long acc;
+    if (h->total >= 32) {
+        acc = util_rotl64(h->v[0], 1) + util_rotl64(h->v[1], 7) +
+              util_rotl64(h->v[2], 12) + util_rotl64(h->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            acc = util_xxh64_merge(acc, h->v[i]);
+    } else {
+        acc = h->seed + UTIL_XXH_P5;
+    }
+    acc += h->total;
+    const png_byte *p = h->buf;
+    size_t size = h->buffered;
+    for (; size >= 8; p += 8, size -= 8) {
+        acc ^= util_xxh64_round(0, util_load_le64(p));
+        acc = util_rotl64(acc, 27) * UTIL_XXH_P1 + UTIL_XXH_P4;
+    }
+    if (size >= 4) {
+        unsigned long long v = (unsigned long long)p[0] | ((unsigned long long)p[1] << 8) |
+                               ((unsigned long long)p[2] << 16) | ((unsigned long long)p[3] << 24);
+        acc ^= v * UTIL_XXH_P1;
+        acc = util_rotl64(acc, 23) * UTIL_XXH_P2 + UTIL_XXH_P3;
+        p += 4;
+        size -= 4;
+    }
+    for (; size > 0; p++, size--) {
+        acc ^= *p * UTIL_XXH_P5;
+        acc = util_rotl64(acc, 11) * UTIL_XXH_P1;
+    }
+    acc ^= acc >> 33;
+    acc *= UTIL_XXH_P2;
+    acc ^= acc >> 29;
+    acc *= UTIL_XXH_P3;
+    acc ^= acc >> 32;
+    return acc;
+}
+
+// ------ Threads ------
+
+#ifdef _WIN32
+typedef SRWLOCK util_mutex;
+#define UTIL_MUTEX_INIT SRWLOCK_INIT
+static void util_mutex_init(util_mutex *m) { InitializeSRWLock(m); }
+static void util_mutex_destroy(util_mutex *m) { (void)m; }
+static void util_mutex_lock(util_mutex *m) { AcquireSRWLockExclusive(m); }
+static void util_mutex_unlock(util_mutex *m) { ReleaseSRWLockExclusive(m); }
+
+typedef CONDITION_VARIABLE util_cond;
+static void util_cond_init(util_cond *c) { InitializeConditionVariable(c); }
+static void util_cond_destroy(util_cond *c) { (void)c; }
+static void util_cond_wait(util_cond *c, util_mutex *m) { SleepConditionVariableSRW(c, m, INFINITE, 0); }
+static void util_cond_broadcast(util_cond *c) { WakeAllConditionVariable(c); }
+
+// Adds delta and returns the new value. It's a full barrier.
+static long long util_atomic_add(volatile long long *v, long long delta) {
+    return InterlockedExchangeAdd64((volatile LONG64 *)v, delta) + delta;
+}
+
+// Reads v after the reads before it and before the reads after it. Unlike util_atomic_add(),
+// it doesn't write the cache line, so readers on other cores don't contend.
+static long long util_atomic_load(const volatile long long *v) {
+    MemoryBarrier();
+    long long value = *v;
+    MemoryBarrier();
+    return value;
+}
+
+// Writes v after the writes before it. It's a full barrier.
+static void util_atomic_store(volatile long long *v, long long value) {
+    InterlockedExchange64((volatile LONG64 *)v, value);
+}
+
+// Keeps the writes before it from being seen after the writes after it.
+static void util_release_fence(void) {
+    MemoryBarrier();
+}
+
+typedef HANDLE util_thread;
+#define UTIL_THREAD_MAIN(name, arg) static DWORD WINAPI name(LPVOID arg)
+#define UTIL_THREAD_RETURN return 0
+static int util_thread_start(util_thread *thread, LPTHREAD_START_ROUTINE fn, void *arg) {
+    *thread = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    return *thread != NULL;
+}
+static void util_thread_join(util_thread thread) {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+static int util_cpu_count(void) {
+    SYSTEM_INFO sysinfo;
+    GetSystemInfo(&sysinfo);
+    return (int)sysinfo.dwNumberOfProcessors;
+}
+
+// Monotonic time in seconds.
+static double util_now(void) {
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (double)count.QuadPart / (double)freq.QuadPart;
+}
+#else  // _WIN32
+typedef pthread_mutex_t util_mutex;
+#define UTIL_MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+static void util_mutex_init(util_mutex *m) { pthread_mutex_init(m, NULL); }
+static void util_mutex_destroy(util_mutex *m) { pthread_mutex_destroy(m); }
+static void util_mutex_lock(util_mutex *m) { pthread_mutex_lock(m); }
+static void util_mutex_unlock(util_mutex *m) { pthread_mutex_unlock(m); }
+
+typedef pthread_cond_t util_cond;
+static void util_cond_init(util_cond *c) { pthread_cond_init(c, NULL); }
+static void util_cond_destroy(util_cond *c) { pthread_cond_destroy(c); }
+static void util_cond_wait(util_cond *c, util_mutex *m) { pthread_cond_wait(c, m); }
+static void util_cond_broadcast(util_cond *c) { pthread_cond_broadcast(c); }
+
+// Adds delta and returns the new value. It's a full barrier.
+static long long util_atomic_add(volatile long long *v, long long delta) {
+    return __atomic_add_fetch(v, delta, __ATOMIC_SEQ_CST);
+}
+
+// Reads v after the reads before it and before the reads after it. Unlike util_atomic_add(),
+// it doesn't write the cache line, so readers on other cores don't contend.
+static long long util_atomic_load(const volatile long long *v) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(v, __ATOMIC_ACQUIRE);
+}
+
+// Writes v after the writes before it. It's a full barrier.
+static void util_atomic_store(volatile long long *v, long long value) {
+    __atomic_store_n(v, value, __ATOMIC_SEQ_CST);
+}
+
+// Keeps the writes before it from being seen after the writes after it.
+static void util_release_fence(void) {
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+typedef pthread_t util_thread;
+#define UTIL_THREAD_MAIN(name, arg) static void *name(void *arg)
+#define UTIL_THREAD_RETURN return NULL
+static int util_thread_start(util_thread *thread, void *(*fn)(void *), void *arg) {
+    return pthread_create(thread, NULL, fn, arg) == 0;
+}
+static void util_thread_join(util_thread thread) {
+    pthread_join(thread, NULL);
+}
+
+static int util_cpu_count(void) {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+
+// Monotonic time in seconds.
+static double util_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+#endif  // _WIN32
+
+typedef void (*util_task_fn)(void *ctx, size_t index);
+
+typedef struct util_task_queue {
+    util_task_fn fn;
+    void *ctx;
+    size_t count;
+    size_t next;
+    util_mutex lock;
+} util_task_queue;
+
+static void util_task_loop(util_task_queue *queue) {
+    for (;;) {
+        util_mutex_lock(&queue->lock);
+        size_t index = queue->next;
+        if (index < queue->count)
+            queue->next++;
+        util_mutex_unlock(&queue->lock);
+        if (index >= queue->count)
+            return;
+        queue->fn(queue->ctx, index);
+    }
+}
+
+UTIL_THREAD_MAIN(util_task_main, arg) {
+    util_task_loop((util_task_queue *)arg);
+    UTIL_THREAD_RETURN;
+}
+
+// Runs fn(ctx, i) for every i in [0, count) on up to `threads` threads.
+// The calling thread is one of the workers, so this never fails.
+static void util_run_tasks(size_t count, int threads, util_task_fn fn, void *ctx) {
+    if (threads <= 0)
+        threads = util_cpu_count();
+    if ((size_t)threads > count)
+        threads = (int)count;
+    if (threads <= 1) {
+        for (size_t i = 0; i < count; i++)
+            fn(ctx, i);
+        return;
+    }
+
+    util_task_queue queue;
+    queue.fn = fn;
+    queue.ctx = ctx;
+    queue.count = count;
+    queue.next = 0;
+    util_mutex_init(&queue.lock);
+
+    util_thread *workers = (util_thread *)malloc(sizeof(util_thread) * (size_t)(threads - 1));
+    int started = 0;
+    if (workers) {
+        while (started < threads - 1 &&
+               util_thread_start(&workers[started], util_task_main, &queue))
+            started++;
+    }
+    util_task_loop(&queue);
+    for (int i = 0; i < started; i++)
+        util_thread_join(workers[i]);
+    free(workers);
+    util_mutex_destroy(&queue.lock);
+}
+
+// ------ zlib ------
+
+// A subset of zlib's ABI. zlib is not linked at compile time,
+// so the functions are resolved from the zlib that libpng depends on.
+#define UTIL_Z_OK 0
+#define UTIL_Z_STREAM_END 1
+#define UTIL_Z_BUF_ERROR (-5)
+#define UTIL_Z_NO_FLUSH 0
+#define UTIL_Z_FULL_FLUSH 3
+#define UTIL_Z_DEFLATED 8
+#define UTIL_Z_DEFAULT_COMPRESSION (-1)
+#define UTIL_Z_DEFAULT_STRATEGY 0
+
+typedef struct util_z_stream {
+    const png_byte *next_in;
+    unsigned int avail_in;
+    unsigned long total_in;
+    png_byte *next_out;
+    unsigned int avail_out;
+    unsigned long total_out;
+    const char *msg;
+    void *state;
+    void *(*zalloc)(void *, unsigned int, unsigned int);
+    void (*zfree)(void *, void *);
+    void *opaque;
+    int data_type;
+    unsigned long adler;
+    unsigned long reserved;
+} util_z_stream;
+
+typedef const char *(*PFN_zlibVersion)(void);
+typedef int (*PFN_deflateInit2_)(util_z_stream *, int, int, int, int, int, const char *, int);
+typedef int (*PFN_deflate)(util_z_stream *, int);
+typedef int (*PFN_deflateEnd)(util_z_stream *);
+typedef int (*PFN_inflateInit2_)(util_z_stream *, int, const char *, int);
+typedef int (*PFN_inflate)(util_z_stream *, int);
+typedef int (*PFN_inflateEnd)(util_z_stream *);
+
+#define UTIL_ZLIB_MAPPING \
+    UTIL_ZLIB_MAP(zlibVersion) \
+    UTIL_ZLIB_MAP(deflateInit2_) \
+    UTIL_ZLIB_MAP(deflate) \
+    UTIL_ZLIB_MAP(deflateEnd) \
+    UTIL_ZLIB_MAP(inflateInit2_) \
+    UTIL_ZLIB_MAP(inflate) \
+    UTIL_ZLIB_MAP(inflateEnd)
+
+typedef struct util_zlib {
+    #define UTIL_ZLIB_MAP(func) PFN_##func func;
+    UTIL_ZLIB_MAPPING
+    #undef UTIL_ZLIB_MAP
+    const char *version;
+} util_zlib;
+
+static util_mutex util_zlib_lock = UTIL_MUTEX_INIT;
+static int util_zlib_tried = 0;
+static util_zlib util_zlib_funcs;
+static const util_zlib *util_zlib_ptr = NULL;
+
+static int util_zlib_load(util_zlib *z) {
+    // zlib is loaded already as a dependency of libpng,
+    // so these calls only take a reference to it.
+    static const char *names[] = {
+#ifdef _WIN32
+        "zlib1.dll", "zlib.dll", "zlibd1.dll",
+#elif defined(__APPLE__)
+        "libz.1.dylib", "libz.dylib",
+#else
+        "libz.so.1", "libz.so",
+#endif
+    };
+    void *lib = NULL;
+    for (size_t i = 0; !lib && i < sizeof(names) / sizeof(names[0]); i++) {
+#ifdef _WIN32
+        lib = (void *)LoadLibraryA(names[i]);
+#else
+        lib = dlopen(names[i], RTLD_NOW | RTLD_LOCAL);
+#endif
+    }
+    if (!lib)
+        return 0;
+
+#ifdef _WIN32
+    #define UTIL_ZLIB_MAP(func) z->func = (PFN_##func)GetProcAddress((HMODULE)lib, #func);
+#else
+    #define UTIL_ZLIB_MAP(func) z->func = (PFN_##func)dlsym(lib, #func);
+#endif
+    UTIL_ZLIB_MAPPING
+    #undef UTIL_ZLIB_MAP
+
+    #define UTIL_ZLIB_MAP(func) (z->func != NULL) &&
+    int loaded = UTIL_ZLIB_MAPPING 1;
+    #undef UTIL_ZLIB_MAP
+    // zlib checks only the major version.
+    if (loaded) {
+        z->version = z->zlibVersion();
+        loaded = z->version && z->version[0] == '1';
+    }
+    if (!loaded) {
+#ifdef _WIN32
+        FreeLibrary((HMODULE)lib);
+#else
+        dlclose(lib);
+#endif
+    }
+    return loaded;
+}
+
+// Returns zlib functions, or NULL if zlib is not available.
+// The library stays referenced until the process exits.
+static const util_zlib *util_zlib_get(void) {
+    util_mutex_lock(&util_zlib_lock);
+    if (!util_zlib_tried) {
+        util_zlib_tried = 1;
+        if (util_zlib_load(&util_zlib_funcs))
+            util_zlib_ptr = &util_zlib_funcs;
+    }
+    const util_zlib *z = util_zlib_ptr;
+    util_mutex_unlock(&util_zlib_lock);
+    return z;
+}
+
+// ------ libpng glue ------
+
+// libpng-loader does not expose png_jmpbuf, so errors are caught with
+// our own jmp_buf. setjmp and longjmp are called from the same CRT.
+typedef struct util_trap {
+    jmp_buf jmp;
+} util_trap;
+
+static void util_error_fn(png_struct *png_ptr, const png_char *message) {
+    (void)message;
+    util_trap *trap = (util_trap *)png_get_error_ptr(png_ptr);
+    longjmp(trap->jmp, 1);
+}
+
+static void util_warning_fn(png_struct *png_ptr, const png_char *message) {
+    (void)png_ptr;
+    (void)message;
+}
+
+static png_struct *util_create_read_struct(util_trap *trap) {
+    return png_create_read_struct(PNG_LIBPNG_VER_STRING, trap, util_error_fn, util_warning_fn);
+}
+
+static png_struct *util_create_write_struct(util_trap *trap) {
+    return png_create_write_struct(PNG_LIBPNG_VER_STRING, trap, util_error_fn, util_warning_fn);
+}
+
+typedef struct util_mem_reader {
+    const png_byte *data;
+    size_t size;
+    size_t pos;
+} util_mem_reader;
+
+static void util_read_mem(png_struct *png_ptr, png_byte *data, size_t length) {
+    util_mem_reader *reader = (util_mem_reader *)png_get_io_ptr(png_ptr);
+    if (length > reader->size - reader->pos)
+        png_error(png_ptr, "Read Error");
+    memcpy(data, reader->data + reader->pos, length);
+    reader->pos += length;
+}
+
+static png_util_error util_check_loaded(void) {
+    return libpng_is_loaded() ? PNG_UTIL_SUCCESS : PNG_UTIL_ERROR_NOT_LOADED;
+}
+
+// ------ Images ------
+
+static int util_channels(int color_type) {
+    switch (color_type) {
+    case PNG_COLOR_TYPE_GRAY:
+    case PNG_COLOR_TYPE_PALETTE:
+        return 1;
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+        return 2;
+    case PNG_COLOR_TYPE_RGB:
+        return 3;
+    case PNG_COLOR_TYPE_RGB_ALPHA:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+// Returns 1 if the IHDR fields are allowed by the PNG specification.
+static int util_valid_format(png_uint_32 width, png_uint_32 height, int bit_depth, int color_type) {
+    if (width == 0 || height == 0 || width > PNG_UINT_31_MAX || height > PNG_UINT_31_MAX)
+        return 0;
+    switch (color_type) {
+    case PNG_COLOR_TYPE_GRAY:
+        return bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8 || bit_depth == 16;
+    case PNG_COLOR_TYPE_PALETTE:
+        return bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8;
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+    case PNG_COLOR_TYPE_RGB:
+    case PNG_COLOR_TYPE_RGB_ALPHA:
+        return bit_depth == 8 || bit_depth == 16;
+    default:
+        return 0;
+    }
+}
+
+static size_t util_rowbytes(png_uint_32 width, int bit_depth, int color_type) {
+    return ((size_t)width * (size_t)(util_channels(color_type) * bit_depth) + 7) >> 3;
+}
+
+// Distance in bytes to the corresponding byte of the previous pixel (at least 1).
+static size_t util_filter_bpp(int bit_depth, int color_type) {
+    size_t bits = (size_t)(util_channels(color_type) * bit_depth);
+    return bits < 8 ? 1 : bits >> 3;
+}
+
+// Allocates pixels for a tightly packed image. Returns 0 on overflow or failure.
+static int util_image_alloc(png_util_image *image, png_uint_32 width, png_uint_32 height,
+                            int bit_depth, int color_type) {
+    size_t rowbytes = util_rowbytes(width, bit_depth, color_type);
+    if (rowbytes == 0 || height > PNG_SIZE_MAX / rowbytes)
+        return 0;
+    image->pixels = (png_byte *)calloc(height, rowbytes);
+    if (!image->pixels)
+        return 0;
+    image->width = width;
+    image->height = height;
+    image->bit_depth = bit_depth;
+    image->color_type = color_type;
+    image->row_stride = rowbytes;
+    return 1;
+}
+
+void png_util_image_free(png_util_image *image) {
+    if (!image)
+        return;
+    free(image->pixels);
+    memset(image, 0, sizeof(*image));
+}
+
+// Decodes raw rows with libpng. Interlaced images are deinterlaced.
+static png_util_error util_read_serial(const void *data, size_t size, png_util_image *image) {
+    util_trap trap;
+    util_mem_reader reader = { (const png_byte *)data, size, 0 };
+    png_struct *png = util_create_read_struct(&trap);
+    if (!png)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    png_info *info = png_create_info_struct(png);
+    png_byte *volatile pixels = NULL;
+    png_byte **volatile rows = NULL;
+    if (!info || setjmp(trap.jmp)) {
+        png_util_error err = info ? PNG_UTIL_ERROR_LIBPNG : PNG_UTIL_ERROR_OUT_OF_MEMORY;
+        free(pixels);
+        free(rows);
+        png_destroy_read_struct(&png, &info, NULL);
+        return err;
+    }
+
+    png_set_read_fn(png, &reader, util_read_mem);
+    png_read_info(png, info);
+    png_uint_32 width, height;
+    int bit_depth, color_type, interlace;
+    png_get_IHDR(png, info, &width, &height, &bit_depth, &color_type, &interlace, NULL, NULL);
+    if (interlace != PNG_INTERLACE_NONE)
+        png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+
+    png_util_image out;
+    if (!util_image_alloc(&out, width, height, bit_depth, color_type))
+        png_error(png, "Out of memory");
+    pixels = out.pixels;
+    rows = (png_byte **)malloc(sizeof(png_byte *) * height);
+    if (!rows)
+        png_error(png, "Out of memory");
+    for (png_uint_32 y = 0; y < height; y++)
+        rows[y] = out.pixels + out.row_stride * y;
+    png_read_image(png, rows);
+
+    free(rows);
+    png_destroy_read_struct(&png, &info, NULL);
+    *image = out;
+    return PNG_UTIL_SUCCESS;
+}
+
+// Sets transforms that convert any PNG to 8-bit RGBA. Call it after png_read_info().
+static void util_set_rgba8(png_struct *png, png_info *info) {
+    int bit_depth = png_get_bit_depth(png, info);
+    int color_type = png_get_color_type(png, info);
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(png);
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+        png_set_expand_gray_1_2_4_to_8(png);
+    if (png_get_valid(png, info, PNG_INFO_tRNS))
+        png_set_tRNS_to_alpha(png);
+    else if (!(color_type & PNG_COLOR_MASK_ALPHA))
+        png_set_add_alpha(png, 0xff, PNG_FILLER_AFTER);
+    if (bit_depth == 16)
+        png_set_strip_16(png);
+    if (!(color_type & PNG_COLOR_MASK_COLOR))
+        png_set_gray_to_rgb(png);
+}
+
+// ------ Filters ------
+
+static size_t util_filter_cost(const png_byte *data, size_t size) {
+    size_t sum = 0;
+    for (size_t i = 0; i < size; i++)
+        sum += data[i] < 128 ? data[i] : 256 - data[i];
+    return sum;
+}
+
+static png_byte util_paeth(png_byte a, png_byte b, png_byte c) {
+    int p = (int)a + (int)b - (int)c;
+    int pa = abs(p - (int)a);
+    int pb = abs(p - (int)b);
+    int pc = abs(p - (int)c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+static void util_apply_filter(int type, const png_byte *row, const png_byte *prev,
+                              size_t rowbytes, size_t bpp, png_byte *out) {
+    out[0] = (png_byte)type;
+    out++;
+    for (size_t i = 0; i < rowbytes; i++) {
+        png_byte a = i >= bpp ? row[i - bpp] : 0;
+        png_byte b = prev[i];
+        png_byte c = i >= bpp ? prev[i - bpp] : 0;
+        switch (type) {
+        case PNG_FILTER_VALUE_SUB: out[i] = (png_byte)(row[i] - a); break;
+        case PNG_FILTER_VALUE_UP: out[i] = (png_byte)(row[i] - b); break;
+        case PNG_FILTER_VALUE_AVG: out[i] = (png_byte)(row[i] - ((a + b) >> 1)); break;
+        case PNG_FILTER_VALUE_PAETH: out[i] = (png_byte)(row[i] - util_paeth(a, b, c)); break;
+        default: out[i] = row[i]; break;
+        }
+    }
+}
+
+// Filters a row with the heuristic libpng uses (the smallest sum of absolute differences).
+// prev is NULL for the first row of a segment, which always uses filter None.
+// Returns buf_a or buf_b, each of which must hold rowbytes + 1 bytes.
+static const png_byte *util_filter_row(const png_byte *row, const png_byte *prev,
+                                       size_t rowbytes, size_t bpp,
+                                       png_byte *buf_a, png_byte *buf_b) {
+    png_byte *best = buf_a;
+    png_byte *trial = buf_b;
+    best[0] = PNG_FILTER_VALUE_NONE;
+    memcpy(best + 1, row, rowbytes);
+    if (!prev)
+        return best;
+
+    size_t best_cost = util_filter_cost(best + 1, rowbytes);
+    for (int type = PNG_FILTER_VALUE_SUB; type < PNG_FILTER_VALUE_LAST; type++) {
+        util_apply_filter(type, row, prev, rowbytes, bpp, trial);
+        size_t cost = util_filter_cost(trial + 1, rowbytes);
+        if (cost < best_cost) {
+            png_byte *tmp = best;
+            best = trial;
+            trial = tmp;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+// Reverses a filter. Returns 0 if the row needs a previous row but prev is NULL.
+static int util_unfilter_row(int type, const png_byte *src, const png_byte *prev,
+                             size_t rowbytes, size_t bpp, png_byte *dst) {
+    if (!prev && type != PNG_FILTER_VALUE_NONE && type != PNG_FILTER_VALUE_SUB)
+        return 0;
+    size_t i;
+    switch (type) {
+    case PNG_FILTER_VALUE_NONE:
+        memcpy(dst, src, rowbytes);
+        return 1;
+    case PNG_FILTER_VALUE_SUB:
+        for (i = 0; i < bpp && i < rowbytes; i++)
+            dst[i] = src[i];
+        for (; i < rowbytes; i++)
+            dst[i] = (png_byte)(src[i] + dst[i - bpp]);
+        return 1;
+    case PNG_FILTER_VALUE_UP:
+        for (i = 0; i < rowbytes; i++)
+            dst[i] = (png_byte)(src[i] + prev[i]);
+        return 1;
+    case PNG_FILTER_VALUE_AVG:
+        for (i = 0; i < bpp && i < rowbytes; i++)
+            dst[i] = (png_byte)(src[i] + (prev[i] >> 1));
+        for (; i < rowbytes; i++)
+            dst[i] = (png_byte)(src[i] + ((dst[i - bpp] + prev[i]) >> 1));
+        return 1;
+    case PNG_FILTER_VALUE_PAETH:
+        for (i = 0; i < bpp && i < rowbytes; i++)
+            dst[i] = (png_byte)(src[i] + prev[i]);
+        for (; i < rowbytes; i++)
+            dst[i] = (png_byte)(src[i] + util_paeth(dst[i - bpp], prev[i], prev[i - bpp]));
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// ------ PNG chunks ------
+
+static const png_byte util_png_signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+typedef struct util_idat {
+    const png_byte *data;
+    size_t size;
+    size_t offset;  // offset in the concatenated zlib stream
+} util_idat;
+
+// Chunks of a PNG in memory that the utilities care about.
+typedef struct util_layout {
+    png_uint_32 width;
+    png_uint_32 height;
+    int bit_depth;
+    int color_type;
+    int interlace;
+    const png_byte *restart;  // data of PNG_UTIL_PARALLEL_CHUNK, or NULL
+    png_uint_32 restart_size;
+    const png_byte *plte;  // data of PLTE, or NULL
+    png_uint_32 plte_size;
+    util_idat *idat;
+    size_t idat_count;
+    size_t stream_size;  // total size of IDAT data
+    size_t end;  // offset after IEND
+} util_layout;
+
+static void util_layout_free(util_layout *layout) {
+    free(layout->idat);
+    layout->idat = NULL;
+}
+
+// Walks chunks up to IEND. Only the CRCs of IHDR and the restart chunk are checked.
+static png_util_error util_scan_chunks(const png_byte *data, size_t size, util_layout *layout) {
+    memset(layout, 0, sizeof(*layout));
+    if (size < 8 || memcmp(data, util_png_signature, 8) != 0)
+        return PNG_UTIL_ERROR_INVALID_PNG;
+
+    size_t capacity = 0;
+    size_t pos = 8;
+    int has_ihdr = 0;
+    for (;;) {
+        if (size - pos < 12)
+            goto invalid;
+        png_uint_32 length = util_load_be32(data + pos);
+        const png_byte *type = data + pos + 4;
+        const png_byte *body = data + pos + 8;
+        if (length > PNG_UINT_31_MAX || length > size - pos - 12)
+            goto invalid;
+        int is_ihdr = memcmp(type, "IHDR", 4) == 0;
+        if (has_ihdr == is_ihdr)
+            goto invalid;  // IHDR must be the first chunk
+        int is_restart = memcmp(type, PNG_UTIL_PARALLEL_CHUNK, 4) == 0;
+        if ((is_ihdr || is_restart) &&
+                util_crc32(0, type, (size_t)length + 4) != util_load_be32(body + length))
+            goto invalid;
+
+        if (is_ihdr) {
+            if (length != 13)
+                goto invalid;
+            has_ihdr = 1;
+            layout->width = util_load_be32(body);
+            layout->height = util_load_be32(body + 4);
+            layout->bit_depth = body[8];
+            layout->color_type = body[9];
+            layout->interlace = body[12];
+            if (!util_valid_format(layout->width, layout->height,
+                                   layout->bit_depth, layout->color_type))
+                goto invalid;
+        } else if (is_restart) {
+            if (layout->idat_count == 0) {
+                layout->restart = body;
+                layout->restart_size = length;
+            }
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            if (layout->idat_count == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                util_idat *idat = (util_idat *)realloc(layout->idat, sizeof(util_idat) * capacity);
+                if (!idat) {
+                    util_layout_free(layout);
+                    return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+                }
+                layout->idat = idat;
+            }
+            util_idat *idat = &layout->idat[layout->idat_count++];
+            idat->data = body;
+            idat->size = length;
+            idat->offset = layout->stream_size;
+            layout->stream_size += length;
+        } else if (memcmp(type, "PLTE", 4) == 0) {
+            layout->plte = body;
+            layout->plte_size = length;
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            layout->end = pos + (size_t)length + 12;
+            break;
+        }
+        pos += (size_t)length + 12;
+    }
+    if (layout->idat_count == 0)
+        goto invalid;
+    return PNG_UTIL_SUCCESS;
+
+invalid:
+    util_layout_free(layout);
+    return PNG_UTIL_ERROR_INVALID_PNG;
+}
+
+// ------ Parallel-decodable profile ------
+
+#define UTIL_RESTART_VERSION 1
+#define UTIL_RESTART_HEADER_SIZE 8
+#define UTIL_RESTART_ENTRY_SIZE 16
+#define UTIL_SEGMENT_TARGET_BYTES (256 * 1024)
+#define UTIL_IDAT_MAX_SIZE (1U << 30)
+#define UTIL_IDAT_DEFAULT_SIZE 8192  // libpng's PNG_ZBUF_SIZE
+
+typedef struct util_segment {
+    png_uint_32 first_row;
+    png_uint_32 rows;
+    png_uint_32 offset;  // offset in the zlib stream
+    png_uint_32 size;  // compressed size
+    png_uint_32 adler;  // Adler-32 of the filtered rows
+    png_byte *data;  // compressed data (encoder only)
+    png_util_error status;
+} util_segment;
+
+typedef struct util_parallel_ctx {
+    const util_zlib *zlib;
+    png_util_image *image;
+    size_t rowbytes;
+    size_t bpp;
+    int level;
+    util_segment *segments;
+    const util_layout *layout;  // decoder only
+} util_parallel_ctx;
+
+// Compresses a segment into a raw deflate stream that ends with a full flush.
+static void util_encode_segment(void *arg, size_t index) {
+    util_parallel_ctx *ctx = (util_parallel_ctx *)arg;
+    util_segment *seg = &ctx->segments[index];
+    const util_zlib *z = ctx->zlib;
+    size_t filtered_size = ctx->rowbytes + 1;
+    png_byte *buf = (png_byte *)malloc(filtered_size * 2);
+    size_t capacity = filtered_size * seg->rows / 2 + 1024;
+    png_byte *out = (png_byte *)malloc(capacity);
+    seg->status = PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    util_z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (!buf || !out || z->deflateInit2_(&strm, ctx->level, UTIL_Z_DEFLATED, -15, 8,
+                                         UTIL_Z_DEFAULT_STRATEGY, z->version,
+                                         (int)sizeof(strm)) != UTIL_Z_OK) {
+        free(buf);
+        free(out);
+        return;
+    }
+
+    png_uint_32 adler = 1;
+    size_t size = 0;
+    int ok = 1;
+    for (png_uint_32 r = 0; ok && r < seg->rows; r++) {
+        const png_byte *row = ctx->image->pixels + ctx->image->row_stride * (seg->first_row + r);
+        const png_byte *prev = r > 0 ? row - ctx->image->row_stride : NULL;
+        const png_byte *filtered = util_filter_row(row, prev, ctx->rowbytes, ctx->bpp,
+                                                   buf, buf + filtered_size);
+        adler = util_adler32(adler, filtered, filtered_size);
+
+        int flush = r + 1 == seg->rows ? UTIL_Z_FULL_FLUSH : UTIL_Z_NO_FLUSH;
+        strm.next_in = filtered;
+        strm.avail_in = (unsigned int)filtered_size;
+        do {
+            if (size == capacity) {
+                png_byte *grown = (png_byte *)realloc(out, capacity * 2);
+                if (!grown) {
+                    ok = 0;
+                    break;
+                }
+                out = grown;
+                capacity *= 2;
+            }
+            size_t room = capacity - size;
+            strm.next_out = out + size;
+            strm.avail_out = room > 0x40000000 ? 0x40000000 : (unsigned int)room;
+            size_t before = strm.avail_out;
+            if (z->deflate(&strm, flush) != UTIL_Z_OK && strm.avail_in > 0) {
+                ok = 0;
+                break;
+            }
+            size += before - strm.avail_out;
+        } while (strm.avail_in > 0 || strm.avail_out == 0);
+    }
+    z->deflateEnd(&strm);
+    free(buf);
+
+    if (!ok || size > PNG_UINT_32_MAX) {
+        free(out);
+        return;
+    }
+    seg->data = out;
+    seg->size = (png_uint_32)size;
+    seg->adler = adler;
+    seg->status = PNG_UTIL_SUCCESS;
+}
+
+// Writes pieces of the zlib stream as IDAT chunks of at most chunk_size bytes.
+static void util_write_idat(png_struct *png, const png_byte *const *pieces,
+                            const size_t *sizes, int count, size_t chunk_size) {
+    size_t total = 0;
+    for (int i = 0; i < count; i++)
+        total += sizes[i];
+    int piece = 0;
+    size_t offset = 0;
+    while (total > 0) {
+        size_t chunk = total < chunk_size ? total : chunk_size;
+        total -= chunk;
+        png_write_chunk_start(png, (const png_byte *)"IDAT", (png_uint_32)chunk);
+        while (chunk > 0) {
+            size_t n = sizes[piece] - offset;
+            if (n > chunk)
+                n = chunk;
+            png_write_chunk_data(png, pieces[piece] + offset, n);
+            chunk -= n;
+            offset += n;
+            if (offset == sizes[piece]) {
+                piece++;
+                offset = 0;
+            }
+        }
+        png_write_chunk_end(png);
+    }
+}
+
+static png_util_error util_write_parallel_png(FILE *fp, const png_util_image *image,
+                                              const png_util_parallel_options *options,
+                                              const png_byte *index, size_t index_size,
+                                              const png_byte *header, const png_byte *tail,
+                                              const util_segment *segments, size_t count) {
+    util_trap trap;
+    png_struct *png = util_create_write_struct(&trap);
+    if (!png)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    png_info *info = png_create_info_struct(png);
+    if (!info || setjmp(trap.jmp)) {
+        png_util_error err = info ? PNG_UTIL_ERROR_LIBPNG : PNG_UTIL_ERROR_OUT_OF_MEMORY;
+        png_destroy_write_struct(&png, &info);
+        return err;
+    }
+
+    png_init_write_io(png, fp);
+    png_set_IHDR(png, info, image->width, image->height, image->bit_depth, image->color_type,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    if (options && options->setup_fn)
+        options->setup_fn(png, info, options->setup_ptr);
+    png_write_info(png, info);
+    png_write_chunk(png, (const png_byte *)PNG_UTIL_PARALLEL_CHUNK, index, index_size);
+
+    // IDAT is written by hand, so png_write_end() can't be used.
+    for (size_t i = 0; i < count; i++) {
+        const png_byte *pieces[3];
+        size_t sizes[3];
+        int n = 0;
+        if (i == 0) {
+            pieces[n] = header;
+            sizes[n++] = 2;
+        }
+        pieces[n] = segments[i].data;
+        sizes[n++] = segments[i].size;
+        if (i + 1 == count) {
+            pieces[n] = tail;
+            sizes[n++] = 6;
+        }
+        util_write_idat(png, pieces, sizes, n, UTIL_IDAT_MAX_SIZE);
+    }
+    png_write_chunk(png, (const png_byte *)"IEND", NULL, 0);
+    png_destroy_write_struct(&png, &info);
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_write_parallel(FILE *fp, const png_util_image *image,
+                                  const png_util_parallel_options *options) {
+    if (!fp || !image || !image->pixels)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    if (!util_valid_format(image->width, image->height, image->bit_depth, image->color_type))
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    size_t rowbytes = util_rowbytes(image->width, image->bit_depth, image->color_type);
+    if (image->row_stride < rowbytes)
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    const util_zlib *zlib = util_zlib_get();
+    if (!zlib)
+        return PNG_UTIL_ERROR_UNSUPPORTED;
+
+    png_uint_32 rows_per_segment = options ? options->rows_per_segment : 0;
+    if (rows_per_segment == 0) {
+        size_t rows = UTIL_SEGMENT_TARGET_BYTES / (rowbytes + 1);
+        rows_per_segment = rows > 0 ? (png_uint_32)rows : 1;
+    }
+    if (rows_per_segment > image->height)
+        rows_per_segment = image->height;
+    size_t count = (image->height + (size_t)rows_per_segment - 1) / rows_per_segment;
+    if (count > (PNG_UINT_31_MAX - UTIL_RESTART_HEADER_SIZE) / UTIL_RESTART_ENTRY_SIZE)
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+
+    util_segment *segments = (util_segment *)calloc(count, sizeof(util_segment));
+    size_t index_size = UTIL_RESTART_HEADER_SIZE + UTIL_RESTART_ENTRY_SIZE * count;
+    png_byte *index = (png_byte *)calloc(index_size, 1);
+    if (!segments || !index) {
+        free(segments);
+        free(index);
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    }
+    for (size_t i = 0; i < count; i++) {
+        segments[i].first_row = (png_uint_32)(i * rows_per_segment);
+        segments[i].rows = image->height - segments[i].first_row;
+        if (segments[i].rows > rows_per_segment)
+            segments[i].rows = rows_per_segment;
+    }
+
+    int level = options ? options->compression_level : 0;
+    if (level < 0 || level > 9)
+        level = 0;
+    util_parallel_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.zlib = zlib;
+    ctx.image = (png_util_image *)image;
+    ctx.rowbytes = rowbytes;
+    ctx.bpp = util_filter_bpp(image->bit_depth, image->color_type);
+    ctx.level = level == 0 ? UTIL_Z_DEFAULT_COMPRESSION : level;
+    ctx.segments = segments;
+    util_run_tasks(count, options ? options->threads : 0, util_encode_segment, &ctx);
+
+    // zlib header for a 32K window, then the segments, an empty final block and Adler-32.
+    png_byte header[2] = { 0x78, 0 };
+    int level_flags = level == 0 || level == 6 ? 2 : level < 2 ? 0 : level < 6 ? 1 : 3;
+    header[1] = (png_byte)(level_flags << 6);
+    header[1] = (png_byte)(header[1] + 31 - (header[0] * 256 + header[1]) % 31);
+
+    png_uint_32 adler = 1;
+    size_t offset = 2;
+    util_store_be32(index + 4, (png_uint_32)count);
+    index[0] = UTIL_RESTART_VERSION;
+    for (size_t i = 0; i < count && err == PNG_UTIL_SUCCESS; i++) {
+        util_segment *seg = &segments[i];
+        err = seg->status;
+        if (offset + seg->size > PNG_UINT_32_MAX)
+            err = PNG_UTIL_ERROR_UNSUPPORTED;
+        if (err != PNG_UTIL_SUCCESS)
+            break;
+        seg->offset = (png_uint_32)offset;
+        offset += seg->size;
+        adler = util_adler32_combine(adler, seg->adler, (ctx.rowbytes + 1) * seg->rows);
+        png_byte *entry = index + UTIL_RESTART_HEADER_SIZE + UTIL_RESTART_ENTRY_SIZE * i;
+        util_store_be32(entry, seg->first_row);
+        util_store_be32(entry + 4, seg->offset);
+        util_store_be32(entry + 8, seg->size);
+        util_store_be32(entry + 12, seg->adler);
+    }
+    png_byte tail[6] = { 0x03, 0x00 };
+    util_store_be32(tail + 2, adler);
+
+    if (err == PNG_UTIL_SUCCESS)
+        err = util_write_parallel_png(fp, image, options, index, index_size,
+                                      header, tail, segments, count);
+    for (size_t i = 0; i < count; i++)
+        free(segments[i].data);
+    free(segments);
+    free(index);
+    return err;
+}
+
+// Reads the restart index. Returns NULL if it is missing or inconsistent.
+static util_segment *util_read_restart_index(const util_layout *layout, size_t *count) {
+    const png_byte *index = layout->restart;
+    if (!index || layout->restart_size < UTIL_RESTART_HEADER_SIZE ||
+            index[0] != UTIL_RESTART_VERSION)
+        return NULL;
+    size_t n = util_load_be32(index + 4);
+    if (n == 0 || n > layout->height ||
+            (layout->restart_size - UTIL_RESTART_HEADER_SIZE) / UTIL_RESTART_ENTRY_SIZE != n ||
+            (layout->restart_size - UTIL_RESTART_HEADER_SIZE) % UTIL_RESTART_ENTRY_SIZE != 0)
+        return NULL;
+
+    // The zlib header must be a plain deflate header without a preset dictionary.
+    png_byte cmf = layout->idat[0].size > 0 ? layout->idat[0].data[0] : 0;
+    png_byte flg = layout->idat[0].size > 1 ? layout->idat[0].data[1] : 0;
+    if ((cmf & 0x0f) != UTIL_Z_DEFLATED || (cmf >> 4) > 7 || (flg & 0x20) ||
+            (cmf * 256 + flg) % 31 != 0)
+        return NULL;
+
+    util_segment *segments = (util_segment *)calloc(n, sizeof(util_segment));
+    if (!segments)
+        return NULL;
+    size_t expected_offset = 2;
+    for (size_t i = 0; i < n; i++) {
+        const png_byte *entry = index + UTIL_RESTART_HEADER_SIZE + UTIL_RESTART_ENTRY_SIZE * i;
+        util_segment *seg = &segments[i];
+        seg->first_row = util_load_be32(entry);
+        seg->offset = util_load_be32(entry + 4);
+        seg->size = util_load_be32(entry + 8);
+        seg->adler = util_load_be32(entry + 12);
+        png_uint_32 next_row = i + 1 < n ? util_load_be32(entry + UTIL_RESTART_ENTRY_SIZE)
+                                         : layout->height;
+        if (seg->offset != expected_offset || seg->offset > layout->stream_size ||
+                seg->first_row >= next_row ||
+                next_row > layout->height || (i == 0 && seg->first_row != 0) ||
+                seg->size > layout->stream_size - seg->offset) {
+            free(segments);
+            return NULL;
+        }
+        seg->rows = next_row - seg->first_row;
+        expected_offset += seg->size;
+    }
+    *count = n;
+    return segments;
+}
+
+// Inflates and unfilters a segment into the output image.
+static void util_decode_segment(void *arg, size_t index) {
+    util_parallel_ctx *ctx = (util_parallel_ctx *)arg;
+    util_segment *seg = &ctx->segments[index];
+    const util_layout *layout = ctx->layout;
+    const util_zlib *z = ctx->zlib;
+    size_t filtered_size = ctx->rowbytes + 1;
+    seg->status = PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    png_byte *buf = (png_byte *)malloc(filtered_size);
+    util_z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (!buf || z->inflateInit2_(&strm, -15, z->version, (int)sizeof(strm)) != UTIL_Z_OK) {
+        free(buf);
+        return;
+    }
+    seg->status = PNG_UTIL_ERROR_INVALID_PNG;
+
+    // find the IDAT chunk that contains the first byte of the segment
+    size_t lo = 0, hi = layout->idat_count;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (layout->idat[mid].offset <= seg->offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    size_t chunk = lo;
+    size_t pos = seg->offset;
+    size_t end = (size_t)seg->offset + seg->size;
+
+    png_uint_32 adler = 1;
+    int ok = 1;
+    for (png_uint_32 r = 0; ok && r < seg->rows; r++) {
+        strm.next_out = buf;
+        strm.avail_out = (unsigned int)filtered_size;
+        while (ok && strm.avail_out > 0) {
+            if (strm.avail_in == 0) {
+                while (chunk < layout->idat_count &&
+                       layout->idat[chunk].offset + layout->idat[chunk].size <= pos)
+                    chunk++;
+                if (pos >= end || chunk == layout->idat_count) {
+                    ok = 0;
+                    break;
+                }
+                const util_idat *idat = &layout->idat[chunk];
+                size_t avail = idat->offset + idat->size;
+                if (avail > end)
+                    avail = end;
+                avail -= pos;
+                if (avail > 0x40000000)
+                    avail = 0x40000000;
+                strm.next_in = idat->data + (pos - idat->offset);
+                strm.avail_in = (unsigned int)avail;
+                pos += avail;
+            }
+            int ret = z->inflate(&strm, UTIL_Z_NO_FLUSH);
+            if (ret != UTIL_Z_OK && ret != UTIL_Z_BUF_ERROR)
+                ok = 0;  // includes Z_STREAM_END, which must not be inside a segment
+        }
+        if (!ok)
+            break;
+        adler = util_adler32(adler, buf, filtered_size);
+        png_byte *row = ctx->image->pixels + ctx->image->row_stride * (seg->first_row + r);
+        const png_byte *prev = r > 0 ? row - ctx->image->row_stride : NULL;
+        ok = util_unfilter_row(buf[0], buf + 1, prev, ctx->rowbytes, ctx->bpp, row);
+    }
+    z->inflateEnd(&strm);
+    free(buf);
+    if (ok && adler == seg->adler)
+        seg->status = PNG_UTIL_SUCCESS;
+}
+
+// Decodes indexed segments in parallel. Returns an error if the serial path should be used.
+static png_util_error util_read_restart(const util_layout *layout, int threads,
+                                        png_util_image *image) {
+    const util_zlib *zlib = util_zlib_get();
+    if (!zlib || layout->interlace != PNG_INTERLACE_NONE)
+        return PNG_UTIL_ERROR_UNSUPPORTED;
+    size_t count = 0;
+    util_segment *segments = util_read_restart_index(layout, &count);
+    if (!segments)
+        return PNG_UTIL_ERROR_INVALID_PNG;
+
+    png_util_image out;
+    if (!util_image_alloc(&out, layout->width, layout->height,
+                          layout->bit_depth, layout->color_type)) {
+        free(segments);
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    }
+    util_parallel_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.zlib = zlib;
+    ctx.image = &out;
+    ctx.rowbytes = out.row_stride;
+    ctx.bpp = util_filter_bpp(out.bit_depth, out.color_type);
+    ctx.segments = segments;
+    ctx.layout = layout;
+    util_run_tasks(count, threads, util_decode_segment, &ctx);
+
+    png_util_error err = PNG_UTIL_SUCCESS;
+    for (size_t i = 0; i < count && err == PNG_UTIL_SUCCESS; i++)
+        err = segments[i].status;
+    free(segments);
+    if (err != PNG_UTIL_SUCCESS) {
+        png_util_image_free(&out);
+        return err;
+    }
+    *image = out;
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_read_parallel(const void *data, size_t size, int threads,
+                                 png_util_image *image) {
+    if (!data || !image)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    memset(image, 0, sizeof(*image));
+
+    util_layout layout;
+    err = util_scan_chunks((const png_byte *)data, size, &layout);
+    if (err == PNG_UTIL_ERROR_OUT_OF_MEMORY)
+        return err;
+    if (err == PNG_UTIL_SUCCESS) {
+        if (layout.restart)
+            err = util_read_restart(&layout, threads, image);
+        else
+            err = PNG_UTIL_ERROR_UNSUPPORTED;
+        util_layout_free(&layout);
+        if (err == PNG_UTIL_SUCCESS || err == PNG_UTIL_ERROR_OUT_OF_MEMORY)
+            return err;
+    }
+    // No usable restart points. Let libpng decode (and validate) the whole stream.
+    return util_read_serial(data, size, image);
+}
+
+// ------ Header probe ------
+
+png_util_error png_probe_header(const void *data, size_t size, png_util_header *header) {
+    if (!data || !header)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    const png_byte *p = (const png_byte *)data;
+    if (size < PNG_UTIL_PROBE_SIZE || memcmp(p, util_png_signature, 8) != 0 ||
+            util_load_be32(p + 8) != 13 || memcmp(p + 12, "IHDR", 4) != 0 ||
+            util_crc32(0, p + 12, 17) != util_load_be32(p + 29))
+        return PNG_UTIL_ERROR_INVALID_PNG;
+
+    png_util_header out;
+    out.width = util_load_be32(p + 16);
+    out.height = util_load_be32(p + 20);
+    out.bit_depth = p[24];
+    out.color_type = p[25];
+    out.interlace_type = p[28];
+    // compression and filter methods have only one valid value
+    if (!util_valid_format(out.width, out.height, out.bit_depth, out.color_type) ||
+            p[26] != PNG_COMPRESSION_TYPE_BASE || p[27] != PNG_FILTER_TYPE_BASE ||
+            out.interlace_type >= PNG_INTERLACE_LAST)
+        return PNG_UTIL_ERROR_INVALID_PNG;
+    *header = out;
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_probe_header_file(const char *path, png_util_header *header) {
+    if (!path || !header)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return PNG_UTIL_ERROR_IO;
+    png_byte buf[PNG_UTIL_PROBE_SIZE];
+    size_t size = fread(buf, 1, sizeof(buf), fp);
+    int failed = ferror(fp);
+    fclose(fp);
+    if (failed)
+        return PNG_UTIL_ERROR_IO;
+    return png_probe_header(buf, size, header);
+}
+
+typedef struct util_probe_ctx {
+    const char *const *paths;
+    png_util_header *headers;
+    png_util_error *errors;
+} util_probe_ctx;
+
+static void util_probe_task(void *arg, size_t index) {
+    util_probe_ctx *ctx = (util_probe_ctx *)arg;
+    ctx->errors[index] = png_probe_header_file(ctx->paths[index], &ctx->headers[index]);
+}
+
+png_util_error png_probe_headers(const char *const *paths, size_t count, int threads,
+                                 png_util_header *headers, png_util_error *errors) {
+    if ((!paths || !headers || !errors) && count > 0)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    util_probe_ctx ctx = { paths, headers, errors };
+    util_run_tasks(count, threads, util_probe_task, &ctx);
+    for (size_t i = 0; i < count; i++) {
+        if (errors[i] != PNG_UTIL_SUCCESS)
+            return errors[i];
+    }
+    return PNG_UTIL_SUCCESS;
+}
+
+// ------ Metadata scan ------
+
+// Chunks parsed by util_metadata_chunk. The getters for them are optional in
+// libpng-loader, so they are handled as unknown chunks on every libpng version.
+static const png_byte util_raw_chunks[] = "cICP\0cLLI\0mDCV\0eXIf";
+#define UTIL_RAW_CHUNK_COUNT 4
+
+static int util_metadata_chunk(png_struct *png_ptr, png_unknown_chunk *chunk) {
+    png_util_metadata *meta = (png_util_metadata *)png_get_user_chunk_ptr(png_ptr);
+    const png_byte *data = chunk->data;
+    size_t size = chunk->size;
+    if (memcmp(chunk->name, "cICP", 4) == 0) {
+        if (size == 4) {
+            memcpy(meta->cicp, data, 4);
+            meta->valid |= PNG_INFO_cICP;
+        }
+    } else if (memcmp(chunk->name, "cLLI", 4) == 0) {
+        if (size == 8) {
+            meta->clli_max_cll = util_load_be32(data);
+            meta->clli_max_fall = util_load_be32(data + 4);
+            meta->valid |= PNG_INFO_cLLI;
+        }
+    } else if (memcmp(chunk->name, "mDCV", 4) == 0) {
+        if (size == 24) {
+            for (int i = 0; i < 8; i++)
+                meta->mdcv_chromaticities[i] = (png_uint_16)((data[i * 2] << 8) | data[i * 2 + 1]);
+            meta->mdcv_max_luminance = util_load_be32(data + 16);
+            meta->mdcv_min_luminance = util_load_be32(data + 20);
+            meta->valid |= PNG_INFO_mDCV;
+        }
+    } else if (memcmp(chunk->name, "eXIf", 4) == 0) {
+        // Only one eXIf is allowed. Keep the first one.
+        if ((meta->valid & PNG_INFO_eXIf) || size == 0 || size > PNG_UINT_31_MAX)
+            return 1;
+        meta->exif = (png_byte *)malloc(size);
+        if (!meta->exif)
+            png_error(png_ptr, "Out of memory");
+        memcpy(meta->exif, data, size);
+        meta->exif_size = (png_uint_32)size;
+        meta->valid |= PNG_INFO_eXIf;
+    } else {
+        return 0;  // let libpng discard it
+    }
+    return 1;
+}
+
+// Copies a string into dst and returns the next byte, or returns NULL for a NULL string.
+static png_char *util_copy_string(png_char **dst, const png_char *src, size_t length) {
+    if (!src) {
+        *dst = NULL;
+        return NULL;
+    }
+    memcpy(*dst, src, length);
+    (*dst)[length] = '\0';
+    png_char *out = *dst;
+    *dst += length + 1;
+    return out;
+}
+
+static size_t util_strlen(const png_char *str) {
+    return str ? strlen(str) : 0;
+}
+
+// Copies text chunks. Each entry owns one allocation that starts with its key.
+static int util_copy_text(png_util_metadata *meta, const png_text *text, int num_text) {
+    meta->text = (png_text *)calloc((size_t)num_text, sizeof(png_text));
+    if (!meta->text)
+        return 0;
+    for (int i = 0; i < num_text; i++) {
+        const png_text *src = &text[i];
+        size_t key_length = util_strlen(src->key);
+        size_t text_length = src->compression > 0 ? src->itxt_length : src->text_length;
+        size_t lang_length = util_strlen(src->lang);
+        size_t lang_key_length = util_strlen(src->lang_key);
+        png_char *buf = (png_char *)malloc(key_length + text_length + lang_length + lang_key_length + 4);
+        if (!buf)
+            return 0;
+        png_text *dst = &meta->text[i];
+        dst->compression = src->compression;
+        dst->key = util_copy_string(&buf, src->key ? src->key : "", key_length);
+        dst->text = util_copy_string(&buf, src->text ? src->text : "", text_length);
+        if (src->compression > 0)
+            dst->itxt_length = text_length;
+        else
+            dst->text_length = text_length;
+        dst->lang = util_copy_string(&buf, src->lang, lang_length);
+        dst->lang_key = util_copy_string(&buf, src->lang_key, lang_key_length);
+        meta->num_text = i + 1;
+    }
+    return 1;
+}
+
+void png_util_metadata_free(png_util_metadata *meta) {
+    if (!meta)
+        return;
+    for (int i = 0; i < meta->num_text; i++)
+        free(meta->text[i].key);
+    free(meta->text);
+    free(meta->iccp_name);
+    free(meta->iccp_profile);
+    free(meta->exif);
+    memset(meta, 0, sizeof(*meta));
+}
+
+// Reads chunks up to the first IDAT from fp, or from reader if fp is NULL.
+static png_util_error util_read_metadata(FILE *fp, util_mem_reader *reader,
+                                         png_util_metadata *meta) {
+    memset(meta, 0, sizeof(*meta));
+    util_trap trap;
+    png_struct *png = util_create_read_struct(&trap);
+    if (!png)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    png_info *info = png_create_info_struct(png);
+    if (!info || setjmp(trap.jmp)) {
+        png_util_error err = info ? PNG_UTIL_ERROR_LIBPNG : PNG_UTIL_ERROR_OUT_OF_MEMORY;
+        png_util_metadata_free(meta);
+        png_destroy_read_struct(&png, &info, NULL);
+        return err;
+    }
+
+    if (fp)
+        png_init_read_io(png, fp);
+    else
+        png_set_read_fn(png, reader, util_read_mem);
+    // Don't store other unknown chunks in info.
+    png_set_keep_unknown_chunks(png, PNG_HANDLE_CHUNK_NEVER, NULL, 0);
+    png_set_keep_unknown_chunks(png, PNG_HANDLE_CHUNK_ALWAYS, util_raw_chunks, UTIL_RAW_CHUNK_COUNT);
+    png_set_read_user_chunk_fn(png, meta, util_metadata_chunk);
+    png_read_info(png, info);
+
+    png_get_IHDR(png, info, &meta->header.width, &meta->header.height, &meta->header.bit_depth,
+                 &meta->header.color_type, &meta->header.interlace_type, NULL, NULL);
+
+    png_text *text;
+    int num_text = 0;
+    png_get_text(png, info, &text, &num_text);
+    if (num_text > 0 && !util_copy_text(meta, text, num_text))
+        png_error(png, "Out of memory");
+
+    png_char *name;
+    png_byte *profile;
+    png_uint_32 profile_size;
+    int compression;
+    if (png_get_iCCP(png, info, &name, &compression, &profile, &profile_size)) {
+        size_t name_length = strlen(name);
+        meta->iccp_name = (png_char *)malloc(name_length + 1);
+        meta->iccp_profile = (png_byte *)malloc(profile_size);
+        if (!meta->iccp_name || !meta->iccp_profile)
+            png_error(png, "Out of memory");
+        memcpy(meta->iccp_name, name, name_length + 1);
+        memcpy(meta->iccp_profile, profile, profile_size);
+        meta->iccp_size = profile_size;
+        meta->valid |= PNG_INFO_iCCP;
+    }
+
+    if (png_get_pHYs(png, info, &meta->phys_x, &meta->phys_y, &meta->phys_unit))
+        meta->valid |= PNG_INFO_pHYs;
+
+    png_time *time;
+    if (png_get_tIME(png, info, &time)) {
+        meta->time = *time;
+        meta->valid |= PNG_INFO_tIME;
+    }
+
+    png_destroy_read_struct(&png, &info, NULL);
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_read_metadata(const void *data, size_t size, png_util_metadata *meta) {
+    if (!data || !meta)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    util_mem_reader reader = { (const png_byte *)data, size, 0 };
+    return util_read_metadata(NULL, &reader, meta);
+}
+
+png_util_error png_read_metadata_file(const char *path, png_util_metadata *meta) {
+    if (!path || !meta)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    memset(meta, 0, sizeof(*meta));
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return PNG_UTIL_ERROR_IO;
+    err = util_read_metadata(fp, NULL, meta);
+    fclose(fp);
+    return err;
+}
+
+typedef struct util_metadata_ctx {
+    const char *const *paths;
+    png_util_metadata *metas;
+    png_util_error *errors;
+} util_metadata_ctx;
+
+static void util_metadata_task(void *arg, size_t index) {
+    util_metadata_ctx *ctx = (util_metadata_ctx *)arg;
+    ctx->errors[index] = png_read_metadata_file(ctx->paths[index], &ctx->metas[index]);
+}
+
+png_util_error png_read_metadata_files(const char *const *paths, size_t count, int threads,
+                                       png_util_metadata *metas, png_util_error *errors) {
+    if ((!paths || !metas || !errors) && count > 0)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    util_metadata_ctx ctx = { paths, metas, errors };
+    util_run_tasks(count, threads, util_metadata_task, &ctx);
+    for (size_t i = 0; i < count; i++) {
+        if (errors[i] != PNG_UTIL_SUCCESS)
+            return errors[i];
+    }
+    return PNG_UTIL_SUCCESS;
+}
+
+// ------ Region decode ------
+
+// Copies `count` pixels starting at pixel `first` of a raw row.
+static void util_copy_pixels(png_byte *dst, const png_byte *src, png_uint_32 first,
+                             png_uint_32 count, size_t pixel_bits) {
+    if (pixel_bits >= 8) {
+        size_t bytes = pixel_bits >> 3;
+        memcpy(dst, src + (size_t)first * bytes, (size_t)count * bytes);
+        return;
+    }
+    // Packed pixels are stored from the most significant bits.
+    unsigned int mask = (1U << pixel_bits) - 1;
+    memset(dst, 0, ((size_t)count * pixel_bits + 7) >> 3);
+    for (png_uint_32 i = 0; i < count; i++) {
+        size_t s = (size_t)(first + i) * pixel_bits;
+        size_t d = (size_t)i * pixel_bits;
+        unsigned int v = (src[s >> 3] >> (8 - pixel_bits - (s & 7))) & mask;
+        dst[d >> 3] |= (png_byte)(v << (8 - pixel_bits - (d & 7)));
+    }
+}
+
+png_util_error png_decode_region(const void *data, size_t size,
+                                 png_uint_32 x, png_uint_32 y, png_uint_32 width, png_uint_32 height,
+                                 png_util_image *image, png_util_region_stats *stats) {
+    if (!data || !image)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    memset(image, 0, sizeof(*image));
+    if (width == 0 || height == 0)
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    double start = util_now();
+
+    util_trap trap;
+    util_mem_reader reader = { (const png_byte *)data, size, 0 };
+    png_struct *png = util_create_read_struct(&trap);
+    if (!png)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    png_info *info = png_create_info_struct(png);
+    png_byte *volatile row = NULL;
+    volatile png_util_error result = PNG_UTIL_ERROR_LIBPNG;
+    if (!info || setjmp(trap.jmp)) {
+        err = info ? result : PNG_UTIL_ERROR_OUT_OF_MEMORY;
+        free(row);
+        png_util_image_free(image);
+        png_destroy_read_struct(&png, &info, NULL);
+        return err;
+    }
+
+    png_set_read_fn(png, &reader, util_read_mem);
+    png_read_info(png, info);
+    png_uint_32 image_width, image_height;
+    int bit_depth, color_type, interlace;
+    png_get_IHDR(png, info, &image_width, &image_height, &bit_depth, &color_type, &interlace,
+                 NULL, NULL);
+    result = PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    if (x >= image_width || width > image_width - x || y >= image_height || height > image_height - y)
+        png_error(png, "Region out of bounds");
+    // Rows of an interlaced image are only complete after the last pass.
+    result = PNG_UTIL_ERROR_UNSUPPORTED;
+    if (interlace != PNG_INTERLACE_NONE)
+        png_error(png, "Interlaced images are not supported");
+    result = PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    row = (png_byte *)malloc(util_rowbytes(image_width, bit_depth, color_type));
+    if (!row || !util_image_alloc(image, width, height, bit_depth, color_type))
+        png_error(png, "Out of memory");
+    result = PNG_UTIL_ERROR_LIBPNG;
+
+    // Rows above the band are unfiltered (the next row needs them) but not copied.
+    for (png_uint_32 i = 0; i < y; i++)
+        png_read_row(png, NULL, NULL);
+    size_t pixel_bits = (size_t)(util_channels(color_type) * bit_depth);
+    for (png_uint_32 i = 0; i < height; i++) {
+        png_read_row(png, row, NULL);
+        util_copy_pixels(image->pixels + image->row_stride * i, row, x, width, pixel_bits);
+    }
+
+    // Stop here. The rest of the stream is neither inflated nor checked.
+    free(row);
+    png_destroy_read_struct(&png, &info, NULL);
+    if (stats) {
+        stats->seconds = util_now() - start;
+        stats->rows_decoded = y + height;
+        stats->image_height = image_height;
+        stats->bytes_read = reader.pos;
+    }
+    return PNG_UTIL_SUCCESS;
+}
+
+// ------ Thumbnails ------
+
+// Reduces 8-bit RGBA rows to the size of `out` as they arrive. When `out` is larger,
+// source pixels are repeated (box) or interpolated (bilinear). Colors are averaged with premultiplied alpha, so transparent pixels don't bleed.
+typedef struct util_reducer {
+    png_uint_32 src_width;
+    png_uint_32 src_height;
+    int filter;
+    png_util_image *out;
+    png_uint_32 next_y;  // next output row
+    png_uint_32 *x0;  // box: bounds of the source columns (width + 1); bilinear: left column
+    float *fx;  // bilinear: weight of the right column
+    float *row;  // the current source row, reduced horizontally
+    float *prev;  // bilinear: the previous source row
+    float *acc;  // box: sum of the rows of the current output row; bilinear: a blended row
+    png_uint_32 acc_rows;
+    png_uint_32 acc_y;
+    float *buf;  // owns row, prev, acc and fx
+} util_reducer;
+
+// Returns the source coordinate that output pixel `i` samples (bilinear).
+static float util_sample_pos(png_uint_32 i, png_uint_32 src, png_uint_32 dst, png_uint_32 *i0) {
+    double pos = ((double)i + 0.5) * (double)src / (double)dst - 0.5;
+    if (pos < 0.0)
+        pos = 0.0;
+    if (pos > (double)(src - 1))
+        pos = (double)(src - 1);
+    *i0 = (png_uint_32)pos;
+    return (float)(pos - (double)*i0);
+}
+
+static void util_reducer_free(util_reducer *r) {
+    if (!r)
+        return;
+    free(r->x0);
+    free(r->buf);
+    free(r);
+}
+
+static util_reducer *util_reducer_new(png_uint_32 src_width, png_uint_32 src_height,
+                                      int filter, png_util_image *out) {
+    util_reducer *r = (util_reducer *)calloc(1, sizeof(util_reducer));
+    if (!r)
+        return NULL;
+    r->src_width = src_width;
+    r->src_height = src_height;
+    r->filter = filter;
+    r->out = out;
+    size_t w = out->width;
+    r->x0 = (png_uint_32 *)malloc(sizeof(png_uint_32) * (w + 1));
+    r->buf = (float *)calloc(w * 13, sizeof(float));
+    if (!r->x0 || !r->buf) {
+        util_reducer_free(r);
+        return NULL;
+    }
+    r->row = r->buf;
+    r->prev = r->row + w * 4;
+    r->acc = r->prev + w * 4;
+    r->fx = r->acc + w * 4;
+    for (png_uint_32 i = 0; i <= w; i++) {
+        if (filter == PNG_UTIL_THUMBNAIL_BILINEAR && i < w)
+            r->fx[i] = util_sample_pos(i, src_width, out->width, &r->x0[i]);
+        else
+            r->x0[i] = (png_uint_32)((double)i * src_width / out->width);
+    }
+    return r;
+}
+
+static void util_reducer_emit(util_reducer *r, const float *v) {
+    png_byte *dst = r->out->pixels + r->out->row_stride * r->next_y++;
+    for (png_uint_32 i = 0; i < r->out->width; i++, v += 4, dst += 4) {
+        float alpha = v[3];
+        if (alpha <= 0.0f) {
+            memset(dst, 0, 4);
+            continue;
+        }
+        for (int c = 0; c < 3; c++) {
+            float value = v[c] / alpha + 0.5f;
+            dst[c] = (png_byte)(value > 255.0f ? 255.0f : value);
+        }
+        dst[3] = (png_byte)(alpha + 0.5f);
+    }
+}
+
+// Flushes the box accumulator as the output rows before `end`.
+static void util_reducer_flush(util_reducer *r, png_uint_32 end) {
+    if (r->acc_rows == 0)
+        return;
+    size_t count = (size_t)r->out->width * 4;
+    float scale = 1.0f / (float)r->acc_rows;
+    for (size_t i = 0; i < count; i++)
+        r->acc[i] *= scale;
+    do {
+        util_reducer_emit(r, r->acc);
+    } while (r->next_y < end);
+    memset(r->acc, 0, sizeof(float) * count);
+    r->acc_rows = 0;
+}
+
+// Adds source row `y`. Rows must be added in order.
+static void util_reducer_add(util_reducer *r, const png_byte *src, png_uint_32 y) {
+    png_uint_32 w = r->out->width;
+    if (r->filter == PNG_UTIL_THUMBNAIL_BILINEAR) {
+        float *tmp = r->prev;
+        r->prev = r->row;
+        r->row = tmp;
+        for (png_uint_32 i = 0; i < w; i++) {
+            png_uint_32 x0 = r->x0[i];
+            png_uint_32 x1 = x0 + 1 < r->src_width ? x0 + 1 : x0;
+            const png_byte *p0 = src + (size_t)x0 * 4;
+            const png_byte *p1 = src + (size_t)x1 * 4;
+            float a0 = p0[3] * (1.0f - r->fx[i]);
+            float a1 = p1[3] * r->fx[i];
+            float *dst = r->row + (size_t)i * 4;
+            for (int c = 0; c < 3; c++)
+                dst[c] = p0[c] * a0 + p1[c] * a1;
+            dst[3] = a0 + a1;
+        }
+        // Emit every output row whose lower source row is y.
+        while (r->next_y < r->out->height) {
+            png_uint_32 y0;
+            float fy = util_sample_pos(r->next_y, r->src_height, r->out->height, &y0);
+            png_uint_32 y1 = y0 + 1 < r->src_height ? y0 + 1 : y0;
+            if (y1 > y)
+                break;
+            if (y0 == y) {
+                util_reducer_emit(r, r->row);
+                continue;
+            }
+            for (size_t i = 0; i < (size_t)w * 4; i++)
+                r->acc[i] = r->prev[i] * (1.0f - fy) + r->row[i] * fy;
+            util_reducer_emit(r, r->acc);
+        }
+        return;
+    }
+
+    png_uint_32 out_y = (png_uint_32)((double)y * r->out->height / r->src_height);
+    if (out_y != r->acc_y)
+        util_reducer_flush(r, out_y);
+    r->acc_y = out_y;
+    r->acc_rows++;
+    for (png_uint_32 i = 0; i < w; i++) {
+        float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        png_uint_32 x1 = r->x0[i + 1] > r->x0[i] ? r->x0[i + 1] : r->x0[i] + 1;
+        for (png_uint_32 x = r->x0[i]; x < x1; x++) {
+            const png_byte *p = src + (size_t)x * 4;
+            float alpha = p[3];
+            sum[0] += p[0] * alpha;
+            sum[1] += p[1] * alpha;
+            sum[2] += p[2] * alpha;
+            sum[3] += alpha;
+        }
+        float scale = 1.0f / (float)(x1 - r->x0[i]);
+        float *dst = r->acc + (size_t)i * 4;
+        for (int c = 0; c < 4; c++)
+            dst[c] += sum[c] * scale;
+    }
+}
+
+// Returns the pixel distance of the Adam7 grid that passes [0, last] fill,
+// and 1 for the full image.
+static png_uint_32 util_adam7_step(int last) {
+    return last >= 6 ? 1 : last >= 4 ? 2 : last >= 2 ? 4 : 8;
+}
+
+png_util_error png_decode_thumbnail(const void *data, size_t size,
+                                    png_uint_32 width, png_uint_32 height, int filter,
+                                    png_util_image *thumbnail) {
+    if (!data || !thumbnail)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    memset(thumbnail, 0, sizeof(*thumbnail));
+    if ((width == 0 && height == 0) ||
+            (filter != PNG_UTIL_THUMBNAIL_BOX && filter != PNG_UTIL_THUMBNAIL_BILINEAR))
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+
+    util_trap trap;
+    util_mem_reader reader = { (const png_byte *)data, size, 0 };
+    png_struct *png = util_create_read_struct(&trap);
+    if (!png)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    png_info *info = png_create_info_struct(png);
+    png_byte *volatile row = NULL;
+    png_byte *volatile grid = NULL;
+    util_reducer *volatile reducer = NULL;
+    volatile png_util_error result = PNG_UTIL_ERROR_LIBPNG;
+    if (!info || setjmp(trap.jmp)) {
+        err = info ? result : PNG_UTIL_ERROR_OUT_OF_MEMORY;
+        free(row);
+        free(grid);
+        util_reducer_free(reducer);
+        png_util_image_free(thumbnail);
+        png_destroy_read_struct(&png, &info, NULL);
+        return err;
+    }
+
+    png_set_read_fn(png, &reader, util_read_mem);
+    png_read_info(png, info);
+    png_uint_32 src_width = png_get_image_width(png, info);
+    png_uint_32 src_height = png_get_image_height(png, info);
+    int interlace = png_get_interlace_type(png, info);
+    // A zero size keeps the aspect ratio. Thumbnails are never larger than the image.
+    png_uint_32 out_width = width;
+    png_uint_32 out_height = height;
+    if (out_width == 0)
+        out_width = (png_uint_32)((double)height * src_width / src_height + 0.5);
+    if (out_height == 0)
+        out_height = (png_uint_32)((double)width * src_height / src_width + 0.5);
+    out_width = out_width == 0 ? 1 : out_width < src_width ? out_width : src_width;
+    out_height = out_height == 0 ? 1 : out_height < src_height ? out_height : src_height;
+
+    // Stop after the first Adam7 passes when they hold enough pixels. The grid of the passes
+    // is kept until it is reduced, so at most passes 0-4 are read (a quarter of the pixels),
+    // and larger thumbnails are scaled up from them.
+    int last_pass = 6;
+    if (interlace != PNG_INTERLACE_NONE) {
+        last_pass = 4;
+        while (last_pass > 0) {
+            png_uint_32 step = util_adam7_step(last_pass - 2);
+            if ((src_width + step - 1) / step < out_width ||
+                    (src_height + step - 1) / step < out_height)
+                break;
+            last_pass -= 2;
+        }
+    }
+    png_uint_32 step = util_adam7_step(last_pass);
+    png_uint_32 grid_width = (src_width + step - 1) / step;
+    png_uint_32 grid_height = (src_height + step - 1) / step;
+
+    util_set_rgba8(png, info);
+    png_read_update_info(png, info);
+    result = PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    if (!util_image_alloc(thumbnail, out_width, out_height, 8, PNG_COLOR_TYPE_RGB_ALPHA))
+        png_error(png, "Out of memory");
+    row = (png_byte *)malloc((size_t)src_width * 4);
+    reducer = util_reducer_new(grid_width, grid_height, filter, thumbnail);
+    if (!row || !reducer)
+        png_error(png, "Out of memory");
+
+    if (interlace == PNG_INTERLACE_NONE) {
+        result = PNG_UTIL_ERROR_LIBPNG;
+        for (png_uint_32 y = 0; y < src_height; y++) {
+            png_read_row(png, row, NULL);
+            util_reducer_add(reducer, row, y);
+        }
+    } else {
+        // Without png_set_interlace_handling, libpng returns the rows of each pass.
+        size_t grid_stride = (size_t)grid_width * 4;
+        if (grid_height > PNG_SIZE_MAX / grid_stride)
+            png_error(png, "Out of memory");
+        grid = (png_byte *)malloc(grid_stride * grid_height);
+        if (!grid)
+            png_error(png, "Out of memory");
+        result = PNG_UTIL_ERROR_LIBPNG;
+        for (int pass = 0; pass <= last_pass; pass++) {
+            png_uint_32 cols = PNG_PASS_COLS(src_width, pass);
+            png_uint_32 rows = PNG_PASS_ROWS(src_height, pass);
+            if (cols == 0 || rows == 0)
+                continue;  // libpng skips empty passes
+            for (png_uint_32 y = 0; y < rows; y++) {
+                png_read_row(png, row, NULL);
+                png_uint_32 grid_y = (PNG_PASS_START_ROW(pass) + y * PNG_PASS_ROW_OFFSET(pass)) / step;
+                png_byte *dst = grid + grid_stride * grid_y;
+                for (png_uint_32 x = 0; x < cols; x++) {
+                    png_uint_32 grid_x = (PNG_PASS_START_COL(pass) + x * PNG_PASS_COL_OFFSET(pass)) / step;
+                    memcpy(dst + (size_t)grid_x * 4, row + (size_t)x * 4, 4);
+                }
+            }
+        }
+        for (png_uint_32 y = 0; y < grid_height; y++)
+            util_reducer_add(reducer, grid + grid_stride * y, y);
+    }
+    util_reducer_flush(reducer, out_height);
+
+    // The remaining passes and chunks are not read.
+    free(row);
+    free(grid);
+    util_reducer_free(reducer);
+    png_destroy_read_struct(&png, &info, NULL);
+    return PNG_UTIL_SUCCESS;
+}
+
+// ------ Progressive preview ------
+
+struct png_util_preview_decoder {
+    util_trap trap;
+    png_struct *png;
+    png_info *info;
+    png_util_preview_ptr preview_fn;
+    void *user_ptr;
+    png_util_image surface;
+    int last_pass;  // the last non-empty pass
+    png_util_error error;  // sticky error of png_process_data
+};
+
+static void util_preview_info(png_struct *png_ptr, png_info *info_ptr) {
+    png_util_preview_decoder *dec = (png_util_preview_decoder *)png_get_progressive_ptr(png_ptr);
+    png_uint_32 width = png_get_image_width(png_ptr, info_ptr);
+    png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
+    dec->last_pass = 0;
+    if (png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE) {
+        dec->last_pass = 6;
+        while (PNG_PASS_COLS(width, dec->last_pass) == 0 || PNG_PASS_ROWS(height, dec->last_pass) == 0)
+            dec->last_pass--;
+    }
+    util_set_rgba8(png_ptr, info_ptr);
+    // libpng expands the pixels of each pass into blocks ("blocky" display),
+    // so the surface is a nearest-neighbor upsampling of the passes so far.
+    png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+    if (!util_image_alloc(&dec->surface, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA)) {
+        dec->error = PNG_UTIL_ERROR_OUT_OF_MEMORY;
+        png_error(png_ptr, "Out of memory");
+    }
+}
+
+static void util_preview_row(png_struct *png_ptr, png_byte *new_row, png_uint_32 row_num, int pass) {
+    png_util_preview_decoder *dec = (png_util_preview_decoder *)png_get_progressive_ptr(png_ptr);
+    // new_row is NULL for rows that the pass doesn't touch.
+    if (new_row)
+        png_progressive_combine_row(png_ptr, dec->surface.pixels + dec->surface.row_stride * row_num, new_row);
+    if (row_num == dec->surface.height - 1 && dec->preview_fn)
+        dec->preview_fn(&dec->surface, pass == dec->last_pass ? 6 : pass, dec->user_ptr);
+}
+
+static void util_preview_end(png_struct *png_ptr, png_info *info_ptr) {
+    (void)png_ptr;
+    (void)info_ptr;
+}
+
+png_util_error png_preview_decoder_create(png_util_preview_ptr preview_fn, void *user_ptr,
+                                          png_util_preview_decoder **decoder) {
+    if (!decoder)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    *decoder = NULL;
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    png_util_preview_decoder *dec = (png_util_preview_decoder *)calloc(1, sizeof(png_util_preview_decoder));
+    if (!dec)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    dec->png = util_create_read_struct(&dec->trap);
+    dec->info = dec->png ? png_create_info_struct(dec->png) : NULL;
+    if (!dec->info) {
+        png_preview_decoder_destroy(dec);
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    }
+    dec->preview_fn = preview_fn;
+    dec->user_ptr = user_ptr;
+    png_set_progressive_read_fn(dec->png, dec, util_preview_info, util_preview_row, util_preview_end);
+    *decoder = dec;
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_preview_decoder_feed(png_util_preview_decoder *decoder,
+                                        const void *data, size_t size) {
+    if (!decoder || (!data && size > 0))
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    if (decoder->error != PNG_UTIL_SUCCESS)
+        return decoder->error;
+    if (setjmp(decoder->trap.jmp)) {
+        if (decoder->error == PNG_UTIL_SUCCESS)
+            decoder->error = PNG_UTIL_ERROR_LIBPNG;
+        return decoder->error;
+    }
+    // libpng doesn't modify the buffer.
+    png_process_data(decoder->png, decoder->info, (png_byte *)data, size);
+    return PNG_UTIL_SUCCESS;
+}
+
+const png_util_image *png_preview_decoder_surface(const png_util_preview_decoder *decoder) {
+    if (!decoder || !decoder->surface.pixels)
+        return NULL;
+    return &decoder->surface;
+}
+
+void png_preview_decoder_destroy(png_util_preview_decoder *decoder) {
+    if (!decoder)
+        return;
+    if (decoder->png)
+        png_destroy_read_struct(&decoder->png, &decoder->info, NULL);
+    png_util_image_free(&decoder->surface);
+    free(decoder);
+}
+
+// ------ Pixel kernels ------
+
+// Scalar kernels. They define the results that the SIMD variants must match.
+
+static void util_rgb_to_rgba8_c(const png_byte *src, png_byte *dst, size_t count) {
+    for (size_t i = 0; i < count; i++, src += 3, dst += 4) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = 255;
+    }
+}
+
+static void util_rgba_to_rgb8_c(const png_byte *src, png_byte *dst, size_t count) {
+    for (size_t i = 0; i < count; i++, src += 4, dst += 3) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+    }
+}
+
+static void util_swap_rb8_c(const png_byte *src, png_byte *dst, size_t count) {
+    for (size_t i = 0; i < count; i++, src += 4, dst += 4) {
+        png_byte r = src[0];
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = r;
+        dst[3] = src[3];
+    }
+}
+
+static void util_swap_rb8_rgb_c(const png_byte *src, png_byte *dst, size_t count) {
+    for (size_t i = 0; i < count; i++, src += 3, dst += 3) {
+        png_byte r = src[0];
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = r;
+    }
+}
+
+static void util_gray_to_rgb8_c(const png_byte *src, png_byte *dst, size_t count) {
+    for (size_t i = 0; i < count; i++, dst += 3)
+        dst[0] = dst[1] = dst[2] = src[i];
+}
+
+static void util_gray_to_rgba8_c(const png_byte *src, png_byte *dst, size_t count) {
+    for (size_t i = 0; i < count; i++, dst += 4) {
+        dst[0] = dst[1] = dst[2] = src[i];
+        dst[3] = 255;
+    }
+}
+
+static void util_gray_alpha_to_rgba8_c(const png_byte *src, png_byte *dst, size_t count) {
+    for (size_t i = 0; i < count; i++, src += 2, dst += 4) {
+        dst[0] = dst[1] = dst[2] = src[0];
+        dst[3] = src[1];
+    }
+}
+
+// round(c * a / 255) without a division
+static png_byte util_mul255(unsigned int c, unsigned int a) {
+    unsigned int t = c * a + 128;
+    return (png_byte)((t + (t >> 8)) >> 8);
+}
+
+static void util_premultiply8_c(const png_byte *src, png_byte *dst, size_t count) {
+    for (size_t i = 0; i < count; i++, src += 4, dst += 4) {
+        png_byte a = src[3];
+        dst[0] = util_mul255(src[0], a);
+        dst[1] = util_mul255(src[1], a);
+        dst[2] = util_mul255(src[2], a);
+        dst[3] = a;
+    }
+}
+
+static void util_unpremultiply8_c(const png_byte *src, png_byte *dst, size_t count) {
+    for (size_t i = 0; i < count; i++, src += 4, dst += 4) {
+        unsigned int a = src[3];
+        for (int c = 0; c < 3; c++) {
+            unsigned int v = a ? (src[c] * 255U + a / 2) / a : 0;
+            dst[c] = (png_byte)(v > 255 ? 255 : v);
+        }
+        dst[3] = (png_byte)a;
+    }
+}
+
+// Big-endian 16-bit samples to 8 bits, rounded like png_set_scale_16.
+// dst can be src.
+static void util_narrow16_c(const png_byte *src, png_byte *dst, size_t count) {
+    for (size_t i = 0; i < count; i++, src += 2) {
+        unsigned int v = ((unsigned int)src[0] << 8) | src[1];
+        dst[i] = (png_byte)((v * 255 + 32895) >> 16);
+    }
+}
+
+// 8-bit samples to native-endian 16 bits (v * 257). Both bytes are equal.
+static void util_widen8_c(const png_byte *src, png_byte *dst, size_t count) {
+    for (size_t i = 0; i < count; i++, dst += 2)
+        dst[0] = dst[1] = src[i];
+}
+
+// Palette indices to 4-byte pixels. lut has 256 entries of 4 bytes.
+static void util_palette4_c(const png_byte *lut, const png_byte *src, png_byte *dst, size_t count) {
+    for (size_t i = 0; i < count; i++, dst += 4)
+        memcpy(dst, lut + src[i] * 4, 4);
+}
+
+static void util_palette3_c(const png_byte *lut, const png_byte *src, png_byte *dst, size_t count) {
+    for (size_t i = 0; i < count; i++, dst += 3)
+        memcpy(dst, lut + src[i] * 4, 3);
+}
+
+// RGBA8 to linear float RGBA. lut has 256 colors followed by 256 alpha values.
+// dst can overlap the end of src, as each pixel is loaded before it is stored.
+static void util_linear8_c(const float *lut, const png_byte *src, png_byte *dst, size_t count) {
+    for (size_t i = 0; i < count; i++, src += 4, dst += 16) {
+        float v[4] = { lut[src[0]], lut[src[1]], lut[src[2]], lut[256 + src[3]] };
+        memcpy(dst, v, sizeof(v));
+    }
+}
+
+// Big-endian RGBA16 to linear float RGBA. Colors are interpolated between
+// 1025 entries of lut (one per 64 values).
+static void util_linear16_c(const float *lut, const png_byte *src, png_byte *dst, size_t count) {
+    for (size_t i = 0; i < count; i++, src += 8, dst += 16) {
+        float v[4];
+        for (int c = 0; c < 3; c++) {
+            unsigned int x = ((unsigned int)src[c * 2] << 8) | src[c * 2 + 1];
+            float a = lut[x >> 6];
+            float b = lut[(x >> 6) + 1];
+            v[c] = a + (b - a) * ((float)(x & 63) * (1.0f / 64));
+        }
+        v[3] = (float)(((unsigned int)src[6] << 8) | src[7]) * (1.0f / 65535);
+        memcpy(dst, v, sizeof(v));
+    }
+}
+
+// IEEE half from float, rounded to nearest even.
+static png_uint_16 util_float_to_half(float f) {
+    png_uint_32 x;
+    memcpy(&x, &f, sizeof(x));
+    png_uint_32 sign = (x >> 16) & 0x8000;
+    png_uint_32 bits = x & 0x7fffffff;
+    if (bits >= 0x47800000)  // overflow, inf or NaN
+        return (png_uint_16)(sign | (bits > 0x7f800000 ? 0x7e00 : 0x7c00));
+    if (bits < 0x38800000) {
+        // Subnormal halves. Adding 0.5 rounds the value to a multiple of 2^-24.
+        float v;
+        memcpy(&v, &bits, sizeof(v));
+        v += 0.5f;
+        memcpy(&bits, &v, sizeof(bits));
+        return (png_uint_16)(sign | (bits - 0x3f000000));
+    }
+    // Rebias the exponent and round the mantissa.
+    bits += 0xc8000fff + ((bits >> 13) & 1);
+    return (png_uint_16)(sign | (bits >> 13));
+}
+
+// count is the number of floats. dst can be the same buffer as src.
+static void util_float_to_half_c(const float *src, png_byte *dst, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        png_uint_16 h = util_float_to_half(src[i]);
+        memcpy(dst + i * 2, &h, sizeof(h));
+    }
+}
+
+#ifdef UTIL_X86
+static void util_swap_rb8_sse2(const png_byte *src, png_byte *dst, size_t count) {
+    const __m128i ga = _mm_set1_epi32((int)0xff00ff00);
+    const __m128i r = _mm_set1_epi32(0x000000ff);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        __m128i out = _mm_or_si128(_mm_and_si128(v, ga),
+                      _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), r),
+                                   _mm_slli_epi32(_mm_and_si128(v, r), 16)));
+        _mm_storeu_si128((__m128i *)(dst + i * 4), out);
+    }
+    util_swap_rb8_c(src + i * 4, dst + i * 4, count - i);
+}
+
+static void util_gray_to_rgba8_sse2(const png_byte *src, png_byte *dst, size_t count) {
+    const __m128i ff = _mm_set1_epi8((char)0xff);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i g = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i gg_lo = _mm_unpacklo_epi8(g, g);
+        __m128i gg_hi = _mm_unpackhi_epi8(g, g);
+        __m128i ga_lo = _mm_unpacklo_epi8(g, ff);
+        __m128i ga_hi = _mm_unpackhi_epi8(g, ff);
+        png_byte *out = dst + i * 4;
+        _mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi16(gg_lo, ga_lo));
+        _mm_storeu_si128((__m128i *)(out + 16), _mm_unpackhi_epi16(gg_lo, ga_lo));
+        _mm_storeu_si128((__m128i *)(out + 32), _mm_unpacklo_epi16(gg_hi, ga_hi));
+        _mm_storeu_si128((__m128i *)(out + 48), _mm_unpackhi_epi16(gg_hi, ga_hi));
+    }
+    util_gray_to_rgba8_c(src + i, dst + i * 4, count - i);
+}
+
+// Premultiplies two pixels in 16-bit lanes. The alpha lane is multiplied by 255.
+static __m128i util_premultiply_sse2(__m128i v, __m128i alpha_one) {
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xff), 0xff);
+    a = _mm_or_si128(_mm_andnot_si128(alpha_one, a), _mm_and_si128(alpha_one, _mm_set1_epi16(255)));
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(v, a), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static void util_premultiply8_sse2(const png_byte *src, png_byte *dst, size_t count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_one = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        __m128i lo = util_premultiply_sse2(_mm_unpacklo_epi8(v, zero), alpha_one);
+        __m128i hi = util_premultiply_sse2(_mm_unpackhi_epi8(v, zero), alpha_one);
+        _mm_storeu_si128((__m128i *)(dst + i * 4), _mm_packus_epi16(lo, hi));
+    }
+    util_premultiply8_c(src + i * 4, dst + i * 4, count - i);
+}
+
+// Eight big-endian samples to 8 bits in 16-bit lanes.
+static __m128i util_narrow16_sse2_lanes(__m128i v) {
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    // (v * 255 + 32895) >> 16 in 16 bits
+    __m128i s = _mm_srli_epi16(_mm_adds_epu16(v, _mm_set1_epi16(128)), 8);
+    return _mm_srli_epi16(_mm_add_epi16(_mm_sub_epi16(v, s), _mm_set1_epi16(128)), 8);
+}
+
+static void util_narrow16_sse2(const png_byte *src, png_byte *dst, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i * 2 + 16));
+        __m128i out = _mm_packus_epi16(util_narrow16_sse2_lanes(a), util_narrow16_sse2_lanes(b));
+        _mm_storeu_si128((__m128i *)(dst + i), out);
+    }
+    util_narrow16_c(src + i * 2, dst + i, count - i);
+}
+
+static void util_widen8_sse2(const png_byte *src, png_byte *dst, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_unpacklo_epi8(v, v));
+        _mm_storeu_si128((__m128i *)(dst + i * 2 + 16), _mm_unpackhi_epi8(v, v));
+    }
+    util_widen8_c(src + i, dst + i * 2, count - i);
+}
+
+UTIL_TARGET_AVX2
+static void util_rgb_to_rgba8_avx2(const png_byte *src, png_byte *dst, size_t count) {
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+    size_t i = 0;
+    // Each load reads 16 bytes for 4 pixels (12 bytes), so keep 4 bytes of margin.
+    for (; i + 18 <= count; i += 16) {
+        const png_byte *s = src + i * 3;
+        png_byte *d = dst + i * 4;
+        for (int j = 0; j < 4; j++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(s + j * 12));
+            _mm_storeu_si128((__m128i *)(d + j * 16), _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha));
+        }
+    }
+    util_rgb_to_rgba8_c(src + i * 3, dst + i * 4, count - i);
+}
+
+UTIL_TARGET_AVX2
+static void util_rgba_to_rgb8_avx2(const png_byte *src, png_byte *dst, size_t count) {
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    size_t i = 0;
+    // Each store writes 16 bytes for 4 pixels (12 bytes), so keep 4 bytes of margin.
+    for (; i + 6 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        _mm_storeu_si128((__m128i *)(dst + i * 3), _mm_shuffle_epi8(v, shuffle));
+    }
+    util_rgba_to_rgb8_c(src + i * 4, dst + i * 3, count - i);
+}
+
+UTIL_TARGET_AVX2
+static void util_swap_rb8_avx2(const png_byte *src, png_byte *dst, size_t count) {
+    const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                             2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+        _mm256_storeu_si256((__m256i *)(dst + i * 4), _mm256_shuffle_epi8(v, shuffle));
+    }
+    util_swap_rb8_c(src + i * 4, dst + i * 4, count - i);
+}
+
+UTIL_TARGET_AVX2
+static void util_palette4_avx2(const png_byte *lut, const png_byte *src, png_byte *dst, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+        __m256i v = _mm256_i32gather_epi32((const int *)lut, index, 4);
+        _mm256_storeu_si256((__m256i *)(dst + i * 4), v);
+    }
+    util_palette4_c(lut, src + i, dst + i * 4, count - i);
+}
+
+UTIL_TARGET_AVX2
+static void util_linear8_avx2(const float *lut, const png_byte *src, png_byte *dst, size_t count) {
+    const __m256i alpha = _mm256_setr_epi32(0, 0, 0, 256, 0, 0, 0, 256);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i * 4)));
+        __m256 v = _mm256_i32gather_ps(lut, _mm256_add_epi32(index, alpha), 4);
+        _mm256_storeu_ps((float *)(dst + i * 16), v);
+    }
+    util_linear8_c(lut, src + i * 4, dst + i * 16, count - i);
+}
+
+UTIL_TARGET_AVX2
+static void util_linear16_avx2(const float *lut, const png_byte *src, png_byte *dst, size_t count) {
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    const __m256 alpha = _mm256_castsi256_ps(_mm256_setr_epi32(0, 0, 0, -1, 0, 0, 0, -1));
+    const __m256i one = _mm256_set1_epi32(1);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128i v16 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + i * 8)), swap);
+        __m256i x = _mm256_cvtepu16_epi32(v16);
+        __m256i index = _mm256_srli_epi32(x, 6);
+        __m256 a = _mm256_i32gather_ps(lut, index, 4);
+        __m256 b = _mm256_i32gather_ps(lut, _mm256_add_epi32(index, one), 4);
+        __m256 f = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(x, _mm256_set1_epi32(63))),
+                                 _mm256_set1_ps(1.0f / 64));
+        __m256 color = _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), f));
+        __m256 opacity = _mm256_mul_ps(_mm256_cvtepi32_ps(x), _mm256_set1_ps(1.0f / 65535));
+        _mm256_storeu_ps((float *)(dst + i * 16), _mm256_blendv_ps(color, opacity, alpha));
+    }
+    util_linear16_c(lut, src + i * 8, dst + i * 16, count - i);
+}
+
+UTIL_TARGET_F16C
+static void util_float_to_half_f16c(const float *src, png_byte *dst, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i *)(dst + i * 2), h);
+    }
+    util_float_to_half_c(src + i, dst + i * 2, count - i);
+}
+
+UTIL_TARGET_AVX2
+static void util_premultiply8_avx2(const png_byte *src, png_byte *dst, size_t count) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alpha_one = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0);
+    const __m256i c255 = _mm256_set1_epi16(255);
+    const __m256i c128 = _mm256_set1_epi16(128);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+        // unpack and pack work within 128-bit lanes, so the order is preserved.
+        __m256i halves[2] = { _mm256_unpacklo_epi8(v, zero), _mm256_unpackhi_epi8(v, zero) };
+        for (int h = 0; h < 2; h++) {
+            __m256i x = halves[h];
+            __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(x, 0xff), 0xff);
+            a = _mm256_blendv_epi8(a, c255, alpha_one);
+            __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(x, a), c128);
+            halves[h] = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+        }
+        _mm256_storeu_si256((__m256i *)(dst + i * 4), _mm256_packus_epi16(halves[0], halves[1]));
+    }
+    util_premultiply8_c(src + i * 4, dst + i * 4, count - i);
+}
+
+// Adler-32 of 32-byte blocks. Each block adds 32 * a to b, plus the bytes weighted 32..1.
+// Blocks are summed in 32-bit lanes up to UTIL_ADLER_NMAX bytes, which can't overflow.
+UTIL_TARGET_AVX2
+static png_uint_32 util_adler32_avx2(png_uint_32 adler, const png_byte *data, size_t size) {
+    png_uint_32 a = adler & 0xffff;
+    png_uint_32 b = adler >> 16;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                             16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i ones = _mm256_set1_epi16(1);
+    while (size >= 32) {
+        size_t n = size < UTIL_ADLER_NMAX ? size : UTIL_ADLER_NMAX;
+        n &= ~(size_t)31;
+        size -= n;
+        __m256i vs1 = _mm256_setr_epi32((int)a, 0, 0, 0, 0, 0, 0, 0);
+        __m256i vs2 = _mm256_setr_epi32((int)b, 0, 0, 0, 0, 0, 0, 0);
+        __m256i prev = zero;  // sum of a before each block
+        for (; n > 0; n -= 32, data += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)data);
+            prev = _mm256_add_epi32(prev, vs1);
+            vs1 = _mm256_add_epi32(vs1, _mm256_sad_epu8(v, zero));
+            vs2 = _mm256_add_epi32(vs2, _mm256_madd_epi16(_mm256_maddubs_epi16(v, weights), ones));
+        }
+        vs2 = _mm256_add_epi32(vs2, _mm256_slli_epi32(prev, 5));
+        __m128i s1 = _mm_add_epi32(_mm256_castsi256_si128(vs1), _mm256_extracti128_si256(vs1, 1));
+        __m128i s2 = _mm_add_epi32(_mm256_castsi256_si128(vs2), _mm256_extracti128_si256(vs2, 1));
+        s1 = _mm_add_epi32(s1, _mm_shuffle_epi32(s1, _MM_SHUFFLE(1, 0, 3, 2)));
+        s2 = _mm_add_epi32(s2, _mm_shuffle_epi32(s2, _MM_SHUFFLE(1, 0, 3, 2)));
+        s1 = _mm_add_epi32(s1, _mm_shuffle_epi32(s1, _MM_SHUFFLE(2, 3, 0, 1)));
+        s2 = _mm_add_epi32(s2, _mm_shuffle_epi32(s2, _MM_SHUFFLE(2, 3, 0, 1)));
+        a = (png_uint_32)_mm_cvtsi128_si32(s1) % UTIL_ADLER_BASE;
+        b = (png_uint_32)_mm_cvtsi128_si32(s2) % UTIL_ADLER_BASE;
+    }
+    return util_adler32((b << 16) | a, data, size);
+}
+
+// CRC-32 by folding 64-byte blocks with carry-less multiplication, then a Barrett reduction.
+// See "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009).
+// The constants are for the bit-reflected polynomial 0xEDB88320.
+UTIL_TARGET_PCLMUL
+static png_uint_32 util_crc32_pclmul(png_uint_32 crc, const png_byte *data, size_t size) {
+    if (size < 64)
+        return util_crc32(crc, data, size);
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+    const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124LL);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+    const __m128i mask32 = _mm_setr_epi32(-1, 0, -1, 0);
+    size_t rest = size & 15;
+    size -= rest;
+
+    __m128i x1 = _mm_loadu_si128((const __m128i *)data);
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(data + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(data + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(data + 48));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)~crc));
+    data += 64;
+    size -= 64;
+    for (; size >= 64; data += 64, size -= 64) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)data));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(data + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(data + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(data + 48)));
+    }
+
+    // Fold the four lanes and the remaining 16-byte blocks into one.
+    __m128i next[3] = { x2, x3, x4 };
+    for (int i = 0; i < 3; i++) {
+        __m128i lo = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), lo), next[i]);
+    }
+    for (; size >= 16; data += 16, size -= 16) {
+        __m128i lo = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), lo),
+                           _mm_loadu_si128((const __m128i *)data));
+    }
+
+    // 128 to 64 bits, then Barrett reduction to 32 bits.
+    __m128i t = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t);
+    t = _mm_srli_si128(x1, 4);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00), t);
+    t = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+    t = _mm_clmulepi64_si128(_mm_and_si128(t, mask32), poly, 0x00);
+    x1 = _mm_xor_si128(x1, t);
+    crc = ~(png_uint_32)_mm_extract_epi32(x1, 1);
+    return util_crc32(crc, data, rest);
+}
+
+static png_util_cpu_flags util_detect_cpu(void) {
+    png_util_cpu_flags flags = PNG_UTIL_CPU_SSE2;
+    unsigned int regs[4] = { 0, 0, 0, 0 };
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    unsigned int max_leaf = (unsigned int)info[0];
+    __cpuid(info, 1);
+    memcpy(regs, info, sizeof(regs));
+#else
+    unsigned int max_leaf = __get_cpuid_max(0, NULL);
+    __cpuid(1, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    // AVX2 and F16C also need the OS to save YMM registers (OSXSAVE and XCR0 bits 1-2).
+    int osxsave_avx = (regs[2] & (1U << 27)) && (regs[2] & (1U << 28));
+    int f16c = (regs[2] & (1U << 29)) != 0;
+    // PCLMULQDQ and SSE4.1 don't need OS support for YMM registers.
+    if ((regs[2] & (1U << 1)) && (regs[2] & (1U << 19)))
+        flags |= PNG_UTIL_CPU_PCLMUL;
+    if (!osxsave_avx)
+        return flags;
+#ifdef _MSC_VER
+    unsigned long long xcr0 = _xgetbv(0);
+#else
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    unsigned long long xcr0 = xcr0_lo;
+#endif
+    if ((xcr0 & 6) != 6)
+        return flags;
+    if (f16c)
+        flags |= PNG_UTIL_CPU_F16C;
+    if (max_leaf < 7)
+        return flags;
+#ifdef _MSC_VER
+    __cpuidex(info, 7, 0);
+    memcpy(regs, info, sizeof(regs));
+#else
+    __cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    if (regs[1] & (1U << 5))
+        flags |= PNG_UTIL_CPU_AVX2;
+    return flags;
+}
+#elif defined(UTIL_NEON)
+static void util_rgb_to_rgba8_neon(const png_byte *src, png_byte *dst, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x3_t rgb = vld3q_u8(src + i * 3);
+        uint8x16x4_t rgba;
+        rgba.val[0] = rgb.val[0];
+        rgba.val[1] = rgb.val[1];
+        rgba.val[2] = rgb.val[2];
+        rgba.val[3] = vdupq_n_u8(255);
+        vst4q_u8(dst + i * 4, rgba);
+    }
+    util_rgb_to_rgba8_c(src + i * 3, dst + i * 4, count - i);
+}
+
+static void util_rgba_to_rgb8_neon(const png_byte *src, png_byte *dst, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x4_t rgba = vld4q_u8(src + i * 4);
+        uint8x16x3_t rgb;
+        rgb.val[0] = rgba.val[0];
+        rgb.val[1] = rgba.val[1];
+        rgb.val[2] = rgba.val[2];
+        vst3q_u8(dst + i * 3, rgb);
+    }
+    util_rgba_to_rgb8_c(src + i * 4, dst + i * 3, count - i);
+}
+
+static void util_swap_rb8_neon(const png_byte *src, png_byte *dst, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x4_t v = vld4q_u8(src + i * 4);
+        uint8x16_t r = v.val[0];
+        v.val[0] = v.val[2];
+        v.val[2] = r;
+        vst4q_u8(dst + i * 4, v);
+    }
+    util_swap_rb8_c(src + i * 4, dst + i * 4, count - i);
+}
+
+static void util_gray_to_rgba8_neon(const png_byte *src, png_byte *dst, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x4_t v;
+        v.val[0] = v.val[1] = v.val[2] = vld1q_u8(src + i);
+        v.val[3] = vdupq_n_u8(255);
+        vst4q_u8(dst + i * 4, v);
+    }
+    util_gray_to_rgba8_c(src + i, dst + i * 4, count - i);
+}
+
+// round(c * a / 255) = (t + ((t + 128) >> 8) + 128) >> 8 with t = c * a
+static uint8x8_t util_mul255_neon(uint8x8_t c, uint8x8_t a) {
+    uint16x8_t t = vmull_u8(c, a);
+    return vraddhn_u16(t, vrshrq_n_u16(t, 8));
+}
+
+static void util_premultiply8_neon(const png_byte *src, png_byte *dst, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t v = vld4_u8(src + i * 4);
+        v.val[0] = util_mul255_neon(v.val[0], v.val[3]);
+        v.val[1] = util_mul255_neon(v.val[1], v.val[3]);
+        v.val[2] = util_mul255_neon(v.val[2], v.val[3]);
+        vst4_u8(dst + i * 4, v);
+    }
+    util_premultiply8_c(src + i * 4, dst + i * 4, count - i);
+}
+
+static void util_narrow16_neon(const png_byte *src, png_byte *dst, size_t count) {
+    const uint16x8_t c128 = vdupq_n_u16(128);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t v = vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(src + i * 2)));
+        uint16x8_t s = vshrq_n_u16(vqaddq_u16(v, c128), 8);
+        vst1_u8(dst + i, vmovn_u16(vshrq_n_u16(vaddq_u16(vsubq_u16(v, s), c128), 8)));
+    }
+    util_narrow16_c(src + i * 2, dst + i, count - i);
+}
+
+static void util_float_to_half_neon(const float *src, png_byte *dst, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+        vst1_u16((uint16_t *)(dst + i * 2), vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(src + i))));
+    util_float_to_half_c(src + i, dst + i * 2, count - i);
+}
+
+static void util_widen8_neon(const png_byte *src, png_byte *dst, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x2_t v;
+        v.val[0] = v.val[1] = vld1q_u8(src + i);
+        vst2q_u8(dst + i * 2, v);
+    }
+    util_widen8_c(src + i, dst + i * 2, count - i);
+}
+
+static png_util_cpu_flags util_detect_cpu(void) {
+    // NEON is part of the AArch64 baseline.
+    return PNG_UTIL_CPU_NEON;
+}
+#else
+static png_util_cpu_flags util_detect_cpu(void) {
+    return 0;
+}
+#endif
+
+typedef void (*util_row_fn)(const png_byte *src, png_byte *dst, size_t count);
+typedef void (*util_lut_fn)(const png_byte *lut, const png_byte *src, png_byte *dst, size_t count);
+typedef void (*util_linear_fn)(const float *lut, const png_byte *src, png_byte *dst, size_t count);
+typedef void (*util_half_fn)(const float *src, png_byte *dst, size_t count);
+typedef png_uint_32 (*util_crc_fn)(png_uint_32 crc, const png_byte *data, size_t size);
+typedef png_uint_32 (*util_adler_fn)(png_uint_32 adler, const png_byte *data, size_t size);
+
+typedef struct util_kernels {
+    util_row_fn rgb_to_rgba8;
+    util_row_fn rgba_to_rgb8;
+    util_row_fn swap_rb8;
+    util_row_fn swap_rb8_rgb;
+    util_row_fn gray_to_rgb8;
+    util_row_fn gray_to_rgba8;
+    util_row_fn gray_alpha_to_rgba8;
+    util_row_fn premultiply8;
+    util_row_fn unpremultiply8;
+    util_row_fn narrow16;  // count is samples
+    util_row_fn widen8;  // count is samples
+    util_lut_fn palette4;
+    util_lut_fn palette3;
+    util_linear_fn linear8;
+    util_linear_fn linear16;
+    util_half_fn float_to_half;  // count is floats
+    util_crc_fn crc32;  // chainable like util_crc32()
+    util_adler_fn adler32;  // chainable like util_adler32()
+} util_kernels;
+
+#define UTIL_CPU_COMBINATIONS 32  // every subset of png_util_cpu_flags
+
+static util_mutex util_kernels_lock = UTIL_MUTEX_INIT;  // guards the tables and the variables below
+static int util_cpu_ready = 0;
+static png_util_cpu_flags util_cpu_detected = 0;
+static png_util_cpu_flags util_cpu_mask = ~0U;
+// One table per feature set. A table doesn't change once it's built.
+static util_kernels util_kernel_tables[UTIL_CPU_COMBINATIONS];
+static int util_kernel_built[UTIL_CPU_COMBINATIONS];
+// Features of the current table, or -1 before the first use. It's read without the lock.
+static volatile long long util_kernels_current = -1;
+
+static void util_kernels_build(png_util_cpu_flags cpu, util_kernels *k) {
+    k->rgb_to_rgba8 = util_rgb_to_rgba8_c;
+    k->rgba_to_rgb8 = util_rgba_to_rgb8_c;
+    k->swap_rb8 = util_swap_rb8_c;
+    k->swap_rb8_rgb = util_swap_rb8_rgb_c;
+    k->gray_to_rgb8 = util_gray_to_rgb8_c;
+    k->gray_to_rgba8 = util_gray_to_rgba8_c;
+    k->gray_alpha_to_rgba8 = util_gray_alpha_to_rgba8_c;
+    k->premultiply8 = util_premultiply8_c;
+    k->unpremultiply8 = util_unpremultiply8_c;
+    k->narrow16 = util_narrow16_c;
+    k->widen8 = util_widen8_c;
+    k->palette4 = util_palette4_c;
+    k->palette3 = util_palette3_c;
+    k->linear8 = util_linear8_c;
+    k->linear16 = util_linear16_c;
+    k->float_to_half = util_float_to_half_c;
+    k->crc32 = util_crc32;
+    k->adler32 = util_adler32;
+#ifdef UTIL_X86
+    if (cpu & PNG_UTIL_CPU_SSE2) {
+        k->swap_rb8 = util_swap_rb8_sse2;
+        k->gray_to_rgba8 = util_gray_to_rgba8_sse2;
+        k->premultiply8 = util_premultiply8_sse2;
+        k->narrow16 = util_narrow16_sse2;
+        k->widen8 = util_widen8_sse2;
+    }
+    if (cpu & PNG_UTIL_CPU_AVX2) {
+        k->rgb_to_rgba8 = util_rgb_to_rgba8_avx2;
+        k->rgba_to_rgb8 = util_rgba_to_rgb8_avx2;
+        k->swap_rb8 = util_swap_rb8_avx2;
+        k->premultiply8 = util_premultiply8_avx2;
+        k->palette4 = util_palette4_avx2;
+        k->linear8 = util_linear8_avx2;
+        k->linear16 = util_linear16_avx2;
+        k->adler32 = util_adler32_avx2;
+    }
+    if (cpu & PNG_UTIL_CPU_F16C)
+        k->float_to_half = util_float_to_half_f16c;
+    if (cpu & PNG_UTIL_CPU_PCLMUL)
+        k->crc32 = util_crc32_pclmul;
+#elif defined(UTIL_NEON)
+    if (cpu & PNG_UTIL_CPU_NEON) {
+        k->rgb_to_rgba8 = util_rgb_to_rgba8_neon;
+        k->rgba_to_rgb8 = util_rgba_to_rgb8_neon;
+        k->swap_rb8 = util_swap_rb8_neon;
+        k->gray_to_rgba8 = util_gray_to_rgba8_neon;
+        k->premultiply8 = util_premultiply8_neon;
+        k->narrow16 = util_narrow16_neon;
+        k->widen8 = util_widen8_neon;
+        k->float_to_half = util_float_to_half_neon;
+    }
+#endif
+}
+
+// Builds the table for the allowed features if needed and makes it current.
+// Call it with util_kernels_lock held.
+static void util_kernels_select(void) {
+    if (!util_cpu_ready) {
+        util_cpu_detected = util_detect_cpu();
+        util_cpu_ready = 1;
+    }
+    png_util_cpu_flags cpu = util_cpu_detected & util_cpu_mask & (UTIL_CPU_COMBINATIONS - 1);
+    if (!util_kernel_built[cpu]) {
+        util_kernels_build(cpu, &util_kernel_tables[cpu]);
+        util_kernel_built[cpu] = 1;
+    }
+    util_atomic_store(&util_kernels_current, (long long)cpu);
+}
+
+// Returns the kernels for this CPU without taking a lock. Tables are never modified,
+// so conversions that run while png_util_set_cpu_mask() switches tables keep a valid one.
+static const util_kernels *util_kernels_get(void) {
+    long long cpu = util_atomic_load(&util_kernels_current);
+    if (cpu < 0) {
+        util_mutex_lock(&util_kernels_lock);
+        if (util_atomic_load(&util_kernels_current) < 0)
+            util_kernels_select();
+        util_mutex_unlock(&util_kernels_lock);
+        cpu = util_atomic_load(&util_kernels_current);
+    }
+    return &util_kernel_tables[cpu];
+}
+
+png_util_cpu_flags png_util_cpu_features(void) {
+    util_kernels_get();
+    return (png_util_cpu_flags)util_atomic_load(&util_kernels_current);
+}
+
+void png_util_set_cpu_mask(png_util_cpu_flags mask) {
+    util_mutex_lock(&util_kernels_lock);
+    util_cpu_mask = mask;
+    util_kernels_select();
+    util_mutex_unlock(&util_kernels_lock);
+}
+
+void png_util_rgb_to_rgba8(const png_byte *src, png_byte *dst, size_t count) {
+    util_kernels_get()->rgb_to_rgba8(src, dst, count);
+}
+
+void png_util_rgba_to_rgb8(const png_byte *src, png_byte *dst, size_t count) {
+    util_kernels_get()->rgba_to_rgb8(src, dst, count);
+}
+
+void png_util_swap_rb8(const png_byte *src, png_byte *dst, size_t count) {
+    util_kernels_get()->swap_rb8(src, dst, count);
+}
+
+void png_util_gray_to_rgba8(const png_byte *src, png_byte *dst, size_t count) {
+    util_kernels_get()->gray_to_rgba8(src, dst, count);
+}
+
+void png_util_premultiply8(const png_byte *src, png_byte *dst, size_t count) {
+    util_kernels_get()->premultiply8(src, dst, count);
+}
+
+void png_util_unpremultiply8(const png_byte *src, png_byte *dst, size_t count) {
+    util_kernels_get()->unpremultiply8(src, dst, count);
+}
+
+void png_util_16_to_8(const png_byte *src, png_byte *dst, size_t count) {
+    util_kernels_get()->narrow16(src, dst, count);
+}
+
+void png_util_8_to_16(const png_byte *src, png_uint_16 *dst, size_t count) {
+    util_kernels_get()->widen8(src, (png_byte *)dst, count);
+}
+
+png_uint_32 png_util_crc32(png_uint_32 crc, const png_byte *data, size_t size) {
+    return util_kernels_get()->crc32(crc, data, size);
+}
+
+png_uint_32 png_util_adler32(png_uint_32 adler, const png_byte *data, size_t size) {
+    return util_kernels_get()->adler32(adler, data, size);
+}
+
+// ------ Palette LUTs ------
+
+#define UTIL_PALETTE_CACHE_SIZE 16
+
+// Colors and alpha of all 256 indices, and the format of the table.
+typedef struct util_palette_key {
+    png_byte rgb[256 * 3];
+    png_byte alpha[256];
+    png_util_format format;
+} util_palette_key;
+
+// Entries are looked up without a lock. seq is odd while a writer replaces the entry,
+// and readers retry when it changed during their copy.
+typedef struct util_palette_entry {
+    volatile long long seq;  // 0 for empty entries
+    unsigned long long hash;
+    volatile long long referenced;  // for the clock eviction
+    util_palette_key key;
+    png_byte lut[256 * 4];
+} util_palette_entry;
+
+static util_mutex util_palette_lock = UTIL_MUTEX_INIT;  // taken by writers only
+static util_palette_entry util_palette_cache[UTIL_PALETTE_CACHE_SIZE];
+static int util_palette_hand = 0;
+static volatile long long util_palette_hits = 0;
+static volatile long long util_palette_misses = 0;
+
+static int util_format_is_bgr(png_util_format format);
+static int util_format_is_premultiplied(png_util_format format);
+
+// Indices without a PLTE entry are opaque black, like libpng expands them.
+// Returns a hash of PLTE, tRNS and the format.
+static unsigned long long util_palette_key_init(png_struct *png, png_info *info, png_util_format format,
+                                                util_palette_key *key) {
+    png_color *palette = NULL;
+    int num_palette = 0;
+    png_byte *trans = NULL;
+    int num_trans = 0;
+    memset(key, 0, sizeof(*key));
+    memset(key->alpha, 255, sizeof(key->alpha));
+    key->format = format;
+    if (png_get_PLTE(png, info, &palette, &num_palette) && num_palette > 256)
+        num_palette = 256;
+    for (int i = 0; i < num_palette; i++) {
+        key->rgb[i * 3 + 0] = palette[i].red;
+        key->rgb[i * 3 + 1] = palette[i].green;
+        key->rgb[i * 3 + 2] = palette[i].blue;
+    }
+    if (!png_get_tRNS(png, info, &trans, &num_trans, NULL) || !trans)
+        num_trans = 0;
+    if (num_trans > num_palette)
+        num_trans = num_palette;
+    for (int i = 0; i < num_trans; i++)
+        key->alpha[i] = trans[i];
+    util_xxh64 h;
+    util_xxh64_init_seed(&h, (unsigned long long)format);
+    util_xxh64_update(&h, key->rgb, (size_t)num_palette * 3);
+    util_xxh64_update(&h, key->alpha, (size_t)num_trans);
+    return util_xxh64_digest(&h);
+}
+
+// Each entry is 4 bytes in the channel order of the format. Colors are premultiplied if needed.
+static void util_palette_build(const util_palette_key *key, png_byte *lut) {
+    int bgr = util_format_is_bgr(key->format);
+    int premultiply = util_format_is_premultiplied(key->format);
+    for (int i = 0; i < 256; i++) {
+        png_byte a = key->alpha[i];
+        for (int c = 0; c < 3; c++) {
+            png_byte v = key->rgb[i * 3 + c];
+            lut[i * 4 + (bgr ? 2 - c : c)] = premultiply ? util_mul255(v, a) : v;
+        }
+        lut[i * 4 + 3] = a;
+    }
+}
+
+// Copies the table of a key. The full key is only compared when the hash matches.
+static int util_palette_find(const util_palette_key *key, unsigned long long hash, png_byte *lut) {
+    for (int i = 0; i < UTIL_PALETTE_CACHE_SIZE; i++) {
+        util_palette_entry *entry = &util_palette_cache[i];
+        for (;;) {
+            long long seq = util_atomic_load(&entry->seq);
+            if (seq & 1)
+                continue;  // a writer is replacing the entry
+            if (seq == 0 || entry->hash != hash)
+                break;
+            // A writer may replace the entry during the compare and the copy. The result is
+            // only used if seq didn't change, and retried otherwise.
+            int same = memcmp(&entry->key, key, sizeof(*key)) == 0;
+            if (same)
+                memcpy(lut, entry->lut, sizeof(entry->lut));
+            if (util_atomic_load(&entry->seq) != seq)
+                continue;
+            if (!same)
+                break;
+            if (!util_atomic_load(&entry->referenced))
+                util_atomic_store(&entry->referenced, 1);  // only written once per sweep of the clock hand
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Gets the lookup table of the image's palette. Call it after png_read_info().
+// Tables are cached across images because many assets share palettes.
+static void util_palette_lut(png_struct *png, png_info *info, png_util_format format, png_byte *lut) {
+    util_palette_key key;
+    unsigned long long hash = util_palette_key_init(png, info, format, &key);
+    if (util_palette_find(&key, hash, lut)) {
+        util_atomic_add(&util_palette_hits, 1);
+        return;
+    }
+    util_palette_build(&key, lut);
+    util_atomic_add(&util_palette_misses, 1);
+    util_mutex_lock(&util_palette_lock);
+    // Another thread may have added it meanwhile.
+    png_byte existing[256 * 4];
+    if (!util_palette_find(&key, hash, existing)) {
+        // Clock eviction. Entries used since the last sweep get a second chance.
+        util_palette_entry *victim;
+        for (;;) {
+            victim = &util_palette_cache[util_palette_hand];
+            util_palette_hand = (util_palette_hand + 1) % UTIL_PALETTE_CACHE_SIZE;
+            if (!util_atomic_load(&victim->referenced))
+                break;
+            util_atomic_store(&victim->referenced, 0);
+        }
+        util_atomic_add(&victim->seq, 1);
+        // Readers must not see the new entry while seq is still even.
+        util_release_fence();
+        victim->hash = hash;
+        victim->key = key;
+        memcpy(victim->lut, lut, sizeof(victim->lut));
+        util_atomic_store(&victim->referenced, 1);
+        util_atomic_add(&victim->seq, 1);
+    }
+    util_mutex_unlock(&util_palette_lock);
+}
+
+void png_util_palette_cache_stats(size_t *hits, size_t *misses) {
+    if (hits)
+        *hits = (size_t)util_atomic_load(&util_palette_hits);
+    if (misses)
+        *misses = (size_t)util_atomic_load(&util_palette_misses);
+}
+
+png_util_error png_decode_indexed(const void *data, size_t size, png_util_indexed_image *image) {
+    if (!data || !image)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    memset(image, 0, sizeof(*image));
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+
+    util_trap trap;
+    util_mem_reader reader = { (const png_byte *)data, size, 0 };
+    png_struct *png = util_create_read_struct(&trap);
+    if (!png)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    png_info *info = png_create_info_struct(png);
+    volatile png_util_error result = PNG_UTIL_ERROR_LIBPNG;
+    if (!info || setjmp(trap.jmp)) {
+        err = info ? result : PNG_UTIL_ERROR_OUT_OF_MEMORY;
+        png_destroy_read_struct(&png, &info, NULL);
+        png_util_image_free(&image->indices);
+        return err;
+    }
+
+    png_set_read_fn(png, &reader, util_read_mem);
+    png_read_info(png, info);
+    png_uint_32 width = png_get_image_width(png, info);
+    png_uint_32 height = png_get_image_height(png, info);
+    if (png_get_color_type(png, info) != PNG_COLOR_TYPE_PALETTE) {
+        result = PNG_UTIL_ERROR_UNSUPPORTED;
+        png_error(png, "Not an indexed-color image");
+    }
+    if (png_get_bit_depth(png, info) < 8)
+        png_set_packing(png);
+    int passes = png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+    result = PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    if (!util_image_alloc(&image->indices, width, height, 8, PNG_COLOR_TYPE_PALETTE))
+        png_error(png, "Out of memory");
+    result = PNG_UTIL_ERROR_LIBPNG;
+
+    util_palette_lut(png, info, PNG_UTIL_FORMAT_RGBA8, image->palette);
+    png_color *palette;
+    if (!png_get_PLTE(png, info, &palette, &image->num_palette))
+        image->num_palette = 0;
+    for (int pass = 0; pass < passes; pass++) {
+        for (png_uint_32 y = 0; y < height; y++)
+            png_read_row(png, image->indices.pixels + image->indices.row_stride * y, NULL);
+    }
+    png_read_end(png, NULL);
+    png_destroy_read_struct(&png, &info, NULL);
+    return PNG_UTIL_SUCCESS;
+}
+
+// ------ Linear light ------
+
+// Transfer functions of encoded samples
+enum {
+    UTIL_TRANSFER_SRGB = 0,
+    UTIL_TRANSFER_LINEAR,
+    UTIL_TRANSFER_GAMMA,
+    UTIL_TRANSFER_BT709,
+    UTIL_TRANSFER_PQ,
+    UTIL_TRANSFER_HLG
+};
+
+typedef struct util_transfer {
+    int kind;
+    png_fixed_point gamma;  // File gamma for UTIL_TRANSFER_GAMMA (45455 is 1/2.2). 0 otherwise.
+} util_transfer;
+
+#define UTIL_TRANSFER_CACHE_SIZE 8
+#define UTIL_LINEAR16_SIZE 1025
+
+typedef struct util_transfer_entry {
+    util_transfer key;
+    float lut8[512];  // 256 colors followed by 256 alpha values
+    float lut16[UTIL_LINEAR16_SIZE];  // colors at every 64th value
+    unsigned long long last_used;  // 0 for empty entries
+} util_transfer_entry;
+
+static util_mutex util_transfer_lock = UTIL_MUTEX_INIT;
+static util_transfer_entry util_transfer_cache[UTIL_TRANSFER_CACHE_SIZE];
+static unsigned long long util_transfer_clock = 0;
+static size_t util_transfer_hits = 0;
+static size_t util_transfer_misses = 0;
+
+// Stores cICP to a 5-byte buffer. The last byte is set to 1 when the chunk is valid.
+static int util_cicp_chunk(png_struct *png_ptr, png_unknown_chunk *chunk) {
+    png_byte *cicp = (png_byte *)png_get_user_chunk_ptr(png_ptr);
+    if (memcmp(chunk->name, "cICP", 4) != 0)
+        return 0;
+    if (chunk->size == 4 && !cicp[4]) {
+        memcpy(cicp, chunk->data, 4);
+        cicp[4] = 1;
+    }
+    return 1;
+}
+
+// cICP takes precedence over sRGB, and sRGB over gAMA. Untagged images are assumed to be sRGB.
+static util_transfer util_detect_transfer(png_struct *png, png_info *info, const png_byte *cicp) {
+    util_transfer t = { UTIL_TRANSFER_SRGB, 0 };
+    if (cicp[4]) {
+        switch (cicp[1]) {
+        case 1: case 6: case 14: case 15: t.kind = UTIL_TRANSFER_BT709; return t;
+        case 4: t.kind = UTIL_TRANSFER_GAMMA; t.gamma = 45455; return t;
+        case 5: t.kind = UTIL_TRANSFER_GAMMA; t.gamma = 35714; return t;
+        case 8: t.kind = UTIL_TRANSFER_LINEAR; return t;
+        case 13: return t;
+        case 16: t.kind = UTIL_TRANSFER_PQ; return t;
+        case 18: t.kind = UTIL_TRANSFER_HLG; return t;
+        default: break;  // Unknown. Fall back to other chunks.
+        }
+    }
+    int intent;
+    if (png_get_sRGB(png, info, &intent))
+        return t;
+    png_fixed_point gamma;
+    if (png_get_gAMA_fixed(png, info, &gamma) && gamma > 0) {
+        if (gamma == PNG_FP_1) {
+            t.kind = UTIL_TRANSFER_LINEAR;
+        } else {
+            t.kind = UTIL_TRANSFER_GAMMA;
+            t.gamma = gamma;
+        }
+    }
+    return t;
+}
+
+// Encoded value in [0, 1] to linear light. PQ is 1.0 at 10000 cd/m2.
+static double util_linearize(const util_transfer *t, double x) {
+    switch (t->kind) {
+    case UTIL_TRANSFER_LINEAR:
+        return x;
+    case UTIL_TRANSFER_GAMMA:
+        return pow(x, PNG_FP_1 / (double)t->gamma);
+    case UTIL_TRANSFER_BT709:
+        return x < 0.081 ? x / 4.5 : pow((x + 0.099) / 1.099, 1 / 0.45);
+    case UTIL_TRANSFER_PQ: {
+        double p = pow(x, 1 / 78.84375);
+        double n = p - 0.8359375;
+        return pow((n > 0 ? n : 0) / (18.8515625 - 18.6875 * p), 1 / 0.1593017578125);
+    }
+    case UTIL_TRANSFER_HLG: {
+        const double a = 0.17883277, b = 1 - 4 * a, c = 0.5 - a * log(4 * a);
+        return x <= 0.5 ? x * x / 3 : (exp((x - c) / a) + b) / 12;
+    }
+    default:
+        return x <= 0.04045 ? x / 12.92 : pow((x + 0.055) / 1.055, 2.4);
+    }
+}
+
+// Copies the tables of the transfer function. They are built once and cached across images.
+static void util_transfer_luts(const util_transfer *t, float *lut8, float *lut16) {
+    util_mutex_lock(&util_transfer_lock);
+    util_transfer_entry *entry = NULL;
+    util_transfer_entry *victim = &util_transfer_cache[0];
+    for (int i = 0; i < UTIL_TRANSFER_CACHE_SIZE && !entry; i++) {
+        util_transfer_entry *e = &util_transfer_cache[i];
+        if (e->last_used && e->key.kind == t->kind && e->key.gamma == t->gamma)
+            entry = e;
+        else if (e->last_used < victim->last_used)
+            victim = e;
+    }
+    if (entry) {
+        util_transfer_hits++;
+    } else {
+        util_transfer_misses++;
+        entry = victim;
+        entry->key = *t;
+        for (int i = 0; i < 256; i++) {
+            entry->lut8[i] = (float)util_linearize(t, i / 255.0);
+            entry->lut8[256 + i] = (float)(i / 255.0);
+        }
+        for (int i = 0; i < UTIL_LINEAR16_SIZE; i++)
+            entry->lut16[i] = (float)util_linearize(t, i * 64 / 65535.0);
+    }
+    entry->last_used = ++util_transfer_clock;
+    if (lut8)
+        memcpy(lut8, entry->lut8, sizeof(entry->lut8));
+    if (lut16)
+        memcpy(lut16, entry->lut16, sizeof(entry->lut16));
+    util_mutex_unlock(&util_transfer_lock);
+}
+
+void png_util_transfer_cache_stats(size_t *hits, size_t *misses) {
+    util_mutex_lock(&util_transfer_lock);
+    if (hits)
+        *hits = util_transfer_hits;
+    if (misses)
+        *misses = util_transfer_misses;
+    util_mutex_unlock(&util_transfer_lock);
+}
+
+// ------ Strided destinations ------
+
+static int util_is_little_endian(void) {
+    const png_uint_16 one = 1;
+    return *(const png_byte *)&one == 1;
+}
+
+static int util_format_channels(png_util_format format) {
+    switch (format) {
+    case PNG_UTIL_FORMAT_GRAY8:
+    case PNG_UTIL_FORMAT_GRAY16:
+        return 1;
+    case PNG_UTIL_FORMAT_GRAY_ALPHA8:
+        return 2;
+    case PNG_UTIL_FORMAT_RGB8:
+    case PNG_UTIL_FORMAT_BGR8:
+        return 3;
+    case PNG_UTIL_FORMAT_RGBA8:
+    case PNG_UTIL_FORMAT_BGRA8:
+    case PNG_UTIL_FORMAT_RGBA16:
+    case PNG_UTIL_FORMAT_RGBA8_PREMULTIPLIED:
+    case PNG_UTIL_FORMAT_BGRA8_PREMULTIPLIED:
+    case PNG_UTIL_FORMAT_RGBA32F:
+    case PNG_UTIL_FORMAT_RGBA16F:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+static int util_format_is_bgr(png_util_format format) {
+    return format == PNG_UTIL_FORMAT_BGR8 || format == PNG_UTIL_FORMAT_BGRA8 ||
+           format == PNG_UTIL_FORMAT_BGRA8_PREMULTIPLIED;
+}
+
+static int util_format_is_premultiplied(png_util_format format) {
+    return format == PNG_UTIL_FORMAT_RGBA8_PREMULTIPLIED || format == PNG_UTIL_FORMAT_BGRA8_PREMULTIPLIED;
+}
+
+static int util_format_is_float(png_util_format format) {
+    return format == PNG_UTIL_FORMAT_RGBA32F || format == PNG_UTIL_FORMAT_RGBA16F;
+}
+
+size_t png_util_format_size(png_util_format format) {
+    int bytes = 1;
+    if (format == PNG_UTIL_FORMAT_GRAY16 || format == PNG_UTIL_FORMAT_RGBA16 || format == PNG_UTIL_FORMAT_RGBA16F)
+        bytes = 2;
+    else if (format == PNG_UTIL_FORMAT_RGBA32F)
+        bytes = 4;
+    return (size_t)(util_format_channels(format) * bytes);
+}
+
+// Sets libpng transforms that convert any PNG to the format. Call it after png_read_info().
+// Float formats get big-endian RGBA16 or RGBA8, which are linearized with util_linear_plan.
+static void util_set_format(png_struct *png, png_info *info, png_util_format format) {
+    int bit_depth = png_get_bit_depth(png, info);
+    int color_type = png_get_color_type(png, info);
+    int channels = util_format_channels(format);
+    int has_alpha = (color_type & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, info, PNG_INFO_tRNS);
+    int want_alpha = channels == 2 || channels == 4;
+    int want_color = channels >= 3;
+    int want_16 = format == PNG_UTIL_FORMAT_GRAY16 || format == PNG_UTIL_FORMAT_RGBA16;
+
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(png);
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+        png_set_expand_gray_1_2_4_to_8(png);
+    if (png_get_valid(png, info, PNG_INFO_tRNS))
+        png_set_tRNS_to_alpha(png);
+    if (want_16) {
+        if (bit_depth < 16)
+            png_set_expand_16(png);
+        // 16-bit formats are native-endian.
+        if (util_is_little_endian())
+            png_set_swap(png);
+    } else if (bit_depth == 16 && !util_format_is_float(format)) {
+        png_set_scale_16(png);
+    }
+    if (want_color && !(color_type & PNG_COLOR_MASK_COLOR))
+        png_set_gray_to_rgb(png);
+    if (!want_color && (color_type & PNG_COLOR_MASK_COLOR))
+        png_set_rgb_to_gray_fixed(png, PNG_ERROR_ACTION_NONE, -1, -1);
+    if (want_alpha && !has_alpha)
+        png_set_add_alpha(png, 0xffff, PNG_FILLER_AFTER);
+    else if (!want_alpha && has_alpha)
+        png_set_strip_alpha(png);
+    if (util_format_is_bgr(format))
+        png_set_bgr(png);
+}
+
+// Converts rows with the pixel kernels instead of libpng transforms.
+// libpng only expands low bit depths and tRNS. Palettes use lookup tables.
+typedef struct util_row_plan {
+    const util_kernels *k;
+    int src_channels;
+    int src_16;
+    util_lut_fn palette;  // Expands indices with lut. Other steps are skipped.
+    png_byte lut[256 * 4];
+    util_row_fn expand;  // NULL when the channels already match
+    util_row_fn swap_rb;
+    int premultiply;
+    int dst_16;
+    size_t scratch_size;  // 0 when libpng can write into the destination
+} util_row_plan;
+
+// Returns 1 and sets libpng transforms when the rows of the image can be converted with kernels.
+// Call it after png_read_info().
+static int util_plan_rows(png_struct *png, png_info *info, png_util_format format, util_row_plan *plan) {
+    int bit_depth = png_get_bit_depth(png, info);
+    int color_type = png_get_color_type(png, info);
+    int trns = png_get_valid(png, info, PNG_INFO_tRNS) != 0;
+    int dst_channels = util_format_channels(format);
+    int dst_16 = format == PNG_UTIL_FORMAT_RGBA16;
+    if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE || dst_channels < 3 || (dst_16 && bit_depth == 16))
+        return 0;
+
+    memset(plan, 0, sizeof(*plan));
+    plan->k = util_kernels_get();
+    png_uint_32 width = png_get_image_width(png, info);
+    if (color_type == PNG_COLOR_TYPE_PALETTE && !dst_16) {
+        // The table already has the channel order and premultiplied alpha.
+        util_palette_lut(png, info, format, plan->lut);
+        plan->palette = dst_channels == 4 ? plan->k->palette4 : plan->k->palette3;
+        plan->src_channels = 1;
+        plan->scratch_size = width;
+        if (bit_depth < 8)
+            png_set_packing(png);
+        return 1;
+    }
+    plan->src_channels = (color_type & PNG_COLOR_MASK_COLOR ? 3 : 1) +
+                         ((color_type & PNG_COLOR_MASK_ALPHA) || trns ? 1 : 0);
+    plan->src_16 = bit_depth == 16;
+    plan->dst_16 = dst_16;
+    switch (plan->src_channels * 10 + dst_channels) {
+    case 13: plan->expand = plan->k->gray_to_rgb8; break;
+    case 14: plan->expand = plan->k->gray_to_rgba8; break;
+    case 24: plan->expand = plan->k->gray_alpha_to_rgba8; break;
+    case 34: plan->expand = plan->k->rgb_to_rgba8; break;
+    case 43: plan->expand = plan->k->rgba_to_rgb8; break;
+    case 33: case 44: break;
+    default: return 0;
+    }
+    if (util_format_is_bgr(format))
+        plan->swap_rb = dst_channels == 4 ? plan->k->swap_rb8 : plan->k->swap_rb8_rgb;
+    plan->premultiply = util_format_is_premultiplied(format) && (plan->src_channels % 2) == 0;
+
+    if (plan->expand || plan->src_16 || dst_16)
+        plan->scratch_size = (size_t)width * plan->src_channels * (plan->src_16 ? 2 : 1) +
+                             (dst_16 ? (size_t)width * 4 : 0);
+
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(png);
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+        png_set_expand_gray_1_2_4_to_8(png);
+    if (trns)
+        png_set_tRNS_to_alpha(png);
+    return 1;
+}
+
+// Converts a row from libpng. src is the scratch buffer, or dst when libpng wrote into it.
+static void util_convert_row(const util_row_plan *plan, png_byte *src, png_byte *dst, png_uint_32 width) {
+    if (plan->palette) {
+        plan->palette(plan->lut, src, dst, width);
+        return;
+    }
+    size_t samples = (size_t)width * plan->src_channels;
+    if (plan->src_16)
+        plan->k->narrow16(src, src, samples);
+    png_byte *out = plan->dst_16 ? src + samples * (plan->src_16 ? 2 : 1) : dst;
+    if (plan->expand)
+        plan->expand(src, out, width);
+    else if (out != src)
+        memcpy(out, src, samples);
+    if (plan->swap_rb)
+        plan->swap_rb(out, out, width);
+    if (plan->premultiply)
+        plan->k->premultiply8(out, out, width);
+    if (plan->dst_16)
+        plan->k->widen8(out, dst, (size_t)width * 4);
+}
+
+// Converts RGBA8 or RGBA16 rows from libpng to linear float RGBA.
+typedef struct util_linear_plan {
+    util_linear_fn convert;
+    util_half_fn to_half;  // NULL for float32 output
+    float lut[UTIL_LINEAR16_SIZE];
+    size_t src_rowbytes;
+    size_t scratch_size;
+} util_linear_plan;
+
+// Sets libpng transforms and picks the tables for the image. Call it after png_read_info().
+static void util_plan_linear(png_struct *png, png_info *info, png_util_format format, const png_byte *cicp,
+                             util_linear_plan *plan) {
+    const util_kernels *k = util_kernels_get();
+    util_transfer t = util_detect_transfer(png, info, cicp);
+    png_uint_32 width = png_get_image_width(png, info);
+    int src_16 = png_get_bit_depth(png, info) == 16;
+    util_set_format(png, info, format);
+    plan->convert = src_16 ? k->linear16 : k->linear8;
+    plan->to_half = format == PNG_UTIL_FORMAT_RGBA16F ? k->float_to_half : NULL;
+    util_transfer_luts(&t, src_16 ? NULL : plan->lut, src_16 ? plan->lut : NULL);
+    plan->src_rowbytes = (size_t)width * (src_16 ? 8 : 4);
+    plan->scratch_size = plan->to_half ? (size_t)width * 16 : 0;
+}
+
+// Rows from libpng are stored at the end of the destination row, and converted in place.
+static png_byte *util_linear_src(const util_linear_plan *plan, png_byte *row, size_t rowbytes) {
+    return row + rowbytes - plan->src_rowbytes;
+}
+
+static void util_linear_row(const util_linear_plan *plan, png_byte *row, size_t rowbytes,
+                            png_byte *scratch, png_uint_32 width) {
+    png_byte *src = util_linear_src(plan, row, rowbytes);
+    if (plan->to_half) {
+        plan->convert(plan->lut, src, scratch, width);
+        plan->to_half((const float *)scratch, row, (size_t)width * 4);
+    } else {
+        plan->convert(plan->lut, src, row, width);
+    }
+}
+
+png_util_error png_dest_layout(png_uint_32 width, png_uint_32 height, png_util_format format,
+                               size_t alignment, size_t *row_stride, size_t *size) {
+    if (!row_stride || !size)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    if (alignment == 0)
+        alignment = PNG_UTIL_ROW_ALIGNMENT;
+    size_t pixel_size = png_util_format_size(format);
+    if (pixel_size == 0 || width == 0 || height == 0 || (alignment & (alignment - 1)) != 0)
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    if (width > (PNG_SIZE_MAX - alignment) / pixel_size)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    size_t stride = ((size_t)width * pixel_size + alignment - 1) & ~(alignment - 1);
+    if (height > PNG_SIZE_MAX / stride)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    *row_stride = stride;
+    *size = stride * height;
+    return PNG_UTIL_SUCCESS;
+}
+
+// Finishes a row from libpng. Rows are converted and hashed while they are still in the cache.
+typedef struct util_row_sink {
+    const util_row_plan *fused;  // NULL unless util_plan_rows() succeeded
+    const util_linear_plan *linear;  // NULL unless the format is float
+    util_row_fn premultiply;  // for libpng transforms
+    util_xxh64 *hash;  // NULL when no digest is requested
+    png_byte *scratch;
+    png_uint_32 width;
+    size_t rowbytes;
+} util_row_sink;
+
+// Where libpng writes the row.
+static png_byte *util_sink_target(const util_row_sink *sink, png_byte *row) {
+    if (sink->linear)
+        return util_linear_src(sink->linear, row, sink->rowbytes);
+    return sink->fused && sink->scratch ? sink->scratch : row;
+}
+
+static void util_sink_row(const util_row_sink *sink, png_byte *row) {
+    if (sink->linear)
+        util_linear_row(sink->linear, row, sink->rowbytes, sink->scratch, sink->width);
+    else if (sink->fused)
+        util_convert_row(sink->fused, util_sink_target(sink, row), row, sink->width);
+    else if (sink->premultiply)
+        sink->premultiply(row, row, sink->width);
+    if (sink->hash)
+        util_xxh64_update(sink->hash, row, sink->rowbytes);
+}
+
+// Starts a pixel digest. The image size and the format are hashed first,
+// so the digest doesn't depend on the row stride or on the PNG encoding.
+static void util_digest_init(util_xxh64 *hash, png_uint_32 width, png_uint_32 height, png_util_format format) {
+    png_byte header[12];
+    util_store_be32(header, width);
+    util_store_be32(header + 4, height);
+    util_store_be32(header + 8, format);
+    util_xxh64_init(hash);
+    util_xxh64_update(hash, header, sizeof(header));
+}
+
+static void util_digest_final(const util_xxh64 *hash, png_util_digest *digest) {
+    unsigned long long v = util_xxh64_digest(hash);
+    for (int i = 0; i < PNG_UTIL_DIGEST_SIZE; i++)
+        digest->bytes[i] = (png_byte)(v >> (8 * (PNG_UTIL_DIGEST_SIZE - 1 - i)));
+}
+
+// Decodes into a validated destination. A zero row stride reuses one row
+// for non-interlaced images, which is enough when only the digest is needed.
+static png_util_error util_decode_into(const void *data, size_t size, const png_util_dest *dest,
+                                       png_util_digest *digest) {
+    size_t rowbytes = (size_t)dest->width * png_util_format_size(dest->format);
+    util_trap trap;
+    util_mem_reader reader = { (const png_byte *)data, size, 0 };
+    png_struct *png = util_create_read_struct(&trap);
+    if (!png)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    png_info *info = png_create_info_struct(png);
+    png_byte *volatile scratch = NULL;
+    volatile png_util_error result = PNG_UTIL_ERROR_LIBPNG;
+    if (!info || setjmp(trap.jmp)) {
+        png_util_error err = info ? result : PNG_UTIL_ERROR_OUT_OF_MEMORY;
+        png_destroy_read_struct(&png, &info, NULL);
+        free(scratch);
+        return err;
+    }
+
+    png_set_read_fn(png, &reader, util_read_mem);
+    int linear = util_format_is_float(dest->format);
+    png_byte cicp[5] = { 0, 0, 0, 0, 0 };
+    if (linear) {
+        png_set_keep_unknown_chunks(png, PNG_HANDLE_CHUNK_ALWAYS, (png_const_bytep)"cICP", 1);
+        png_set_read_user_chunk_fn(png, cicp, util_cicp_chunk);
+    }
+    png_read_info(png, info);
+    result = PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    if (png_get_image_width(png, info) != dest->width || png_get_image_height(png, info) != dest->height)
+        png_error(png, "Size mismatch");
+    util_row_plan plan;
+    util_linear_plan linear_plan;
+    util_row_sink sink;
+    memset(&sink, 0, sizeof(sink));
+    sink.width = dest->width;
+    sink.rowbytes = rowbytes;
+    size_t src_rowbytes = rowbytes;
+    size_t scratch_size = 0;
+    if (linear) {
+        util_plan_linear(png, info, dest->format, cicp, &linear_plan);
+        sink.linear = &linear_plan;
+        src_rowbytes = linear_plan.src_rowbytes;
+        scratch_size = linear_plan.scratch_size;
+    } else if (util_plan_rows(png, info, dest->format, &plan)) {
+        sink.fused = &plan;
+        src_rowbytes = (size_t)dest->width * plan.src_channels * (plan.src_16 ? 2 : 1);
+        scratch_size = plan.scratch_size;
+    } else {
+        util_set_format(png, info, dest->format);
+        if (util_format_is_premultiplied(dest->format))
+            sink.premultiply = util_kernels_get()->premultiply8;
+    }
+    int passes = png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+    if (png_get_rowbytes(png, info) != src_rowbytes || (passes > 1 && dest->row_stride == 0))
+        png_error(png, "Unexpected row size");
+    result = PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    if (scratch_size && !(scratch = (png_byte *)malloc(scratch_size)))
+        png_error(png, "Out of memory");
+    result = PNG_UTIL_ERROR_LIBPNG;
+    sink.scratch = scratch;
+    util_xxh64 hash;
+    if (digest) {
+        util_digest_init(&hash, dest->width, dest->height, dest->format);
+        sink.hash = &hash;
+    }
+
+    // Rows are written in place, so interlaced images don't need row pointers either.
+    // They are finished after the last pass.
+    png_byte *base = (png_byte *)dest->pixels;
+    for (int pass = 0; pass < passes; pass++) {
+        for (png_uint_32 y = 0; y < dest->height; y++) {
+            png_byte *row = base + dest->row_stride * y;
+            png_read_row(png, util_sink_target(&sink, row), NULL);
+            if (passes == 1)
+                util_sink_row(&sink, row);
+        }
+    }
+    for (png_uint_32 y = 0; y < dest->height && passes > 1; y++)
+        util_sink_row(&sink, base + dest->row_stride * y);
+    if (dest->row_stride > rowbytes) {
+        for (png_uint_32 y = 0; y < dest->height; y++)
+            memset(base + dest->row_stride * y + rowbytes, 0, dest->row_stride - rowbytes);
+    }
+    png_read_end(png, NULL);
+    png_destroy_read_struct(&png, &info, NULL);
+    free(scratch);
+    if (digest)
+        util_digest_final(&hash, digest);
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_decode_into_digest(const void *data, size_t size, const png_util_dest *dest,
+                                      png_util_digest *digest) {
+    if (!data || !dest || !dest->pixels)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    size_t alignment = dest->alignment ? dest->alignment : PNG_UTIL_ROW_ALIGNMENT;
+    size_t pixel_size = png_util_format_size(dest->format);
+    if (pixel_size == 0 || dest->width == 0 || dest->height == 0 ||
+            dest->width > PNG_SIZE_MAX / pixel_size || (alignment & (alignment - 1)) != 0)
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    size_t rowbytes = (size_t)dest->width * pixel_size;
+    // The base and the stride must keep every row aligned, and the last row must fit.
+    if (((size_t)dest->pixels & (alignment - 1)) != 0 || (dest->row_stride & (alignment - 1)) != 0 ||
+            dest->row_stride < rowbytes || dest->size < rowbytes ||
+            dest->height - 1 > (dest->size - rowbytes) / dest->row_stride)
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    return util_decode_into(data, size, dest, digest);
+}
+
+png_util_error png_decode_into(const void *data, size_t size, const png_util_dest *dest) {
+    return png_decode_into_digest(data, size, dest, NULL);
+}
+
+png_util_error png_hash_pixels(const void *data, size_t size, png_util_format format, png_util_digest *digest) {
+    if (!data || !digest)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    png_util_header header;
+    err = png_probe_header(data, size, &header);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    png_util_dest dest;
+    memset(&dest, 0, sizeof(dest));
+    dest.width = header.width;
+    dest.height = header.height;
+    dest.format = format;
+    // Non-interlaced rows are hashed one by one in a single row buffer.
+    size_t rows = header.interlace_type == PNG_INTERLACE_NONE ? 1 : header.height;
+    err = png_dest_layout(header.width, (png_uint_32)rows, format, 0, &dest.row_stride, &dest.size);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    if (rows == 1)
+        dest.row_stride = 0;
+    dest.pixels = malloc(dest.size);
+    if (!dest.pixels)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    err = util_decode_into(data, size, &dest, digest);
+    free(dest.pixels);
+    return err;
+}
+
+// ------ Tensors ------
+
+// Rows of the source image. Non-interlaced images are read on demand,
+// keeping the last two rows for bilinear sampling.
+typedef struct util_tensor_src {
+    png_struct *png;
+    png_byte *image;  // all rows of interlaced images, or NULL
+    png_byte *rows[2];
+    png_uint_32 row_y[2];
+    int row_valid[2];
+    png_uint_32 next_y;  // the next row libpng returns
+    size_t rowbytes;
+} util_tensor_src;
+
+// Requested rows must not go backward.
+static const png_byte *util_tensor_row(util_tensor_src *src, png_uint_32 y) {
+    if (src->image)
+        return src->image + src->rowbytes * y;
+    for (int i = 0; i < 2; i++) {
+        if (src->row_valid[i] && src->row_y[i] == y)
+            return src->rows[i];
+    }
+    int slot = !src->row_valid[0] ? 0 : !src->row_valid[1] ? 1 : src->row_y[0] < src->row_y[1] ? 0 : 1;
+    for (; src->next_y < y; src->next_y++)
+        png_read_row(src->png, NULL, NULL);
+    png_read_row(src->png, src->rows[slot], NULL);
+    src->next_y++;
+    src->row_y[slot] = y;
+    src->row_valid[slot] = 1;
+    return src->rows[slot];
+}
+
+// Source position and interpolation weight of an output coordinate.
+typedef struct util_tensor_tap {
+    png_uint_32 i0;
+    png_uint_32 i1;
+    float w;  // weight of i1
+} util_tensor_tap;
+
+// Maps [0, count) of the output onto [start, start + length) of the source with
+// bilinear taps. Positions outside the source repeat its edges.
+static void util_tensor_taps(util_tensor_tap *taps, png_uint_32 count, double start, double length,
+                             png_uint_32 size) {
+    double scale = length / count;
+    for (png_uint_32 i = 0; i < count; i++) {
+        double pos = start + (i + 0.5) * scale - 0.5;
+        if (pos < 0)
+            pos = 0;
+        if (pos > size - 1)
+            pos = size - 1;
+        png_uint_32 i0 = (png_uint_32)pos;
+        taps[i].i0 = i0;
+        taps[i].i1 = i0 + 1 < size ? i0 + 1 : i0;
+        taps[i].w = (float)(pos - i0);
+    }
+}
+
+// Computes the source window of the fit mode.
+static int util_tensor_window(const png_util_tensor_options *options, png_uint_32 width, png_uint_32 height,
+                              double *x, double *y, double *w, double *h) {
+    switch (options->fit) {
+    case PNG_UTIL_TENSOR_EXACT:
+        if (width != options->width || height != options->height)
+            return 0;
+        *x = *y = 0;
+        *w = width;
+        *h = height;
+        return 1;
+    case PNG_UTIL_TENSOR_CENTER_CROP:
+        // Integer offsets keep the samples unfiltered.
+        *x = floor(((double)width - options->width) / 2);
+        *y = floor(((double)height - options->height) / 2);
+        *w = options->width;
+        *h = options->height;
+        return 1;
+    case PNG_UTIL_TENSOR_RESIZE:
+        *x = *y = 0;
+        *w = width;
+        *h = height;
+        return 1;
+    case PNG_UTIL_TENSOR_RESIZE_CROP: {
+        double scale = (double)options->width / width;
+        if ((double)options->height / height > scale)
+            scale = (double)options->height / height;
+        *w = options->width / scale;
+        *h = options->height / scale;
+        *x = (width - *w) / 2;
+        *y = (height - *h) / 2;
+        return 1;
+    }
+    default:
+        return 0;
+    }
+}
+
+png_util_error png_decode_tensor(const void *data, size_t size, const png_util_tensor_options *options,
+                                 float *tensor) {
+    if (!data || !options || !tensor)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    int channels = options->channels;
+    if ((channels != 1 && channels != 3 && channels != 4) || options->width == 0 || options->height == 0)
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+
+    // Normalization is an affine map of 8-bit values.
+    float scale[4], bias[4];
+    for (int c = 0; c < channels; c++) {
+        float std = options->std[c] != 0 ? options->std[c] : 1.0f;
+        scale[c] = 1.0f / (255.0f * std);
+        bias[c] = -options->mean[c] / std;
+    }
+
+    util_trap trap;
+    util_mem_reader reader = { (const png_byte *)data, size, 0 };
+    png_struct *png = util_create_read_struct(&trap);
+    if (!png)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    png_info *info = png_create_info_struct(png);
+    png_byte *volatile buffer = NULL;
+    util_tensor_tap *volatile taps = NULL;
+    volatile png_util_error result = PNG_UTIL_ERROR_LIBPNG;
+    if (!info || setjmp(trap.jmp)) {
+        err = info ? result : PNG_UTIL_ERROR_OUT_OF_MEMORY;
+        png_destroy_read_struct(&png, &info, NULL);
+        free(buffer);
+        free(taps);
+        return err;
+    }
+
+    png_set_read_fn(png, &reader, util_read_mem);
+    png_read_info(png, info);
+    png_uint_32 width = png_get_image_width(png, info);
+    png_uint_32 height = png_get_image_height(png, info);
+    double win_x, win_y, win_w, win_h;
+    if (!util_tensor_window(options, width, height, &win_x, &win_y, &win_w, &win_h)) {
+        result = PNG_UTIL_ERROR_INVALID_ARGUMENT;
+        png_error(png, "Size mismatch");
+    }
+    util_set_format(png, info, channels == 1 ? PNG_UTIL_FORMAT_GRAY8 :
+                               channels == 3 ? PNG_UTIL_FORMAT_RGB8 : PNG_UTIL_FORMAT_RGBA8);
+    int interlaced = png_set_interlace_handling(png) > 1;
+    png_read_update_info(png, info);
+
+    util_tensor_src src;
+    memset(&src, 0, sizeof(src));
+    src.png = png;
+    src.rowbytes = (size_t)width * channels;
+    result = PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    if (png_get_rowbytes(png, info) != src.rowbytes || (interlaced && height > PNG_SIZE_MAX / src.rowbytes))
+        png_error(png, "Unexpected row size");
+    buffer = (png_byte *)malloc(src.rowbytes * (interlaced ? height : 2));
+    taps = (util_tensor_tap *)malloc(sizeof(util_tensor_tap) * ((size_t)options->width + options->height));
+    if (!buffer || !taps)
+        png_error(png, "Out of memory");
+    result = PNG_UTIL_ERROR_LIBPNG;
+    if (interlaced) {
+        // Adam7 rows are complete only after the last pass.
+        for (int pass = 0; pass < 7; pass++) {
+            for (png_uint_32 y = 0; y < height; y++)
+                png_read_row(png, buffer + src.rowbytes * y, NULL);
+        }
+        src.image = buffer;
+    } else {
+        src.rows[0] = buffer;
+        src.rows[1] = buffer + src.rowbytes;
+    }
+
+    util_tensor_tap *xtaps = taps;
+    util_tensor_tap *ytaps = taps + options->width;
+    util_tensor_taps(xtaps, options->width, win_x, win_w, width);
+    util_tensor_taps(ytaps, options->height, win_y, win_h, height);
+    size_t plane = (size_t)options->width * options->height;
+    for (png_uint_32 oy = 0; oy < options->height; oy++) {
+        const png_byte *r0 = util_tensor_row(&src, ytaps[oy].i0);
+        const png_byte *r1 = util_tensor_row(&src, ytaps[oy].i1);
+        float wy = ytaps[oy].w;
+        for (int c = 0; c < channels; c++) {
+            float *out = tensor + plane * c + (size_t)options->width * oy;
+            for (png_uint_32 ox = 0; ox < options->width; ox++) {
+                size_t i0 = (size_t)xtaps[ox].i0 * channels + c;
+                size_t i1 = (size_t)xtaps[ox].i1 * channels + c;
+                float wx = xtaps[ox].w;
+                float top = r0[i0] + (r0[i1] - r0[i0]) * wx;
+                float bottom = r1[i0] + (r1[i1] - r1[i0]) * wx;
+                out[ox] = (top + (bottom - top) * wy) * scale[c] + bias[c];
+            }
+        }
+    }
+
+    // Rows below the window are never decoded.
+    png_destroy_read_struct(&png, &info, NULL);
+    free(buffer);
+    free(taps);
+    return PNG_UTIL_SUCCESS;
+}
+
+typedef struct util_tensor_ctx {
+    const void *const *data;
+    const size_t *sizes;
+    const png_util_tensor_options *options;
+    float *tensors;
+    png_util_error *errors;
+} util_tensor_ctx;
+
+static void util_tensor_task(void *ctx, size_t index) {
+    util_tensor_ctx *c = (util_tensor_ctx *)ctx;
+    size_t slot = (size_t)c->options->channels * c->options->width * c->options->height;
+    c->errors[index] = png_decode_tensor(c->data[index], c->sizes[index], c->options,
+                                         c->tensors + slot * index);
+}
+
+png_util_error png_decode_tensors(const void *const *data, const size_t *sizes, size_t count, int threads,
+                                  const png_util_tensor_options *options, float *tensors,
+                                  png_util_error *errors) {
+    if ((!data || !sizes || !options || !tensors || !errors) && count > 0)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    util_tensor_ctx ctx = { data, sizes, options, tensors, errors };
+    util_run_tasks(count, threads, util_tensor_task, &ctx);
+    for (size_t i = 0; i < count; i++) {
+        if (errors[i] != PNG_UTIL_SUCCESS)
+            return errors[i];
+    }
+    return PNG_UTIL_SUCCESS;
+}
+
+// ------ Decoded image cache ------
+
+#define UTIL_CACHE_SHARDS 16
+
+typedef struct util_cache_key {
+    unsigned long long hash;  // XXH64 of the PNG data, or of the path
+    unsigned long long size;  // size of the PNG data or the file
+    unsigned long long inode;  // 0 for content keys
+    long long mtime;  // in nanoseconds, 0 for content keys
+    png_util_format format;
+} util_cache_key;
+
+typedef struct util_cache_entry {
+    png_util_cached_image image;  // first, so released images can be cast back
+    volatile long long refs;  // the cache holds one reference while the entry is indexed
+    util_cache_key key;
+    size_t charge;
+    long long last_used;
+    struct util_cache_entry *next;  // bucket chain
+    struct util_cache_entry *newer;
+    struct util_cache_entry *older;
+} util_cache_entry;
+
+typedef struct util_cache_shard {
+    util_mutex lock;
+    util_cache_entry **buckets;
+    size_t bucket_count;
+    size_t count;
+    util_cache_entry lru;  // lru.older is the most recently used entry
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} util_cache_shard;
+
+struct png_util_image_cache {
+    size_t budget;
+    volatile long long bytes;
+    volatile long long clock;  // orders entries across shards
+    util_cache_shard shards[UTIL_CACHE_SHARDS];
+};
+
+static void util_cache_content_key(const void *data, size_t size, png_util_format format, util_cache_key *key) {
+    memset(key, 0, sizeof(*key));
+    util_xxh64 hash;
+    util_xxh64_init(&hash);
+    util_xxh64_update(&hash, (const png_byte *)data, size);
+    key->hash = util_xxh64_digest(&hash);
+    key->size = size;
+    key->format = format;
+}
+
+// Modification time in nanoseconds where the platform has it.
+static long long util_stat_mtime(const struct stat *st) {
+    long long mtime = (long long)st->st_mtime * 1000000000;
+#if defined(__APPLE__)
+    mtime += st->st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+    mtime += st->st_mtim.tv_nsec;
+#endif
+    return mtime;
+}
+
+// Returns 0 when the file can't be stat'ed.
+static int util_cache_file_key(const char *path, png_util_format format, util_cache_key *key) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return 0;
+    memset(key, 0, sizeof(*key));
+    util_xxh64 hash;
+    util_xxh64_init(&hash);
+    util_xxh64_update(&hash, (const png_byte *)path, strlen(path));
+    key->hash = util_xxh64_digest(&hash);
+    key->size = (unsigned long long)st.st_size;
+    key->inode = (unsigned long long)st.st_ino ^ ((unsigned long long)st.st_dev << 32);
+    key->mtime = util_stat_mtime(&st);
+    key->format = format;
+    return 1;
+}
+
+static int util_cache_key_equal(const util_cache_key *a, const util_cache_key *b) {
+    return a->hash == b->hash && a->size == b->size && a->inode == b->inode &&
+           a->mtime == b->mtime && a->format == b->format;
+}
+
+// Mixes the whole key, so files that share a path still spread over buckets.
+static size_t util_cache_key_hash(const util_cache_key *key) {
+    unsigned long long h = key->hash ^ (key->inode * 0x9E3779B97F4A7C15ULL) ^
+                           ((unsigned long long)key->mtime * 0xC2B2AE3D27D4EB4FULL) ^ (unsigned long long)key->format;
+    return (size_t)(h ^ (h >> 32));
+}
+
+static util_cache_shard *util_cache_shard_of(png_util_image_cache *cache, const util_cache_key *key) {
+    return &cache->shards[util_cache_key_hash(key) % UTIL_CACHE_SHARDS];
+}
+
+static void util_cache_unref(util_cache_entry *entry) {
+    if (util_atomic_add(&entry->refs, -1) == 0)
+        free(entry);
+}
+
+static void util_cache_unlink_lru(util_cache_entry *entry) {
+    entry->newer->older = entry->older;
+    entry->older->newer = entry->newer;
+}
+
+static void util_cache_push_lru(util_cache_shard *shard, util_cache_entry *entry) {
+    entry->newer = &shard->lru;
+    entry->older = shard->lru.older;
+    shard->lru.older->newer = entry;
+    shard->lru.older = entry;
+}
+
+// Finds an entry and marks it as used. Call it with the shard locked.
+static util_cache_entry *util_cache_find(png_util_image_cache *cache, util_cache_shard *shard,
+                                         const util_cache_key *key) {
+    if (shard->bucket_count == 0)
+        return NULL;
+    util_cache_entry *entry = shard->buckets[util_cache_key_hash(key) / UTIL_CACHE_SHARDS % shard->bucket_count];
+    while (entry && !util_cache_key_equal(&entry->key, key))
+        entry = entry->next;
+    if (entry) {
+        util_cache_unlink_lru(entry);
+        util_cache_push_lru(shard, entry);
+        entry->last_used = util_atomic_add(&cache->clock, 1);
+        util_atomic_add(&entry->refs, 1);
+    }
+    return entry;
+}
+
+// Doubles the bucket array. The chains stay longer if it fails.
+static void util_cache_grow(util_cache_shard *shard) {
+    size_t count = shard->bucket_count ? shard->bucket_count * 2 : 64;
+    util_cache_entry **buckets = (util_cache_entry **)calloc(count, sizeof(util_cache_entry *));
+    if (!buckets)
+        return;
+    for (size_t i = 0; i < shard->bucket_count; i++) {
+        util_cache_entry *entry = shard->buckets[i];
+        while (entry) {
+            util_cache_entry *next = entry->next;
+            size_t index = util_cache_key_hash(&entry->key) / UTIL_CACHE_SHARDS % count;
+            entry->next = buckets[index];
+            buckets[index] = entry;
+            entry = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = count;
+}
+
+// Drops the oldest entry of a shard. Call it with the shard locked.
+static void util_cache_evict(png_util_image_cache *cache, util_cache_shard *shard) {
+    util_cache_entry *entry = shard->lru.newer;
+    util_cache_entry **link = &shard->buckets[util_cache_key_hash(&entry->key) / UTIL_CACHE_SHARDS % shard->bucket_count];
+    while (*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+    util_cache_unlink_lru(entry);
+    shard->count--;
+    shard->evictions++;
+    util_atomic_add(&cache->bytes, -(long long)entry->charge);
+    util_cache_unref(entry);
+}
+
+// Indexes a decoded entry and returns the entry to hand out.
+// Another thread may have decoded the same key first. Its entry wins.
+static util_cache_entry *util_cache_insert(png_util_image_cache *cache, util_cache_entry *entry) {
+    util_cache_shard *shard = util_cache_shard_of(cache, &entry->key);
+    util_mutex_lock(&shard->lock);
+    util_cache_entry *found = util_cache_find(cache, shard, &entry->key);
+    if (found || entry->charge > cache->budget) {
+        // Images over the budget are returned without being cached.
+        util_mutex_unlock(&shard->lock);
+        if (!found)
+            return entry;
+        free(entry);
+        return found;
+    }
+    if (shard->count >= shard->bucket_count)
+        util_cache_grow(shard);
+    size_t index = util_cache_key_hash(&entry->key) / UTIL_CACHE_SHARDS % shard->bucket_count;
+    entry->next = shard->buckets[index];
+    shard->buckets[index] = entry;
+    util_cache_push_lru(shard, entry);
+    entry->last_used = util_atomic_add(&cache->clock, 1);
+    shard->count++;
+    entry->refs = 2;
+    util_mutex_unlock(&shard->lock);
+
+    // The budget is shared. The oldest entry of each shard is its LRU tail,
+    // so the oldest tail is the least recently used entry of the cache.
+    // Only one shard is locked at a time, and the new entry is never evicted.
+    util_atomic_add(&cache->bytes, (long long)entry->charge);
+    while (util_atomic_load(&cache->bytes) > (long long)cache->budget) {
+        util_cache_shard *victim = NULL;
+        long long oldest = 0;
+        for (int i = 0; i < UTIL_CACHE_SHARDS; i++) {
+            util_cache_shard *s = &cache->shards[i];
+            util_mutex_lock(&s->lock);
+            util_cache_entry *tail = s->lru.newer;
+            if (s->count > 0 && tail != entry && (!victim || tail->last_used < oldest)) {
+                victim = s;
+                oldest = tail->last_used;
+            }
+            util_mutex_unlock(&s->lock);
+        }
+        if (!victim)
+            break;
+        util_mutex_lock(&victim->lock);
+        if (victim->count > 0 && victim->lru.newer != entry &&
+                util_atomic_load(&cache->bytes) > (long long)cache->budget)
+            util_cache_evict(cache, victim);
+        util_mutex_unlock(&victim->lock);
+    }
+    return entry;
+}
+
+static util_cache_entry *util_cache_lookup(png_util_image_cache *cache, const util_cache_key *key) {
+    util_cache_shard *shard = util_cache_shard_of(cache, key);
+    util_mutex_lock(&shard->lock);
+    util_cache_entry *entry = util_cache_find(cache, shard, key);
+    if (entry)
+        shard->hits++;
+    else
+        shard->misses++;
+    util_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+// Decodes into a new entry with 64-byte aligned rows. It is allocated in one block.
+static png_util_error util_cache_decode(const void *data, size_t size, const util_cache_key *key,
+                                        util_cache_entry **entry) {
+    png_util_header header;
+    png_util_error err = png_probe_header(data, size, &header);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    png_util_dest dest;
+    memset(&dest, 0, sizeof(dest));
+    dest.width = header.width;
+    dest.height = header.height;
+    dest.format = key->format;
+    err = png_dest_layout(header.width, header.height, key->format, 0, &dest.row_stride, &dest.size);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    size_t offset = (sizeof(util_cache_entry) + PNG_UTIL_ROW_ALIGNMENT - 1) & ~(size_t)(PNG_UTIL_ROW_ALIGNMENT - 1);
+    if (dest.size > PNG_SIZE_MAX - offset - PNG_UTIL_ROW_ALIGNMENT)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    util_cache_entry *e = (util_cache_entry *)malloc(offset + dest.size + PNG_UTIL_ROW_ALIGNMENT);
+    if (!e)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    // malloc only guarantees the alignment of max_align_t.
+    size_t base = ((size_t)e + offset + PNG_UTIL_ROW_ALIGNMENT - 1) & ~(size_t)(PNG_UTIL_ROW_ALIGNMENT - 1);
+    dest.pixels = (void *)base;
+    err = png_decode_into(data, size, &dest);
+    if (err != PNG_UTIL_SUCCESS) {
+        free(e);
+        return err;
+    }
+    memset(e, 0, sizeof(*e));
+    e->image.width = dest.width;
+    e->image.height = dest.height;
+    e->image.format = dest.format;
+    e->image.row_stride = dest.row_stride;
+    e->image.size = dest.size;
+    e->image.pixels = (const png_byte *)dest.pixels;
+    e->refs = 1;
+    e->key = *key;
+    e->charge = offset + dest.size + PNG_UTIL_ROW_ALIGNMENT;
+    *entry = e;
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_image_cache_create(size_t budget, png_util_image_cache **cache) {
+    if (!cache)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_image_cache *c = (png_util_image_cache *)calloc(1, sizeof(png_util_image_cache));
+    if (!c)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    c->budget = budget;
+    for (int i = 0; i < UTIL_CACHE_SHARDS; i++) {
+        util_cache_shard *shard = &c->shards[i];
+        util_mutex_init(&shard->lock);
+        shard->lru.newer = &shard->lru;
+        shard->lru.older = &shard->lru;
+    }
+    *cache = c;
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_image_cache_decode(png_util_image_cache *cache, const void *data, size_t size,
+                                      png_util_format format, const png_util_cached_image **image) {
+    if (!cache || !data || !image)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    util_cache_key key;
+    util_cache_content_key(data, size, format, &key);
+    util_cache_entry *entry = util_cache_lookup(cache, &key);
+    if (!entry) {
+        png_util_error err = util_cache_decode(data, size, &key, &entry);
+        if (err != PNG_UTIL_SUCCESS)
+            return err;
+        entry = util_cache_insert(cache, entry);
+    }
+    *image = &entry->image;
+    return PNG_UTIL_SUCCESS;
+}
+
+// Reads a whole file into memory.
+static png_util_error util_read_file(const char *path, png_byte **data, size_t *size) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return PNG_UTIL_ERROR_IO;
+    png_byte *buf = NULL;
+    size_t used = 0, capacity = 0;
+    png_util_error err = PNG_UTIL_SUCCESS;
+    for (;;) {
+        if (used == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 65536;
+            png_byte *new_buf = (png_byte *)realloc(buf, new_capacity);
+            if (!new_buf) {
+                err = PNG_UTIL_ERROR_OUT_OF_MEMORY;
+                break;
+            }
+            buf = new_buf;
+            capacity = new_capacity;
+        }
+        size_t n = fread(buf + used, 1, capacity - used, fp);
+        used += n;
+        if (n == 0) {
+            if (ferror(fp))
+                err = PNG_UTIL_ERROR_IO;
+            break;
+        }
+    }
+    fclose(fp);
+    if (err != PNG_UTIL_SUCCESS) {
+        free(buf);
+        return err;
+    }
+    *data = buf;
+    *size = used;
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_image_cache_decode_file(png_util_image_cache *cache, const char *path,
+                                           png_util_format format, const png_util_cached_image **image) {
+    if (!cache || !path || !image)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    util_cache_key key;
+    if (!util_cache_file_key(path, format, &key))
+        return PNG_UTIL_ERROR_IO;
+    util_cache_entry *entry = util_cache_lookup(cache, &key);
+    if (!entry) {
+        // The file is read after stat(), so a newer file is never cached under an older key.
+        png_byte *data;
+        size_t size;
+        png_util_error err = util_read_file(path, &data, &size);
+        if (err != PNG_UTIL_SUCCESS)
+            return err;
+        err = util_cache_decode(data, size, &key, &entry);
+        free(data);
+        if (err != PNG_UTIL_SUCCESS)
+            return err;
+        entry = util_cache_insert(cache, entry);
+    }
+    *image = &entry->image;
+    return PNG_UTIL_SUCCESS;
+}
+
+void png_image_cache_release(const png_util_cached_image *image) {
+    if (image)
+        util_cache_unref((util_cache_entry *)image);
+}
+
+void png_image_cache_stats(png_util_image_cache *cache, png_util_image_cache_stats *stats) {
+    if (!cache || !stats)
+        return;
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < UTIL_CACHE_SHARDS; i++) {
+        util_cache_shard *shard = &cache->shards[i];
+        util_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->entries += shard->count;
+        util_mutex_unlock(&shard->lock);
+    }
+    stats->bytes = (size_t)util_atomic_load(&cache->bytes);
+}
+
+void png_image_cache_destroy(png_util_image_cache *cache) {
+    if (!cache)
+        return;
+    for (int i = 0; i < UTIL_CACHE_SHARDS; i++) {
+        util_cache_shard *shard = &cache->shards[i];
+        util_cache_entry *entry = shard->lru.older;
+        while (entry != &shard->lru) {
+            util_cache_entry *next = entry->older;
+            util_cache_unref(entry);
+            entry = next;
+        }
+        free(shard->buckets);
+        util_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+}
+
+// ------ Disk cache ------
+
+// Entries are "<key hash>.pxc" files: a 64-byte header and the pixels.
+// Pixels start at offset 64, so mapped rows keep their 64-byte alignment.
+#define UTIL_DISK_MAGIC "PNGUPIX1"
+#define UTIL_DISK_HEADER_SIZE 64
+#define UTIL_DISK_SUFFIX ".pxc"
+#define UTIL_DISK_TEMP_SUFFIX ".tmp"  // "<entry>.<pid>-<counter>.tmp" while it's written
+
+typedef struct util_mapping {
+    const png_byte *data;
+    size_t size;
+} util_mapping;
+
+#ifdef _WIN32
+static png_util_error util_map_file(const char *path, int touch, util_mapping *map) {
+    HANDLE file = CreateFileA(path, GENERIC_READ | FILE_WRITE_ATTRIBUTES,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return PNG_UTIL_ERROR_IO;
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0 && (unsigned long long)size.QuadPart <= PNG_SIZE_MAX)
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping && touch) {
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        SetFileTime(file, NULL, NULL, &now);
+    }
+    CloseHandle(file);
+    if (!mapping)
+        return PNG_UTIL_ERROR_IO;
+    // The view keeps the mapping alive.
+    map->data = (const png_byte *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    map->size = (size_t)size.QuadPart;
+    CloseHandle(mapping);
+    return map->data ? PNG_UTIL_SUCCESS : PNG_UTIL_ERROR_IO;
+}
+
+static void util_unmap_file(util_mapping *map) {
+    UnmapViewOfFile(map->data);
+}
+
+static int util_replace_file(const char *from, const char *to) {
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+static int util_make_dir(const char *dir) {
+    return CreateDirectoryA(dir, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+static unsigned long util_process_id(void) {
+    return (unsigned long)GetCurrentProcessId();
+}
+
+static int util_process_alive(unsigned long pid) {
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, (DWORD)pid);
+    if (!process)
+        return GetLastError() != ERROR_INVALID_PARAMETER;
+    DWORD code;
+    int alive = !GetExitCodeProcess(process, &code) || code == STILL_ACTIVE;
+    CloseHandle(process);
+    return alive;
+}
+
+typedef void (*util_dir_fn)(void *ctx, const char *name, unsigned long long size, long long mtime);
+
+// Calls fn for every file in dir whose name ends with suffix.
+static void util_list_entries(const char *dir, const char *suffix, util_dir_fn fn, void *ctx) {
+    char pattern[4096];
+    if (snprintf(pattern, sizeof(pattern), "%s\\*%s", dir, suffix) >= (int)sizeof(pattern))
+        return;
+    WIN32_FIND_DATAA found;
+    HANDLE find = FindFirstFileA(pattern, &found);
+    if (find == INVALID_HANDLE_VALUE)
+        return;
+    do {
+        unsigned long long size = ((unsigned long long)found.nFileSizeHigh << 32) | found.nFileSizeLow;
+        long long mtime = (long long)(((unsigned long long)found.ftLastWriteTime.dwHighDateTime << 32) |
+                                      found.ftLastWriteTime.dwLowDateTime);
+        fn(ctx, found.cFileName, size, mtime * 100);
+    } while (FindNextFileA(find, &found));
+    FindClose(find);
+}
+#else  // _WIN32
+static png_util_error util_map_file(const char *path, int touch, util_mapping *map) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return PNG_UTIL_ERROR_IO;
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && (unsigned long long)st.st_size <= PNG_SIZE_MAX)
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The modification time orders entries for eviction.
+    if (data != MAP_FAILED && touch)
+        futimens(fd, NULL);
+    close(fd);
+    if (data == MAP_FAILED)
+        return PNG_UTIL_ERROR_IO;
+    map->data = (const png_byte *)data;
+    map->size = (size_t)st.st_size;
+    return PNG_UTIL_SUCCESS;
+}
+
+static void util_unmap_file(util_mapping *map) {
+    munmap((void *)map->data, map->size);
+}
+
+static int util_replace_file(const char *from, const char *to) {
+    return rename(from, to) == 0;
+}
+
+static int util_make_dir(const char *dir) {
+    struct stat st;
+    return mkdir(dir, 0777) == 0 || (stat(dir, &st) == 0 && S_ISDIR(st.st_mode));
+}
+
+static unsigned long util_process_id(void) {
+    return (unsigned long)getpid();
+}
+
+static int util_process_alive(unsigned long pid) {
+    if ((pid_t)pid <= 0)
+        return 0;  // not a process ID, and kill() would signal a group
+    return kill((pid_t)pid, 0) == 0 || errno == EPERM;
+}
+
+typedef void (*util_dir_fn)(void *ctx, const char *name, unsigned long long size, long long mtime);
+
+// Calls fn for every file in dir whose name ends with suffix.
+static void util_list_entries(const char *dir, const char *suffix, util_dir_fn fn, void *ctx) {
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+    size_t suffix_len = strlen(suffix);
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (len <= suffix_len || strcmp(ent->d_name + len - suffix_len, suffix) != 0)
+            continue;
+        char path[4096];
+        struct stat st;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name) < (int)sizeof(path) &&
+                stat(path, &st) == 0 && S_ISREG(st.st_mode))
+            fn(ctx, ent->d_name, (unsigned long long)st.st_size, util_stat_mtime(&st));
+    }
+    closedir(d);
+}
+#endif  // _WIN32
+
+struct png_util_disk_cache {
+    char *dir;
+    unsigned long long budget;
+    util_mutex lock;
+    unsigned long long bytes;  // bytes of entries, as of the last scan plus inserts since then
+    unsigned long temp_counter;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+};
+
+// A mapped entry. The image is first, so released images can be cast back.
+typedef struct util_disk_image {
+    png_util_cached_image image;
+    util_mapping map;
+} util_disk_image;
+
+typedef struct util_disk_file {
+    char name[32];
+    unsigned long long size;
+    long long mtime;
+} util_disk_file;
+
+typedef struct util_disk_scan {
+    util_disk_file *files;
+    size_t count;
+    size_t capacity;
+    unsigned long long bytes;
+} util_disk_scan;
+
+static void util_disk_scan_entry(void *ctx, const char *name, unsigned long long size, long long mtime) {
+    util_disk_scan *scan = (util_disk_scan *)ctx;
+    scan->bytes += size;
+    if (strlen(name) >= sizeof(scan->files[0].name))
+        return;
+    if (scan->count == scan->capacity) {
+        size_t capacity = scan->capacity ? scan->capacity * 2 : 256;
+        util_disk_file *files = (util_disk_file *)realloc(scan->files, capacity * sizeof(util_disk_file));
+        if (!files)
+            return;
+        scan->files = files;
+        scan->capacity = capacity;
+    }
+    util_disk_file *file = &scan->files[scan->count++];
+    strcpy(file->name, name);
+    file->size = size;
+    file->mtime = mtime;
+}
+
+static int util_disk_file_cmp(const void *a, const void *b) {
+    long long x = ((const util_disk_file *)a)->mtime, y = ((const util_disk_file *)b)->mtime;
+    return x < y ? -1 : x > y;
+}
+
+static void util_disk_name(const util_cache_key *key, char *name) {
+    unsigned long long h = key->hash ^ ((unsigned long long)util_cache_key_hash(key) << 1);
+    snprintf(name, 32, "%016llx" UTIL_DISK_SUFFIX, h);
+}
+
+static int util_disk_path(const png_util_disk_cache *cache, const char *name, char *path, size_t size) {
+#ifdef _WIN32
+    return snprintf(path, size, "%s\\%s", cache->dir, name) < (int)size;
+#else
+    return snprintf(path, size, "%s/%s", cache->dir, name) < (int)size;
+#endif
+}
+
+// Deletes the least recently used entries until the directory is down to 90% of the budget,
+// so the next scan waits until the cache grows by a tenth of the budget again.
+// The directory is scanned again, so entries written by other processes are counted too.
+static void util_disk_evict(png_util_disk_cache *cache, const char *keep) {
+    util_disk_scan scan;
+    memset(&scan, 0, sizeof(scan));
+    util_list_entries(cache->dir, UTIL_DISK_SUFFIX, util_disk_scan_entry, &scan);
+    if (scan.bytes <= cache->budget) {
+        free(scan.files);
+        util_mutex_lock(&cache->lock);
+        cache->bytes = scan.bytes;
+        util_mutex_unlock(&cache->lock);
+        return;
+    }
+    qsort(scan.files, scan.count, sizeof(util_disk_file), util_disk_file_cmp);
+    unsigned long long low_water = cache->budget - cache->budget / 10;
+    size_t evictions = 0;
+    for (size_t i = 0; i < scan.count && scan.bytes > low_water; i++) {
+        char path[4096];
+        if (strcmp(scan.files[i].name, keep) == 0 || !util_disk_path(cache, scan.files[i].name, path, sizeof(path)))
+            continue;
+        // Mapped entries stay valid on POSIX. Windows refuses to delete them.
+        if (remove(path) == 0) {
+            scan.bytes -= scan.files[i].size;
+            evictions++;
+        }
+    }
+    free(scan.files);
+    util_mutex_lock(&cache->lock);
+    cache->bytes = scan.bytes;
+    cache->evictions += evictions;
+    util_mutex_unlock(&cache->lock);
+}
+
+static void util_store_be64(png_byte *p, unsigned long long v) {
+    util_store_be32(p, (png_uint_32)(v >> 32));
+    util_store_be32(p + 4, (png_uint_32)v);
+}
+
+static unsigned long long util_load_be64(const png_byte *p) {
+    return ((unsigned long long)util_load_be32(p) << 32) | util_load_be32(p + 4);
+}
+
+// Host byte order of 16-bit and float samples.
+static png_uint_32 util_disk_flags(void) {
+    return util_is_little_endian() ? 1 : 0;
+}
+
+static void util_disk_header(const util_cache_key *key, const png_util_cached_image *image, png_byte *header) {
+    memset(header, 0, UTIL_DISK_HEADER_SIZE);
+    memcpy(header, UTIL_DISK_MAGIC, 8);
+    util_store_be32(header + 8, image->width);
+    util_store_be32(header + 12, image->height);
+    util_store_be32(header + 16, (png_uint_32)key->format);
+    util_store_be32(header + 20, util_disk_flags());
+    util_store_be64(header + 24, image->row_stride);
+    util_store_be64(header + 32, key->hash);
+    util_store_be64(header + 40, key->size);
+    util_store_be64(header + 48, key->inode);
+    util_store_be64(header + 56, (unsigned long long)key->mtime);
+}
+
+// Maps an entry. Entries of other keys (hash collisions), other hosts or truncated files are misses.
+static int util_disk_open(const char *path, const util_cache_key *key, util_disk_image **image) {
+    util_mapping map;
+    if (util_map_file(path, 1, &map) != PNG_UTIL_SUCCESS)
+        return 0;
+    const png_byte *h = map.data;
+    png_util_cached_image info;
+    memset(&info, 0, sizeof(info));
+    if (map.size >= UTIL_DISK_HEADER_SIZE) {
+        info.width = util_load_be32(h + 8);
+        info.height = util_load_be32(h + 12);
+        info.format = key->format;
+        info.row_stride = (size_t)util_load_be64(h + 24);
+    }
+    png_byte expected[UTIL_DISK_HEADER_SIZE];
+    util_disk_header(key, &info, expected);
+    size_t stride, size;
+    if (map.size < UTIL_DISK_HEADER_SIZE || memcmp(h, expected, UTIL_DISK_HEADER_SIZE) != 0 ||
+            png_dest_layout(info.width, info.height, key->format, 0, &stride, &size) != PNG_UTIL_SUCCESS ||
+            stride != info.row_stride || map.size - UTIL_DISK_HEADER_SIZE != size) {
+        util_unmap_file(&map);
+        return 0;
+    }
+    util_disk_image *img = (util_disk_image *)malloc(sizeof(util_disk_image));
+    if (!img) {
+        util_unmap_file(&map);
+        return 0;
+    }
+    info.size = size;
+    info.pixels = map.data + UTIL_DISK_HEADER_SIZE;
+    img->image = info;
+    img->map = map;
+    *image = img;
+    return 1;
+}
+
+// Deletes a temporary file whose writer is gone, e.g. after a crash.
+static void util_disk_remove_temp(void *ctx, const char *name, unsigned long long size, long long mtime) {
+    (void)size;
+    (void)mtime;
+    const png_util_disk_cache *cache = (const png_util_disk_cache *)ctx;
+    const char *pid = strstr(name, UTIL_DISK_SUFFIX ".");
+    char path[4096];
+    if (!pid || util_process_alive(strtoul(pid + sizeof(UTIL_DISK_SUFFIX), NULL, 10)) ||
+            !util_disk_path(cache, name, path, sizeof(path)))
+        return;
+    remove(path);
+}
+
+// Decodes a PNG and writes the entry through a temporary file and a rename,
+// so readers never see a partial entry.
+static png_util_error util_disk_store(png_util_disk_cache *cache, const void *data, size_t size,
+                                      const util_cache_key *key, const char *name, const char *path) {
+    png_util_header header;
+    png_util_error err = png_probe_header(data, size, &header);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    png_util_dest dest;
+    memset(&dest, 0, sizeof(dest));
+    dest.width = header.width;
+    dest.height = header.height;
+    dest.format = key->format;
+    err = png_dest_layout(header.width, header.height, key->format, 0, &dest.row_stride, &dest.size);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    if (dest.size > PNG_SIZE_MAX - UTIL_DISK_HEADER_SIZE - PNG_UTIL_ROW_ALIGNMENT)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    // The header is stored right before the 64-byte aligned pixels.
+    png_byte *buf = (png_byte *)malloc(UTIL_DISK_HEADER_SIZE + dest.size + PNG_UTIL_ROW_ALIGNMENT);
+    if (!buf)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    png_byte *base = (png_byte *)(((size_t)buf + UTIL_DISK_HEADER_SIZE + PNG_UTIL_ROW_ALIGNMENT - 1) &
+                                  ~(size_t)(PNG_UTIL_ROW_ALIGNMENT - 1));
+    dest.pixels = base;
+    err = png_decode_into(data, size, &dest);
+    if (err != PNG_UTIL_SUCCESS) {
+        free(buf);
+        return err;
+    }
+    png_util_cached_image info;
+    memset(&info, 0, sizeof(info));
+    info.width = dest.width;
+    info.height = dest.height;
+    info.row_stride = dest.row_stride;
+    util_disk_header(key, &info, base - UTIL_DISK_HEADER_SIZE);
+
+    util_mutex_lock(&cache->lock);
+    unsigned long counter = ++cache->temp_counter;
+    util_mutex_unlock(&cache->lock);
+    char temp[4096];
+    if (snprintf(temp, sizeof(temp), "%s.%lu-%lu" UTIL_DISK_TEMP_SUFFIX, path, util_process_id(), counter) >= (int)sizeof(temp)) {
+        free(buf);
+        return PNG_UTIL_ERROR_IO;
+    }
+    FILE *fp = fopen(temp, "wb");
+    size_t total = UTIL_DISK_HEADER_SIZE + dest.size;
+    int ok = fp && fwrite(base - UTIL_DISK_HEADER_SIZE, 1, total, fp) == total;
+    if (fp && fclose(fp) != 0)
+        ok = 0;
+    free(buf);
+    if (!ok || !util_replace_file(temp, path)) {
+        remove(temp);
+        return PNG_UTIL_ERROR_IO;
+    }
+    util_mutex_lock(&cache->lock);
+    cache->bytes += total;
+    int over = cache->bytes > cache->budget;
+    util_mutex_unlock(&cache->lock);
+    if (over)
+        util_disk_evict(cache, name);
+    return PNG_UTIL_SUCCESS;
+}
+
+static png_util_error util_disk_get(png_util_disk_cache *cache, const void *data, size_t size,
+                                    const char *source, const util_cache_key *key,
+                                    const png_util_cached_image **image) {
+    char name[32], path[4096];
+    util_disk_name(key, name);
+    if (!util_disk_path(cache, name, path, sizeof(path)))
+        return PNG_UTIL_ERROR_IO;
+    util_disk_image *img;
+    int hit = util_disk_open(path, key, &img);
+    util_mutex_lock(&cache->lock);
+    if (hit)
+        cache->hits++;
+    else
+        cache->misses++;
+    util_mutex_unlock(&cache->lock);
+    if (!hit) {
+        png_byte *file_data = NULL;
+        png_util_error err = PNG_UTIL_SUCCESS;
+        if (source) {
+            err = util_read_file(source, &file_data, &size);
+            data = file_data;
+        }
+        if (err == PNG_UTIL_SUCCESS)
+            err = util_disk_store(cache, data, size, key, name, path);
+        free(file_data);
+        if (err != PNG_UTIL_SUCCESS)
+            return err;
+        if (!util_disk_open(path, key, &img))
+            return PNG_UTIL_ERROR_IO;
+    }
+    *image = &img->image;
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_disk_cache_open(const char *dir, unsigned long long budget, png_util_disk_cache **cache) {
+    if (!dir || !cache)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    if (!util_make_dir(dir))
+        return PNG_UTIL_ERROR_IO;
+    png_util_disk_cache *c = (png_util_disk_cache *)calloc(1, sizeof(png_util_disk_cache));
+    size_t len = strlen(dir);
+    if (c)
+        c->dir = (char *)malloc(len + 1);
+    if (!c || !c->dir) {
+        free(c);
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    }
+    memcpy(c->dir, dir, len + 1);
+    c->budget = budget;
+    util_mutex_init(&c->lock);
+    // Entries from earlier runs count toward the budget.
+    util_list_entries(c->dir, UTIL_DISK_TEMP_SUFFIX, util_disk_remove_temp, c);
+    util_disk_evict(c, "");
+    c->evictions = 0;
+    *cache = c;
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_disk_cache_decode(png_util_disk_cache *cache, const void *data, size_t size,
+                                     png_util_format format, const png_util_cached_image **image) {
+    if (!cache || !data || !image)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    util_cache_key key;
+    util_cache_content_key(data, size, format, &key);
+    return util_disk_get(cache, data, size, NULL, &key, image);
+}
+
+png_util_error png_disk_cache_decode_file(png_util_disk_cache *cache, const char *path,
+                                          png_util_format format, const png_util_cached_image **image) {
+    if (!cache || !path || !image)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    util_cache_key key;
+    if (!util_cache_file_key(path, format, &key))
+        return PNG_UTIL_ERROR_IO;
+    return util_disk_get(cache, NULL, 0, path, &key, image);
+}
+
+void png_disk_cache_release(const png_util_cached_image *image) {
+    if (!image)
+        return;
+    util_disk_image *img = (util_disk_image *)image;
+    util_unmap_file(&img->map);
+    free(img);
+}
+
+void png_disk_cache_stats(png_util_disk_cache *cache, png_util_disk_cache_stats *stats) {
+    if (!cache || !stats)
+        return;
+    util_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->bytes = cache->bytes;
+    util_mutex_unlock(&cache->lock);
+}
+
+void png_disk_cache_close(png_util_disk_cache *cache) {
+    if (!cache)
+        return;
+    util_mutex_destroy(&cache->lock);
+    free(cache->dir);
+    free(cache);
+}
+
+// ------ Encoder ------
+
+void png_util_buffer_free(png_util_buffer *buffer) {
+    if (!buffer)
+        return;
+    free(buffer->data);
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+typedef struct util_mem_writer {
+    png_byte *data;
+    size_t size;
+    size_t capacity;
+    int out_of_memory;
+    volatile long long *limit;  // writing stops when the size exceeds it. NULL means no limit.
+    int aborted;
+} util_mem_writer;
+
+static void util_write_mem(png_struct *png_ptr, png_byte *data, size_t length) {
+    util_mem_writer *writer = (util_mem_writer *)png_get_io_ptr(png_ptr);
+    if (writer->limit && (long long)(writer->size + length) > util_atomic_add(writer->limit, 0)) {
+        writer->aborted = 1;
+        png_error(png_ptr, "Size limit exceeded");
+    }
+    if (length > writer->capacity - writer->size) {
+        size_t capacity = writer->capacity ? writer->capacity : 4096;
+        while (capacity - writer->size < length && capacity <= PNG_SIZE_MAX / 2)
+            capacity *= 2;
+        png_byte *grown = capacity - writer->size >= length ? (png_byte *)realloc(writer->data, capacity) : NULL;
+        if (!grown) {
+            writer->out_of_memory = 1;
+            png_error(png_ptr, "Out of memory");
+        }
+        writer->data = grown;
+        writer->capacity = capacity;
+    }
+    memcpy(writer->data + writer->size, data, length);
+    writer->size += length;
+}
+
+static void util_flush_mem(png_struct *png_ptr) {
+    (void)png_ptr;
+}
+
+static png_util_error util_check_image(const png_util_image *image) {
+    if (!util_valid_format(image->width, image->height, image->bit_depth, image->color_type))
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    if (image->row_stride < util_rowbytes(image->width, image->bit_depth, image->color_type))
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    return PNG_UTIL_SUCCESS;
+}
+
+// Applies encode options to a write struct. Zero fields keep libpng's defaults.
+static void util_set_encode_options(png_struct *png, const png_util_encode_options *options) {
+    if (!options)
+        return;
+    if (options->compression_level > 0)
+        png_set_compression_level(png, options->compression_level);
+    if (options->filters != 0)
+        png_set_filter(png, PNG_FILTER_TYPE_BASE, options->filters);
+    if (options->strategy != PNG_UTIL_STRATEGY_AUTO)
+        png_set_compression_strategy(png, options->strategy - 1);
+    if (options->window_bits > 0)
+        png_set_compression_window_bits(png, options->window_bits);
+    if (options->mem_level > 0)
+        png_set_compression_mem_level(png, options->mem_level);
+    if (options->buffer_size > 0)
+        png_set_compression_buffer_size(png, options->buffer_size);
+}
+
+static png_util_error util_check_encode_options(const png_util_encode_options *options) {
+    if (options && (options->compression_level < 0 || options->compression_level > 9 ||
+                    (options->filters & ~PNG_ALL_FILTERS) != 0 ||
+                    options->strategy < PNG_UTIL_STRATEGY_AUTO || options->strategy > PNG_UTIL_STRATEGY_FIXED ||
+                    (options->window_bits != 0 && (options->window_bits < 8 || options->window_bits > 15)) ||
+                    options->mem_level < 0 || options->mem_level > 9 ||
+                    (options->buffer_size != 0 && (options->buffer_size < 6 || options->buffer_size > PNG_UINT_31_MAX))))
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    return PNG_UTIL_SUCCESS;
+}
+
+#define UTIL_SOLID_BLOCK_BYTES (1U << 20)  // filtered bytes in a repeated block
+#define UTIL_ROW_OTHER 0
+#define UTIL_ROW_REPEAT 1  // same as the previous row
+#define UTIL_ROW_SOLID 2  // one color
+
+// Finds rows that filter to zeros with Up or Sub. Returns the number of them.
+static png_uint_32 util_classify_rows(const png_util_image *image, size_t rowbytes, size_t bpp,
+                                      png_byte *classes) {
+    png_uint_32 count = 0;
+    for (png_uint_32 y = 0; y < image->height; y++) {
+        const png_byte *row = image->pixels + image->row_stride * y;
+        // memcmp is vectorized in common C libraries.
+        if (y > 0 && memcmp(row, row - image->row_stride, rowbytes) == 0)
+            classes[y] = UTIL_ROW_REPEAT;
+        else if (memcmp(row, row + bpp, rowbytes - bpp) == 0)
+            classes[y] = UTIL_ROW_SOLID;
+        else
+            classes[y] = UTIL_ROW_OTHER;
+        count += classes[y] != UTIL_ROW_OTHER;
+    }
+    return count;
+}
+
+// Appends a full-flushed piece of a raw deflate stream to out.
+static int util_deflate_piece(const util_zlib *z, util_z_stream *strm, const png_byte *data, size_t size,
+                              png_byte **out, size_t *out_size, size_t *capacity) {
+    strm->next_in = data;
+    strm->avail_in = (unsigned int)size;
+    do {
+        if (*out_size == *capacity) {
+            png_byte *grown = (png_byte *)realloc(*out, *capacity * 2);
+            if (!grown)
+                return 0;
+            *out = grown;
+            *capacity *= 2;
+        }
+        size_t room = *capacity - *out_size;
+        strm->next_out = *out + *out_size;
+        strm->avail_out = room > 0x40000000 ? 0x40000000 : (unsigned int)room;
+        size_t before = strm->avail_out;
+        if (z->deflate(strm, UTIL_Z_FULL_FLUSH) != UTIL_Z_OK && strm->avail_in > 0)
+            return 0;
+        *out_size += before - strm->avail_out;
+    } while (strm->avail_in > 0 || strm->avail_out == 0);
+    return 1;
+}
+
+// The zlib stream of an image of one color, as pieces for util_write_idat().
+typedef struct util_solid_idat {
+    png_byte header[2];
+    png_byte tail[6];
+    png_byte *data;
+    const png_byte **pieces;
+    size_t *sizes;
+    int count;
+} util_solid_idat;
+
+static void util_solid_idat_free(util_solid_idat *idat) {
+    free(idat->data);
+    free((void *)idat->pieces);
+    free(idat->sizes);
+    memset(idat, 0, sizeof(*idat));
+}
+
+// Compresses an image of one color without filtering or compressing every row.
+// Row 0 filters to zeros with Sub and the rest with Up, so the stream is row 0, a block of
+// Up rows repeated as it is, and the remaining rows. Each piece ends with a full flush,
+// so the block doesn't refer to earlier data. Returns 0 on failure.
+static int util_build_solid_idat(const png_util_image *image, const png_util_encode_options *options,
+                                 size_t rowbytes, size_t bpp, util_solid_idat *idat) {
+    const util_zlib *z = util_zlib_get();
+    if (!z)
+        return 0;
+    size_t filtered_size = rowbytes + 1;
+    size_t rest = image->height - 1;
+    size_t block_rows = UTIL_SOLID_BLOCK_BYTES / filtered_size;
+    if (block_rows == 0)
+        block_rows = 1;
+    if (block_rows > rest)
+        block_rows = rest;
+    size_t repeats = rest / block_rows;
+    size_t tail_rows = rest - repeats * block_rows;
+    if (repeats > PNG_UINT_31_MAX - 4)
+        return 0;
+    size_t capacity = 4096;
+    png_byte *first = (png_byte *)calloc(filtered_size, 1);
+    png_byte *block = (png_byte *)calloc(block_rows, filtered_size);
+    idat->data = (png_byte *)malloc(capacity);
+    idat->pieces = (const png_byte **)malloc(sizeof(png_byte *) * (repeats + 4));
+    idat->sizes = (size_t *)malloc(sizeof(size_t) * (repeats + 4));
+    // zlib can't write raw streams with 8 window bits.
+    int window_bits = !options || options->window_bits == 0 ? 15 :
+                      options->window_bits < 9 ? 9 : options->window_bits;
+    int level = options && options->compression_level > 0 ? options->compression_level : UTIL_Z_DEFAULT_COMPRESSION;
+    util_z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (!first || !block || !idat->data || !idat->pieces || !idat->sizes ||
+            z->deflateInit2_(&strm, level, UTIL_Z_DEFLATED, -window_bits,
+                             options && options->mem_level > 0 ? options->mem_level : 8,
+                             options && options->strategy > 0 ? options->strategy - 1 : UTIL_Z_DEFAULT_STRATEGY,
+                             z->version, (int)sizeof(strm)) != UTIL_Z_OK) {
+        free(first);
+        free(block);
+        util_solid_idat_free(idat);
+        return 0;
+    }
+
+    first[0] = PNG_FILTER_VALUE_SUB;
+    memcpy(first + 1, image->pixels, bpp);
+    for (size_t i = 0; i < block_rows; i++)
+        block[filtered_size * i] = PNG_FILTER_VALUE_UP;
+    size_t size = 0;
+    int ok = util_deflate_piece(z, &strm, first, filtered_size, &idat->data, &size, &capacity);
+    size_t first_end = size;
+    ok = ok && util_deflate_piece(z, &strm, block, filtered_size * block_rows, &idat->data, &size, &capacity);
+    size_t block_end = size;
+    if (tail_rows > 0)
+        ok = ok && util_deflate_piece(z, &strm, block, filtered_size * tail_rows, &idat->data, &size, &capacity);
+    z->deflateEnd(&strm);
+    png_uint_32 adler = util_adler32(1, first, filtered_size);
+    png_uint_32 block_adler = util_adler32(1, block, filtered_size * block_rows);
+    for (size_t i = 0; i < repeats; i++)
+        adler = util_adler32_combine(adler, block_adler, filtered_size * block_rows);
+    adler = util_adler32_combine(adler, util_adler32(1, block, filtered_size * tail_rows),
+                                 filtered_size * tail_rows);
+    free(first);
+    free(block);
+    if (!ok) {
+        util_solid_idat_free(idat);
+        return 0;
+    }
+
+    // zlib header, the pieces, an empty final block and Adler-32.
+    idat->header[0] = (png_byte)(((window_bits - 8) << 4) | UTIL_Z_DEFLATED);
+    int level_flags = level < 0 || level == 6 ? 2 : level < 2 ? 0 : level < 6 ? 1 : 3;
+    idat->header[1] = (png_byte)(level_flags << 6);
+    idat->header[1] = (png_byte)(idat->header[1] + 31 - (idat->header[0] * 256 + idat->header[1]) % 31);
+    idat->tail[0] = 0x03;
+    idat->tail[1] = 0x00;
+    util_store_be32(idat->tail + 2, adler);
+    int n = 0;
+    idat->pieces[n] = idat->header;
+    idat->sizes[n++] = 2;
+    idat->pieces[n] = idat->data;
+    idat->sizes[n++] = first_end;
+    for (size_t i = 0; i < repeats; i++) {
+        idat->pieces[n] = idat->data + first_end;
+        idat->sizes[n++] = block_end - first_end;
+    }
+    if (tail_rows > 0) {
+        idat->pieces[n] = idat->data + block_end;
+        idat->sizes[n++] = size - block_end;
+    }
+    idat->pieces[n] = idat->tail;
+    idat->sizes[n++] = 6;
+    idat->count = n;
+    return 1;
+}
+
+// Encodes rows with libpng. palette (PLTE data) is required for palette images.
+// buffer_size sets the IDAT size unless the options set it. 0 keeps libpng's default.
+// Unless the options set filters, repeated rows use Up, rows of one color use Sub
+// and images of one color are compressed by util_build_solid_idat(). Z_RLE is used
+// when 7/8 of the rows are such rows and the options don't set a strategy.
+static png_util_error util_encode(const png_util_image *image, const png_util_encode_options *options,
+                                  const png_byte *palette, png_uint_32 palette_size, size_t buffer_size,
+                                  util_mem_writer *writer) {
+    size_t rowbytes = util_rowbytes(image->width, image->bit_depth, image->color_type);
+    size_t bpp = util_filter_bpp(image->bit_depth, image->color_type);
+    png_byte *classes = NULL;
+    int rle = 0;
+    util_solid_idat solid;
+    memset(&solid, 0, sizeof(solid));
+    if ((!options || options->filters == 0) && !palette && image->width > 1 && image->height > 1) {
+        classes = (png_byte *)malloc(image->height);
+        if (!classes)
+            return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+        png_uint_32 cheap = util_classify_rows(image, rowbytes, bpp, classes);
+        // Rows after a solid row 0 are repeats when the whole image has one color.
+        if (cheap == image->height && classes[0] == UTIL_ROW_SOLID &&
+                memchr(classes + 1, UTIL_ROW_SOLID, image->height - 1) == NULL)
+            util_build_solid_idat(image, options, rowbytes, bpp, &solid);
+        // Mostly zeros after filtering. Z_RLE finds the runs much faster than the default strategy.
+        rle = (!options || options->strategy == PNG_UTIL_STRATEGY_AUTO) && cheap >= image->height - image->height / 8;
+        if (solid.count > 0 || cheap == 0) {
+            free(classes);
+            classes = NULL;
+        }
+    }
+
+    util_trap trap;
+    png_struct *png = util_create_write_struct(&trap);
+    if (!png) {
+        free(classes);
+        util_solid_idat_free(&solid);
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    }
+    png_info *info = png_create_info_struct(png);
+    if (!info || setjmp(trap.jmp)) {
+        png_util_error err = !info || writer->out_of_memory ? PNG_UTIL_ERROR_OUT_OF_MEMORY : PNG_UTIL_ERROR_LIBPNG;
+        png_destroy_write_struct(&png, &info);
+        free(classes);
+        util_solid_idat_free(&solid);
+        free(writer->data);
+        writer->data = NULL;
+        return err;
+    }
+
+    png_set_write_fn(png, writer, util_write_mem, util_flush_mem);
+    png_set_IHDR(png, info, image->width, image->height, image->bit_depth, image->color_type,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    if (palette) {
+        png_color colors[256];
+        int count = (int)(palette_size / 3);
+        for (int i = 0; i < count; i++) {
+            colors[i].red = palette[i * 3];
+            colors[i].green = palette[i * 3 + 1];
+            colors[i].blue = palette[i * 3 + 2];
+        }
+        png_set_PLTE(png, info, colors, count);
+    }
+    if (buffer_size > 0)
+        png_set_compression_buffer_size(png, buffer_size);
+    util_set_encode_options(png, options);
+    if (classes) {
+        // Up needs the previous row, which libpng keeps only if Up is allowed at the start.
+        png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_ALL_FILTERS);
+        if (rle)
+            png_set_compression_strategy(png, PNG_UTIL_STRATEGY_RLE - 1);
+    }
+    png_write_info(png, info);
+    if (solid.count > 0) {
+        // IDAT is written by hand, so png_write_end() can't be used.
+        // Chunks have the size libpng would give them.
+        size_t chunk_size = options && options->buffer_size > 0 ? options->buffer_size :
+                            buffer_size > 0 ? buffer_size : UTIL_IDAT_DEFAULT_SIZE;
+        util_write_idat(png, solid.pieces, solid.sizes, solid.count, chunk_size);
+        png_write_chunk(png, (const png_byte *)"IEND", NULL, 0);
+        util_solid_idat_free(&solid);
+        png_destroy_write_struct(&png, &info);
+        return PNG_UTIL_SUCCESS;
+    }
+    // libpng's default filters
+    int filters = image->bit_depth < 8 ? PNG_FILTER_NONE : PNG_ALL_FILTERS;
+    int current = PNG_ALL_FILTERS;
+    for (png_uint_32 y = 0; y < image->height; y++) {
+        if (classes) {
+            int wanted = classes[y] == UTIL_ROW_REPEAT ? PNG_FILTER_UP :
+                         classes[y] == UTIL_ROW_SOLID ? PNG_FILTER_SUB : filters;
+            if (wanted != current) {
+                png_set_filter(png, PNG_FILTER_TYPE_BASE, wanted);
+                current = wanted;
+            }
+        }
+        png_write_row(png, image->pixels + image->row_stride * y);
+    }
+    png_write_end(png, NULL);
+    free(classes);
+    png_destroy_write_struct(&png, &info);
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_encode(const png_util_image *image, const png_util_encode_options *options,
+                          png_util_buffer *png_data) {
+    if (!image || !image->pixels || !png_data)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err == PNG_UTIL_SUCCESS)
+        err = util_check_image(image);
+    if (err == PNG_UTIL_SUCCESS)
+        err = util_check_encode_options(options);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+
+    util_mem_writer writer;
+    memset(&writer, 0, sizeof(writer));
+    err = util_encode(image, options, NULL, 0, 0, &writer);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    png_data->data = writer.data;
+    png_data->size = writer.size;
+    return PNG_UTIL_SUCCESS;
+}
+
+// ------ Encode memoization ------
+
+typedef struct util_encode_entry {
+    unsigned long long key[2];  // two XXH64 seeds, so a match is a 128-bit match
+    png_byte *data;
+    size_t size;
+    unsigned long long last_used;
+} util_encode_entry;
+
+struct png_util_encode_cache {
+    util_mutex lock;
+    size_t budget;
+    size_t bytes;
+    util_encode_entry *entries;
+    size_t count;
+    size_t capacity;
+    unsigned long long clock;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+};
+
+// Hashes the packed rows and everything that changes the output.
+// Row padding is skipped, so the stride doesn't matter.
+static void util_encode_key(const png_util_image *image, const png_util_encode_options *options,
+                            unsigned long long *key) {
+    png_byte params[44];
+    util_store_be32(params, image->width);
+    util_store_be32(params + 4, image->height);
+    util_store_be32(params + 8, (png_uint_32)image->bit_depth);
+    util_store_be32(params + 12, (png_uint_32)image->color_type);
+    util_store_be32(params + 16, options ? (png_uint_32)options->compression_level : 0);
+    util_store_be32(params + 20, options ? (png_uint_32)options->filters : 0);
+    util_store_be32(params + 24, options ? (png_uint_32)options->strategy : 0);
+    util_store_be32(params + 28, options ? (png_uint_32)options->window_bits : 0);
+    util_store_be32(params + 32, options ? (png_uint_32)options->mem_level : 0);
+    util_store_be64(params + 36, options ? (unsigned long long)options->buffer_size : 0);
+    size_t rowbytes = util_rowbytes(image->width, image->bit_depth, image->color_type);
+    util_xxh64 h[2];
+    for (int i = 0; i < 2; i++) {
+        util_xxh64_init_seed(&h[i], i == 0 ? 0 : UTIL_XXH_P3);
+        util_xxh64_update(&h[i], params, sizeof(params));
+    }
+    for (png_uint_32 y = 0; y < image->height; y++) {
+        const png_byte *row = image->pixels + image->row_stride * y;
+        util_xxh64_update(&h[0], row, rowbytes);
+        util_xxh64_update(&h[1], row, rowbytes);
+    }
+    key[0] = util_xxh64_digest(&h[0]);
+    key[1] = util_xxh64_digest(&h[1]);
+}
+
+// Copies a cached PNG out. Call it with the cache locked.
+static int util_encode_cache_find(png_util_encode_cache *cache, const unsigned long long *key,
+                                  png_util_buffer *png_data, png_util_error *err) {
+    for (size_t i = 0; i < cache->count; i++) {
+        util_encode_entry *e = &cache->entries[i];
+        if (e->key[0] != key[0] || e->key[1] != key[1])
+            continue;
+        e->last_used = ++cache->clock;
+        png_data->data = (png_byte *)malloc(e->size);
+        png_data->size = e->size;
+        *err = png_data->data ? PNG_UTIL_SUCCESS : PNG_UTIL_ERROR_OUT_OF_MEMORY;
+        if (png_data->data)
+            memcpy(png_data->data, e->data, e->size);
+        return 1;
+    }
+    return 0;
+}
+
+// Stores a copy of an encoded PNG, evicting the least recently used ones over the budget.
+static void util_encode_cache_store(png_util_encode_cache *cache, const unsigned long long *key,
+                                    const png_util_buffer *png_data) {
+    if (png_data->size > cache->budget)
+        return;
+    png_util_buffer unused;
+    png_util_error err;
+    if (util_encode_cache_find(cache, key, &unused, &err)) {
+        // Another thread encoded the same image first.
+        png_util_buffer_free(&unused);
+        return;
+    }
+    while (cache->count > 0 && cache->bytes + png_data->size > cache->budget) {
+        size_t oldest = 0;
+        for (size_t i = 1; i < cache->count; i++) {
+            if (cache->entries[i].last_used < cache->entries[oldest].last_used)
+                oldest = i;
+        }
+        cache->bytes -= cache->entries[oldest].size;
+        free(cache->entries[oldest].data);
+        cache->entries[oldest] = cache->entries[--cache->count];
+        cache->evictions++;
+    }
+    if (cache->count == cache->capacity) {
+        size_t capacity = cache->capacity ? cache->capacity * 2 : 16;
+        util_encode_entry *entries = (util_encode_entry *)realloc(cache->entries, capacity * sizeof(util_encode_entry));
+        if (!entries)
+            return;
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+    png_byte *copy = (png_byte *)malloc(png_data->size);
+    if (!copy)
+        return;
+    memcpy(copy, png_data->data, png_data->size);
+    util_encode_entry *e = &cache->entries[cache->count++];
+    e->key[0] = key[0];
+    e->key[1] = key[1];
+    e->data = copy;
+    e->size = png_data->size;
+    e->last_used = ++cache->clock;
+    cache->bytes += png_data->size;
+}
+
+png_util_error png_encode_cache_create(size_t budget, png_util_encode_cache **cache) {
+    if (!cache)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_encode_cache *c = (png_util_encode_cache *)calloc(1, sizeof(png_util_encode_cache));
+    if (!c)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    util_mutex_init(&c->lock);
+    c->budget = budget;
+    *cache = c;
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_encode_cached(png_util_encode_cache *cache, const png_util_image *image,
+                                 const png_util_encode_options *options, png_util_buffer *png_data) {
+    if (!cache || !image || !image->pixels || !png_data)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err == PNG_UTIL_SUCCESS)
+        err = util_check_image(image);
+    if (err == PNG_UTIL_SUCCESS)
+        err = util_check_encode_options(options);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    unsigned long long key[2];
+    util_encode_key(image, options, key);
+    util_mutex_lock(&cache->lock);
+    int hit = util_encode_cache_find(cache, key, png_data, &err);
+    if (hit)
+        cache->hits++;
+    else
+        cache->misses++;
+    util_mutex_unlock(&cache->lock);
+    if (hit)
+        return err;
+
+    err = png_encode(image, options, png_data);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    util_mutex_lock(&cache->lock);
+    util_encode_cache_store(cache, key, png_data);
+    util_mutex_unlock(&cache->lock);
+    return PNG_UTIL_SUCCESS;
+}
+
+void png_encode_cache_stats(png_util_encode_cache *cache, png_util_encode_cache_stats *stats) {
+    if (!cache || !stats)
+        return;
+    util_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->entries = cache->count;
+    stats->bytes = cache->bytes;
+    util_mutex_unlock(&cache->lock);
+    size_t total = stats->hits + stats->misses;
+    stats->hit_rate = total ? (double)stats->hits / (double)total : 0.0;
+}
+
+void png_encode_cache_destroy(png_util_encode_cache *cache) {
+    if (!cache)
+        return;
+    for (size_t i = 0; i < cache->count; i++)
+        free(cache->entries[i].data);
+    free(cache->entries);
+    util_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+// ------ Chunk rewriter ------
+
+// Ancillary chunks that png_util_rewrite_options::strip_metadata drops.
+static const char *const util_metadata_chunks[] = { "tEXt", "zTXt", "iTXt", "eXIf", "tIME" };
+
+// A piece of the output: a byte range of the input, or a new chunk.
+typedef struct util_rewrite_op {
+    size_t offset;
+    size_t size;
+    const png_util_chunk *chunk;  // NULL for ranges
+} util_rewrite_op;
+
+typedef struct util_rewrite_plan {
+    util_rewrite_op *ops;
+    size_t count;
+    size_t capacity;
+    size_t out_size;
+} util_rewrite_plan;
+
+static int util_is_critical(const png_byte *type) {
+    return (type[0] & 0x20) == 0;
+}
+
+// bKGD, hIST and tRNS must follow PLTE. Other new chunks go before it.
+static int util_follows_plte(const png_byte *type) {
+    return memcmp(type, "bKGD", 4) == 0 || memcmp(type, "hIST", 4) == 0 || memcmp(type, "tRNS", 4) == 0;
+}
+
+static int util_rewrite_drops(const png_util_rewrite_options *options, const png_byte *type) {
+    if (!options || util_is_critical(type))
+        return 0;
+    for (size_t i = 0; i < options->drop_count; i++) {
+        if (memcmp(options->drop[i], type, 4) == 0)
+            return 1;
+    }
+    for (size_t i = 0; i < options->insert_count; i++) {
+        if (memcmp(options->insert[i].type, type, 4) == 0)
+            return 1;
+    }
+    for (size_t i = 0; i < sizeof(util_metadata_chunks) / sizeof(util_metadata_chunks[0]) && options->strip_metadata; i++) {
+        if (memcmp(util_metadata_chunks[i], type, 4) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static png_util_error util_check_rewrite_options(const png_util_rewrite_options *options) {
+    if (!options)
+        return PNG_UTIL_SUCCESS;
+    if ((!options->drop && options->drop_count > 0) || (!options->insert && options->insert_count > 0))
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    for (size_t i = 0; i < options->drop_count; i++) {
+        if (!options->drop[i] || strlen(options->drop[i]) != 4 || util_is_critical((const png_byte *)options->drop[i]))
+            return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    }
+    for (size_t i = 0; i < options->insert_count; i++) {
+        const png_util_chunk *chunk = &options->insert[i];
+        // Critical chunks can't be added, since IHDR, PLTE and IDAT are copied as they are.
+        if (strlen(chunk->type) != 4 || util_is_critical((const png_byte *)chunk->type) ||
+                chunk->size > PNG_UINT_31_MAX || (!chunk->data && chunk->size > 0))
+            return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    }
+    return PNG_UTIL_SUCCESS;
+}
+
+static int util_rewrite_push(util_rewrite_plan *plan, size_t offset, size_t size, const png_util_chunk *chunk) {
+    if (!chunk && plan->count > 0) {
+        // Adjacent ranges are copied at once.
+        util_rewrite_op *last = &plan->ops[plan->count - 1];
+        if (!last->chunk && last->offset + last->size == offset) {
+            last->size += size;
+            plan->out_size += size;
+            return 1;
+        }
+    }
+    if (plan->count == plan->capacity) {
+        size_t capacity = plan->capacity ? plan->capacity * 2 : 16;
+        util_rewrite_op *ops = (util_rewrite_op *)realloc(plan->ops, capacity * sizeof(util_rewrite_op));
+        if (!ops)
+            return 0;
+        plan->ops = ops;
+        plan->capacity = capacity;
+    }
+    util_rewrite_op *op = &plan->ops[plan->count++];
+    op->offset = offset;
+    op->size = chunk ? (size_t)chunk->size + 12 : size;
+    op->chunk = chunk;
+    plan->out_size += op->size;
+    return 1;
+}
+
+static int util_rewrite_insert(util_rewrite_plan *plan, const png_util_rewrite_options *options, int after_plte) {
+    for (size_t i = 0; options && i < options->insert_count; i++) {
+        if (util_follows_plte((const png_byte *)options->insert[i].type) == after_plte &&
+                !util_rewrite_push(plan, 0, 0, &options->insert[i]))
+            return 0;
+    }
+    return 1;
+}
+
+// Walks the chunk headers and lists what to copy. Chunk data is never read,
+// so a mapped input only pages in the headers. CRCs of copied chunks are not checked.
+static png_util_error util_plan_rewrite(const png_byte *data, size_t size, const png_util_rewrite_options *options,
+                                       util_rewrite_plan *plan) {
+    memset(plan, 0, sizeof(*plan));
+    if (size < 8 || memcmp(data, util_png_signature, 8) != 0)
+        return PNG_UTIL_ERROR_INVALID_PNG;
+    if (!util_rewrite_push(plan, 0, 8, NULL))
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    size_t pos = 8;
+    int state = 0;  // 0: before PLTE, 1: after PLTE, 2: after the first IDAT
+    int ok = 1;
+    for (;;) {
+        if (size - pos < 12)
+            goto invalid;
+        png_uint_32 length = util_load_be32(data + pos);
+        const png_byte *type = data + pos + 4;
+        if (length > PNG_UINT_31_MAX || length > size - pos - 12 || (pos == 8) != (memcmp(type, "IHDR", 4) == 0))
+            goto invalid;
+        int is_plte = memcmp(type, "PLTE", 4) == 0;
+        int is_idat = memcmp(type, "IDAT", 4) == 0;
+        int is_iend = memcmp(type, "IEND", 4) == 0;
+        if (state == 0 && (is_plte || is_idat || is_iend)) {
+            ok = ok && util_rewrite_insert(plan, options, 0);
+            state = 1;
+        }
+        if (state == 1 && (is_idat || is_iend)) {
+            ok = ok && util_rewrite_insert(plan, options, 1);
+            state = 2;
+        }
+        if (!util_rewrite_drops(options, type))
+            ok = ok && util_rewrite_push(plan, pos, (size_t)length + 12, NULL);
+        pos += (size_t)length + 12;
+        if (is_iend)
+            break;
+    }
+    if (!ok) {
+        free(plan->ops);
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    }
+    return PNG_UTIL_SUCCESS;
+
+invalid:
+    free(plan->ops);
+    return PNG_UTIL_ERROR_INVALID_PNG;
+}
+
+static void util_chunk_header(const png_util_chunk *chunk, png_byte *header, png_byte *crc) {
+    util_store_be32(header, chunk->size);
+    memcpy(header + 4, chunk->type, 4);
+    png_uint_32 c = util_crc32(0, header + 4, 4);
+    util_store_be32(crc, util_crc32(c, chunk->data, chunk->size));
+}
+
+png_util_error png_rewrite_chunks(const void *data, size_t size, const png_util_rewrite_options *options,
+                                  png_util_buffer *png_data) {
+    if (!data || !png_data)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_rewrite_options(options);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    util_rewrite_plan plan;
+    err = util_plan_rewrite((const png_byte *)data, size, options, &plan);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    png_byte *out = (png_byte *)malloc(plan.out_size);
+    if (!out) {
+        free(plan.ops);
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    }
+    png_byte *p = out;
+    for (size_t i = 0; i < plan.count; i++) {
+        const util_rewrite_op *op = &plan.ops[i];
+        if (op->chunk) {
+            util_chunk_header(op->chunk, p, p + 8 + op->chunk->size);
+            if (op->chunk->size > 0)
+                memcpy(p + 8, op->chunk->data, op->chunk->size);
+        } else {
+            memcpy(p, (const png_byte *)data + op->offset, op->size);
+        }
+        p += op->size;
+    }
+    png_data->data = out;
+    png_data->size = plan.out_size;
+    free(plan.ops);
+    return PNG_UTIL_SUCCESS;
+}
+
+#ifdef _WIN32
+typedef struct util_file_writer {
+    FILE *fp;
+} util_file_writer;
+
+static int util_writer_open(util_file_writer *w, const char *path, const char *source) {
+    (void)source;
+    w->fp = fopen(path, "wb");
+    return w->fp != NULL;
+}
+
+static int util_writer_write(util_file_writer *w, const png_byte *data, size_t size) {
+    return fwrite(data, 1, size, w->fp) == size;
+}
+
+static int util_writer_copy(util_file_writer *w, const png_byte *mapped, size_t offset, size_t size) {
+    return util_writer_write(w, mapped + offset, size);
+}
+
+static int util_writer_close(util_file_writer *w) {
+    return fclose(w->fp) == 0;
+}
+#else  // _WIN32
+typedef struct util_file_writer {
+    int fd;
+    int in_fd;  // the input for copy_file_range(), or -1 once it fails
+} util_file_writer;
+
+static int util_writer_open(util_file_writer *w, const char *path, const char *source) {
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#ifdef UTIL_COPY_FILE_RANGE
+    w->in_fd = w->fd >= 0 ? open(source, O_RDONLY) : -1;
+#else
+    (void)source;
+    w->in_fd = -1;
+#endif
+    return w->fd >= 0;
+}
+
+static int util_writer_write(util_file_writer *w, const png_byte *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(w->fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        data += n;
+        size -= (size_t)n;
+    }
+    return 1;
+}
+
+// Copies a range of the input. copy_file_range() copies inside the kernel (or shares extents
+// on filesystems that support it). It falls back to writing from the mapping,
+// e.g. across filesystems on older kernels.
+static int util_writer_copy(util_file_writer *w, const png_byte *mapped, size_t offset, size_t size) {
+#ifdef UTIL_COPY_FILE_RANGE
+    while (size > 0 && w->in_fd >= 0) {
+        loff_t in_offset = (loff_t)offset;
+        ssize_t n = copy_file_range(w->in_fd, &in_offset, w->fd, NULL, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            close(w->in_fd);
+            w->in_fd = -1;
+            break;
+        }
+        offset += (size_t)n;
+        size -= (size_t)n;
+    }
+#endif
+    return util_writer_write(w, mapped + offset, size);
+}
+
+static int util_writer_close(util_file_writer *w) {
+    if (w->in_fd >= 0)
+        close(w->in_fd);
+    return close(w->fd) == 0;
+}
+#endif  // _WIN32
+
+static volatile long long util_temp_counter;
+
+png_util_error png_rewrite_chunks_file(const char *src, const char *dst, const png_util_rewrite_options *options) {
+    if (!src || !dst)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_rewrite_options(options);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    util_mapping map;
+    if (util_map_file(src, 0, &map) != PNG_UTIL_SUCCESS)
+        return PNG_UTIL_ERROR_IO;
+    util_rewrite_plan plan;
+    err = util_plan_rewrite(map.data, map.size, options, &plan);
+    if (err != PNG_UTIL_SUCCESS) {
+        util_unmap_file(&map);
+        return err;
+    }
+
+    // The output is renamed into place, so dst can be src.
+    char temp[4096];
+    util_file_writer w;
+    long long counter = util_atomic_add(&util_temp_counter, 1);
+    int ok = snprintf(temp, sizeof(temp), "%s.%lu-%lld.tmp", dst, util_process_id(), counter) < (int)sizeof(temp) &&
+             util_writer_open(&w, temp, src);
+    if (ok) {
+        for (size_t i = 0; i < plan.count && ok; i++) {
+            const util_rewrite_op *op = &plan.ops[i];
+            if (op->chunk) {
+                png_byte header[8], crc[4];
+                util_chunk_header(op->chunk, header, crc);
+                ok = util_writer_write(&w, header, 8) && util_writer_write(&w, op->chunk->data, op->chunk->size) &&
+                     util_writer_write(&w, crc, 4);
+            } else {
+                ok = util_writer_copy(&w, map.data, op->offset, op->size);
+            }
+        }
+        ok = util_writer_close(&w) && ok;
+    }
+    util_unmap_file(&map);
+    free(plan.ops);
+    if (!ok || !util_replace_file(temp, dst)) {
+        remove(temp);
+        return PNG_UTIL_ERROR_IO;
+    }
+    return PNG_UTIL_SUCCESS;
+}
+
+typedef struct util_rewrite_ctx {
+    const char *const *src;
+    const char *const *dst;
+    const png_util_rewrite_options *options;
+    png_util_error *errors;
+} util_rewrite_ctx;
+
+static void util_rewrite_task(void *arg, size_t index) {
+    util_rewrite_ctx *ctx = (util_rewrite_ctx *)arg;
+    ctx->errors[index] = png_rewrite_chunks_file(ctx->src[index], ctx->dst[index], ctx->options);
+}
+
+png_util_error png_rewrite_chunks_files(const char *const *src, const char *const *dst, size_t count, int threads,
+                                        const png_util_rewrite_options *options, png_util_error *errors) {
+    if ((!src || !dst || !errors) && count > 0)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_rewrite_options(options);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    util_rewrite_ctx ctx = { src, dst, options, errors };
+    util_run_tasks(count, threads, util_rewrite_task, &ctx);
+    for (size_t i = 0; i < count; i++) {
+        if (errors[i] != PNG_UTIL_SUCCESS)
+            return errors[i];
+    }
+    return PNG_UTIL_SUCCESS;
+}
+
+// ------ Validation ------
+
+#define UTIL_VALIDATE_BLOCK 65536
+
+enum {
+    UTIL_VALIDATE_SIGNATURE,
+    UTIL_VALIDATE_HEADER,  // chunk length and type
+    UTIL_VALIDATE_DATA,
+    UTIL_VALIDATE_CRC,
+    UTIL_VALIDATE_DONE,  // IEND was read. Trailing bytes are ignored like libpng does.
+    UTIL_VALIDATE_FAILED
+};
+
+// Checks a PNG as a byte stream. It can be fed blocks of any size,
+// so memory use doesn't depend on the image or the chunk sizes.
+typedef struct util_validator {
+    int level;
+    util_crc_fn crc32;
+    int state;
+    png_byte buf[8];  // signature, chunk header or CRC
+    size_t fill;
+    png_byte ihdr[13];
+    png_byte type[4];
+    png_uint_32 remaining;  // data bytes left in the current chunk
+    png_uint_32 crc;
+    unsigned long long offset;  // bytes consumed so far
+    unsigned long long chunk_offset;
+    png_uint_32 width;
+    png_uint_32 height;
+    int bit_depth;
+    int color_type;
+    int interlace;
+    int has_ihdr;
+    int has_plte;
+    int idat;  // 0 before IDAT, 1 in the IDAT run, 2 after it
+
+    // inflate check (PNG_UTIL_VALIDATE_INFLATE)
+    const util_zlib *zlib;
+    util_z_stream strm;
+    int inflating;
+    int stream_end;
+    png_byte *scratch;  // inflated data is discarded here
+    int pass;  // 7 when all rows were seen
+    png_uint_32 rows_left;  // in the current pass
+    size_t row_size;  // filter byte and data
+    size_t row_pos;
+
+    unsigned long long error_offset;
+    const char *reason;
+} util_validator;
+
+static void util_validator_init(util_validator *v, int level, const util_zlib *zlib, png_byte *scratch) {
+    memset(v, 0, sizeof(*v));
+    v->level = level;
+    v->crc32 = util_kernels_get()->crc32;
+    v->zlib = zlib;
+    v->scratch = scratch;
+}
+
+static void util_validator_free(util_validator *v) {
+    if (v->inflating)
+        v->zlib->inflateEnd(&v->strm);
+    v->inflating = 0;
+}
+
+static int util_validate_fail(util_validator *v, unsigned long long offset, const char *reason) {
+    v->state = UTIL_VALIDATE_FAILED;
+    v->error_offset = offset;
+    v->reason = reason;
+    return 0;
+}
+
+// Moves to the next Adam7 pass that has pixels, or to the only pass of other images.
+static void util_validate_next_pass(util_validator *v) {
+    v->rows_left = 0;
+    v->row_pos = 0;
+    while (++v->pass < 7) {
+        png_uint_32 cols = v->width, rows = v->height;
+        if (v->interlace) {
+            cols = PNG_PASS_COLS(v->width, v->pass);
+            rows = PNG_PASS_ROWS(v->height, v->pass);
+        } else if (v->pass > 0) {
+            continue;
+        }
+        if (cols > 0 && rows > 0) {
+            v->rows_left = rows;
+            v->row_size = util_rowbytes(cols, v->bit_depth, v->color_type) + 1;
+            return;
+        }
+    }
+}
+
+// Walks the filtered rows of inflated data. Only filter types are checked.
+static int util_validate_rows(util_validator *v, const png_byte *data, size_t size) {
+    while (size > 0) {
+        if (v->pass >= 7)
+            return util_validate_fail(v, v->chunk_offset, "too much image data");
+        if (v->row_pos == 0 && data[0] > PNG_FILTER_VALUE_PAETH)
+            return util_validate_fail(v, v->chunk_offset, "invalid filter type");
+        size_t n = v->row_size - v->row_pos;
+        if (n > size)
+            n = size;
+        v->row_pos += n;
+        data += n;
+        size -= n;
+        if (v->row_pos == v->row_size) {
+            v->row_pos = 0;
+            if (--v->rows_left == 0)
+                util_validate_next_pass(v);
+        }
+    }
+    return 1;
+}
+
+// Inflates IDAT data into the scratch buffer. zlib checks the header and the Adler-32.
+static int util_validate_inflate(util_validator *v, const png_byte *data, size_t size) {
+    if (size == 0)
+        return 1;
+    if (v->stream_end)
+        return util_validate_fail(v, v->chunk_offset, "data after the end of the zlib stream");
+    const util_zlib *z = v->zlib;
+    if (!v->inflating) {
+        if (z->inflateInit2_(&v->strm, 15, z->version, (int)sizeof(v->strm)) != UTIL_Z_OK)
+            return util_validate_fail(v, v->chunk_offset, "out of memory");
+        v->inflating = 1;
+        v->pass = -1;
+        util_validate_next_pass(v);
+    }
+    v->strm.next_in = data;
+    v->strm.avail_in = (unsigned int)size;  // chunks are at most 2^31 - 1 bytes
+    do {
+        v->strm.next_out = v->scratch;
+        v->strm.avail_out = UTIL_VALIDATE_BLOCK;
+        int ret = z->inflate(&v->strm, UTIL_Z_NO_FLUSH);
+        if (!util_validate_rows(v, v->scratch, UTIL_VALIDATE_BLOCK - v->strm.avail_out))
+            return 0;
+        if (ret == UTIL_Z_STREAM_END) {
+            v->stream_end = 1;
+            if (v->strm.avail_in > 0)
+                return util_validate_fail(v, v->chunk_offset, "data after the end of the zlib stream");
+            if (v->pass < 7)
+                return util_validate_fail(v, v->chunk_offset, "not enough image data");
+            return 1;
+        }
+        if (ret != UTIL_Z_OK)
+            return util_validate_fail(v, v->chunk_offset, "invalid zlib stream");
+    } while (v->strm.avail_in > 0 || v->strm.avail_out == 0);
+    return 1;
+}
+
+static int util_is_chunk_letter(png_byte c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+static int util_validate_header(util_validator *v) {
+    png_uint_32 length = util_load_be32(v->buf);
+    memcpy(v->type, v->buf + 4, 4);
+    for (int i = 0; i < 4; i++) {
+        if (!util_is_chunk_letter(v->type[i]))
+            return util_validate_fail(v, v->chunk_offset, "invalid chunk type");
+    }
+    if (v->type[2] & 0x20)
+        return util_validate_fail(v, v->chunk_offset, "reserved bit set in chunk type");
+    if (length > PNG_UINT_31_MAX)
+        return util_validate_fail(v, v->chunk_offset, "chunk length exceeds 2^31 - 1");
+
+    int is_ihdr = memcmp(v->type, "IHDR", 4) == 0;
+    int is_idat = memcmp(v->type, "IDAT", 4) == 0;
+    if (!v->has_ihdr && !is_ihdr)
+        return util_validate_fail(v, v->chunk_offset, "IHDR is not the first chunk");
+    if (is_ihdr && (v->has_ihdr || length != 13))
+        return util_validate_fail(v, v->chunk_offset, "invalid IHDR");
+    if (is_idat) {
+        if (v->idat == 2)
+            return util_validate_fail(v, v->chunk_offset, "IDAT chunks are not consecutive");
+        if (v->color_type == PNG_COLOR_TYPE_PALETTE && !v->has_plte)
+            return util_validate_fail(v, v->chunk_offset, "PLTE is missing");
+        v->idat = 1;
+    } else if (v->idat == 1) {
+        v->idat = 2;
+        if (v->level >= PNG_UTIL_VALIDATE_INFLATE && !v->stream_end)
+            return util_validate_fail(v, v->chunk_offset, "not enough image data");
+    }
+    if (memcmp(v->type, "PLTE", 4) == 0) {
+        png_uint_32 entries = length / 3;
+        if (v->has_plte || v->idat != 0)
+            return util_validate_fail(v, v->chunk_offset, "misplaced PLTE");
+        if (!(v->color_type & PNG_COLOR_MASK_COLOR))
+            return util_validate_fail(v, v->chunk_offset, "PLTE in a grayscale image");
+        if (length % 3 != 0 || entries == 0 || entries > 256 ||
+                (v->color_type == PNG_COLOR_TYPE_PALETTE && entries > (1U << v->bit_depth)))
+            return util_validate_fail(v, v->chunk_offset, "invalid PLTE length");
+        v->has_plte = 1;
+    } else if (memcmp(v->type, "IEND", 4) == 0) {
+        if (length != 0)
+            return util_validate_fail(v, v->chunk_offset, "IEND is not empty");
+        if (v->idat == 0)
+            return util_validate_fail(v, v->chunk_offset, "IDAT is missing");
+    } else if (!is_ihdr && !is_idat && util_is_critical(v->type)) {
+        return util_validate_fail(v, v->chunk_offset, "unknown critical chunk");
+    }
+    v->has_ihdr = 1;
+    v->remaining = length;
+    v->crc = v->crc32(0, v->type, 4);
+    return 1;
+}
+
+// Called after the CRC of a chunk matched.
+static int util_validate_chunk_end(util_validator *v) {
+    if (memcmp(v->type, "IHDR", 4) == 0) {
+        v->width = util_load_be32(v->ihdr);
+        v->height = util_load_be32(v->ihdr + 4);
+        v->bit_depth = v->ihdr[8];
+        v->color_type = v->ihdr[9];
+        v->interlace = v->ihdr[12];
+        if (!util_valid_format(v->width, v->height, v->bit_depth, v->color_type) ||
+                v->ihdr[10] != PNG_COMPRESSION_TYPE_BASE || v->ihdr[11] != PNG_FILTER_TYPE_BASE ||
+                v->interlace > PNG_INTERLACE_ADAM7)
+            return util_validate_fail(v, v->chunk_offset, "invalid IHDR");
+    } else if (memcmp(v->type, "IEND", 4) == 0) {
+        v->state = UTIL_VALIDATE_DONE;
+        return 1;
+    }
+    v->state = UTIL_VALIDATE_HEADER;
+    v->chunk_offset = v->offset;
+    return 1;
+}
+
+// Consumes the next block. Returns 0 when the PNG is invalid.
+static int util_validate_feed(util_validator *v, const png_byte *data, size_t size) {
+    while (size > 0) {
+        size_t n;
+        if (v->state == UTIL_VALIDATE_DONE)
+            return 1;
+        if (v->state == UTIL_VALIDATE_FAILED)
+            return 0;
+        if (v->state == UTIL_VALIDATE_DATA) {
+            n = v->remaining < size ? v->remaining : size;
+            v->crc = v->crc32(v->crc, data, n);
+            if (memcmp(v->type, "IHDR", 4) == 0)
+                memcpy(v->ihdr + (13 - v->remaining), data, n);
+            else if (v->level >= PNG_UTIL_VALIDATE_INFLATE && memcmp(v->type, "IDAT", 4) == 0 &&
+                     !util_validate_inflate(v, data, n))
+                return 0;
+            v->remaining -= (png_uint_32)n;
+            if (v->remaining == 0)
+                v->state = UTIL_VALIDATE_CRC;
+        } else {
+            size_t need = v->state == UTIL_VALIDATE_CRC ? 4 : 8;
+            n = need - v->fill < size ? need - v->fill : size;
+            memcpy(v->buf + v->fill, data, n);
+            v->fill += n;
+        }
+        v->offset += n;
+        data += n;
+        size -= n;
+
+        if (v->state == UTIL_VALIDATE_SIGNATURE && v->fill == 8) {
+            v->fill = 0;
+            if (memcmp(v->buf, util_png_signature, 8) != 0)
+                return util_validate_fail(v, 0, "invalid signature");
+            v->state = UTIL_VALIDATE_HEADER;
+            v->chunk_offset = v->offset;
+        } else if (v->state == UTIL_VALIDATE_HEADER && v->fill == 8) {
+            v->fill = 0;
+            if (!util_validate_header(v))
+                return 0;
+            v->state = v->remaining > 0 ? UTIL_VALIDATE_DATA : UTIL_VALIDATE_CRC;
+        } else if (v->state == UTIL_VALIDATE_CRC && v->fill == 4) {
+            v->fill = 0;
+            if (util_load_be32(v->buf) != v->crc)
+                return util_validate_fail(v, v->chunk_offset, "CRC mismatch");
+            if (!util_validate_chunk_end(v))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static int util_validate_finish(util_validator *v) {
+    if (v->state == UTIL_VALIDATE_FAILED)
+        return 0;
+    if (v->state != UTIL_VALIDATE_DONE)
+        return util_validate_fail(v, v->offset, "unexpected end of data");
+    return 1;
+}
+
+// Input of a validation: memory or a file read in blocks.
+typedef struct util_validate_source {
+    const png_byte *data;
+    size_t size;
+    size_t pos;
+    FILE *fp;
+    util_validator *v;
+    util_trap trap;
+    char message[PNG_UTIL_VALIDATE_REASON_SIZE];  // libpng's error message
+} util_validate_source;
+
+static void util_validate_error_fn(png_struct *png_ptr, const png_char *message) {
+    util_validate_source *src = (util_validate_source *)png_get_error_ptr(png_ptr);
+    snprintf(src->message, sizeof(src->message), "%s", message ? message : "libpng error");
+    longjmp(src->trap.jmp, 1);
+}
+
+// Reads for libpng and passes the same bytes to the structure check.
+static void util_validate_read(png_struct *png_ptr, png_byte *data, size_t length) {
+    util_validate_source *src = (util_validate_source *)png_get_io_ptr(png_ptr);
+    if (src->fp) {
+        if (fread(data, 1, length, src->fp) != length)
+            png_error(png_ptr, ferror(src->fp) ? "Read Error" : "unexpected end of data");
+    } else {
+        if (length > src->size - src->pos)
+            png_error(png_ptr, "unexpected end of data");
+        memcpy(data, src->data + src->pos, length);
+        src->pos += length;
+    }
+    if (!util_validate_feed(src->v, data, length))
+        png_error(png_ptr, src->v->reason);
+}
+
+// Decodes every row into one row buffer. Benign errors (e.g. extra image data) are errors here.
+static png_util_error util_validate_decode(util_validate_source *src) {
+    png_struct *png = png_create_read_struct(PNG_LIBPNG_VER_STRING, src, util_validate_error_fn,
+                                             util_warning_fn);
+    if (!png)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    png_info *info = png_create_info_struct(png);
+    png_byte *volatile row = NULL;
+    if (!info || setjmp(src->trap.jmp)) {
+        png_util_error err = info ? PNG_UTIL_ERROR_INVALID_PNG : PNG_UTIL_ERROR_OUT_OF_MEMORY;
+        free(row);
+        png_destroy_read_struct(&png, &info, NULL);
+        return err;
+    }
+    png_set_benign_errors(png, 0);
+    png_set_read_fn(png, src, util_validate_read);
+    png_read_info(png, info);
+    int passes = png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+    png_uint_32 height = png_get_image_height(png, info);
+    row = (png_byte *)calloc(1, png_get_rowbytes(png, info));
+    if (!row)
+        png_error(png, "Out of memory");
+    for (int pass = 0; pass < passes; pass++) {
+        for (png_uint_32 y = 0; y < height; y++)
+            png_read_row(png, row, NULL);
+    }
+    png_read_end(png, NULL);
+    free(row);
+    png_destroy_read_struct(&png, &info, NULL);
+    return PNG_UTIL_SUCCESS;
+}
+
+static png_util_error util_validate(util_validate_source *src, int level, png_util_validation *result) {
+    if (level < PNG_UTIL_VALIDATE_STRUCTURE || level > PNG_UTIL_VALIDATE_DECODE)
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    if (level == PNG_UTIL_VALIDATE_DECODE && util_check_loaded() != PNG_UTIL_SUCCESS)
+        return PNG_UTIL_ERROR_NOT_LOADED;
+    const util_zlib *zlib = NULL;
+    if (level == PNG_UTIL_VALIDATE_INFLATE) {
+        zlib = util_zlib_get();
+        if (!zlib)
+            return PNG_UTIL_ERROR_UNSUPPORTED;
+    }
+    // libpng inflates at level 3, so the stream check only walks chunks.
+    int check_level = level == PNG_UTIL_VALIDATE_DECODE ? PNG_UTIL_VALIDATE_STRUCTURE : level;
+    // A block for inflated data and a block for file reads. libpng reads files itself at level 3.
+    size_t scratch_size = 0;
+    if (level != PNG_UTIL_VALIDATE_DECODE)
+        scratch_size = (zlib ? UTIL_VALIDATE_BLOCK : 0) + (src->fp ? UTIL_VALIDATE_BLOCK : 0);
+    png_byte *scratch = NULL;
+    if (scratch_size > 0) {
+        scratch = (png_byte *)malloc(scratch_size);
+        if (!scratch)
+            return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    }
+    util_validator v;
+    util_validator_init(&v, check_level, zlib, scratch);
+    src->v = &v;
+    src->message[0] = '\0';
+
+    png_util_error err = PNG_UTIL_SUCCESS;
+    if (level == PNG_UTIL_VALIDATE_DECODE) {
+        err = util_validate_decode(src);
+        if (err == PNG_UTIL_ERROR_INVALID_PNG && v.state != UTIL_VALIDATE_FAILED)
+            util_validate_fail(&v, v.offset, src->message);
+    } else if (src->fp) {
+        png_byte *block = scratch + (zlib ? UTIL_VALIDATE_BLOCK : 0);
+        size_t n;
+        while (v.state < UTIL_VALIDATE_DONE && (n = fread(block, 1, UTIL_VALIDATE_BLOCK, src->fp)) > 0)
+            util_validate_feed(&v, block, n);
+        if (ferror(src->fp))
+            err = PNG_UTIL_ERROR_IO;
+    } else {
+        util_validate_feed(&v, src->data, src->size);
+    }
+    if (err == PNG_UTIL_SUCCESS && !util_validate_finish(&v))
+        err = PNG_UTIL_ERROR_INVALID_PNG;
+    util_validator_free(&v);
+    free(scratch);
+
+    if (result) {
+        result->bytes = v.offset;
+        result->offset = err == PNG_UTIL_ERROR_INVALID_PNG ? v.error_offset : 0;
+        snprintf(result->reason, sizeof(result->reason), "%s",
+                 err == PNG_UTIL_ERROR_INVALID_PNG && v.reason ? v.reason : "");
+    }
+    return err;
+}
+
+png_util_error png_validate(const void *data, size_t size, int level, png_util_validation *result) {
+    if (!data && size > 0)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    util_validate_source src;
+    memset(&src, 0, sizeof(src));
+    src.data = (const png_byte *)data;
+    src.size = size;
+    return util_validate(&src, level, result);
+}
+
+png_util_error png_validate_file(const char *path, int level, png_util_validation *result) {
+    if (!path)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    util_validate_source src;
+    memset(&src, 0, sizeof(src));
+    src.fp = fopen(path, "rb");
+    if (!src.fp)
+        return PNG_UTIL_ERROR_IO;
+    png_util_error err = util_validate(&src, level, result);
+    fclose(src.fp);
+    return err;
+}
+
+typedef struct util_validate_ctx {
+    const char *const *paths;
+    int level;
+    png_util_error *errors;
+    volatile long long bytes;
+    volatile long long invalid;
+} util_validate_ctx;
+
+static void util_validate_task(void *arg, size_t index) {
+    util_validate_ctx *ctx = (util_validate_ctx *)arg;
+    png_util_validation result;
+    memset(&result, 0, sizeof(result));
+    png_util_error err = png_validate_file(ctx->paths[index], ctx->level, &result);
+    ctx->errors[index] = err;
+    util_atomic_add(&ctx->bytes, (long long)result.bytes);
+    if (err == PNG_UTIL_ERROR_INVALID_PNG)
+        util_atomic_add(&ctx->invalid, 1);
+}
+
+png_util_error png_validate_files(const char *const *paths, size_t count, int threads, int level,
+                                  png_util_error *errors, png_util_validate_stats *stats) {
+    if ((!paths || !errors) && count > 0)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    if (level < PNG_UTIL_VALIDATE_STRUCTURE || level > PNG_UTIL_VALIDATE_DECODE)
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    util_validate_ctx ctx = { paths, level, errors, 0, 0 };
+    double start = util_now();
+    util_run_tasks(count, threads, util_validate_task, &ctx);
+    double seconds = util_now() - start;
+    if (stats) {
+        stats->files = count;
+        stats->invalid = (size_t)ctx.invalid;
+        stats->bytes = (unsigned long long)ctx.bytes;
+        stats->seconds = seconds;
+        stats->files_per_second = seconds > 0 ? (double)count / seconds : 0;
+        stats->megabytes_per_second = seconds > 0 ? (double)ctx.bytes / seconds / 1e6 : 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (errors[i] != PNG_UTIL_SUCCESS)
+            return errors[i];
+    }
+    return PNG_UTIL_SUCCESS;
+}
+
+// ------ Recompression optimizer ------
+
+// IDAT size of trials. Larger chunks save 12 bytes per 8 KiB over libpng's default,
+// and the size limit is still checked often enough to stop losing trials early.
+#define UTIL_OPTIMIZE_IDAT_SIZE 65536
+
+void png_optimize_default_trials(png_util_encode_options *trials) {
+    static const int filters[5] = {
+        PNG_ALL_FILTERS, PNG_FILTER_NONE, PNG_FILTER_PAETH, PNG_FILTER_UP, PNG_FILTER_SUB
+    };
+    static const int strategies[3] = {
+        PNG_UTIL_STRATEGY_DEFAULT, PNG_UTIL_STRATEGY_FILTERED, PNG_UTIL_STRATEGY_RLE
+    };
+    png_util_encode_options *t = trials;
+    for (int f = 0; f < 5; f++) {
+        for (int s = 0; s < 3; s++) {
+            for (int mem_level = 9; mem_level >= 8; mem_level--) {
+                memset(t, 0, sizeof(*t));
+                t->compression_level = 9;
+                t->filters = filters[f];
+                t->strategy = strategies[s];
+                t->window_bits = 15;
+                t->mem_level = mem_level;
+                t++;
+            }
+        }
+    }
+}
+
+typedef struct util_optimize_ctx {
+    const png_util_image *image;
+    const util_layout *layout;
+    const png_util_encode_options *trials;
+    png_util_optimize_result *results;
+    volatile long long best_size;  // size of the smallest trial output so far
+    util_mutex lock;
+    png_byte *best;  // the smallest trial output and its index
+    size_t best_index;
+    png_util_error error;
+} util_optimize_ctx;
+
+static void util_optimize_task(void *arg, size_t index) {
+    util_optimize_ctx *ctx = (util_optimize_ctx *)arg;
+    png_util_optimize_result *result = &ctx->results[index];
+    util_mem_writer writer;
+    memset(&writer, 0, sizeof(writer));
+    writer.limit = &ctx->best_size;
+    double start = util_now();
+    png_util_error err = util_encode(ctx->image, &ctx->trials[index], ctx->layout->plte, ctx->layout->plte_size,
+                                     UTIL_OPTIMIZE_IDAT_SIZE, &writer);
+    result->seconds = util_now() - start;
+    result->aborted = writer.aborted;
+    result->size = 0;
+    if (err != PNG_UTIL_SUCCESS) {
+        if (!writer.aborted) {
+            util_mutex_lock(&ctx->lock);
+            if (ctx->error == PNG_UTIL_SUCCESS)
+                ctx->error = err;
+            util_mutex_unlock(&ctx->lock);
+        }
+        return;
+    }
+
+    // Every trial writes the same chunks around IDAT, so trial sizes compare like final sizes.
+    const util_layout *layout = ctx->layout;
+    const util_idat *last = &layout->idat[layout->idat_count - 1];
+    size_t kept = layout->end - (size_t)(last->data + last->size + 4 - (layout->idat[0].data - 8));
+    util_layout trial;
+    if (util_scan_chunks(writer.data, writer.size, &trial) == PNG_UTIL_SUCCESS) {
+        result->size = kept + trial.stream_size + 12 * trial.idat_count;
+        util_layout_free(&trial);
+    }
+    util_mutex_lock(&ctx->lock);
+    if ((long long)writer.size < ctx->best_size || ((long long)writer.size == ctx->best_size && index < ctx->best_index)) {
+        free(ctx->best);
+        ctx->best = writer.data;
+        ctx->best_index = index;
+        writer.data = NULL;
+        util_atomic_add(&ctx->best_size, (long long)writer.size - ctx->best_size);
+    }
+    util_mutex_unlock(&ctx->lock);
+    free(writer.data);
+}
+
+// Replaces IHDR and the IDAT run of the original PNG with the ones of a trial.
+// Other chunks are copied as they are.
+static png_util_error util_splice_idat(const png_byte *data, const util_layout *layout,
+                                       const png_byte *trial_data, size_t trial_size, png_util_buffer *png_data) {
+    util_layout trial;
+    png_util_error err = util_scan_chunks(trial_data, trial_size, &trial);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    size_t head_end = (size_t)(layout->idat[0].data - 8 - data);
+    const util_idat *last = &layout->idat[layout->idat_count - 1];
+    size_t tail_start = (size_t)(last->data - data) + last->size + 4;
+    size_t idat_start = (size_t)(trial.idat[0].data - 8 - trial_data);
+    const util_idat *trial_last = &trial.idat[trial.idat_count - 1];
+    size_t idat_size = (size_t)(trial_last->data - trial_data) + trial_last->size + 4 - idat_start;
+    util_layout_free(&trial);
+
+    size_t size = head_end + idat_size + (layout->end - tail_start);
+    png_byte *out = (png_byte *)malloc(size);
+    if (!out)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    // IHDR is the first chunk of both. The trial's one is non-interlaced.
+    memcpy(out, trial_data, 33);
+    memcpy(out + 33, data + 33, head_end - 33);
+    memcpy(out + head_end, trial_data + idat_start, idat_size);
+    memcpy(out + head_end + idat_size, data + tail_start, layout->end - tail_start);
+    png_data->data = out;
+    png_data->size = size;
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_optimize(const void *data, size_t size, const png_util_optimize_options *options,
+                            png_util_buffer *png_data, png_util_optimize_result *results) {
+    if (!data || !png_data)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    png_util_encode_options defaults[PNG_UTIL_OPTIMIZE_DEFAULT_TRIALS];
+    const png_util_encode_options *trials = options ? options->trials : NULL;
+    size_t count = options && options->trials ? options->trial_count : PNG_UTIL_OPTIMIZE_DEFAULT_TRIALS;
+    if (!trials) {
+        png_optimize_default_trials(defaults);
+        trials = defaults;
+    }
+    if (count == 0)
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    for (size_t i = 0; i < count; i++) {
+        err = util_check_encode_options(&trials[i]);
+        if (err != PNG_UTIL_SUCCESS)
+            return err;
+    }
+
+    util_layout layout;
+    err = util_scan_chunks((const png_byte *)data, size, &layout);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    // Chunks between IDAT chunks can't be kept.
+    for (size_t i = 0; i + 1 < layout.idat_count && err == PNG_UTIL_SUCCESS; i++) {
+        if (layout.idat[i].data + layout.idat[i].size + 12 != layout.idat[i + 1].data)
+            err = PNG_UTIL_ERROR_INVALID_PNG;
+    }
+    if (err == PNG_UTIL_SUCCESS && layout.end == 0)
+        err = PNG_UTIL_ERROR_INVALID_PNG;
+    if (err == PNG_UTIL_SUCCESS && layout.color_type == PNG_COLOR_TYPE_PALETTE && !layout.plte)
+        err = PNG_UTIL_ERROR_INVALID_PNG;
+    png_util_image image;
+    if (err == PNG_UTIL_SUCCESS)
+        err = util_read_serial(data, size, &image);
+    if (err != PNG_UTIL_SUCCESS) {
+        util_layout_free(&layout);
+        return err;
+    }
+
+    png_util_optimize_result *trial_results = results;
+    if (!trial_results)
+        trial_results = (png_util_optimize_result *)malloc(sizeof(png_util_optimize_result) * count);
+    util_optimize_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.image = &image;
+    ctx.layout = &layout;
+    ctx.trials = trials;
+    ctx.results = trial_results;
+    ctx.best_size = 0x7fffffffffffffffLL;
+    ctx.best_index = count;
+    util_mutex_init(&ctx.lock);
+    if (!trial_results)
+        ctx.error = PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    else
+        util_run_tasks(count, options ? options->threads : 0, util_optimize_task, &ctx);
+    util_mutex_destroy(&ctx.lock);
+    png_util_image_free(&image);
+
+    // The original is kept when no trial is smaller.
+    err = ctx.error;
+    if (err == PNG_UTIL_SUCCESS) {
+        size_t best = ctx.best ? trial_results[ctx.best_index].size : 0;
+        if (ctx.best && best > 0 && best < layout.end) {
+            err = util_splice_idat((const png_byte *)data, &layout, ctx.best, (size_t)ctx.best_size, png_data);
+        } else {
+            png_data->data = (png_byte *)malloc(layout.end);
+            png_data->size = layout.end;
+            if (png_data->data)
+                memcpy(png_data->data, data, layout.end);
+            else
+                err = PNG_UTIL_ERROR_OUT_OF_MEMORY;
+        }
+    }
+    free(ctx.best);
+    if (trial_results != results)
+        free(trial_results);
+    util_layout_free(&layout);
+    return err;
+}
+
+// ------ Encode presets ------
+
+png_util_error png_encode_preset(int preset, png_util_encode_options *options) {
+    if (!options)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    memset(options, 0, sizeof(*options));
+    // Larger IDAT chunks mean fewer write callbacks and less chunk overhead.
+    options->buffer_size = 65536;
+    switch (preset) {
+    case PNG_UTIL_PRESET_REALTIME:
+        // One cheap filter and RLE, which skips zlib's match search.
+        options->compression_level = 1;
+        options->filters = PNG_FILTER_SUB;
+        options->strategy = PNG_UTIL_STRATEGY_RLE;
+        break;
+    case PNG_UTIL_PRESET_BALANCED:
+        options->compression_level = 6;
+        options->filters = PNG_ALL_FILTERS;
+        options->strategy = PNG_UTIL_STRATEGY_FILTERED;
+        break;
+    case PNG_UTIL_PRESET_ARCHIVAL:
+        options->compression_level = 9;
+        options->filters = PNG_ALL_FILTERS;
+        options->strategy = PNG_UTIL_STRATEGY_DEFAULT;
+        options->window_bits = 15;
+        options->mem_level = 9;
+        break;
+    default:
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    }
+    return PNG_UTIL_SUCCESS;
+}
+
+// The auto-tuner encodes bands of rows spread over the image with each candidate.
+#define UTIL_TUNE_BANDS 8
+#define UTIL_TUNE_BAND_ROWS 16
+#define UTIL_TUNE_CANDIDATES 4
+
+// Realtime, a middle ground between realtime and balanced, balanced and archival.
+static void util_tune_candidates(png_util_encode_options *candidates) {
+    png_encode_preset(PNG_UTIL_PRESET_REALTIME, &candidates[0]);
+    png_encode_preset(PNG_UTIL_PRESET_REALTIME, &candidates[1]);
+    candidates[1].compression_level = 3;
+    candidates[1].filters = PNG_FILTER_PAETH;
+    candidates[1].strategy = PNG_UTIL_STRATEGY_FILTERED;
+    png_encode_preset(PNG_UTIL_PRESET_BALANCED, &candidates[2]);
+    png_encode_preset(PNG_UTIL_PRESET_ARCHIVAL, &candidates[3]);
+}
+
+// Images of a class share the bit depth, the color type and the power-of-two size buckets.
+typedef struct util_tune_class {
+    int width_bits;
+    int height_bits;
+    int bit_depth;
+    int color_type;
+    double bytes_per_second;
+    double max_seconds;
+} util_tune_class;
+
+typedef struct util_tune_entry {
+    util_tune_class key;
+    int candidate;
+    double bytes_per_pixel;  // of the chosen candidate, to predict other images of the class
+    double seconds_per_pixel;
+    unsigned long long last_used;
+} util_tune_entry;
+
+struct png_util_tune_cache {
+    util_mutex lock;
+    util_tune_entry *entries;
+    size_t count;
+    size_t capacity;
+    unsigned long long clock;
+    size_t hits;
+    size_t misses;
+};
+
+static int util_bit_width(png_uint_32 v) {
+    int bits = 0;
+    while (v > 0) {
+        bits++;
+        v >>= 1;
+    }
+    return bits;
+}
+
+static void util_tune_class_of(const png_util_image *image, const png_util_tune_target *target,
+                               util_tune_class *key) {
+    memset(key, 0, sizeof(*key));
+    key->width_bits = util_bit_width(image->width - 1);
+    key->height_bits = util_bit_width(image->height - 1);
+    key->bit_depth = image->bit_depth;
+    key->color_type = image->color_type;
+    key->bytes_per_second = target->bytes_per_second;
+    key->max_seconds = target->max_seconds;
+}
+
+static int util_tune_class_equal(const util_tune_class *a, const util_tune_class *b) {
+    return a->width_bits == b->width_bits && a->height_bits == b->height_bits && a->bit_depth == b->bit_depth &&
+           a->color_type == b->color_type && a->bytes_per_second == b->bytes_per_second &&
+           a->max_seconds == b->max_seconds;
+}
+
+png_util_error png_tune_cache_create(size_t capacity, png_util_tune_cache **cache) {
+    if (!cache)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    if (capacity == 0)
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    png_util_tune_cache *c = (png_util_tune_cache *)calloc(1, sizeof(png_util_tune_cache));
+    if (!c)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    c->entries = (util_tune_entry *)calloc(capacity, sizeof(util_tune_entry));
+    if (!c->entries) {
+        free(c);
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    }
+    util_mutex_init(&c->lock);
+    c->capacity = capacity;
+    *cache = c;
+    return PNG_UTIL_SUCCESS;
+}
+
+static int util_tune_cache_find(png_util_tune_cache *cache, const util_tune_class *key, util_tune_entry *found) {
+    int hit = 0;
+    util_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < cache->count; i++) {
+        util_tune_entry *e = &cache->entries[i];
+        if (util_tune_class_equal(&e->key, key)) {
+            e->last_used = ++cache->clock;
+            *found = *e;
+            hit = 1;
+            break;
+        }
+    }
+    if (hit)
+        cache->hits++;
+    else
+        cache->misses++;
+    util_mutex_unlock(&cache->lock);
+    return hit;
+}
+
+// Adds a decision. The least recently used class is replaced when the cache is full.
+static void util_tune_cache_add(png_util_tune_cache *cache, const util_tune_entry *entry) {
+    util_mutex_lock(&cache->lock);
+    util_tune_entry *slot = NULL;
+    for (size_t i = 0; i < cache->count && !slot; i++) {
+        if (util_tune_class_equal(&cache->entries[i].key, &entry->key))
+            slot = &cache->entries[i];  // another thread tuned the same class
+    }
+    if (!slot && cache->count < cache->capacity) {
+        slot = &cache->entries[cache->count++];
+    } else if (!slot) {
+        slot = &cache->entries[0];
+        for (size_t i = 1; i < cache->count; i++) {
+            if (cache->entries[i].last_used < slot->last_used)
+                slot = &cache->entries[i];
+        }
+    }
+    *slot = *entry;
+    slot->last_used = ++cache->clock;
+    util_mutex_unlock(&cache->lock);
+}
+
+// Encodes the sample with each candidate and picks the one with the lowest
+// size + bytes_per_second * seconds whose predicted time fits max_seconds.
+// The fastest candidate is picked when none fits.
+static png_util_error util_tune(const png_util_image *image, const png_util_tune_target *target,
+                                const png_util_encode_options *candidates, util_tune_entry *decision) {
+    size_t rowbytes = util_rowbytes(image->width, image->bit_depth, image->color_type);
+    png_util_image sample = *image;
+    png_byte *rows = NULL;
+    if (image->height > UTIL_TUNE_BANDS * UTIL_TUNE_BAND_ROWS) {
+        rows = (png_byte *)malloc(rowbytes * UTIL_TUNE_BANDS * UTIL_TUNE_BAND_ROWS);
+        if (!rows)
+            return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+        png_uint_32 step = image->height / UTIL_TUNE_BANDS;
+        for (png_uint_32 b = 0; b < UTIL_TUNE_BANDS; b++) {
+            for (png_uint_32 r = 0; r < UTIL_TUNE_BAND_ROWS; r++) {
+                memcpy(rows + rowbytes * (b * UTIL_TUNE_BAND_ROWS + r),
+                       image->pixels + image->row_stride * (b * step + r), rowbytes);
+            }
+        }
+        sample.pixels = rows;
+        sample.height = UTIL_TUNE_BANDS * UTIL_TUNE_BAND_ROWS;
+        sample.row_stride = rowbytes;
+    }
+    double scale = (double)image->height / (double)sample.height;
+
+    png_util_error err = PNG_UTIL_SUCCESS;
+    double sizes[UTIL_TUNE_CANDIDATES], seconds[UTIL_TUNE_CANDIDATES];
+    for (int i = 0; i < UTIL_TUNE_CANDIDATES && err == PNG_UTIL_SUCCESS; i++) {
+        util_mem_writer writer;
+        memset(&writer, 0, sizeof(writer));
+        double start = util_now();
+        err = util_encode(&sample, &candidates[i], NULL, 0, 0, &writer);
+        seconds[i] = (util_now() - start) * scale;
+        sizes[i] = (double)writer.size * scale;
+        free(writer.data);
+    }
+    free(rows);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+
+    int best = -1, fastest = 0;
+    for (int i = 0; i < UTIL_TUNE_CANDIDATES; i++) {
+        if (seconds[i] < seconds[fastest])
+            fastest = i;
+        if (target->max_seconds > 0 && seconds[i] > target->max_seconds)
+            continue;
+        double cost = sizes[i] + target->bytes_per_second * seconds[i];
+        if (best < 0 || cost < sizes[best] + target->bytes_per_second * seconds[best])
+            best = i;
+    }
+    if (best < 0)
+        best = fastest;
+    double pixels = (double)image->width * (double)image->height;
+    decision->candidate = best;
+    decision->bytes_per_pixel = sizes[best] / pixels;
+    decision->seconds_per_pixel = seconds[best] / pixels;
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_encode_auto(png_util_tune_cache *cache, const png_util_image *image,
+                               const png_util_tune_target *target, png_util_buffer *png_data,
+                               png_util_tune_decision *decision) {
+    if (!image || !image->pixels || !target || !png_data)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err == PNG_UTIL_SUCCESS)
+        err = util_check_image(image);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    if (target->bytes_per_second < 0 || target->max_seconds < 0)
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+
+    png_util_encode_options candidates[UTIL_TUNE_CANDIDATES];
+    util_tune_candidates(candidates);
+    util_tune_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    util_tune_class_of(image, target, &entry.key);
+    int cached = cache && util_tune_cache_find(cache, &entry.key, &entry);
+    if (!cached) {
+        err = util_tune(image, target, candidates, &entry);
+        if (err != PNG_UTIL_SUCCESS)
+            return err;
+        if (cache)
+            util_tune_cache_add(cache, &entry);
+    }
+
+    util_mem_writer writer;
+    memset(&writer, 0, sizeof(writer));
+    err = util_encode(image, &candidates[entry.candidate], NULL, 0, 0, &writer);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    png_data->data = writer.data;
+    png_data->size = writer.size;
+    if (decision) {
+        double pixels = (double)image->width * (double)image->height;
+        decision->options = candidates[entry.candidate];
+        decision->predicted_size = (size_t)(entry.bytes_per_pixel * pixels);
+        decision->predicted_seconds = entry.seconds_per_pixel * pixels;
+        decision->cached = cached;
+    }
+    return PNG_UTIL_SUCCESS;
+}
+
+void png_tune_cache_stats(png_util_tune_cache *cache, png_util_tune_cache_stats *stats) {
+    if (!cache || !stats)
+        return;
+    util_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->entries = cache->count;
+    util_mutex_unlock(&cache->lock);
+}
+
+void png_tune_cache_destroy(png_util_tune_cache *cache) {
+    if (!cache)
+        return;
+    free(cache->entries);
+    util_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+// ------ Stored-block encoder ------
+
+#define UTIL_STORED_BLOCK 65535  // the largest stored deflate block
+#define UTIL_STORED_IDAT (1U << 20)
+#define UTIL_STORED_FILE_BUFFER (1U << 20)
+
+// Writes a PNG without libpng or zlib. Output is staged in buf, which holds
+// the whole PNG for memory output or is flushed to fp when it fills up.
+typedef struct util_stored_writer {
+    png_byte *buf;
+    size_t capacity;
+    size_t pos;
+    FILE *fp;
+    int failed;
+    util_crc_fn crc32;
+    size_t idat_left;  // data bytes left in the current IDAT
+    size_t stream_left;  // zlib bytes not written yet
+    png_uint_32 crc;
+} util_stored_writer;
+
+static void util_stored_put(util_stored_writer *w, const png_byte *data, size_t size) {
+    while (size > 0 && !w->failed) {
+        if (w->pos == w->capacity) {
+            if (!w->fp || fwrite(w->buf, 1, w->pos, w->fp) != w->pos) {
+                w->failed = 1;
+                return;
+            }
+            w->pos = 0;
+        }
+        size_t n = w->capacity - w->pos < size ? w->capacity - w->pos : size;
+        memcpy(w->buf + w->pos, data, n);
+        w->pos += n;
+        data += n;
+        size -= n;
+    }
+}
+
+static void util_stored_chunk(util_stored_writer *w, const char *type, const png_byte *data, png_uint_32 size) {
+    png_byte header[8], crc[4];
+    util_store_be32(header, size);
+    memcpy(header + 4, type, 4);
+    util_store_be32(crc, w->crc32(w->crc32(0, header + 4, 4), data, size));
+    util_stored_put(w, header, 8);
+    util_stored_put(w, data, size);
+    util_stored_put(w, crc, 4);
+}
+
+// Appends zlib stream bytes, splitting them into IDAT chunks.
+static void util_stored_idat(util_stored_writer *w, const png_byte *data, size_t size) {
+    while (size > 0) {
+        if (w->idat_left == 0) {
+            png_byte header[8];
+            w->idat_left = w->stream_left < UTIL_STORED_IDAT ? w->stream_left : UTIL_STORED_IDAT;
+            util_store_be32(header, (png_uint_32)w->idat_left);
+            memcpy(header + 4, "IDAT", 4);
+            util_stored_put(w, header, 8);
+            w->crc = w->crc32(0, header + 4, 4);
+        }
+        size_t n = w->idat_left < size ? w->idat_left : size;
+        util_stored_put(w, data, n);
+        w->crc = w->crc32(w->crc, data, n);
+        w->idat_left -= n;
+        w->stream_left -= n;
+        data += n;
+        size -= n;
+        if (w->idat_left == 0) {
+            png_byte crc[4];
+            util_store_be32(crc, w->crc);
+            util_stored_put(w, crc, 4);
+        }
+    }
+}
+
+// Size of the PNG, or 0 if it doesn't fit in size_t.
+static size_t util_stored_size(const png_util_image *image, size_t *stream_size) {
+    size_t rowbytes = util_rowbytes(image->width, image->bit_depth, image->color_type) + 1;
+    if (image->height > PNG_SIZE_MAX / rowbytes)
+        return 0;
+    size_t filtered = rowbytes * image->height;
+    size_t blocks = (filtered + UTIL_STORED_BLOCK - 1) / UTIL_STORED_BLOCK;
+    if (filtered > PNG_SIZE_MAX - blocks * 5 - 6 - 1024)
+        return 0;
+    size_t stream = 2 + filtered + blocks * 5 + 4;
+    size_t chunks = (stream + UTIL_STORED_IDAT - 1) / UTIL_STORED_IDAT;
+    if (stream > PNG_SIZE_MAX - chunks * 12 - 1024)
+        return 0;
+    *stream_size = stream;
+    return 8 + 25 + chunks * 12 + stream + 12;
+}
+
+// Writes filter type None rows in stored blocks. Checksums run on the rows as they are copied.
+static void util_stored_encode(util_stored_writer *w, const png_util_image *image, size_t stream_size) {
+    util_adler_fn adler32 = util_kernels_get()->adler32;
+    png_byte ihdr[13];
+    util_store_be32(ihdr, image->width);
+    util_store_be32(ihdr + 4, image->height);
+    ihdr[8] = (png_byte)image->bit_depth;
+    ihdr[9] = (png_byte)image->color_type;
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    util_stored_put(w, util_png_signature, 8);
+    util_stored_chunk(w, "IHDR", ihdr, 13);
+
+    w->stream_left = stream_size;
+    static const png_byte zlib_header[2] = { 0x78, 0x01 };
+    util_stored_idat(w, zlib_header, 2);
+    size_t rowbytes = util_rowbytes(image->width, image->bit_depth, image->color_type);
+    size_t filtered_left = (rowbytes + 1) * image->height;
+    size_t block_left = 0;
+    png_uint_32 adler = 1;
+    for (png_uint_32 y = 0; y < image->height && !w->failed; y++) {
+        const png_byte *row = image->pixels + image->row_stride * y;
+        size_t pos = 0;
+        // pos counts the filter byte, so pos - 1 is the offset in the row.
+        while (pos < rowbytes + 1) {
+            if (block_left == 0) {
+                block_left = filtered_left < UTIL_STORED_BLOCK ? filtered_left : UTIL_STORED_BLOCK;
+                png_byte header[5];
+                header[0] = block_left == filtered_left ? 1 : 0;  // BFINAL, BTYPE 00
+                header[1] = (png_byte)block_left;
+                header[2] = (png_byte)(block_left >> 8);
+                header[3] = (png_byte)~block_left;
+                header[4] = (png_byte)(~block_left >> 8);
+                util_stored_idat(w, header, 5);
+            }
+            size_t n;
+            if (pos == 0) {
+                static const png_byte none = PNG_FILTER_VALUE_NONE;
+                n = 1;
+                util_stored_idat(w, &none, 1);
+                adler = util_adler32(adler, &none, 1);
+            } else {
+                n = rowbytes + 1 - pos < block_left ? rowbytes + 1 - pos : block_left;
+                util_stored_idat(w, row + pos - 1, n);
+                adler = adler32(adler, row + pos - 1, n);
+            }
+            pos += n;
+            block_left -= n;
+            filtered_left -= n;
+        }
+    }
+    png_byte trailer[4];
+    util_store_be32(trailer, adler);
+    util_stored_idat(w, trailer, 4);
+    util_stored_chunk(w, "IEND", NULL, 0);
+}
+
+static png_util_error util_check_stored_image(const png_util_image *image) {
+    png_util_error err = util_check_image(image);
+    if (err == PNG_UTIL_SUCCESS && image->color_type == PNG_COLOR_TYPE_PALETTE)
+        err = PNG_UTIL_ERROR_UNSUPPORTED;  // there is no palette to write
+    return err;
+}
+
+png_util_error png_encode_stored(const png_util_image *image, png_util_buffer *png_data) {
+    if (!image || !image->pixels || !png_data)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_stored_image(image);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    size_t stream_size;
+    size_t size = util_stored_size(image, &stream_size);
+    if (size == 0)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    util_stored_writer w;
+    memset(&w, 0, sizeof(w));
+    w.buf = (png_byte *)malloc(size);
+    if (!w.buf)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    w.capacity = size;
+    w.crc32 = util_kernels_get()->crc32;
+    util_stored_encode(&w, image, stream_size);
+    png_data->data = w.buf;
+    png_data->size = w.pos;
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_encode_stored_file(const png_util_image *image, const char *path) {
+    if (!image || !image->pixels || !path)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_stored_image(image);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    size_t stream_size;
+    if (util_stored_size(image, &stream_size) == 0)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    util_stored_writer w;
+    memset(&w, 0, sizeof(w));
+    w.buf = (png_byte *)malloc(UTIL_STORED_FILE_BUFFER);
+    if (!w.buf)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    w.capacity = UTIL_STORED_FILE_BUFFER;
+    w.crc32 = util_kernels_get()->crc32;
+    w.fp = fopen(path, "wb");
+    if (!w.fp) {
+        free(w.buf);
+        return PNG_UTIL_ERROR_IO;
+    }
+    setvbuf(w.fp, NULL, _IONBF, 0);  // buf is the buffer
+    util_stored_encode(&w, image, stream_size);
+    int ok = !w.failed && fwrite(w.buf, 1, w.pos, w.fp) == w.pos;
+    ok = fclose(w.fp) == 0 && ok;
+    free(w.buf);
+    if (!ok) {
+        remove(path);
+        return PNG_UTIL_ERROR_IO;
+    }
+    return PNG_UTIL_SUCCESS;
+}
+
+// ------ Pipelined encoder ------
+
+#define UTIL_RING_PRODUCER 0
+#define UTIL_RING_CONSUMER 1
+
+// How util_ring_close() stops the ring
+#define UTIL_RING_DRAIN 1  // the producer stopped. The consumer still takes the rows left.
+#define UTIL_RING_CANCEL 2  // both sides stop now
+
+// A single-producer, single-consumer ring of rows. head and tail only grow and each is
+// written by one side, so passing a row takes no lock. The mutex and the condition
+// variable are only used to sleep while the ring is full or empty.
+typedef struct util_ring {
+    png_byte *rows;
+    size_t rowbytes;
+    long long depth;
+    volatile long long head;  // rows pushed
+    volatile long long tail;  // rows taken
+    volatile long long sleepers;
+    volatile long long closed;  // UTIL_RING_DRAIN or UTIL_RING_CANCEL, or 0
+    util_mutex lock;
+    util_cond cond;
+    size_t waits[2];  // indexed by UTIL_RING_PRODUCER or UTIL_RING_CONSUMER
+    double wait_seconds[2];
+} util_ring;
+
+static int util_ring_init(util_ring *ring, size_t rowbytes, size_t depth) {
+    memset(ring, 0, sizeof(*ring));
+    if (depth > PNG_SIZE_MAX / rowbytes)
+        return 0;
+    ring->rows = (png_byte *)malloc(rowbytes * depth);
+    if (!ring->rows)
+        return 0;
+    ring->rowbytes = rowbytes;
+    ring->depth = (long long)depth;
+    util_mutex_init(&ring->lock);
+    util_cond_init(&ring->cond);
+    return 1;
+}
+
+static void util_ring_destroy(util_ring *ring) {
+    free(ring->rows);
+    util_mutex_destroy(&ring->lock);
+    util_cond_destroy(&ring->cond);
+}
+
+// The checks without the lock only read head and tail, so the sides don't write each
+// other's cache lines.
+static int util_ring_ready(util_ring *ring, int side) {
+    long long used = util_atomic_load(&ring->head) - util_atomic_load(&ring->tail);
+    return side == UTIL_RING_PRODUCER ? used < ring->depth : used > 0;
+}
+
+// util_ring_ready() for a side that registered as a sleeper. The full barriers pair with
+// the ones of util_ring_commit(), so either the check sees the commit or the commit sees
+// the sleeper.
+static int util_ring_ready_sleeper(util_ring *ring, int side) {
+    long long used = util_atomic_add(&ring->head, 0) - util_atomic_add(&ring->tail, 0);
+    return side == UTIL_RING_PRODUCER ? used < ring->depth : used > 0;
+}
+
+// Returns the next slot to fill (producer) or to read (consumer). It waits while the ring is
+// full or empty, and returns NULL once the ring is closed. A drained ring gives the consumer
+// its remaining rows first.
+static png_byte *util_ring_acquire(util_ring *ring, int side) {
+    if (!util_ring_ready(ring, side) && !util_atomic_load(&ring->closed)) {
+        double start = util_now();
+        util_mutex_lock(&ring->lock);
+        // Registering before checking again means the other side sees us after its next commit.
+        util_atomic_add(&ring->sleepers, 1);
+        while (!util_ring_ready_sleeper(ring, side) && !util_atomic_add(&ring->closed, 0))
+            util_cond_wait(&ring->cond, &ring->lock);
+        util_atomic_add(&ring->sleepers, -1);
+        util_mutex_unlock(&ring->lock);
+        ring->waits[side]++;
+        ring->wait_seconds[side] += util_now() - start;
+    }
+    long long closed = util_atomic_load(&ring->closed);
+    if (closed != 0 && (closed != UTIL_RING_DRAIN || side == UTIL_RING_PRODUCER || !util_ring_ready(ring, side)))
+        return NULL;
+    long long index = side == UTIL_RING_PRODUCER ? ring->head : ring->tail;
+    return ring->rows + ring->rowbytes * (size_t)(index % ring->depth);
+}
+
+static void util_ring_wake(util_ring *ring) {
+    util_mutex_lock(&ring->lock);
+    util_cond_broadcast(&ring->cond);
+    util_mutex_unlock(&ring->lock);
+}
+
+// Hands the acquired slot to the other side.
+static void util_ring_commit(util_ring *ring, int side) {
+    util_atomic_add(side == UTIL_RING_PRODUCER ? &ring->head : &ring->tail, 1);
+    if (util_atomic_add(&ring->sleepers, 0) > 0)
+        util_ring_wake(ring);
+}
+
+static void util_ring_close(util_ring *ring, int how) {
+    util_atomic_add(&ring->closed, how);
+    util_ring_wake(ring);
+}
+
+static void util_ring_stats(const util_ring *ring, double start, png_util_pipe_stats *stats) {
+    stats->rows = (size_t)ring->tail;
+    stats->producer_waits = ring->waits[UTIL_RING_PRODUCER];
+    stats->producer_wait_seconds = ring->wait_seconds[UTIL_RING_PRODUCER];
+    stats->consumer_waits = ring->waits[UTIL_RING_CONSUMER];
+    stats->consumer_wait_seconds = ring->wait_seconds[UTIL_RING_CONSUMER];
+    stats->seconds = util_now() - start;
+}
+
+struct png_util_pipe_writer {
+    util_ring ring;
+    FILE *fp;
+    png_uint_32 width;
+    png_uint_32 height;
+    int bit_depth;
+    int color_type;
+    png_util_encode_options options;
+    int has_options;
+    png_uint_32 pushed;
+    volatile long long status;  // png_util_error of the background stage
+    int io_failed;
+    util_thread thread;
+    double start;
+};
+
+// png_init_write_io() ignores write errors, so the pipeline checks fwrite() itself.
+static void util_pipe_write_data(png_struct *png_ptr, png_byte *data, size_t length) {
+    png_util_pipe_writer *writer = (png_util_pipe_writer *)png_get_io_ptr(png_ptr);
+    if (fwrite(data, 1, length, writer->fp) != length) {
+        writer->io_failed = 1;
+        png_error(png_ptr, "Write error");
+    }
+}
+
+static void util_pipe_flush_data(png_struct *png_ptr) {
+    png_util_pipe_writer *writer = (png_util_pipe_writer *)png_get_io_ptr(png_ptr);
+    fflush(writer->fp);
+}
+
+// The background stage. It takes rows from the ring and runs libpng on them.
+static void util_pipe_encode(png_util_pipe_writer *writer) {
+    util_trap trap;
+    png_struct *png = util_create_write_struct(&trap);
+    if (!png) {
+        util_atomic_add(&writer->status, PNG_UTIL_ERROR_OUT_OF_MEMORY);
+        util_ring_close(&writer->ring, UTIL_RING_CANCEL);
+        return;
+    }
+    png_info *info = png_create_info_struct(png);
+    if (!info || setjmp(trap.jmp)) {
+        util_atomic_add(&writer->status, !info ? PNG_UTIL_ERROR_OUT_OF_MEMORY :
+                                         writer->io_failed ? PNG_UTIL_ERROR_IO : PNG_UTIL_ERROR_LIBPNG);
+        png_destroy_write_struct(&png, &info);
+        util_ring_close(&writer->ring, UTIL_RING_CANCEL);
+        return;
+    }
+
+    png_set_write_fn(png, writer, util_pipe_write_data, util_pipe_flush_data);
+    png_set_IHDR(png, info, writer->width, writer->height, writer->bit_depth, writer->color_type,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    util_set_encode_options(png, writer->has_options ? &writer->options : NULL);
+    png_write_info(png, info);
+    png_uint_32 y = 0;
+    for (; y < writer->height; y++) {
+        png_byte *row = util_ring_acquire(&writer->ring, UTIL_RING_CONSUMER);
+        if (!row)
+            break;  // canceled
+        png_write_row(png, row);
+        util_ring_commit(&writer->ring, UTIL_RING_CONSUMER);
+    }
+    if (y == writer->height)
+        png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+}
+
+UTIL_THREAD_MAIN(util_pipe_encode_main, arg) {
+    util_pipe_encode((png_util_pipe_writer *)arg);
+    UTIL_THREAD_RETURN;
+}
+
+png_util_error png_pipe_writer_create(FILE *fp, png_uint_32 width, png_uint_32 height, int bit_depth,
+                                      int color_type, const png_util_encode_options *options, size_t depth,
+                                      png_util_pipe_writer **writer) {
+    if (!fp || !writer)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    if (!util_valid_format(width, height, bit_depth, color_type))
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+        return PNG_UTIL_ERROR_UNSUPPORTED;  // there is no palette to write
+    err = util_check_encode_options(options);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+
+    png_util_pipe_writer *w = (png_util_pipe_writer *)calloc(1, sizeof(png_util_pipe_writer));
+    if (!w)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    if (!util_ring_init(&w->ring, util_rowbytes(width, bit_depth, color_type),
+                        depth > 0 ? depth : PNG_UTIL_PIPE_DEFAULT_DEPTH)) {
+        free(w);
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    }
+    w->fp = fp;
+    w->width = width;
+    w->height = height;
+    w->bit_depth = bit_depth;
+    w->color_type = color_type;
+    if (options) {
+        w->options = *options;
+        w->has_options = 1;
+    }
+    w->start = util_now();
+    if (!util_thread_start(&w->thread, util_pipe_encode_main, w)) {
+        util_ring_destroy(&w->ring);
+        free(w);
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    }
+    *writer = w;
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_pipe_writer_push(png_util_pipe_writer *writer, const png_byte *row) {
+    if (!writer || !row)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    if (writer->pushed == writer->height)
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    png_byte *slot = util_ring_acquire(&writer->ring, UTIL_RING_PRODUCER);
+    if (!slot)
+        return (png_util_error)util_atomic_add(&writer->status, 0);
+    memcpy(slot, row, writer->ring.rowbytes);
+    writer->pushed++;
+    util_ring_commit(&writer->ring, UTIL_RING_PRODUCER);
+    return PNG_UTIL_SUCCESS;
+}
+
+size_t png_pipe_writer_free_rows(png_util_pipe_writer *writer) {
+    if (!writer)
+        return 0;
+    util_ring *ring = &writer->ring;
+    return (size_t)(ring->depth - (ring->head - util_atomic_add(&ring->tail, 0)));
+}
+
+png_util_error png_pipe_writer_finish(png_util_pipe_writer *writer, png_util_pipe_stats *stats) {
+    if (!writer)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = PNG_UTIL_SUCCESS;
+    if (writer->pushed < writer->height) {
+        util_ring_close(&writer->ring, UTIL_RING_CANCEL);
+        err = PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    }
+    util_thread_join(writer->thread);
+    png_util_error status = (png_util_error)util_atomic_add(&writer->status, 0);
+    if (status != PNG_UTIL_SUCCESS)
+        err = status;
+    if (stats)
+        util_ring_stats(&writer->ring, writer->start, stats);
+    util_ring_destroy(&writer->ring);
+    free(writer);
+    return err;
+}
+
+// ------ Pipelined decoder ------
+
+struct png_util_pipe_reader {
+    util_ring ring;
+    util_trap trap;  // set by the creating thread, then by the decode thread
+    png_struct *png;
+    png_info *info;
+    FILE *fp;
+    png_util_header header;
+    png_uint_32 taken;  // rows returned to the consumer
+    int holding;  // the consumer holds the slot of the last row
+    int io_failed;
+    volatile long long status;  // png_util_error of the decode thread
+    util_thread thread;
+    double start;
+};
+
+// png_init_read_io() ignores short reads, so the pipeline checks fread() itself.
+static void util_pipe_read_data(png_struct *png_ptr, png_byte *data, size_t length) {
+    png_util_pipe_reader *reader = (png_util_pipe_reader *)png_get_io_ptr(png_ptr);
+    if (fread(data, 1, length, reader->fp) != length) {
+        reader->io_failed = 1;
+        png_error(png_ptr, "Read error");
+    }
+}
+
+// The decode thread. It inflates and unfilters rows into the ring.
+static void util_pipe_decode(png_util_pipe_reader *reader) {
+    if (setjmp(reader->trap.jmp)) {
+        util_atomic_add(&reader->status, reader->io_failed ? PNG_UTIL_ERROR_IO : PNG_UTIL_ERROR_LIBPNG);
+        // Rows decoded before the error still reach the consumer.
+        util_ring_close(&reader->ring, UTIL_RING_DRAIN);
+        return;
+    }
+    for (png_uint_32 y = 0; y < reader->header.height; y++) {
+        png_byte *row = util_ring_acquire(&reader->ring, UTIL_RING_PRODUCER);
+        if (!row)
+            return;  // canceled
+        png_read_row(reader->png, row, NULL);
+        util_ring_commit(&reader->ring, UTIL_RING_PRODUCER);
+    }
+    // The rest of the stream is not read, as in png_decode_region().
+}
+
+UTIL_THREAD_MAIN(util_pipe_decode_main, arg) {
+    util_pipe_decode((png_util_pipe_reader *)arg);
+    UTIL_THREAD_RETURN;
+}
+
+png_util_error png_pipe_reader_create(FILE *fp, size_t depth, png_util_header *header,
+                                      png_util_pipe_reader **reader) {
+    if (!fp || !reader)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    png_util_pipe_reader *r = (png_util_pipe_reader *)calloc(1, sizeof(png_util_pipe_reader));
+    if (!r)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    r->fp = fp;
+    r->png = util_create_read_struct(&r->trap);
+    if (!r->png) {
+        free(r);
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    }
+    r->info = png_create_info_struct(r->png);
+    volatile png_util_error result = PNG_UTIL_ERROR_LIBPNG;
+    if (!r->info || setjmp(r->trap.jmp)) {
+        err = !r->info ? PNG_UTIL_ERROR_OUT_OF_MEMORY : r->io_failed ? PNG_UTIL_ERROR_IO : result;
+        png_destroy_read_struct(&r->png, &r->info, NULL);
+        free(r);
+        return err;
+    }
+
+    png_set_read_fn(r->png, r, util_pipe_read_data);
+    png_read_info(r->png, r->info);
+    png_util_header *h = &r->header;
+    png_get_IHDR(r->png, r->info, &h->width, &h->height, &h->bit_depth, &h->color_type, &h->interlace_type,
+                 NULL, NULL);
+    // Rows of an interlaced image are only complete after the last pass.
+    result = PNG_UTIL_ERROR_UNSUPPORTED;
+    if (h->interlace_type != PNG_INTERLACE_NONE)
+        png_error(r->png, "Interlaced images are not supported");
+    result = PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    if (!util_ring_init(&r->ring, util_rowbytes(h->width, h->bit_depth, h->color_type),
+                        depth > 0 ? depth : PNG_UTIL_PIPE_DEFAULT_DEPTH))
+        png_error(r->png, "Out of memory");
+    r->start = util_now();
+    if (!util_thread_start(&r->thread, util_pipe_decode_main, r)) {
+        util_ring_destroy(&r->ring);
+        png_error(r->png, "Failed to start a thread");
+    }
+    if (header)
+        *header = r->header;
+    *reader = r;
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_pipe_reader_next(png_util_pipe_reader *reader, const png_byte **row) {
+    if (!reader || !row)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    if (reader->holding) {
+        util_ring_commit(&reader->ring, UTIL_RING_CONSUMER);
+        reader->holding = 0;
+    }
+    if (reader->taken == reader->header.height)
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    png_byte *slot = util_ring_acquire(&reader->ring, UTIL_RING_CONSUMER);
+    if (!slot)
+        return (png_util_error)util_atomic_add(&reader->status, 0);
+    reader->holding = 1;
+    reader->taken++;
+    *row = slot;
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_pipe_reader_finish(png_util_pipe_reader *reader, png_util_pipe_stats *stats) {
+    if (!reader)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    if (reader->holding)
+        util_ring_commit(&reader->ring, UTIL_RING_CONSUMER);
+    if (reader->taken < reader->header.height)
+        util_ring_close(&reader->ring, UTIL_RING_CANCEL);
+    util_thread_join(reader->thread);
+    png_util_error err = (png_util_error)util_atomic_add(&reader->status, 0);
+    if (stats)
+        util_ring_stats(&reader->ring, reader->start, stats);
+    util_ring_destroy(&reader->ring);
+    png_destroy_read_struct(&reader->png, &reader->info, NULL);
+    free(reader);
+    return err;
+}
+
+// ------ Out-of-core encoder ------
+
+#define UTIL_STREAM_WRITE_BUFFER (1U << 20)
+#define UTIL_STREAM_READAHEAD (8U << 20)
+
+// Collects libpng's small writes (chunk headers, IDAT data and CRCs) into large sequential writes.
+typedef struct util_coalescer {
+    FILE *fp;
+    png_byte *buf;
+    size_t capacity;
+    size_t pos;
+    unsigned long long written;
+    int failed;
+} util_coalescer;
+
+static int util_coalescer_flush(util_coalescer *out) {
+    if (out->pos > 0 && fwrite(out->buf, 1, out->pos, out->fp) != out->pos)
+        out->failed = 1;
+    out->written += out->pos;
+    out->pos = 0;
+    return !out->failed;
+}
+
+static void util_coalescer_write(png_struct *png_ptr, png_byte *data, size_t length) {
+    util_coalescer *out = (util_coalescer *)png_get_io_ptr(png_ptr);
+    while (length > 0) {
+        if (out->pos == out->capacity && !util_coalescer_flush(out))
+            png_error(png_ptr, "Write error");
+        size_t n = out->capacity - out->pos < length ? out->capacity - out->pos : length;
+        memcpy(out->buf + out->pos, data, n);
+        out->pos += n;
+        data += n;
+        length -= n;
+    }
+}
+
+static void util_coalescer_flush_fn(png_struct *png_ptr) {
+    (void)png_ptr;  // only full buffers are written
+}
+
+typedef struct util_row_source {
+    const png_byte *mapped;  // the first row of a mapped file
+    size_t stride;
+    size_t readahead;
+    png_util_row_source_ptr fn;
+    void *user_ptr;
+    png_byte *row;  // a row for fn
+} util_row_source;
+
+#ifndef _WIN32
+// Prefetches the next window of a mapped source and drops pages behind it,
+// so resident memory stays at about two windows however large the file is.
+static void util_advise_window(const util_row_source *src, png_uint_32 y, png_uint_32 height) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t rows = src->readahead / src->stride;
+    if (rows == 0)
+        rows = 1;
+    if (y % rows != 0)
+        return;
+    uintptr_t begin = (uintptr_t)(src->mapped + src->stride * y);
+    uintptr_t end = (uintptr_t)(src->mapped + src->stride * (y + rows < height ? y + rows : height));
+    uintptr_t aligned = begin & ~(uintptr_t)(page - 1);
+    madvise((void *)aligned, end - aligned, MADV_WILLNEED);
+    if (y >= rows) {
+        uintptr_t done = (uintptr_t)(src->mapped + src->stride * (y - rows)) & ~(uintptr_t)(page - 1);
+        if (done < aligned)
+            madvise((void *)done, aligned - done, MADV_DONTNEED);
+    }
+}
+#endif
+
+// Reserves disk space without changing the file size. It's only a hint.
+static void util_preallocate(FILE *fp, unsigned long long size) {
+#if defined(__linux__)
+    if (size > 0 && size <= (unsigned long long)PNG_SIZE_MAX)
+        fallocate(fileno(fp), FALLOC_FL_KEEP_SIZE, 0, (off_t)size);
+#else
+    (void)fp;
+    (void)size;
+#endif
+}
+
+// Frees space reserved past the end by util_preallocate().
+static void util_trim_file(FILE *fp, unsigned long long size) {
+#if defined(__linux__)
+    if (ftruncate(fileno(fp), (off_t)size) != 0)
+        return;
+#else
+    (void)fp;
+    (void)size;
+#endif
+}
+
+static png_util_error util_encode_stream(const png_util_header *header, util_row_source *src, const char *path,
+                                         const png_util_stream_options *options) {
+    png_util_error err = util_check_loaded();
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    if (!util_valid_format(header->width, header->height, header->bit_depth, header->color_type) ||
+            header->interlace_type != PNG_INTERLACE_NONE)
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    if (header->color_type == PNG_COLOR_TYPE_PALETTE)
+        return PNG_UTIL_ERROR_UNSUPPORTED;  // there is no palette to write
+    err = util_check_encode_options(options ? options->encode : NULL);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+
+    util_coalescer out;
+    memset(&out, 0, sizeof(out));
+    out.capacity = options && options->write_buffer > 0 ? options->write_buffer : UTIL_STREAM_WRITE_BUFFER;
+    out.buf = (png_byte *)malloc(out.capacity);
+    if (!src->mapped)
+        src->row = (png_byte *)malloc(util_rowbytes(header->width, header->bit_depth, header->color_type));
+    if (!out.buf || (!src->mapped && !src->row)) {
+        free(out.buf);
+        free(src->row);
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    }
+    out.fp = fopen(path, "wb");
+    if (!out.fp) {
+        free(out.buf);
+        free(src->row);
+        return PNG_UTIL_ERROR_IO;
+    }
+    setvbuf(out.fp, NULL, _IONBF, 0);  // out.buf is the buffer
+    util_preallocate(out.fp, options ? options->preallocate : 0);
+
+    util_trap trap;
+    png_struct *png = util_create_write_struct(&trap);
+    png_info *info = png ? png_create_info_struct(png) : NULL;
+    volatile png_util_error result = PNG_UTIL_ERROR_LIBPNG;
+    if (!png || !info || setjmp(trap.jmp)) {
+        err = !png || !info ? PNG_UTIL_ERROR_OUT_OF_MEMORY : out.failed ? PNG_UTIL_ERROR_IO : result;
+        png_destroy_write_struct(&png, &info);
+        fclose(out.fp);
+        remove(path);
+        free(out.buf);
+        free(src->row);
+        return err;
+    }
+
+    png_set_write_fn(png, &out, util_coalescer_write, util_coalescer_flush_fn);
+    png_set_IHDR(png, info, header->width, header->height, header->bit_depth, header->color_type,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    util_set_encode_options(png, options ? options->encode : NULL);
+    png_write_info(png, info);
+    for (png_uint_32 y = 0; y < header->height; y++) {
+        const png_byte *row = src->row;
+        if (src->mapped) {
+#ifndef _WIN32
+            util_advise_window(src, y, header->height);
+#endif
+            row = src->mapped + src->stride * y;
+        } else if (!src->fn(y, src->row, src->user_ptr)) {
+            result = PNG_UTIL_ERROR_IO;
+            png_error(png, "The row source failed");
+        }
+        png_write_row(png, row);
+    }
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+
+    int ok = util_coalescer_flush(&out);
+    if (ok && options && options->preallocate > 0)
+        util_trim_file(out.fp, out.written);
+    ok = fclose(out.fp) == 0 && ok;
+    free(out.buf);
+    free(src->row);
+    if (!ok) {
+        remove(path);
+        return PNG_UTIL_ERROR_IO;
+    }
+    return PNG_UTIL_SUCCESS;
+}
+
+png_util_error png_encode_raw_file(const char *raw_path, size_t offset, size_t row_stride,
+                                   const png_util_header *header, const char *png_path,
+                                   const png_util_stream_options *options) {
+    if (!raw_path || !header || !png_path)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    if (!util_valid_format(header->width, header->height, header->bit_depth, header->color_type))
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    size_t rowbytes = util_rowbytes(header->width, header->bit_depth, header->color_type);
+    if (row_stride == 0)
+        row_stride = rowbytes;
+    if (row_stride < rowbytes)
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    util_mapping map;
+    png_util_error err = util_map_file(raw_path, 0, &map);
+    if (err != PNG_UTIL_SUCCESS)
+        return err;
+    // The last row only needs rowbytes.
+    if (offset > map.size || map.size - offset < rowbytes ||
+            header->height - 1 > (map.size - offset - rowbytes) / row_stride) {
+        util_unmap_file(&map);
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    }
+#ifndef _WIN32
+    madvise((void *)map.data, map.size, MADV_SEQUENTIAL);
+#endif
+    util_row_source src;
+    memset(&src, 0, sizeof(src));
+    src.mapped = map.data + offset;
+    src.stride = row_stride;
+    src.readahead = options && options->readahead > 0 ? options->readahead : UTIL_STREAM_READAHEAD;
+    err = util_encode_stream(header, &src, png_path, options);
+    util_unmap_file(&map);
+    return err;
+}
+
+png_util_error png_encode_row_source(png_util_row_source_ptr fn, void *user_ptr, const png_util_header *header,
+                                     const char *png_path, const png_util_stream_options *options) {
+    if (!fn || !header || !png_path)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    util_row_source src;
+    memset(&src, 0, sizeof(src));
+    src.fn = fn;
+    src.user_ptr = user_ptr;
+    return util_encode_stream(header, &src, png_path, options);
+}
+
+// ------ Asynchronous output ------
+
+#define UTIL_ASYNC_BUFFER (1U << 20)
+
+#ifdef _WIN32
+typedef HANDLE util_out_file;
+#define UTIL_OUT_FILE_INVALID INVALID_HANDLE_VALUE
+
+static util_out_file util_out_open(const char *path) {
+    return CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+}
+
+// Writes at an offset. The file pointer is not used.
+static int util_out_pwrite(util_out_file file, const png_byte *data, size_t size, unsigned long long offset) {
+    while (size > 0) {
+        OVERLAPPED ov;
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)offset;
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD n = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+        DWORD written;
+        if (!WriteFile(file, data, n, &written, &ov) || written == 0)
+            return 0;
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return 1;
+}
+
+static void util_out_range(util_out_file file, unsigned long long offset, size_t size, int wait) {
+    (void)file;
+    (void)offset;
+    (void)size;
+    (void)wait;
+}
+
+static int util_out_sync(util_out_file file) {
+    return FlushFileBuffers(file) != 0;
+}
+
+static int util_out_close(util_out_file file) {
+    return CloseHandle(file) != 0;
+}
+#else  // _WIN32
+typedef int util_out_file;
+#define UTIL_OUT_FILE_INVALID (-1)
+
+static util_out_file util_out_open(const char *path) {
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+}
+
+// Writes at an offset. The file offset is not used.
+static int util_out_pwrite(util_out_file file, const png_byte *data, size_t size, unsigned long long offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(file, data, size, (off_t)offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        data += n;
+        size -= (size_t)n;
+        offset += (size_t)n;
+    }
+    return 1;
+}
+
+// Starts write-back of a range, or waits until it's on the disk. It's only a hint.
+static void util_out_range(util_out_file file, unsigned long long offset, size_t size, int wait) {
+#if defined(__linux__)
+    unsigned int flags = wait ? SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER
+                              : SYNC_FILE_RANGE_WRITE;
+    if (sync_file_range(file, (off_t)offset, (off_t)size, flags) != 0)
+        return;
+#else
+    (void)file;
+    (void)offset;
+    (void)size;
+    (void)wait;
+#endif
+}
+
+static int util_out_sync(util_out_file file) {
+    return fsync(file) == 0;
+}
+
+static int util_out_close(util_out_file file) {
+    return close(file) == 0;
+}
+#endif  // _WIN32
+
+struct png_util_async_sink {
+    util_out_file file;
+    int sync;
+    png_byte *bufs[2];
+    size_t capacity;
+    int fill;  // the buffer libpng writes into
+    size_t pos;
+
+    // Shared with the write thread
+    util_mutex lock;
+    util_cond cond;
+    util_thread thread;
+    size_t pending;  // bytes of bufs[fill ^ 1] to write, or 0
+    int closing;
+    volatile long long failed;  // set by the write thread, read by the encoder without the lock
+
+    // Statistics
+    unsigned long long bytes;
+    size_t writes;
+    size_t waits;
+    double wait_seconds;
+    double write_seconds;  // owned by the write thread until it's joined
+};
+
+UTIL_THREAD_MAIN(util_async_write, arg) {
+    png_util_async_sink *sink = (png_util_async_sink *)arg;
+    unsigned long long offset = 0;
+    unsigned long long last_offset = 0;
+    size_t last_size = 0;
+    util_mutex_lock(&sink->lock);
+    for (;;) {
+        while (sink->pending == 0 && !sink->closing)
+            util_cond_wait(&sink->cond, &sink->lock);
+        if (sink->pending == 0)
+            break;
+        const png_byte *data = sink->bufs[sink->fill ^ 1];
+        size_t size = sink->pending;
+        util_mutex_unlock(&sink->lock);
+
+        // Errors are kept for the encoder. Later buffers are dropped.
+        double start = util_now();
+        int failed = (int)util_atomic_load(&sink->failed);
+        if (!failed && !util_out_pwrite(sink->file, data, size, offset)) {
+            util_atomic_store(&sink->failed, 1);
+            failed = 1;
+        }
+        if (!failed && sink->sync == PNG_UTIL_SYNC_RANGE) {
+            // Keeps one buffer of dirty pages in flight.
+            util_out_range(sink->file, offset, size, 0);
+            if (last_size > 0)
+                util_out_range(sink->file, last_offset, last_size, 1);
+            last_offset = offset;
+            last_size = size;
+        }
+        sink->write_seconds += util_now() - start;
+        offset += size;
+
+        util_mutex_lock(&sink->lock);
+        sink->pending = 0;
+        util_cond_broadcast(&sink->cond);
+    }
+    util_mutex_unlock(&sink->lock);
+    UTIL_THREAD_RETURN;
+}
+
+// Hands the filled buffer to the write thread and swaps buffers.
+// With wait, it also waits until the buffer is written.
+static int util_async_submit(png_util_async_sink *sink, int wait) {
+    util_mutex_lock(&sink->lock);
+    if (sink->pending > 0) {
+        double start = util_now();
+        while (sink->pending > 0)
+            util_cond_wait(&sink->cond, &sink->lock);
+        sink->waits++;
+        sink->wait_seconds += util_now() - start;
+    }
+    if (sink->pos > 0) {
+        sink->pending = sink->pos;
+        sink->bytes += sink->pos;
+        sink->writes++;
+        sink->fill ^= 1;
+        sink->pos = 0;
+        util_cond_broadcast(&sink->cond);
+    }
+    while (wait && sink->pending > 0)
+        util_cond_wait(&sink->cond, &sink->lock);
+    util_mutex_unlock(&sink->lock);
+    return !util_atomic_load(&sink->failed);
+}
+
+static void util_async_write_data(png_struct *png_ptr, png_byte *data, size_t length) {
+    png_util_async_sink *sink = (png_util_async_sink *)png_get_io_ptr(png_ptr);
+    if (util_atomic_load(&sink->failed))
+        png_error(png_ptr, "Write error");
+    while (length > 0) {
+        if (sink->pos == sink->capacity && !util_async_submit(sink, 0))
+            png_error(png_ptr, "Write error");
+        size_t n = sink->capacity - sink->pos < length ? sink->capacity - sink->pos : length;
+        memcpy(sink->bufs[sink->fill] + sink->pos, data, n);
+        sink->pos += n;
+        data += n;
+        length -= n;
+    }
+}
+
+static void util_async_flush_data(png_struct *png_ptr) {
+    png_util_async_sink *sink = (png_util_async_sink *)png_get_io_ptr(png_ptr);
+    if (!util_async_submit(sink, 1))
+        png_error(png_ptr, "Write error");
+}
+
+static void util_async_destroy(png_util_async_sink *sink) {
+    util_cond_destroy(&sink->cond);
+    util_mutex_destroy(&sink->lock);
+    free(sink->bufs[0]);
+    free(sink);
+}
+
+png_util_error png_async_sink_open(const char *path, size_t buffer_size, int sync, png_util_async_sink **sink) {
+    if (!path || !sink)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    *sink = NULL;
+    if (sync < PNG_UTIL_SYNC_NONE || sync > PNG_UTIL_SYNC_RANGE || buffer_size > PNG_SIZE_MAX / 2)
+        return PNG_UTIL_ERROR_INVALID_ARGUMENT;
+    png_util_async_sink *s = (png_util_async_sink *)calloc(1, sizeof(png_util_async_sink));
+    if (!s)
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    s->sync = sync;
+    s->capacity = buffer_size > 0 ? buffer_size : UTIL_ASYNC_BUFFER;
+    s->bufs[0] = (png_byte *)malloc(s->capacity * 2);
+    if (!s->bufs[0]) {
+        free(s);
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    }
+    s->bufs[1] = s->bufs[0] + s->capacity;
+    util_mutex_init(&s->lock);
+    util_cond_init(&s->cond);
+    s->file = util_out_open(path);
+    if (s->file == UTIL_OUT_FILE_INVALID) {
+        util_async_destroy(s);
+        return PNG_UTIL_ERROR_IO;
+    }
+    if (!util_thread_start(&s->thread, util_async_write, s)) {
+        util_out_close(s->file);
+        remove(path);
+        util_async_destroy(s);
+        return PNG_UTIL_ERROR_OUT_OF_MEMORY;
+    }
+    *sink = s;
+    return PNG_UTIL_SUCCESS;
+}
+
+void png_async_sink_attach(png_util_async_sink *sink, png_struct *png_ptr) {
+    if (!sink || !png_ptr || util_check_loaded() != PNG_UTIL_SUCCESS)
+        return;
+    png_set_write_fn(png_ptr, sink, util_async_write_data, util_async_flush_data);
+}
+
+png_util_error png_async_sink_close(png_util_async_sink *sink, png_util_async_sink_stats *stats) {
+    if (!sink)
+        return PNG_UTIL_ERROR_NULL_REFERENCE;
+    util_async_submit(sink, 0);
+    util_mutex_lock(&sink->lock);
+    sink->closing = 1;
+    util_cond_broadcast(&sink->cond);
+    util_mutex_unlock(&sink->lock);
+    util_thread_join(sink->thread);
+
+    int ok = !util_atomic_load(&sink->failed);
+    if (ok && sink->sync != PNG_UTIL_SYNC_NONE) {
+        double start = util_now();
+        ok = util_out_sync(sink->file);
+        sink->write_seconds += util_now() - start;
+    }
+    ok = util_out_close(sink->file) && ok;
+    if (stats) {
+        stats->bytes = sink->bytes;
+        stats->writes = sink->writes;
+        stats->waits = sink->waits;
+        stats->wait_seconds = sink->wait_seconds;
+        stats->write_seconds = sink->write_seconds;
+    }
+    util_async_destroy(sink);
+    return ok ? PNG_UTIL_SUCCESS : PNG_UTIL_ERROR_IO;
+}
@@ -0,0 +1,1497 @@
+#ifndef LIBPNG_LOADER_UTILS_H
+#define LIBPNG_LOADER_UTILS_H
+
+/**
+ * Optional helpers built on top of libpng-loader.
+ *
+ * All functions in this file use the `png_*` function pointers,
+ * so libpng must be loaded with `libpng_load()` before calling them.
+ * Some helpers also need zlib. zlib is resolved at runtime
+ * (the same library libpng depends on) and the helpers fall back
+ * or return `PNG_UTIL_ERROR_UNSUPPORTED` when it is not available.
+ *
+ * This file is licensed under the MIT License. See ./LICENSE for details.
+ */
+
+#include "libpng-loader.h"
+
+/**
+ * Error code for `png_*` utility functions.
+ *
+ * @enum png_util_error
+ */
+typedef unsigned int png_util_error;
+enum {
+    PNG_UTIL_SUCCESS = 0,
+    PNG_UTIL_ERROR_NOT_LOADED,  //!< libpng is not loaded.
+    PNG_UTIL_ERROR_NULL_REFERENCE,  //!< a required pointer was NULL.
+    PNG_UTIL_ERROR_INVALID_ARGUMENT,  //!< an argument is out of range.
+    PNG_UTIL_ERROR_OUT_OF_MEMORY,  //!< failed to allocate memory.
+    PNG_UTIL_ERROR_INVALID_PNG,  //!< the input is not a valid PNG stream.
+    PNG_UTIL_ERROR_UNSUPPORTED,  //!< the image or the runtime does not support the operation.
+    PNG_UTIL_ERROR_LIBPNG,  //!< libpng reported an error.
+    PNG_UTIL_ERROR_IO,  //!< failed to read or write a file.
+    PNG_UTIL_ERROR_MAX
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * An image in libpng's raw row format (no transforms applied).
+ * Rows are packed for bit depths below 8 and big-endian for 16-bit images.
+ */
+typedef struct png_util_image {
+    png_uint_32 width;
+    png_uint_32 height;
+    int bit_depth;  //!< 1, 2, 4, 8 or 16.
+    int color_type;  //!< PNG_COLOR_TYPE_*
+    size_t row_stride;  //!< Distance in bytes between the starts of two rows.
+    png_byte *pixels;  //!< The first row.
+} png_util_image;
+
+/**
+ * Free pixels allocated by a `png_*` utility function and clear the struct.
+ *
+ * @param image An image returned by a decoder. NULL is ignored.
+ */
+void png_util_image_free(png_util_image *image);
+
+/**
+ * A callback to set extra chunks (PLTE, tRNS, text, ...) before `png_write_info()`.
+ * It must not enable transforms because the utilities write raw rows.
+ */
+typedef void (*png_util_setup_ptr)(png_struct *png_ptr, png_info *info_ptr, void *user_ptr);
+
+// ------ Parallel-decodable profile ------
+
+/**
+ * Name of the private ancillary chunk that indexes restart points.
+ * It is unsafe-to-copy, so editors that rewrite IDAT drop it.
+ *
+ * The chunk data is big-endian:
+ *   - version (1 byte, currently 1), reserved (3 bytes, zero)
+ *   - segment count (4 bytes)
+ *   - per segment: first row, offset of the segment in the zlib stream,
+ *     compressed size, and Adler-32 of its filtered rows (4 bytes each)
+ */
+#define PNG_UTIL_PARALLEL_CHUNK "rsTR"
+
+/**
+ * Options for `png_write_parallel()`. Zero-initialize it to use defaults.
+ */
+typedef struct png_util_parallel_options {
+    png_uint_32 rows_per_segment;  //!< Rows between restart points. 0 picks about 256 KiB of pixels.
+    int compression_level;  //!< zlib level (1-9). 0 uses zlib's default.
+    int threads;  //!< Worker threads. 0 uses all processors.
+    png_util_setup_ptr setup_fn;  //!< Optional callback to add chunks such as PLTE.
+    void *setup_ptr;  //!< Passed to setup_fn.
+} png_util_parallel_options;
+
+/**
+ * Write a non-interlaced PNG whose image data can be decoded in parallel.
+ *
+ * Each segment of rows is compressed independently and ends with a full flush,
+ * and its first row uses filter None. The restart points are indexed in
+ * a `PNG_UTIL_PARALLEL_CHUNK` chunk. The file stays valid for other readers.
+ * Segments are compressed in parallel.
+ *
+ * @note: Requires zlib. Returns `PNG_UTIL_ERROR_UNSUPPORTED` if it is missing.
+ *
+ * @param fp A file opened in binary write mode.
+ * @param image The image to write.
+ * @param options Encoder options. NULL uses defaults.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_write_parallel(FILE *fp, const png_util_image *image,
+                                  const png_util_parallel_options *options);
+
+/**
+ * Decode a PNG in memory (e.g. a mapped file) into raw rows.
+ *
+ * Segments indexed by a `PNG_UTIL_PARALLEL_CHUNK` chunk are inflated and unfiltered
+ * in parallel. Images without the chunk (or with a broken one) are decoded with
+ * the serial libpng path, and interlaced images are deinterlaced.
+ *
+ * @param data PNG bytes.
+ * @param size Size of data.
+ * @param threads Worker threads. 0 uses all processors.
+ * @param image Receives the image. Free it with `png_util_image_free()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_read_parallel(const void *data, size_t size, int threads,
+                                 png_util_image *image);
+
+// ------ Header probe ------
+
+/**
+ * Fields of the IHDR chunk.
+ */
+typedef struct png_util_header {
+    png_uint_32 width;
+    png_uint_32 height;
+    int bit_depth;
+    int color_type;  //!< PNG_COLOR_TYPE_*
+    int interlace_type;  //!< PNG_INTERLACE_NONE or PNG_INTERLACE_ADAM7
+} png_util_header;
+
+/**
+ * The number of bytes `png_probe_header()` needs (signature and IHDR chunk).
+ */
+#define PNG_UTIL_PROBE_SIZE 33
+
+/**
+ * Parse IHDR without creating a png_struct.
+ * Only the signature and the first chunk are read, and the CRC of IHDR is checked.
+ *
+ * @note: This function does not call libpng, so libpng doesn't have to be loaded.
+ *
+ * @param data The beginning of a PNG (e.g. a mapped file). Only `PNG_UTIL_PROBE_SIZE` bytes are read.
+ * @param size Size of data.
+ * @param header Receives the IHDR fields.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_INVALID_PNG` if the header is broken.
+ */
+png_util_error png_probe_header(const void *data, size_t size, png_util_header *header);
+
+/**
+ * `png_probe_header()` for a file. Reads `PNG_UTIL_PROBE_SIZE` bytes.
+ *
+ * @param path A file path.
+ * @param header Receives the IHDR fields.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_probe_header_file(const char *path, png_util_header *header);
+
+/**
+ * `png_probe_header_file()` for many files. Files are probed on multiple threads
+ * to keep the disk busy.
+ *
+ * @param paths File paths.
+ * @param count The number of paths.
+ * @param threads Worker threads. 0 uses all processors.
+ * @param headers Receives the IHDR fields of each file.
+ * @param errors Receives the result of each file.
+ * @returns `PNG_UTIL_SUCCESS` if all files were probed, the first error otherwise.
+ */
+png_util_error png_probe_headers(const char *const *paths, size_t count, int threads,
+                                 png_util_header *headers, png_util_error *errors);
+
+// ------ Metadata scan ------
+
+/**
+ * Metadata found before the first IDAT chunk.
+ * `valid` tells which fields are set, using `PNG_INFO_*` flags
+ * (`PNG_INFO_iCCP`, `PNG_INFO_eXIf`, `PNG_INFO_cICP`, `PNG_INFO_cLLI`,
+ * `PNG_INFO_mDCV`, `PNG_INFO_pHYs` and `PNG_INFO_tIME`).
+ * Values are stored as they are encoded in the chunks.
+ */
+typedef struct png_util_metadata {
+    png_util_header header;
+    png_uint_32 valid;  //!< PNG_INFO_* flags
+    png_text *text;  //!< tEXt, zTXt and iTXt chunks (decompressed).
+    int num_text;
+    png_char *iccp_name;
+    png_byte *iccp_profile;  //!< Decompressed ICC profile.
+    png_uint_32 iccp_size;
+    png_byte *exif;
+    png_uint_32 exif_size;
+    png_byte cicp[4];  //!< Colour primaries, transfer function, matrix coefficients, full range flag.
+    png_uint_32 clli_max_cll;  //!< In 0.0001 cd/m2.
+    png_uint_32 clli_max_fall;  //!< In 0.0001 cd/m2.
+    png_uint_16 mdcv_chromaticities[8];  //!< Red, green, blue and white point (x, y) in 0.00002 units.
+    png_uint_32 mdcv_max_luminance;  //!< In 0.0001 cd/m2.
+    png_uint_32 mdcv_min_luminance;  //!< In 0.0001 cd/m2.
+    png_uint_32 phys_x;
+    png_uint_32 phys_y;
+    int phys_unit;  //!< PNG_RESOLUTION_*
+    png_time time;
+} png_util_metadata;
+
+/**
+ * Free memory owned by a `png_util_metadata` and clear the struct.
+ *
+ * @param meta Metadata returned by `png_read_metadata()`. NULL is ignored.
+ */
+void png_util_metadata_free(png_util_metadata *meta);
+
+/**
+ * Read metadata chunks without decoding the image.
+ *
+ * libpng stops at the first IDAT chunk, so no image data is read or inflated.
+ * Chunks after the image data (e.g. text written by `png_write_end()`) are not reported.
+ * cICP, cLLI, mDCV and eXIf are parsed from the raw chunks, so they are available
+ * even when `png_get_cICP()` and friends are NULL in the loaded libpng.
+ *
+ * @param data PNG bytes. Only the bytes before the first IDAT chunk are read.
+ * @param size Size of data.
+ * @param meta Receives the metadata. Free it with `png_util_metadata_free()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_read_metadata(const void *data, size_t size, png_util_metadata *meta);
+
+/**
+ * `png_read_metadata()` for a file. The file is read only up to the first IDAT chunk.
+ *
+ * @param path A file path.
+ * @param meta Receives the metadata. Free it with `png_util_metadata_free()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_read_metadata_file(const char *path, png_util_metadata *meta);
+
+/**
+ * `png_read_metadata_file()` for many files on multiple threads.
+ *
+ * @param paths File paths.
+ * @param count The number of paths.
+ * @param threads Worker threads. 0 uses all processors.
+ * @param metas Receives the metadata of each file. Free each of them with `png_util_metadata_free()`.
+ * @param errors Receives the result of each file.
+ * @returns `PNG_UTIL_SUCCESS` if all files were read, the first error otherwise.
+ */
+png_util_error png_read_metadata_files(const char *const *paths, size_t count, int threads,
+                                       png_util_metadata *metas, png_util_error *errors);
+
+// ------ Region decode ------
+
+/**
+ * Statistics of `png_decode_region()`.
+ * Compare them with the image height and the input size to see the saving
+ * against a full decode.
+ */
+typedef struct png_util_region_stats {
+    double seconds;  //!< Wall time of the decode.
+    png_uint_32 rows_decoded;  //!< Rows inflated and unfiltered (the last requested row + 1).
+    png_uint_32 image_height;
+    size_t bytes_read;  //!< Input bytes consumed. The rest of the stream is never read.
+} png_util_region_stats;
+
+/**
+ * Decode a rectangle of a non-interlaced PNG in memory into raw rows.
+ *
+ * Rows above the rectangle are decoded without being copied,
+ * only the requested columns are copied, and decoding stops after the last
+ * requested row. IDAT data after that row is not inflated and IEND is not read,
+ * so CRC errors there are not detected.
+ *
+ * @param data PNG bytes.
+ * @param size Size of data.
+ * @param x The first column.
+ * @param y The first row.
+ * @param width The number of columns.
+ * @param height The number of rows.
+ * @param image Receives the rectangle. Free it with `png_util_image_free()`.
+ * @param stats Receives statistics. Can be NULL.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_INVALID_ARGUMENT` if the rectangle
+ *          is out of the image, `PNG_UTIL_ERROR_UNSUPPORTED` for interlaced images,
+ *          `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_decode_region(const void *data, size_t size,
+                                 png_uint_32 x, png_uint_32 y, png_uint_32 width, png_uint_32 height,
+                                 png_util_image *image, png_util_region_stats *stats);
+
+// ------ Thumbnails ------
+
+#define PNG_UTIL_THUMBNAIL_BOX 0  //!< Average of the covered pixels.
+#define PNG_UTIL_THUMBNAIL_BILINEAR 1  //!< Bilinear interpolation of the nearest pixels.
+
+/**
+ * Decode a PNG in memory into a small 8-bit RGBA image.
+ *
+ * Each decoded row is reduced into the thumbnail as it arrives, so only one source row
+ * and the thumbnail are kept in memory. For interlaced images, decoding stops after
+ * the first Adam7 passes that have enough pixels (1/8, 1/4 or 1/2 of the size),
+ * and those pixels are kept until they are reduced. Passes 5 and 6 are never read,
+ * so at most a quarter of the pixels are kept, and thumbnails larger than half the
+ * image are scaled up from them.
+ *
+ * @param data PNG bytes.
+ * @param size Size of data.
+ * @param width Thumbnail width. 0 keeps the aspect ratio. Clamped to the image width.
+ * @param height Thumbnail height. 0 keeps the aspect ratio. Clamped to the image height.
+ * @param filter `PNG_UTIL_THUMBNAIL_BOX` or `PNG_UTIL_THUMBNAIL_BILINEAR`.
+ * @param thumbnail Receives an 8-bit RGBA image. Free it with `png_util_image_free()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_decode_thumbnail(const void *data, size_t size,
+                                    png_uint_32 width, png_uint_32 height, int filter,
+                                    png_util_image *thumbnail);
+
+// ------ Progressive preview ------
+
+/**
+ * A streaming decoder that keeps an 8-bit RGBA preview of the image.
+ */
+typedef struct png_util_preview_decoder png_util_preview_decoder;
+
+/**
+ * Called when a pass is complete.
+ * The pixels of each Adam7 pass are replicated into the blocks that later passes fill,
+ * so the surface is a full-size preview (1/64 of the pixels after pass 0).
+ *
+ * @param surface The preview. It is valid until the decoder is destroyed.
+ * @param pass The completed pass (0-6). It is 6 when the image is complete,
+ *             even if the last passes are empty. Non-interlaced images report only pass 6.
+ * @param user_ptr The pointer passed to `png_preview_decoder_create()`.
+ */
+typedef void (*png_util_preview_ptr)(const png_util_image *surface, int pass, void *user_ptr);
+
+/**
+ * Create a progressive decoder with libpng's push reader.
+ *
+ * @param preview_fn Called after each pass. Can be NULL.
+ * @param user_ptr Passed to preview_fn.
+ * @param decoder Receives the decoder. Destroy it with `png_preview_decoder_destroy()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_preview_decoder_create(png_util_preview_ptr preview_fn, void *user_ptr,
+                                          png_util_preview_decoder **decoder);
+
+/**
+ * Feed bytes as they arrive. `preview_fn` is called from this function.
+ *
+ * @param decoder A decoder.
+ * @param data The next bytes of the PNG.
+ * @param size Size of data.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ *          After an error, the decoder keeps returning it.
+ */
+png_util_error png_preview_decoder_feed(png_util_preview_decoder *decoder,
+                                        const void *data, size_t size);
+
+/**
+ * Get the preview surface.
+ *
+ * @param decoder A decoder.
+ * @returns The surface, or NULL if the header has not arrived yet.
+ */
+const png_util_image *png_preview_decoder_surface(const png_util_preview_decoder *decoder);
+
+/**
+ * Destroy a decoder and its surface.
+ *
+ * @param decoder A decoder. NULL is ignored.
+ */
+void png_preview_decoder_destroy(png_util_preview_decoder *decoder);
+
+// ------ Pixel kernels ------
+
+/**
+ * CPU features used by the pixel kernels.
+ *
+ * @enum png_util_cpu_flags
+ */
+typedef unsigned int png_util_cpu_flags;
+enum {
+    PNG_UTIL_CPU_SSE2 = 1 << 0,
+    PNG_UTIL_CPU_AVX2 = 1 << 1,
+    PNG_UTIL_CPU_NEON = 1 << 2,
+    PNG_UTIL_CPU_F16C = 1 << 3,
+    PNG_UTIL_CPU_PCLMUL = 1 << 4  //!< PCLMULQDQ and SSE4.1
+};
+
+/**
+ * Get the CPU features that the pixel kernels use.
+ * They are detected once with CPUID (NEON is always available on AArch64).
+ *
+ * @returns Detected features, filtered by `png_util_set_cpu_mask()`.
+ */
+png_util_cpu_flags png_util_cpu_features(void);
+
+/**
+ * Restrict the CPU features that the pixel kernels may use.
+ * 0 selects the scalar kernels. The default is all features.
+ *
+ * @param mask Allowed features.
+ */
+void png_util_set_cpu_mask(png_util_cpu_flags mask);
+
+/**
+ * Pixel kernels. They convert `count` pixels from `src` to `dst`.
+ * `png_decode_into()` runs them on each row as it comes out of libpng.
+ * `src` and `dst` may be the same buffer when the pixel size doesn't change.
+ */
+void png_util_rgb_to_rgba8(const png_byte *src, png_byte *dst, size_t count);
+void png_util_rgba_to_rgb8(const png_byte *src, png_byte *dst, size_t count);
+void png_util_swap_rb8(const png_byte *src, png_byte *dst, size_t count);  //!< RGBA <-> BGRA
+void png_util_gray_to_rgba8(const png_byte *src, png_byte *dst, size_t count);
+void png_util_premultiply8(const png_byte *src, png_byte *dst, size_t count);
+void png_util_unpremultiply8(const png_byte *src, png_byte *dst, size_t count);
+
+/**
+ * Convert big-endian 16-bit samples (as stored in PNG) to 8 bits.
+ * The rounding matches `png_set_scale_16()`. `dst` may be `src`.
+ *
+ * @param count The number of samples.
+ */
+void png_util_16_to_8(const png_byte *src, png_byte *dst, size_t count);
+
+/**
+ * Convert 8-bit samples to native-endian 16-bit samples (v * 257).
+ *
+ * @param count The number of samples.
+ */
+void png_util_8_to_16(const png_byte *src, png_uint_16 *dst, size_t count);
+
+/**
+ * CRC-32 as used by PNG chunks. It uses PCLMULQDQ when available.
+ *
+ * @param crc 0, or the result for the preceding data.
+ * @returns The CRC of the data.
+ */
+png_uint_32 png_util_crc32(png_uint_32 crc, const png_byte *data, size_t size);
+
+/**
+ * Adler-32 as used by zlib streams. It uses AVX2 when available.
+ *
+ * @param adler 1, or the result for the preceding data.
+ * @returns The Adler-32 of the data.
+ */
+png_uint_32 png_util_adler32(png_uint_32 adler, const png_byte *data, size_t size);
+
+// ------ Strided destinations ------
+
+/**
+ * Pixel formats of decoded images. 16-bit formats are native-endian.
+ * Premultiplied formats store colors multiplied by alpha.
+ * Float formats are linearized with the transfer function of cICP, sRGB or gAMA (in that order).
+ * Untagged images are assumed to be sRGB.
+ *
+ * @enum png_util_format
+ */
+typedef unsigned int png_util_format;
+enum {
+    PNG_UTIL_FORMAT_GRAY8 = 0,
+    PNG_UTIL_FORMAT_GRAY_ALPHA8,
+    PNG_UTIL_FORMAT_RGB8,
+    PNG_UTIL_FORMAT_BGR8,
+    PNG_UTIL_FORMAT_RGBA8,
+    PNG_UTIL_FORMAT_BGRA8,
+    PNG_UTIL_FORMAT_GRAY16,
+    PNG_UTIL_FORMAT_RGBA16,
+    PNG_UTIL_FORMAT_RGBA8_PREMULTIPLIED,
+    PNG_UTIL_FORMAT_BGRA8_PREMULTIPLIED,
+    PNG_UTIL_FORMAT_RGBA32F,  //!< Linear-light float RGBA.
+    PNG_UTIL_FORMAT_RGBA16F,  //!< Linear-light half-float RGBA.
+    PNG_UTIL_FORMAT_MAX
+};
+
+/**
+ * Default row alignment in bytes, suitable for SIMD loads.
+ */
+#define PNG_UTIL_ROW_ALIGNMENT 64
+
+/**
+ * A caller-owned destination for decoded pixels.
+ */
+typedef struct png_util_dest {
+    void *pixels;  //!< The first row. Must be aligned to `alignment`.
+    size_t row_stride;  //!< Bytes between rows. Must be a multiple of `alignment`.
+    size_t size;  //!< Bytes available from `pixels`.
+    png_uint_32 width;  //!< Must match the image.
+    png_uint_32 height;  //!< Must match the image.
+    png_util_format format;
+    size_t alignment;  //!< A power of two. 0 uses `PNG_UTIL_ROW_ALIGNMENT`.
+} png_util_dest;
+
+/**
+ * Get the size of a pixel in bytes.
+ *
+ * @param format A pixel format.
+ * @returns The size of a pixel, or 0 for an unknown format.
+ */
+size_t png_util_format_size(png_util_format format);
+
+/**
+ * Compute the row stride and the buffer size for `png_decode_into()`.
+ * Use `png_probe_header()` to get the image size.
+ *
+ * @param width Image width.
+ * @param height Image height.
+ * @param format Pixel format.
+ * @param alignment Row alignment (a power of two). 0 uses `PNG_UTIL_ROW_ALIGNMENT`.
+ * @param row_stride Receives the row stride (row bytes rounded up to the alignment).
+ * @param size Receives the buffer size.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_dest_layout(png_uint_32 width, png_uint_32 height, png_util_format format,
+                               size_t alignment, size_t *row_stride, size_t *size);
+
+/**
+ * Decode a PNG in memory straight into a caller-provided buffer.
+ *
+ * libpng transforms convert the image to `dest->format`, and each final row is written
+ * to its place in the buffer, so no intermediate image or row pointers are allocated.
+ * Alpha is dropped (not composited) for formats without alpha,
+ * and color is converted to gray with the default weights for gray formats.
+ * Padding bytes at the end of each row are set to zero.
+ *
+ * @param data PNG bytes.
+ * @param size Size of data.
+ * @param dest The destination.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_INVALID_ARGUMENT` if the descriptor
+ *          is not aligned, too small, or doesn't match the image, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_decode_into(const void *data, size_t size, const png_util_dest *dest);
+
+// ------ Indexed images ------
+
+/**
+ * Palette indices and the colors they refer to.
+ * Free it with `png_util_image_free(&image->indices)`.
+ */
+typedef struct png_util_indexed_image {
+    png_util_image indices;  //!< One 8-bit index per pixel (PNG_COLOR_TYPE_PALETTE).
+    png_byte palette[256 * 4];  //!< RGBA8 colors with tRNS applied. Missing entries are opaque black.
+    int num_palette;  //!< The number of PLTE entries.
+} png_util_indexed_image;
+
+/**
+ * Decode an indexed-color PNG in memory into palette indices and an RGBA palette,
+ * e.g. to expand them on the GPU.
+ *
+ * @param data PNG data.
+ * @param size Size of PNG data.
+ * @param image Receives the indices and the palette.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_UNSUPPORTED` for other color types,
+ *          `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_decode_indexed(const void *data, size_t size, png_util_indexed_image *image);
+
+/**
+ * Get statistics of the palette cache.
+ * `png_decode_into()` and `png_decode_indexed()` build a lookup table for each palette,
+ * and reuse it for images that share the same palette.
+ *
+ * @param hits Receives the number of palettes found in the cache. Can be NULL.
+ * @param misses Receives the number of tables built. Can be NULL.
+ */
+void png_util_palette_cache_stats(size_t *hits, size_t *misses);
+
+// ------ Linear light ------
+
+/**
+ * Get statistics of the transfer function cache.
+ * `png_decode_into()` builds lookup tables for each transfer function when decoding to float formats,
+ * and reuses them for other images.
+ *
+ * @param hits Receives the number of tables found in the cache. Can be NULL.
+ * @param misses Receives the number of tables built. Can be NULL.
+ */
+void png_util_transfer_cache_stats(size_t *hits, size_t *misses);
+
+// ------ Tensors ------
+
+/**
+ * How `png_decode_tensor()` fits an image into the tensor.
+ */
+#define PNG_UTIL_TENSOR_EXACT 0  //!< The image must have the size of the tensor.
+#define PNG_UTIL_TENSOR_CENTER_CROP 1  //!< Crops the center without scaling. Edges are repeated for small images.
+#define PNG_UTIL_TENSOR_RESIZE 2  //!< Stretches the image with a bilinear filter.
+#define PNG_UTIL_TENSOR_RESIZE_CROP 3  //!< Scales the image to cover the tensor, then crops the center.
+
+/**
+ * Layout and normalization of a planar float tensor (CHW).
+ */
+typedef struct png_util_tensor_options {
+    int channels;  //!< 1 (gray), 3 (RGB) or 4 (RGBA).
+    png_uint_32 width;  //!< W of the tensor.
+    png_uint_32 height;  //!< H of the tensor.
+    int fit;  //!< PNG_UTIL_TENSOR_*
+    float mean[4];  //!< Subtracted from values in [0, 1].
+    float std[4];  //!< Divides the values after `mean`. 0 is treated as 1.
+} png_util_tensor_options;
+
+/**
+ * Decode a PNG in memory into a planar float tensor (channels x height x width).
+ * Each row is normalized and scattered into the channel planes as it is decoded,
+ * and decoding stops after the last row the tensor needs.
+ * Samples are converted to 8 bits first.
+ *
+ * @param data PNG data.
+ * @param size Size of PNG data.
+ * @param options Tensor layout and normalization.
+ * @param tensor Receives `channels * height * width` floats.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_decode_tensor(const void *data, size_t size, const png_util_tensor_options *options,
+                                 float *tensor);
+
+/**
+ * Decode PNGs into a batch tensor (N x C x H x W) on multiple threads.
+ *
+ * @param data PNG data of each image.
+ * @param sizes Size of each PNG.
+ * @param count The number of images (N).
+ * @param threads Worker threads. 0 uses all processors.
+ * @param options Tensor layout and normalization of each image.
+ * @param tensors Receives `count * channels * height * width` floats.
+ * @param errors Receives the result of each image.
+ * @returns `PNG_UTIL_SUCCESS` if all images were decoded, the first error otherwise.
+ */
+png_util_error png_decode_tensors(const void *const *data, const size_t *sizes, size_t count, int threads,
+                                  const png_util_tensor_options *options, float *tensors,
+                                  png_util_error *errors);
+
+// ------ Pixel digests ------
+
+#define PNG_UTIL_DIGEST_SIZE 8
+
+/**
+ * A 64-bit XXH64 digest of decoded pixels, stored big-endian.
+ * It covers the image size, the pixel format and the packed rows,
+ * so it doesn't depend on the row stride or on how the PNG was encoded.
+ * 16-bit and float formats are hashed in native byte order.
+ * XXH64 is not cryptographic. Compare pixels on a match if collisions matter.
+ */
+typedef struct png_util_digest {
+    png_byte bytes[PNG_UTIL_DIGEST_SIZE];
+} png_util_digest;
+
+/**
+ * `png_decode_into()` that also hashes each row as it is written.
+ *
+ * @param data PNG data.
+ * @param size Size of PNG data.
+ * @param dest Destination buffer.
+ * @param digest Receives the digest of the pixels. Can be NULL.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_decode_into_digest(const void *data, size_t size, const png_util_dest *dest,
+                                      png_util_digest *digest);
+
+/**
+ * Compute the pixel digest of a PNG in memory without keeping the image.
+ * Non-interlaced images are hashed one row at a time.
+ * The digest is the same as `png_decode_into_digest()` with the same format.
+ *
+ * @param data PNG data.
+ * @param size Size of PNG data.
+ * @param format Pixel format the rows are converted to before hashing.
+ * @param digest Receives the digest.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_hash_pixels(const void *data, size_t size, png_util_format format, png_util_digest *digest);
+
+// ------ Decoded image cache ------
+
+/**
+ * An in-process cache of decoded images with a byte budget.
+ * Lookups lock one of 16 shards, so threads rarely wait for each other.
+ * All functions are thread-safe.
+ */
+typedef struct png_util_image_cache png_util_image_cache;
+
+/**
+ * A decoded image owned by a cache. It is immutable and reference-counted.
+ * It stays valid after it is evicted or the cache is destroyed,
+ * until it is released with `png_image_cache_release()`.
+ */
+typedef struct png_util_cached_image {
+    png_uint_32 width;
+    png_uint_32 height;
+    png_util_format format;
+    size_t row_stride;  //!< Rows are 64-byte aligned.
+    size_t size;
+    const png_byte *pixels;
+} png_util_cached_image;
+
+typedef struct png_util_image_cache_stats {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;
+    size_t bytes;  //!< Bytes charged to the budget, including headers and padding.
+} png_util_image_cache_stats;
+
+/**
+ * Create a cache. Least recently used images are evicted when the budget is exceeded.
+ * Images larger than the budget are decoded but not cached.
+ *
+ * @param budget Maximum bytes of cached images.
+ * @param cache Receives the cache. Destroy it with `png_image_cache_destroy()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_image_cache_create(size_t budget, png_util_image_cache **cache);
+
+/**
+ * Decode a PNG in memory, or return the cached image.
+ * The key is the XXH64 hash of the PNG data, its size and the format.
+ * XXH64 is not cryptographic, so don't use this for untrusted data that could collide on purpose.
+ *
+ * @param cache The cache.
+ * @param data PNG data.
+ * @param size Size of PNG data.
+ * @param format Pixel format of the image.
+ * @param image Receives the image. Release it with `png_image_cache_release()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_image_cache_decode(png_util_image_cache *cache, const void *data, size_t size,
+                                      png_util_format format, const png_util_cached_image **image);
+
+/**
+ * Decode a PNG file, or return the cached image.
+ * The key is the path, the device and inode, the modification time, the file size and the format,
+ * so a cache hit costs one `stat()` and never reads the file.
+ *
+ * @param cache The cache.
+ * @param path Path to a PNG file.
+ * @param format Pixel format of the image.
+ * @param image Receives the image. Release it with `png_image_cache_release()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_image_cache_decode_file(png_util_image_cache *cache, const char *path,
+                                           png_util_format format, const png_util_cached_image **image);
+
+/**
+ * Release an image returned by the cache.
+ *
+ * @param image The image. Can be NULL.
+ */
+void png_image_cache_release(const png_util_cached_image *image);
+
+/**
+ * Get the statistics of a cache.
+ *
+ * @param cache The cache.
+ * @param stats Receives the statistics.
+ */
+void png_image_cache_stats(png_util_image_cache *cache, png_util_image_cache_stats *stats);
+
+/**
+ * Destroy a cache. Images that are not released yet stay valid.
+ *
+ * @param cache The cache. Can be NULL.
+ */
+void png_image_cache_destroy(png_util_image_cache *cache);
+
+// ------ Disk cache ------
+
+/**
+ * A directory of decoded images, e.g. a second tier behind `png_util_image_cache`.
+ * Entries are raw pixels with a small header (size, format and source identity).
+ * Hits map the entry into memory instead of decoding the PNG.
+ * All functions are thread-safe, and several processes can share a directory.
+ */
+typedef struct png_util_disk_cache png_util_disk_cache;
+
+typedef struct png_util_disk_cache_stats {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    unsigned long long bytes;  //!< Bytes of entries in the directory.
+} png_util_disk_cache_stats;
+
+/**
+ * Open a disk cache. The directory is created if it doesn't exist.
+ * Least recently used entries are deleted when the directory exceeds the budget, down to 90% of it.
+ * Temporary files left by writers that crashed are deleted.
+ *
+ * @param dir Directory of the entries.
+ * @param budget Maximum bytes of entries.
+ * @param cache Receives the cache. Close it with `png_disk_cache_close()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_disk_cache_open(const char *dir, unsigned long long budget, png_util_disk_cache **cache);
+
+/**
+ * Map the cached pixels of a PNG in memory, or decode it and write a new entry.
+ * The key is the same as `png_image_cache_decode()`.
+ *
+ * @param cache The cache.
+ * @param data PNG data.
+ * @param size Size of PNG data.
+ * @param format Pixel format of the image.
+ * @param image Receives the image. Release it with `png_disk_cache_release()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_disk_cache_decode(png_util_disk_cache *cache, const void *data, size_t size,
+                                     png_util_format format, const png_util_cached_image **image);
+
+/**
+ * Map the cached pixels of a PNG file, or decode it and write a new entry.
+ * The key is the same as `png_image_cache_decode_file()`.
+ *
+ * @param cache The cache.
+ * @param path Path to a PNG file.
+ * @param format Pixel format of the image.
+ * @param image Receives the image. Release it with `png_disk_cache_release()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_disk_cache_decode_file(png_util_disk_cache *cache, const char *path,
+                                          png_util_format format, const png_util_cached_image **image);
+
+/**
+ * Unmap an image returned by a disk cache.
+ *
+ * @param image The image. Can be NULL.
+ */
+void png_disk_cache_release(const png_util_cached_image *image);
+
+/**
+ * Get the statistics of a disk cache.
+ *
+ * @param cache The cache.
+ * @param stats Receives the statistics.
+ */
+void png_disk_cache_stats(png_util_disk_cache *cache, png_util_disk_cache_stats *stats);
+
+/**
+ * Close a disk cache. The entries stay in the directory, and mapped images stay valid.
+ *
+ * @param cache The cache. Can be NULL.
+ */
+void png_disk_cache_close(png_util_disk_cache *cache);
+
+// ------ Encoder ------
+
+/**
+ * Bytes allocated by a `png_*` utility function.
+ */
+typedef struct png_util_buffer {
+    png_byte *data;
+    size_t size;
+} png_util_buffer;
+
+/**
+ * Free a buffer and clear the struct.
+ *
+ * @param buffer A buffer returned by an encoder. NULL is ignored.
+ */
+void png_util_buffer_free(png_util_buffer *buffer);
+
+// zlib strategies for `png_util_encode_options`. AUTO keeps libpng's choice.
+#define PNG_UTIL_STRATEGY_AUTO 0
+#define PNG_UTIL_STRATEGY_DEFAULT 1  //!< Z_DEFAULT_STRATEGY
+#define PNG_UTIL_STRATEGY_FILTERED 2  //!< Z_FILTERED
+#define PNG_UTIL_STRATEGY_HUFFMAN_ONLY 3  //!< Z_HUFFMAN_ONLY
+#define PNG_UTIL_STRATEGY_RLE 4  //!< Z_RLE
+#define PNG_UTIL_STRATEGY_FIXED 5  //!< Z_FIXED
+
+/**
+ * Options for `png_encode()`. Zero-initialize it to use libpng's defaults.
+ */
+typedef struct png_util_encode_options {
+    int compression_level;  //!< zlib level (1-9). 0 uses zlib's default.
+    int filters;  //!< `PNG_FILTER_*` flags for `png_set_filter()`. 0 detects cheap rows (see `png_encode()`).
+    int strategy;  //!< `PNG_UTIL_STRATEGY_*`. AUTO may pick RLE for images with 0 filters.
+    int window_bits;  //!< zlib window bits (8-15). 0 uses libpng's choice.
+    int mem_level;  //!< zlib memory level (1-9). 0 uses libpng's default (8).
+    size_t buffer_size;  //!< Size of IDAT chunks. 0 uses libpng's default (8 KiB).
+} png_util_encode_options;
+
+/**
+ * Encode raw rows into a non-interlaced PNG in memory.
+ * When `options->filters` is 0, rows equal to the previous row use filter Up, rows of one color use Sub
+ * and other rows use libpng's default. If 7/8 of the rows are such rows, AUTO strategy becomes RLE.
+ * Images of one color skip libpng's row loop and repeat a block of compressed Up rows.
+ *
+ * @param image Raw rows in libpng's format.
+ * @param options Encode options. NULL uses defaults.
+ * @param png_data Receives the PNG. Free it with `png_util_buffer_free()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_encode(const png_util_image *image, const png_util_encode_options *options,
+                          png_util_buffer *png_data);
+
+// ------ Encode memoization ------
+
+/**
+ * A bounded cache of encoded PNGs keyed by the pixels and the encode options.
+ * All functions are thread-safe.
+ */
+typedef struct png_util_encode_cache png_util_encode_cache;
+
+typedef struct png_util_encode_cache_stats {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;
+    size_t bytes;  //!< Bytes of cached PNGs.
+    double hit_rate;  //!< hits / (hits + misses), or 0 before the first lookup.
+} png_util_encode_cache_stats;
+
+/**
+ * Create an encode cache. Least recently used PNGs are evicted when the budget is exceeded.
+ *
+ * @param budget Maximum bytes of cached PNGs.
+ * @param cache Receives the cache. Destroy it with `png_encode_cache_destroy()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_encode_cache_create(size_t budget, png_util_encode_cache **cache);
+
+/**
+ * `png_encode()` that returns a copy of the cached PNG when the same pixels were encoded with the same options.
+ * The key is two XXH64 hashes (128 bits) of the size, the format, the options and the packed rows.
+ * The row stride doesn't matter.
+ *
+ * @param cache The cache.
+ * @param image Raw rows in libpng's format.
+ * @param options Encode options. NULL uses defaults.
+ * @param png_data Receives the PNG. Free it with `png_util_buffer_free()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_encode_cached(png_util_encode_cache *cache, const png_util_image *image,
+                                 const png_util_encode_options *options, png_util_buffer *png_data);
+
+/**
+ * Get the statistics of an encode cache.
+ *
+ * @param cache The cache.
+ * @param stats Receives the statistics.
+ */
+void png_encode_cache_stats(png_util_encode_cache *cache, png_util_encode_cache_stats *stats);
+
+/**
+ * Destroy an encode cache.
+ *
+ * @param cache The cache. Can be NULL.
+ */
+void png_encode_cache_destroy(png_util_encode_cache *cache);
+
+// ------ Chunk rewriter ------
+
+/**
+ * A chunk to add.
+ */
+typedef struct png_util_chunk {
+    char type[5];  //!< e.g. "pHYs"
+    png_uint_32 size;
+    const png_byte *data;
+} png_util_chunk;
+
+/**
+ * Options for `png_rewrite_chunks()`. Zero-initialize it to copy every chunk.
+ * Only ancillary chunks can be dropped or added.
+ */
+typedef struct png_util_rewrite_options {
+    const char *const *drop;  //!< Types of chunks to drop (e.g. "eXIf").
+    size_t drop_count;
+    int strip_metadata;  //!< Also drop tEXt, zTXt, iTXt, eXIf and tIME.
+    const png_util_chunk *insert;  //!< Chunks to add. They replace existing chunks of the same type.
+    size_t insert_count;
+} png_util_rewrite_options;
+
+/**
+ * Copy a PNG in memory while dropping, replacing or adding ancillary chunks.
+ * Other chunks, including IDAT, are copied byte for byte with their CRCs,
+ * so only new chunks are checksummed and nothing is recompressed.
+ * New chunks are placed before PLTE (bKGD, hIST and tRNS after it) and before IDAT.
+ * libpng doesn't have to be loaded.
+ *
+ * @param data PNG data.
+ * @param size Size of PNG data.
+ * @param options Chunks to drop or add. NULL copies every chunk.
+ * @param png_data Receives the new PNG. Free it with `png_util_buffer_free()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_rewrite_chunks(const void *data, size_t size, const png_util_rewrite_options *options,
+                                  png_util_buffer *png_data);
+
+/**
+ * `png_rewrite_chunks()` for files.
+ * The input is mapped and only chunk headers are read. Copied chunks go through
+ * `copy_file_range()` on Linux, so their data doesn't pass through user space.
+ * The output is written to a temporary file and renamed, so dst can be src.
+ *
+ * @param src Path to the input PNG.
+ * @param dst Path to the output PNG.
+ * @param options Chunks to drop or add. NULL copies every chunk.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_rewrite_chunks_file(const char *src, const char *dst, const png_util_rewrite_options *options);
+
+/**
+ * Rewrite many files on multiple threads.
+ *
+ * @param src Paths to the input PNGs.
+ * @param dst Paths to the output PNGs.
+ * @param count Number of files.
+ * @param threads Worker threads. 0 uses all processors.
+ * @param options Chunks to drop or add. NULL copies every chunk.
+ * @param errors Receives the result of each file.
+ * @returns `PNG_UTIL_SUCCESS` if all files were rewritten, the first error otherwise.
+ */
+png_util_error png_rewrite_chunks_files(const char *const *src, const char *const *dst, size_t count, int threads,
+                                        const png_util_rewrite_options *options, png_util_error *errors);
+
+// ------ Validation ------
+
+/**
+ * Validation levels. Each level includes the checks of the previous ones.
+ *
+ * @enum png_util_validate_level
+ */
+enum {
+    //! Signature, chunk order, chunk types and lengths, IHDR and PLTE fields, and every CRC.
+    PNG_UTIL_VALIDATE_STRUCTURE = 1,
+    //! Inflates IDAT and checks the zlib stream, filter types and the amount of image data.
+    //! The inflated data is discarded.
+    PNG_UTIL_VALIDATE_INFLATE = 2,
+    //! Decodes every row with libpng. Benign errors are treated as errors.
+    PNG_UTIL_VALIDATE_DECODE = 3
+};
+
+#define PNG_UTIL_VALIDATE_REASON_SIZE 96
+
+/**
+ * Details of a validation.
+ */
+typedef struct png_util_validation {
+    unsigned long long bytes;  //!< Bytes checked. Data after IEND is not read.
+    unsigned long long offset;  //!< Where the problem was found, usually the start of the chunk.
+    char reason[PNG_UTIL_VALIDATE_REASON_SIZE];  //!< Empty when the PNG is valid.
+} png_util_validation;
+
+/**
+ * Check a PNG without keeping its pixels.
+ * Data is processed in 64 KiB blocks, so memory use is constant.
+ * Levels 1 and 2 don't need libpng. Level 2 needs the zlib that libpng uses.
+ *
+ * @param data PNG data.
+ * @param size Size of PNG data.
+ * @param level `PNG_UTIL_VALIDATE_*`.
+ * @param result Receives where and why the PNG is invalid. It can be NULL.
+ * @returns `PNG_UTIL_SUCCESS` if the PNG is valid, `PNG_UTIL_ERROR_INVALID_PNG` if it is not,
+ *          `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_validate(const void *data, size_t size, int level, png_util_validation *result);
+
+/**
+ * `png_validate()` for files. The file is read in blocks.
+ *
+ * @param path Path to the PNG.
+ * @param level `PNG_UTIL_VALIDATE_*`.
+ * @param result Receives where and why the PNG is invalid. It can be NULL.
+ * @returns `PNG_UTIL_SUCCESS` if the PNG is valid, `PNG_UTIL_ERROR_INVALID_PNG` if it is not,
+ *          `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_validate_file(const char *path, int level, png_util_validation *result);
+
+/**
+ * Statistics of `png_validate_files()`.
+ */
+typedef struct png_util_validate_stats {
+    size_t files;
+    size_t invalid;
+    unsigned long long bytes;
+    double seconds;
+    double files_per_second;
+    double megabytes_per_second;
+} png_util_validate_stats;
+
+/**
+ * Validate many files on multiple threads.
+ *
+ * @param paths Paths to the PNGs.
+ * @param count Number of files.
+ * @param threads Worker threads. 0 uses all processors.
+ * @param level `PNG_UTIL_VALIDATE_*`.
+ * @param errors Receives the result of each file.
+ * @param stats Receives the throughput. It can be NULL.
+ * @returns `PNG_UTIL_SUCCESS` if all files are valid, the first error otherwise.
+ */
+png_util_error png_validate_files(const char *const *paths, size_t count, int threads, int level,
+                                  png_util_error *errors, png_util_validate_stats *stats);
+
+// ------ Recompression optimizer ------
+
+#define PNG_UTIL_OPTIMIZE_DEFAULT_TRIALS 30
+
+/**
+ * Fill the default trials of `png_optimize()`: level 9 and window bits 15 with
+ * all, none, Paeth, up and sub filters, default, filtered and RLE strategies, and mem levels 9 and 8.
+ *
+ * @param trials Receives `PNG_UTIL_OPTIMIZE_DEFAULT_TRIALS` options.
+ */
+void png_optimize_default_trials(png_util_encode_options *trials);
+
+/**
+ * Options for `png_optimize()`. Zero-initialize it to run the default trials on all processors.
+ */
+typedef struct png_util_optimize_options {
+    const png_util_encode_options *trials;  //!< Encode options to try. NULL runs the default trials.
+    size_t trial_count;
+    int threads;  //!< Worker threads. 0 uses all processors.
+} png_util_optimize_options;
+
+/**
+ * Result of a trial.
+ */
+typedef struct png_util_optimize_result {
+    size_t size;  //!< Size of the PNG with this trial's IDAT. 0 if it was aborted.
+    int aborted;  //!< 1 if it stopped once its output exceeded the smallest output so far.
+    double seconds;
+} png_util_optimize_result;
+
+/**
+ * Re-encode a PNG with each trial in parallel and keep the smallest output.
+ * A trial stops as soon as its output is larger than the smallest finished one.
+ * Only IHDR and IDAT are replaced. The output is non-interlaced,
+ * and other chunks are copied as they are. The input is copied if no trial is smaller.
+ *
+ * @param data PNG data.
+ * @param size Size of PNG data.
+ * @param options Trials and threads. NULL uses the defaults.
+ * @param png_data Receives the smallest PNG. Free it with `png_util_buffer_free()`.
+ * @param results Receives the result of each trial. It can be NULL.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_optimize(const void *data, size_t size, const png_util_optimize_options *options,
+                            png_util_buffer *png_data, png_util_optimize_result *results);
+
+// ------ Encode presets ------
+
+/**
+ * Named encode options for `png_encode_preset()`.
+ *
+ * @enum png_util_preset
+ */
+enum {
+    PNG_UTIL_PRESET_REALTIME = 1,  //!< Level 1, the sub filter and RLE.
+    PNG_UTIL_PRESET_BALANCED = 2,  //!< Level 6, adaptive filters and the filtered strategy.
+    PNG_UTIL_PRESET_ARCHIVAL = 3  //!< Level 9, adaptive filters, window bits 15 and mem level 9.
+};
+
+/**
+ * Get the options of a preset. All presets use 64 KiB IDAT chunks.
+ *
+ * @param preset `PNG_UTIL_PRESET_*`.
+ * @param options Receives the options.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_encode_preset(int preset, png_util_encode_options *options);
+
+/**
+ * What `png_encode_auto()` optimizes.
+ * It picks the candidate with the lowest size + bytes_per_second * seconds
+ * among the ones predicted to finish within max_seconds.
+ */
+typedef struct png_util_tune_target {
+    double bytes_per_second;  //!< How many output bytes a second of encoding is worth. 0 picks the smallest output.
+    double max_seconds;  //!< Limit of the predicted encode time. 0 means no limit. The fastest candidate is used if none fits.
+} png_util_tune_target;
+
+/**
+ * Options that `png_encode_auto()` used.
+ */
+typedef struct png_util_tune_decision {
+    png_util_encode_options options;
+    size_t predicted_size;
+    double predicted_seconds;
+    int cached;  //!< 1 if the decision was reused for the image class.
+} png_util_tune_decision;
+
+/**
+ * Decisions of `png_encode_auto()` per image class: the bit depth, the color type,
+ * the width and height rounded up to powers of two, and the target.
+ * All functions are thread-safe.
+ */
+typedef struct png_util_tune_cache png_util_tune_cache;
+
+typedef struct png_util_tune_cache_stats {
+    size_t hits;
+    size_t misses;
+    size_t entries;
+} png_util_tune_cache_stats;
+
+/**
+ * Create a tuner cache. The least recently used class is replaced when it is full.
+ *
+ * @param capacity Maximum number of classes.
+ * @param cache Receives the cache. Destroy it with `png_tune_cache_destroy()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_tune_cache_create(size_t capacity, png_util_tune_cache **cache);
+
+/**
+ * Encode with options picked for the target.
+ * The realtime, balanced and archival presets and a level 3 Paeth setting are tried on
+ * 8 bands of 16 rows spread over the image, and the full size and time are predicted from them.
+ * Images of up to 128 rows are sampled whole.
+ *
+ * @param cache Decisions to reuse and update. NULL tunes every image.
+ * @param image Raw rows in libpng's format.
+ * @param target What to optimize.
+ * @param png_data Receives the PNG. Free it with `png_util_buffer_free()`.
+ * @param decision Receives the options and the prediction. It can be NULL.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_encode_auto(png_util_tune_cache *cache, const png_util_image *image,
+                               const png_util_tune_target *target, png_util_buffer *png_data,
+                               png_util_tune_decision *decision);
+
+/**
+ * Get the statistics of a tuner cache.
+ *
+ * @param cache The cache.
+ * @param stats Receives the statistics.
+ */
+void png_tune_cache_stats(png_util_tune_cache *cache, png_util_tune_cache_stats *stats);
+
+/**
+ * Destroy a tuner cache.
+ *
+ * @param cache The cache. Can be NULL.
+ */
+void png_tune_cache_destroy(png_util_tune_cache *cache);
+
+// ------ Stored-block encoder ------
+
+/**
+ * Encode raw rows into a PNG as fast as possible, at the cost of size.
+ * Rows use filter type None and go into stored (uncompressed) deflate blocks,
+ * so the PNG is a little larger than the pixels. libpng and zlib are not used.
+ * CRC-32 and Adler-32 use PCLMULQDQ and AVX2 when available.
+ * libpng doesn't have to be loaded. Palette images are not supported.
+ *
+ * @param image Raw rows in libpng's format.
+ * @param png_data Receives the PNG. Free it with `png_util_buffer_free()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_encode_stored(const png_util_image *image, png_util_buffer *png_data);
+
+/**
+ * `png_encode_stored()` to a file. It writes through a 1 MiB buffer.
+ *
+ * @param image Raw rows in libpng's format.
+ * @param path Path to the output PNG.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_encode_stored_file(const png_util_image *image, const char *path);
+
+// ------ Pipelined encoder ------
+
+#define PNG_UTIL_PIPE_DEFAULT_DEPTH 16
+
+/**
+ * Statistics of a row pipeline. The producer makes rows and the consumer takes them.
+ */
+typedef struct png_util_pipe_stats {
+    size_t rows;  //!< Rows that went through the ring.
+    size_t producer_waits;  //!< Times the producer waited for a free slot.
+    double producer_wait_seconds;
+    size_t consumer_waits;  //!< Times the consumer waited for a row.
+    double consumer_wait_seconds;
+    double seconds;  //!< Time from creation to finish.
+} png_util_pipe_stats;
+
+/**
+ * An encoder that runs libpng on a background thread.
+ * The caller pushes rows into a lock-free ring of `depth` rows, and a background thread
+ * filters, compresses and writes them. Pushing waits only when the ring is full.
+ */
+typedef struct png_util_pipe_writer png_util_pipe_writer;
+
+/**
+ * Start a pipelined encoder for a non-interlaced PNG.
+ *
+ * @param fp The output file. It must stay open until `png_pipe_writer_finish()` returns.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param bit_depth Bit depth in libpng's format.
+ * @param color_type `PNG_COLOR_TYPE_*` except for palette.
+ * @param options Encode options. NULL uses defaults.
+ * @param depth Rows the ring can hold. 0 uses `PNG_UTIL_PIPE_DEFAULT_DEPTH`.
+ * @param writer Receives the encoder. Finish it with `png_pipe_writer_finish()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_pipe_writer_create(FILE *fp, png_uint_32 width, png_uint_32 height, int bit_depth,
+                                      int color_type, const png_util_encode_options *options, size_t depth,
+                                      png_util_pipe_writer **writer);
+
+/**
+ * Copy the next row into the ring. It waits while the ring is full.
+ *
+ * @param writer The encoder.
+ * @param row A row in libpng's format.
+ * @returns `PNG_UTIL_SUCCESS` on success, the error of the background thread if it failed,
+ *          or `PNG_UTIL_ERROR_INVALID_ARGUMENT` if all rows were pushed already.
+ */
+png_util_error png_pipe_writer_push(png_util_pipe_writer *writer, const png_byte *row);
+
+/**
+ * Get the number of rows that can be pushed without waiting.
+ * A producer that must not block can check it before pushing.
+ *
+ * @param writer The encoder.
+ * @returns The number of free slots in the ring.
+ */
+size_t png_pipe_writer_free_rows(png_util_pipe_writer *writer);
+
+/**
+ * Wait for the background thread to write the PNG, and destroy the encoder.
+ * Calling it before all rows are pushed cancels encoding and leaves the file incomplete.
+ *
+ * @param writer The encoder.
+ * @param stats Receives the statistics. It can be NULL.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_INVALID_ARGUMENT` if it was canceled,
+ *          `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_pipe_writer_finish(png_util_pipe_writer *writer, png_util_pipe_stats *stats);
+
+// ------ Pipelined decoder ------
+
+/**
+ * A decoder that runs libpng on a background thread.
+ * The thread reads the file, inflates and unfilters rows into a ring of `depth` rows
+ * while the caller processes earlier rows. Memory use is bounded by the ring.
+ */
+typedef struct png_util_pipe_reader png_util_pipe_reader;
+
+/**
+ * Read the header and start the decode thread. Interlaced images are not supported.
+ *
+ * @param fp The input file. It must stay open until `png_pipe_reader_finish()` returns.
+ * @param depth Rows the ring can hold. 0 uses `PNG_UTIL_PIPE_DEFAULT_DEPTH`.
+ * @param header Receives the header. It can be NULL.
+ * @param reader Receives the decoder. Finish it with `png_pipe_reader_finish()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_pipe_reader_create(FILE *fp, size_t depth, png_util_header *header,
+                                      png_util_pipe_reader **reader);
+
+/**
+ * Take the next row. It waits until the decode thread has it.
+ * The row stays valid until the next call, which gives its slot back to the ring.
+ * If decoding fails, the rows decoded before the error are returned first.
+ *
+ * @param reader The decoder.
+ * @param row Receives a pointer to the row in libpng's format.
+ * @returns `PNG_UTIL_SUCCESS` on success, the error of the decode thread if it failed,
+ *          or `PNG_UTIL_ERROR_INVALID_ARGUMENT` after the last row.
+ */
+png_util_error png_pipe_reader_next(png_util_pipe_reader *reader, const png_byte **row);
+
+/**
+ * Stop the decode thread and destroy the decoder.
+ * Calling it before the last row cancels decoding. The rest of the file is not read.
+ *
+ * @param reader The decoder.
+ * @param stats Receives the statistics. The producer is the decode thread. It can be NULL.
+ * @returns `PNG_UTIL_SUCCESS`, or the error of the decode thread if it failed.
+ */
+png_util_error png_pipe_reader_finish(png_util_pipe_reader *reader, png_util_pipe_stats *stats);
+
+// ------ Out-of-core encoder ------
+
+/**
+ * Fills a row for `png_encode_row_source()`.
+ *
+ * @param y Index of the row. Rows are requested from top to bottom.
+ * @param row Receives the row in libpng's format.
+ * @param user_ptr The pointer given to `png_encode_row_source()`.
+ * @returns Nonzero on success. 0 stops encoding with `PNG_UTIL_ERROR_IO`.
+ */
+typedef int (*png_util_row_source_ptr)(png_uint_32 y, png_byte *row, void *user_ptr);
+
+/**
+ * Options for encoders that stream rows into a file.
+ */
+typedef struct png_util_stream_options {
+    const png_util_encode_options *encode;  //!< Encode options. NULL uses defaults.
+    size_t write_buffer;  //!< libpng's writes are coalesced into writes of this size. 0 uses 1 MiB.
+    size_t readahead;  //!< Bytes of a mapped source to prefetch ahead. 0 uses 8 MiB.
+    unsigned long long preallocate;  //!< Bytes to reserve for the output on Linux, e.g. an estimated size. 0 reserves nothing.
+} png_util_stream_options;
+
+/**
+ * Encode a raw pixel file that may be larger than memory into a PNG file.
+ * The source is memory-mapped and read from top to bottom with readahead hints, and pages behind
+ * the current row are released. Apart from the mapping, memory use is O(width).
+ * The output is written sequentially. Large sources need a 64-bit build.
+ *
+ * @param raw_path Path to the raw file.
+ * @param offset Offset of the first row in the raw file.
+ * @param row_stride Distance between rows in bytes. 0 means packed rows.
+ * @param header Size and format of the rows in libpng's format. Interlacing and palettes are not supported.
+ * @param png_path Path to the output PNG. It's removed on failure.
+ * @param options Options. NULL uses defaults.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_encode_raw_file(const char *raw_path, size_t offset, size_t row_stride,
+                                   const png_util_header *header, const char *png_path,
+                                   const png_util_stream_options *options);
+
+/**
+ * `png_encode_raw_file()` with rows from a callback. It holds one row at a time.
+ *
+ * @param fn Fills each row.
+ * @param user_ptr A pointer passed to fn.
+ * @param header Size and format of the rows in libpng's format. Interlacing and palettes are not supported.
+ * @param png_path Path to the output PNG. It's removed on failure.
+ * @param options Options. NULL uses defaults.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_encode_row_source(png_util_row_source_ptr fn, void *user_ptr, const png_util_header *header,
+                                     const char *png_path, const png_util_stream_options *options);
+
+// ------ Asynchronous output ------
+
+/**
+ * How `png_async_sink_close()` makes the output durable.
+ *
+ * @enum png_util_sync_mode
+ */
+enum {
+    PNG_UTIL_SYNC_NONE = 0,  //!< Leave write-back to the OS.
+    PNG_UTIL_SYNC_END = 1,  //!< fsync() (FlushFileBuffers() on Windows) before closing.
+    //! Start write-back of each buffer with sync_file_range() and wait for the one before it,
+    //! so dirty pages stay bounded, then fsync() at the end. It's `PNG_UTIL_SYNC_END` except on Linux.
+    PNG_UTIL_SYNC_RANGE = 2
+};
+
+/**
+ * A libpng output that writes on a background thread.
+ * libpng fills one buffer while the thread writes the other with pwrite(), so compression
+ * does not wait for the disk unless the disk is slower than the encoder.
+ */
+typedef struct png_util_async_sink png_util_async_sink;
+
+/**
+ * Statistics of an asynchronous output.
+ */
+typedef struct png_util_async_sink_stats {
+    unsigned long long bytes;  //!< Bytes handed to the write thread.
+    size_t writes;  //!< Buffers handed to the write thread.
+    size_t waits;  //!< Times the encoder waited for the write thread.
+    double wait_seconds;
+    double write_seconds;  //!< Time the write thread spent writing and syncing.
+} png_util_async_sink_stats;
+
+/**
+ * Create a file and start its write thread.
+ *
+ * @param path Path to the file. It's truncated if it exists.
+ * @param buffer_size Size of each of the two buffers. 0 uses 1 MiB.
+ * @param sync `PNG_UTIL_SYNC_*`.
+ * @param sink Receives the output. Close it with `png_async_sink_close()`.
+ * @returns `PNG_UTIL_SUCCESS` on success, `PNG_UTIL_ERROR_*` otherwise.
+ */
+png_util_error png_async_sink_open(const char *path, size_t buffer_size, int sync, png_util_async_sink **sink);
+
+/**
+ * Make the output the write function of a write struct with `png_set_write_fn()`.
+ * A failed write is reported to the error handler of the write struct at its next write or flush.
+ * A flush waits until the buffered data is written.
+ *
+ * @param sink The output.
+ * @param png_ptr A write struct. It must not be used after `png_async_sink_close()`.
+ */
+void png_async_sink_attach(png_util_async_sink *sink, png_struct *png_ptr);
+
+/**
+ * Write the rest of the data, sync it as requested, and close the file.
+ * The file is kept on failure.
+ *
+ * @param sink The output.
+ * @param stats Receives the statistics. It can be NULL.
+ * @returns `PNG_UTIL_SUCCESS`, or `PNG_UTIL_ERROR_IO` if a write or the sync failed.
+ */
+png_util_error png_async_sink_close(png_util_async_sink *sink, png_util_async_sink_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // LIBPNG_LOADER_UTILS_H
@@ -0,0 +1,160 @@
+#include "test_utils.h"
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static jmp_buf jmp;
+static int errors;
+
+static void on_error(png_struct* png, const char* message) {
+    (void)png;
+    (void)message;
+    errors++;
+    longjmp(jmp, 1);
+}
+
+static void on_warning(png_struct* png, const char* message) {
+    (void)png;
+    (void)message;
+}
+
+static void fill_row(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr) {
+    (void)user_ptr;
+    for (size_t x = 0; x < rowbytes; x++)
+        row[x] = (png_byte)(x * 7 + y * 3 + ((x * y) >> 5));
+}
+
+// Encodes an RGB image into the sink. Returns 0 if libpng reported an error.
+static int encode_to_sink(png_util_async_sink* sink, png_uint_32 width, png_uint_32 height, int level, int flush_rows) {
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, on_error, on_warning);
+    png_infop info = png_create_info_struct(png);
+    png_byte* volatile row = (png_byte*)malloc((size_t)width * 3);
+    if (setjmp(jmp)) {
+        free(row);
+        png_destroy_write_struct(&png, &info);
+        return 0;
+    }
+    png_async_sink_attach(sink, png);
+    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_compression_level(png, level);
+    if (flush_rows > 0)
+        png_set_flush(png, flush_rows);
+    png_write_info(png, info);
+    for (png_uint_32 y = 0; y < height; y++) {
+        fill_row(row, (size_t)width * 3, y, NULL);
+        png_write_row(png, row);
+    }
+    png_write_end(png, info);
+    free(row);
+    png_destroy_write_struct(&png, &info);
+    return 1;
+}
+
+static int check_file(const char* filename, png_uint_32 width, png_uint_32 height, unsigned long long bytes) {
+    mem_buffer buf = read_file(filename);
+    if (!buf.data || buf.size != bytes) {
+        fprintf(stderr, "%s: %zu bytes on disk, %llu bytes written\n", filename, buf.size, bytes);
+        free(buf.data);
+        return 1;
+    }
+    png_util_image image = alloc_image(width, height, 8, PNG_COLOR_TYPE_RGB, 0);
+    for (png_uint_32 y = 0; y < height; y++)
+        fill_row(image.pixels + image.row_stride * y, image.row_stride, y, NULL);
+    int ret = check_png(filename, &image, buf.data, buf.size);
+    png_util_image_free(&image);
+    free(buf.data);
+    return ret;
+}
+
+static int test_sync(int sync, int flush_rows) {
+    png_util_async_sink* sink;
+    png_util_error err = png_async_sink_open("async.png", 512, sync, &sink);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_async_sink_open: error: %u\n", err);
+        return 1;
+    }
+    int written = encode_to_sink(sink, 200, 150, 6, flush_rows);
+    png_util_async_sink_stats stats;
+    err = png_async_sink_close(sink, &stats);
+    if (!written || err != PNG_UTIL_SUCCESS || stats.writes < 2) {
+        fprintf(stderr, "sync %d: unexpected result: %u, %zu writes\n", sync, err, stats.writes);
+        return 1;
+    }
+    return check_file("async.png", 200, 150, stats.bytes);
+}
+
+static int test_errors(void) {
+    png_util_async_sink* sink;
+    if (png_async_sink_open("async.png", 0, 3, &sink) != PNG_UTIL_ERROR_INVALID_ARGUMENT) {
+        fprintf(stderr, "png_async_sink_open accepted an unknown sync mode\n");
+        return 1;
+    }
+#ifdef __linux__
+    // Writes to /dev/full fail. libpng sees it at a later write.
+    if (png_async_sink_open("/dev/full", 512, PNG_UTIL_SYNC_NONE, &sink) != PNG_UTIL_SUCCESS)
+        return 0;
+    errors = 0;
+    int written = encode_to_sink(sink, 200, 150, 0, 0);
+    png_util_error err = png_async_sink_close(sink, NULL);
+    if (written || errors != 1 || err != PNG_UTIL_ERROR_IO) {
+        fprintf(stderr, "a write error was not reported: %u\n", err);
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+static void run_benchmark(void) {
+    png_uint_32 width = 2048, height = 2048;
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png_create_info_struct(png);
+    FILE* fp = fopen("async_bench.png", "wb");
+    png_init_write_io(png, fp);
+    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_compression_level(png, 1);
+    png_byte* row = (png_byte*)malloc((size_t)width * 3);
+    clock_t start = clock();
+    png_write_info(png, info);
+    for (png_uint_32 y = 0; y < height; y++) {
+        fill_row(row, (size_t)width * 3, y, NULL);
+        png_write_row(png, row);
+    }
+    png_write_end(png, info);
+    fclose(fp);
+    double fwrite_ms = elapsed_ms(start);
+    free(row);
+    png_destroy_write_struct(&png, &info);
+    printf("2048x2048 RGB8  fwrite: %.2f ms,", fwrite_ms);
+
+    png_util_async_sink* sink;
+    png_util_async_sink_stats stats;
+    start = clock();
+    png_async_sink_open("async_bench.png", 0, PNG_UTIL_SYNC_NONE, &sink);
+    encode_to_sink(sink, width, height, 1, 0);
+    png_async_sink_close(sink, &stats);
+    printf(" async: %.2f ms (%zu writes, %.2f ms waiting, %.2f ms writing)\n", elapsed_ms(start), stats.writes,
+           stats.wait_seconds * 1000, stats.write_seconds * 1000);
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = 0;
+    for (int sync = PNG_UTIL_SYNC_NONE; sync <= PNG_UTIL_SYNC_RANGE && ret == 0; sync++)
+        ret = test_sync(sync, 0);
+    if (ret == 0)
+        ret = test_sync(PNG_UTIL_SYNC_NONE, 16);
+    if (ret == 0)
+        ret = test_errors();
+    if (ret == 0)
+        run_benchmark();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
@@ -0,0 +1,309 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ------ Kernels ------
+
+typedef void (*kernel_fn)(const png_byte* src, png_byte* dst, size_t count);
+
+static void u8_to_u16(const png_byte* src, png_byte* dst, size_t count) {
+    png_util_8_to_16(src, (png_uint_16*)dst, count);
+}
+
+typedef struct kernel_case {
+    const char* name;
+    kernel_fn fn;
+    size_t src_size;  // bytes per unit
+    size_t dst_size;
+} kernel_case;
+
+static const kernel_case kernels[] = {
+    { "rgb_to_rgba8", png_util_rgb_to_rgba8, 3, 4 },
+    { "rgba_to_rgb8", png_util_rgba_to_rgb8, 4, 3 },
+    { "swap_rb8", png_util_swap_rb8, 4, 4 },
+    { "gray_to_rgba8", png_util_gray_to_rgba8, 1, 4 },
+    { "premultiply8", png_util_premultiply8, 4, 4 },
+    { "unpremultiply8", png_util_unpremultiply8, 4, 4 },
+    { "16_to_8", png_util_16_to_8, 2, 1 },
+    { "8_to_16", u8_to_u16, 1, 2 },
+};
+
+// SIMD kernels must match the scalar ones at any length and alignment.
+static int test_kernels(void) {
+    enum { MAX_COUNT = 131 };
+    png_byte src[MAX_COUNT * 4 + 1];
+    png_byte simd[MAX_COUNT * 4 + 2];
+    png_byte scalar[MAX_COUNT * 4 + 2];
+    png_util_cpu_flags features = png_util_cpu_features();
+    printf("CPU features: %s%s%s\n", features & PNG_UTIL_CPU_SSE2 ? "SSE2 " : "",
+           features & PNG_UTIL_CPU_AVX2 ? "AVX2 " : "", features & PNG_UTIL_CPU_NEON ? "NEON " : "");
+
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        const kernel_case* kc = &kernels[k];
+        for (size_t count = 0; count <= MAX_COUNT; count++) {
+            // 8_to_16 writes 16-bit values, so keep dst aligned for it
+            size_t offset = count & 1;
+            for (size_t i = 0; i < sizeof(src); i++)
+                src[i] = random_byte();
+            memset(simd, 0xcd, sizeof(simd));
+            memset(scalar, 0xcd, sizeof(scalar));
+            png_util_set_cpu_mask(~0U);
+            kc->fn(src + offset, simd + (kc->dst_size == 2 ? 0 : offset), count);
+            png_util_set_cpu_mask(0);
+            kc->fn(src + offset, scalar + (kc->dst_size == 2 ? 0 : offset), count);
+            if (memcmp(simd, scalar, sizeof(simd)) != 0) {
+                fprintf(stderr, "%s: SIMD and scalar results differ (count=%zu)\n", kc->name, count);
+                png_util_set_cpu_mask(~0U);
+                return 1;
+            }
+        }
+    }
+    png_util_set_cpu_mask(~0U);
+
+    // The features follow the mask.
+    png_util_set_cpu_mask(~(png_util_cpu_flags)PNG_UTIL_CPU_AVX2);
+    png_util_cpu_flags masked = png_util_cpu_features();
+    png_util_set_cpu_mask(~0U);
+    if (masked != (features & ~(png_util_cpu_flags)PNG_UTIL_CPU_AVX2) || png_util_cpu_features() != features) {
+        fprintf(stderr, "png_util_cpu_features: unexpected features %x\n", masked);
+        return 1;
+    }
+    return 0;
+}
+
+// Checks the rounding of all inputs.
+static int test_exact(void) {
+    png_byte be[2];
+    png_byte out;
+    for (unsigned int v = 0; v < 65536; v++) {
+        be[0] = (png_byte)(v >> 8);
+        be[1] = (png_byte)v;
+        png_util_16_to_8(be, &out, 1);
+        if (out != (png_byte)((v * 255 + 32895) >> 16)) {
+            fprintf(stderr, "16_to_8: unexpected value for %u: %u\n", v, out);
+            return 1;
+        }
+    }
+
+    // 64 pixels per alpha value, so SIMD loops are used
+    png_byte rgba[256 * 4];
+    png_byte premultiplied[256 * 4];
+    png_byte restored[256 * 4];
+    for (unsigned int a = 0; a < 256; a++) {
+        for (unsigned int c = 0; c < 256; c++) {
+            rgba[c * 4 + 0] = (png_byte)c;
+            rgba[c * 4 + 1] = (png_byte)(255 - c);
+            rgba[c * 4 + 2] = (png_byte)(c ^ a);
+            rgba[c * 4 + 3] = (png_byte)a;
+        }
+        png_util_premultiply8(rgba, premultiplied, 256);
+        for (unsigned int i = 0; i < 256 * 4; i++) {
+            unsigned int expected = i % 4 == 3 ? a : (rgba[i] * a * 2 + 255) / 510;
+            if (premultiplied[i] != expected) {
+                fprintf(stderr, "premultiply8: unexpected value for %u * %u: %u\n",
+                        rgba[i], a, premultiplied[i]);
+                return 1;
+            }
+        }
+        if (a == 255) {
+            png_util_unpremultiply8(premultiplied, restored, 256);
+            if (memcmp(restored, rgba, sizeof(rgba)) != 0) {
+                fprintf(stderr, "unpremultiply8: opaque pixels were changed\n");
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// ------ Decoding ------
+
+static void fill_row(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr) {
+    (void)user_ptr;
+    // Smooth rows compress fast, some noise exercises all values
+    for (size_t i = 0; i < rowbytes; i++)
+        row[i] = (png_byte)(i + y) ^ (random_byte() & 0x11);
+}
+
+// Writes random pixels. Palette and gray images get a tRNS chunk.
+static mem_buffer make_png(png_uint_32 width, png_uint_32 height, int bit_depth, int color_type,
+                           int interlace) {
+    mem_buffer buf = { NULL, 0 };
+    png_infop info;
+    png_structp png = start_png(&buf, &info, width, height, bit_depth, color_type, interlace);
+    png_set_compression_level(png, 1);
+    if (color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_color palette[256];
+        png_byte trans[256];
+        for (int i = 0; i < 256; i++) {
+            palette[i].red = random_byte();
+            palette[i].green = random_byte();
+            palette[i].blue = random_byte();
+            trans[i] = random_byte();
+        }
+        png_set_PLTE(png, info, palette, 1 << bit_depth);
+        png_set_tRNS(png, info, trans, 1 << bit_depth, NULL);
+    } else if (color_type == PNG_COLOR_TYPE_GRAY) {
+        png_color_16 trans = { 0, 0, 0, 0, 1 };
+        png_set_tRNS(png, info, NULL, 0, &trans);
+    }
+    png_write_info(png, info);
+    finish_png(png, info, fill_row, NULL);
+    return buf;
+}
+
+static int is_little_endian(void) {
+    const png_uint_16 one = 1;
+    return *(const png_byte*)&one == 1;
+}
+
+// Sets the libpng transform flags equivalent to a format.
+static void set_transforms(png_struct* png, png_info* info, void* user_ptr) {
+    png_util_format format = *(const png_util_format*)user_ptr;
+    int color_type = png_get_color_type(png, info);
+    int has_alpha = (color_type & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, info, PNG_INFO_tRNS);
+    png_set_expand(png);
+    if (format == PNG_UTIL_FORMAT_RGBA16) {
+        png_set_expand_16(png);
+        if (is_little_endian())
+            png_set_swap(png);
+    } else {
+        png_set_scale_16(png);
+    }
+    if (!(color_type & PNG_COLOR_MASK_COLOR))
+        png_set_gray_to_rgb(png);
+    if (format == PNG_UTIL_FORMAT_RGB8 || format == PNG_UTIL_FORMAT_BGR8)
+        png_set_strip_alpha(png);
+    else if (!has_alpha)
+        png_set_filler(png, 0xffff, PNG_FILLER_AFTER);
+    if (format == PNG_UTIL_FORMAT_BGR8 || format == PNG_UTIL_FORMAT_BGRA8 ||
+            format == PNG_UTIL_FORMAT_BGRA8_PREMULTIPLIED)
+        png_set_bgr(png);
+}
+
+// Decodes with the equivalent libpng transform flags. Rows are packed.
+static png_byte* decode_reference(const mem_buffer* buf, png_util_format format) {
+    png_util_header header;
+    size_t rowbytes;
+    if (png_probe_header(buf->data, buf->size, &header) != PNG_UTIL_SUCCESS)
+        return NULL;
+    png_byte* pixels = decode_libpng(buf->data, buf->size, set_transforms, &format, &rowbytes);
+    if (format == PNG_UTIL_FORMAT_RGBA8_PREMULTIPLIED || format == PNG_UTIL_FORMAT_BGRA8_PREMULTIPLIED) {
+        for (size_t i = 0; i < rowbytes * header.height; i += 4) {
+            for (int c = 0; c < 3; c++)
+                pixels[i + c] = (png_byte)((pixels[i + c] * pixels[i + 3] * 2 + 255) / 510);
+        }
+    }
+    return pixels;
+}
+
+// Decodes with png_decode_into(). Rows are packed.
+static png_byte* decode_into(const mem_buffer* buf, png_util_format format) {
+    png_util_header header;
+    png_util_dest dest;
+    memset(&dest, 0, sizeof(dest));
+    if (png_probe_header(buf->data, buf->size, &header) != PNG_UTIL_SUCCESS)
+        return NULL;
+    dest.width = header.width;
+    dest.height = header.height;
+    dest.format = format;
+    dest.alignment = 1;
+    dest.row_stride = header.width * png_util_format_size(format);
+    dest.size = dest.row_stride * header.height;
+    dest.pixels = malloc(dest.size);
+    if (!dest.pixels)
+        return NULL;
+    png_util_error err = png_decode_into(buf->data, buf->size, &dest);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_decode_into: error: %u\n", err);
+        free(dest.pixels);
+        return NULL;
+    }
+    return (png_byte*)dest.pixels;
+}
+
+static int test_decode(int bit_depth, int color_type, int interlace) {
+    static const png_util_format formats[] = {
+        PNG_UTIL_FORMAT_RGB8, PNG_UTIL_FORMAT_BGR8, PNG_UTIL_FORMAT_RGBA8, PNG_UTIL_FORMAT_BGRA8,
+        PNG_UTIL_FORMAT_RGBA16, PNG_UTIL_FORMAT_RGBA8_PREMULTIPLIED, PNG_UTIL_FORMAT_BGRA8_PREMULTIPLIED,
+    };
+    const png_uint_32 width = 67, height = 13;
+    mem_buffer buf = make_png(width, height, bit_depth, color_type, interlace);
+    int ret = 0;
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]) && ret == 0; f++) {
+        png_byte* expected = decode_reference(&buf, formats[f]);
+        png_byte* actual = decode_into(&buf, formats[f]);
+        if (!actual || memcmp(expected, actual, width * height * png_util_format_size(formats[f])) != 0) {
+            fprintf(stderr, "png_decode_into: unexpected pixels (depth=%d, type=%d, interlace=%d, format=%u)\n",
+                    bit_depth, color_type, interlace, formats[f]);
+            ret = 1;
+        }
+        free(expected);
+        free(actual);
+    }
+    free(buf.data);
+    return ret;
+}
+
+// ------ Benchmark ------
+
+static double benchmark(const mem_buffer* buf, png_util_format format, int use_libpng) {
+    const int repeat = 3;
+    double best = 0;
+    for (int i = 0; i < repeat; i++) {
+        clock_t start = clock();
+        png_byte* pixels = use_libpng ? decode_reference(buf, format) : decode_into(buf, format);
+        double ms = elapsed_ms(start);
+        free(pixels);
+        if (i == 0 || ms < best)
+            best = ms;
+    }
+    return best;
+}
+
+static void run_benchmark(const char* name, int bit_depth, int color_type, png_util_format format) {
+    mem_buffer buf = make_png(1024, 1024, bit_depth, color_type, PNG_INTERLACE_NONE);
+    double libpng = benchmark(&buf, format, 1);
+    png_util_set_cpu_mask(0);
+    double scalar = benchmark(&buf, format, 0);
+    png_util_set_cpu_mask(~0U);
+    double simd = benchmark(&buf, format, 0);
+    printf("%-22s libpng transforms: %.2f ms, kernels (scalar): %.2f ms, kernels: %.2f ms\n",
+           name, libpng, scalar, simd);
+    free(buf.data);
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_kernels();
+    if (ret == 0)
+        ret = test_exact();
+
+    static const int types[][2] = {
+        { 8, PNG_COLOR_TYPE_RGB }, { 8, PNG_COLOR_TYPE_RGB_ALPHA }, { 16, PNG_COLOR_TYPE_RGB },
+        { 16, PNG_COLOR_TYPE_RGB_ALPHA }, { 8, PNG_COLOR_TYPE_GRAY }, { 2, PNG_COLOR_TYPE_GRAY },
+        { 16, PNG_COLOR_TYPE_GRAY_ALPHA }, { 8, PNG_COLOR_TYPE_GRAY_ALPHA }, { 4, PNG_COLOR_TYPE_PALETTE },
+        { 8, PNG_COLOR_TYPE_PALETTE },
+    };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]) && ret == 0; i++) {
+        ret = test_decode(types[i][0], types[i][1], PNG_INTERLACE_NONE);
+        if (ret == 0)
+            ret = test_decode(types[i][0], types[i][1], PNG_INTERLACE_ADAM7);
+    }
+
+    if (ret == 0) {
+        run_benchmark("RGB8 -> BGRA8", 8, PNG_COLOR_TYPE_RGB, PNG_UTIL_FORMAT_BGRA8);
+        run_benchmark("RGBA16 -> RGBA8", 16, PNG_COLOR_TYPE_RGB_ALPHA, PNG_UTIL_FORMAT_RGBA8);
+        run_benchmark("GRAY8 -> RGBA8", 8, PNG_COLOR_TYPE_GRAY, PNG_UTIL_FORMAT_RGBA8);
+        run_benchmark("RGBA8 -> RGBA16", 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_UTIL_FORMAT_RGBA16);
+    }
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
@@ -0,0 +1,139 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Expected RGBA of input.png
+static void input_pixel(png_uint_32 x, png_uint_32 y, png_byte* rgba) {
+    rgba[0] = (png_byte)((double)x / 300.0 * 255);
+    rgba[1] = 255;
+    rgba[2] = (png_byte)((double)y / 250.0 * 255);
+    rgba[3] = 255;
+}
+
+static int check_pixel(png_uint_32 x, png_uint_32 y, const png_byte* pixel, png_util_format format) {
+    png_byte rgba[4];
+    input_pixel(x, y, rgba);
+    int ok = 1;
+    switch (format) {
+    case PNG_UTIL_FORMAT_RGBA8:
+        ok = memcmp(pixel, rgba, 4) == 0;
+        break;
+    case PNG_UTIL_FORMAT_BGRA8:
+        ok = pixel[0] == rgba[2] && pixel[1] == rgba[1] && pixel[2] == rgba[0] && pixel[3] == rgba[3];
+        break;
+    case PNG_UTIL_FORMAT_RGB8:
+        ok = memcmp(pixel, rgba, 3) == 0;
+        break;
+    case PNG_UTIL_FORMAT_RGBA16: {
+        png_uint_16 values[4];
+        memcpy(values, pixel, sizeof(values));
+        for (int c = 0; c < 4; c++)
+            ok &= values[c] == rgba[c] * 257;
+        break;
+    }
+    case PNG_UTIL_FORMAT_GRAY8: {
+        double gray = rgba[0] * 0.2126 + rgba[1] * 0.7152 + rgba[2] * 0.0722;
+        ok = pixel[0] + 2 >= gray && pixel[0] <= gray + 2;
+        break;
+    }
+    default:
+        ok = 0;
+    }
+    if (!ok)
+        fprintf(stderr, "unexpected pixel at (%u, %u) for format %u\n", x, y, format);
+    return !ok;
+}
+
+// Returns a pointer aligned to 64 bytes inside buf.
+static png_byte* align64(png_byte* buf) {
+    return buf + ((64 - ((size_t)buf & 63)) & 63);
+}
+
+static int test_format(const png_byte* data, size_t size, png_util_format format) {
+    png_util_header header;
+    png_util_error err = png_probe_header(data, size, &header);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_probe_header: error: %u\n", err);
+        return 1;
+    }
+    png_util_dest dest;
+    memset(&dest, 0, sizeof(dest));
+    err = png_dest_layout(header.width, header.height, format, 0, &dest.row_stride, &dest.size);
+    if (err != PNG_UTIL_SUCCESS || dest.row_stride % 64 != 0 ||
+            dest.row_stride < header.width * png_util_format_size(format)) {
+        fprintf(stderr, "png_dest_layout: error: %u\n", err);
+        return 1;
+    }
+    png_byte* buf = (png_byte*)malloc(dest.size + 64);
+    if (!buf)
+        return 1;
+    memset(buf, 0xcd, dest.size + 64);
+    dest.pixels = align64(buf);
+    dest.width = header.width;
+    dest.height = header.height;
+    dest.format = format;
+    err = png_decode_into(data, size, &dest);
+    int ret = 0;
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_decode_into: error: %u\n", err);
+        ret = 1;
+    }
+    size_t pixel_size = png_util_format_size(format);
+    size_t rowbytes = header.width * pixel_size;
+    for (png_uint_32 y = 0; y < header.height && ret == 0; y++) {
+        const png_byte* row = (const png_byte*)dest.pixels + dest.row_stride * y;
+        for (png_uint_32 x = 0; x < header.width && ret == 0; x++)
+            ret = check_pixel(x, y, row + x * pixel_size, format);
+        for (size_t i = rowbytes; i < dest.row_stride && ret == 0; i++) {
+            if (row[i] != 0) {
+                fprintf(stderr, "padding is not cleared\n");
+                ret = 1;
+            }
+        }
+    }
+
+    // Misaligned or mismatched descriptors are rejected.
+    png_util_dest bad = dest;
+    bad.pixels = (png_byte*)dest.pixels + 4;
+    bad.size -= 4;
+    if (ret == 0 && png_decode_into(data, size, &bad) != PNG_UTIL_ERROR_INVALID_ARGUMENT) {
+        fprintf(stderr, "png_decode_into: misaligned buffer was accepted\n");
+        ret = 1;
+    }
+    bad = dest;
+    bad.height--;
+    if (ret == 0 && png_decode_into(data, size, &bad) != PNG_UTIL_ERROR_INVALID_ARGUMENT) {
+        fprintf(stderr, "png_decode_into: wrong size was accepted\n");
+        ret = 1;
+    }
+    bad = dest;
+    bad.size = dest.row_stride * (dest.height - 1);
+    if (ret == 0 && png_decode_into(data, size, &bad) != PNG_UTIL_ERROR_INVALID_ARGUMENT) {
+        fprintf(stderr, "png_decode_into: small buffer was accepted\n");
+        ret = 1;
+    }
+    free(buf);
+    return ret;
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    mem_buffer buf = read_file("input.png");
+    int ret = buf.data ? 0 : 1;
+    const png_util_format formats[] = {
+        PNG_UTIL_FORMAT_RGBA8, PNG_UTIL_FORMAT_BGRA8, PNG_UTIL_FORMAT_RGB8,
+        PNG_UTIL_FORMAT_RGBA16, PNG_UTIL_FORMAT_GRAY8,
+    };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]) && ret == 0; i++)
+        ret = test_format(buf.data, buf.size, formats[i]);
+    free(buf.data);
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
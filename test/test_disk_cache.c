@@ -0,0 +1,243 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_DIR "disk_cache"
+
+static void fill_row(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr) {
+    png_uint_32 salt = (png_uint_32)*(const int*)user_ptr;
+    for (size_t x = 0; x < rowbytes; x++)
+        row[x] = (png_byte)(x * 7 + y * 3 + salt * 50);
+}
+
+static mem_buffer make_png(png_uint_32 width, png_uint_32 height, int salt) {
+    return write_png(width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, fill_row, &salt);
+}
+
+// Compares a mapped image with png_decode_into().
+static int check_image(const png_util_cached_image* image, const mem_buffer* buf, png_uint_32 width,
+                       png_uint_32 height, png_util_format format) {
+    png_util_dest dest;
+    memset(&dest, 0, sizeof(dest));
+    dest.width = width;
+    dest.height = height;
+    dest.format = format;
+    dest.alignment = 1;
+    dest.row_stride = width * png_util_format_size(format);
+    dest.size = dest.row_stride * height;
+    dest.pixels = malloc(dest.size);
+    int ret = png_decode_into(buf->data, buf->size, &dest) != PNG_UTIL_SUCCESS ||
+              image->width != width || image->height != height || image->format != format ||
+              ((size_t)image->pixels & 63) != 0;
+    for (png_uint_32 y = 0; y < height && ret == 0; y++) {
+        ret = memcmp(image->pixels + image->row_stride * y, (png_byte*)dest.pixels + dest.row_stride * y,
+                     dest.row_stride) != 0;
+    }
+    if (ret)
+        fprintf(stderr, "unexpected mapped image\n");
+    free(dest.pixels);
+    return ret;
+}
+
+static int expect_stats(png_util_disk_cache* cache, size_t hits, size_t misses, size_t evictions) {
+    png_util_disk_cache_stats stats;
+    png_disk_cache_stats(cache, &stats);
+    if (stats.hits != hits || stats.misses != misses || stats.evictions != evictions) {
+        fprintf(stderr, "unexpected stats: hits=%zu, misses=%zu, evictions=%zu\n",
+                stats.hits, stats.misses, stats.evictions);
+        return 1;
+    }
+    return 0;
+}
+
+// A zero budget deletes the entries of earlier runs.
+static void clear_cache(void) {
+    png_util_disk_cache* cache;
+    if (png_disk_cache_open(CACHE_DIR, 0, &cache) == PNG_UTIL_SUCCESS)
+        png_disk_cache_close(cache);
+}
+
+static int test_hits(void) {
+    mem_buffer a = make_png(70, 20, 0);
+    png_util_disk_cache* cache;
+    if (png_disk_cache_open(CACHE_DIR, 1 << 20, &cache) != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_disk_cache_open failed\n");
+        return 1;
+    }
+    const png_util_cached_image *miss, *hit, *bgra;
+    int ret = png_disk_cache_decode(cache, a.data, a.size, PNG_UTIL_FORMAT_RGBA8, &miss) != PNG_UTIL_SUCCESS ||
+              png_disk_cache_decode(cache, a.data, a.size, PNG_UTIL_FORMAT_RGBA8, &hit) != PNG_UTIL_SUCCESS ||
+              png_disk_cache_decode(cache, a.data, a.size, PNG_UTIL_FORMAT_BGRA8, &bgra) != PNG_UTIL_SUCCESS;
+    if (ret) {
+        fprintf(stderr, "png_disk_cache_decode failed\n");
+        return 1;
+    }
+    ret = check_image(miss, &a, 70, 20, PNG_UTIL_FORMAT_RGBA8) || check_image(hit, &a, 70, 20, PNG_UTIL_FORMAT_RGBA8) ||
+          check_image(bgra, &a, 70, 20, PNG_UTIL_FORMAT_BGRA8) || expect_stats(cache, 1, 2, 0);
+    png_disk_cache_release(miss);
+    png_disk_cache_release(hit);
+    png_disk_cache_release(bgra);
+    png_disk_cache_close(cache);
+
+    // Entries survive the process, so a new cache starts warm.
+    if (ret == 0 && png_disk_cache_open(CACHE_DIR, 1 << 20, &cache) == PNG_UTIL_SUCCESS) {
+        png_util_disk_cache_stats stats;
+        png_disk_cache_stats(cache, &stats);
+        if (stats.bytes < 2 * 70 * 20 * 4) {
+            fprintf(stderr, "existing entries were not counted: %llu\n", stats.bytes);
+            ret = 1;
+        }
+        if (ret == 0 && png_disk_cache_decode(cache, a.data, a.size, PNG_UTIL_FORMAT_RGBA8, &hit) == PNG_UTIL_SUCCESS) {
+            ret = check_image(hit, &a, 70, 20, PNG_UTIL_FORMAT_RGBA8) || expect_stats(cache, 1, 0, 0);
+            png_disk_cache_release(hit);
+        }
+        png_disk_cache_close(cache);
+    }
+
+    // Files are keyed by their identity.
+    FILE* fp = fopen("disk_cache_input.png", "wb");
+    if (fp) {
+        fwrite(a.data, 1, a.size, fp);
+        fclose(fp);
+    }
+    if (ret == 0 && png_disk_cache_open(CACHE_DIR, 1 << 20, &cache) == PNG_UTIL_SUCCESS) {
+        if (png_disk_cache_decode_file(cache, "disk_cache_input.png", PNG_UTIL_FORMAT_RGB8, &miss) ||
+                png_disk_cache_decode_file(cache, "disk_cache_input.png", PNG_UTIL_FORMAT_RGB8, &hit)) {
+            fprintf(stderr, "png_disk_cache_decode_file failed\n");
+            ret = 1;
+        } else {
+            ret = check_image(hit, &a, 70, 20, PNG_UTIL_FORMAT_RGB8) || expect_stats(cache, 1, 1, 0);
+            png_disk_cache_release(miss);
+            png_disk_cache_release(hit);
+        }
+        png_disk_cache_close(cache);
+    }
+    free(a.data);
+    return ret;
+}
+
+static int test_eviction(void) {
+    mem_buffer bufs[3];
+    for (int i = 0; i < 3; i++)
+        bufs[i] = make_png(64, 32, i);
+    png_util_disk_cache* cache;
+    // An entry is 64 + 64 * 32 * 4 bytes, so two of them fit.
+    png_disk_cache_open(CACHE_DIR, 20000, &cache);
+    const png_util_cached_image* images[3];
+    int ret = 0;
+    for (int i = 0; i < 3 && ret == 0; i++)
+        ret = png_disk_cache_decode(cache, bufs[i].data, bufs[i].size, PNG_UTIL_FORMAT_RGBA8, &images[i]) != 0;
+    // The evicted entry is still mapped.
+    if (ret == 0)
+        ret = expect_stats(cache, 0, 3, 1) || check_image(images[0], &bufs[0], 64, 32, PNG_UTIL_FORMAT_RGBA8);
+    for (int i = 0; i < 3 && ret == 0; i++) {
+        png_disk_cache_release(images[i]);
+        png_disk_cache_decode(cache, bufs[2 - i].data, bufs[2 - i].size, PNG_UTIL_FORMAT_RGBA8, &images[i]);
+        png_disk_cache_release(images[i]);
+    }
+    if (ret == 0)
+        ret = expect_stats(cache, 2, 4, 2);
+    png_disk_cache_close(cache);
+    for (int i = 0; i < 3; i++)
+        free(bufs[i].data);
+    return ret;
+}
+
+// Eviction goes below the budget, so the next insert doesn't evict again.
+static int test_low_water(void) {
+    mem_buffer bufs[4];
+    for (int i = 0; i < 4; i++)
+        bufs[i] = make_png(64, 32, i);
+    png_util_disk_cache* cache;
+    // Three entries of 8256 bytes fit, and 90% of the budget holds two,
+    // so the fourth entry evicts two of them.
+    png_disk_cache_open(CACHE_DIR, 25000, &cache);
+    int ret = 0;
+    for (int i = 0; i < 4 && ret == 0; i++) {
+        const png_util_cached_image* image;
+        ret = png_disk_cache_decode(cache, bufs[i].data, bufs[i].size, PNG_UTIL_FORMAT_RGBA8, &image) != 0;
+        if (ret == 0)
+            png_disk_cache_release(image);
+    }
+    if (ret == 0)
+        ret = expect_stats(cache, 0, 4, 2);
+    png_disk_cache_close(cache);
+    for (int i = 0; i < 4; i++)
+        free(bufs[i].data);
+    return ret;
+}
+
+// Temporary files of writers that are gone are deleted on open.
+static int test_temp_files(void) {
+    const char* path = CACHE_DIR "/0123456789abcdef.pxc.2147483646-1.tmp";
+    FILE* fp = fopen(path, "wb");
+    if (!fp)
+        return 1;
+    fputs("partial", fp);
+    fclose(fp);
+    png_util_disk_cache* cache;
+    png_disk_cache_open(CACHE_DIR, 1 << 20, &cache);
+    png_disk_cache_close(cache);
+    fp = fopen(path, "rb");
+    if (fp) {
+        fclose(fp);
+        remove(path);
+        fprintf(stderr, "a stale temporary file was kept\n");
+        return 1;
+    }
+    return 0;
+}
+
+static void run_benchmark(void) {
+    mem_buffer buf = make_png(1024, 1024, 0);
+    png_util_disk_cache* cache;
+    png_disk_cache_open(CACHE_DIR, 64 << 20, &cache);
+    const png_util_cached_image* image;
+    clock_t start = clock();
+    png_disk_cache_decode(cache, buf.data, buf.size, PNG_UTIL_FORMAT_RGBA8, &image);
+    png_disk_cache_release(image);
+    double miss_ms = elapsed_ms(start);
+    start = clock();
+    const int count = 100;
+    unsigned int sum = 0;
+    for (int i = 0; i < count; i++) {
+        png_disk_cache_decode(cache, buf.data, buf.size, PNG_UTIL_FORMAT_RGBA8, &image);
+        // touch one byte per page
+        for (size_t j = 0; j < image->size; j += 4096)
+            sum += image->pixels[j];
+        png_disk_cache_release(image);
+    }
+    double hit_ms = elapsed_ms(start) / count;
+    printf("1024x1024 RGBA8  miss (decode + write): %.2f ms, hit (mmap + page-in): %.3f ms (%u)\n",
+           miss_ms, hit_ms, sum & 1);
+    png_disk_cache_close(cache);
+    free(buf.data);
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    clear_cache();
+    int ret = test_hits();
+    clear_cache();
+    if (ret == 0)
+        ret = test_eviction();
+    clear_cache();
+    if (ret == 0)
+        ret = test_low_water();
+    clear_cache();
+    if (ret == 0)
+        ret = test_temp_files();
+    clear_cache();
+    if (ret == 0)
+        run_benchmark();
+    clear_cache();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
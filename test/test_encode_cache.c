@@ -0,0 +1,153 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Makes a UI-like RGBA frame with some padding after each row. `salt` moves a cursor.
+static png_util_image make_frame(png_uint_32 width, png_uint_32 height, size_t padding, int salt) {
+    png_util_image image = alloc_image(width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA, padding);
+    for (png_uint_32 y = 0; y < height; y++) {
+        png_byte* row = image.pixels + image.row_stride * y;
+        for (png_uint_32 x = 0; x < width; x++) {
+            int cursor = x / 8 == (png_uint_32)salt && y / 8 == 1;
+            row[x * 4] = cursor ? 0 : (png_byte)(y < 16 ? 40 : 230);
+            row[x * 4 + 1] = cursor ? 0 : (png_byte)(y < 16 ? 60 : 230);
+            row[x * 4 + 2] = cursor ? 0 : (png_byte)(x * 255 / width);
+            row[x * 4 + 3] = 255;
+        }
+    }
+    return image;
+}
+
+static int expect_stats(png_util_encode_cache* cache, size_t hits, size_t misses, size_t evictions) {
+    png_util_encode_cache_stats stats;
+    png_encode_cache_stats(cache, &stats);
+    if (stats.hits != hits || stats.misses != misses || stats.evictions != evictions ||
+            stats.hit_rate != (double)hits / (double)(hits + misses)) {
+        fprintf(stderr, "unexpected stats: hits=%zu, misses=%zu, evictions=%zu, hit rate=%f\n",
+                stats.hits, stats.misses, stats.evictions, stats.hit_rate);
+        return 1;
+    }
+    return 0;
+}
+
+static int same_buffer(const png_util_buffer* a, const png_util_buffer* b) {
+    return a->size == b->size && memcmp(a->data, b->data, a->size) == 0;
+}
+
+static int test_memoize(void) {
+    png_util_image frame = make_frame(120, 40, 0, 3);
+    png_util_image padded = make_frame(120, 40, 16, 3);
+    png_util_image moved = make_frame(120, 40, 0, 4);
+    png_util_encode_options fast;
+    memset(&fast, 0, sizeof(fast));
+    fast.compression_level = 1;
+    fast.filters = PNG_FILTER_NONE;
+    fast.strategy = PNG_UTIL_STRATEGY_RLE;
+    png_util_encode_cache* cache;
+    png_encode_cache_create(1 << 20, &cache);
+    png_util_buffer expected, first, second, third, other, other_options;
+    int ret = png_encode(&frame, NULL, &expected) != PNG_UTIL_SUCCESS ||
+              png_encode_cached(cache, &frame, NULL, &first) != PNG_UTIL_SUCCESS ||
+              png_encode_cached(cache, &frame, NULL, &second) != PNG_UTIL_SUCCESS ||
+              png_encode_cached(cache, &padded, NULL, &third) != PNG_UTIL_SUCCESS ||
+              png_encode_cached(cache, &moved, NULL, &other) != PNG_UTIL_SUCCESS ||
+              png_encode_cached(cache, &frame, &fast, &other_options) != PNG_UTIL_SUCCESS;
+    if (ret) {
+        fprintf(stderr, "png_encode_cached failed\n");
+        return 1;
+    }
+    // The stride doesn't change the key, but the pixels and the options do.
+    if (!same_buffer(&expected, &first) || !same_buffer(&expected, &second) || !same_buffer(&expected, &third)) {
+        fprintf(stderr, "png_encode_cached: unexpected PNG\n");
+        ret = 1;
+    }
+    if (ret == 0)
+        ret = expect_stats(cache, 2, 3, 0) || check_png("cached", &frame, second.data, second.size) ||
+              check_png("moved", &moved, other.data, other.size) ||
+              check_png("other options", &frame, other_options.data, other_options.size);
+    png_util_buffer* buffers[6] = { &expected, &first, &second, &third, &other, &other_options };
+    for (int i = 0; i < 6; i++)
+        png_util_buffer_free(buffers[i]);
+
+    png_util_encode_options invalid;
+    memset(&invalid, 0, sizeof(invalid));
+    invalid.compression_level = 10;
+    if (ret == 0 && png_encode_cached(cache, &frame, &invalid, &first) != PNG_UTIL_ERROR_INVALID_ARGUMENT) {
+        fprintf(stderr, "png_encode_cached accepted an invalid level\n");
+        ret = 1;
+    }
+    png_encode_cache_destroy(cache);
+    free(frame.pixels);
+    free(padded.pixels);
+    free(moved.pixels);
+    return ret;
+}
+
+static int test_eviction(void) {
+    png_util_image frames[3];
+    png_util_buffer pngs[3];
+    for (int i = 0; i < 3; i++) {
+        frames[i] = make_frame(120, 40, 0, i);
+        png_encode(&frames[i], NULL, &pngs[i]);
+    }
+    // Two PNGs fit.
+    png_util_encode_cache* cache;
+    png_encode_cache_create(pngs[0].size + pngs[1].size + pngs[2].size - 1, &cache);
+    int ret = 0;
+    static const int order[6] = { 0, 1, 0, 2, 0, 1 };
+    for (int i = 0; i < 6 && ret == 0; i++) {
+        png_util_buffer out;
+        ret = png_encode_cached(cache, &frames[order[i]], NULL, &out) != PNG_UTIL_SUCCESS ||
+              !same_buffer(&out, &pngs[order[i]]);
+        png_util_buffer_free(&out);
+    }
+    // Frame 1 is the least recently used one when frame 2 comes in.
+    if (ret == 0)
+        ret = expect_stats(cache, 2, 4, 2);
+    png_encode_cache_destroy(cache);
+    for (int i = 0; i < 3; i++) {
+        free(frames[i].pixels);
+        png_util_buffer_free(&pngs[i]);
+    }
+    return ret;
+}
+
+static void run_benchmark(void) {
+    png_util_image frame = make_frame(1280, 720, 0, 5);
+    png_util_encode_cache* cache;
+    png_encode_cache_create(16 << 20, &cache);
+    png_util_buffer out;
+    clock_t start = clock();
+    png_encode_cached(cache, &frame, NULL, &out);
+    png_util_buffer_free(&out);
+    double miss_ms = elapsed_ms(start);
+    start = clock();
+    const int count = 20;
+    for (int i = 0; i < count; i++) {
+        png_encode_cached(cache, &frame, NULL, &out);
+        png_util_buffer_free(&out);
+    }
+    double hit_ms = elapsed_ms(start) / count;
+    printf("1280x720 RGBA8  miss (deflate): %.2f ms, hit (hash + copy): %.2f ms\n",
+           miss_ms, hit_ms);
+    png_encode_cache_destroy(cache);
+    free(frame.pixels);
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_memoize();
+    if (ret == 0)
+        ret = test_eviction();
+    if (ret == 0)
+        run_benchmark();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
@@ -0,0 +1,144 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Pixel (x, y) uses one of 16 colors, so the image can also be stored as a palette.
+static png_byte color_index(png_uint_32 x, png_uint_32 y) {
+    return (png_byte)((x / 3 + y * 5) % 16);
+}
+
+static void make_color(int index, int salt, png_byte* rgba) {
+    rgba[0] = (png_byte)(index * 16 + salt);
+    rgba[1] = (png_byte)(255 - index * 9);
+    rgba[2] = (png_byte)(index * 5);
+    rgba[3] = (png_byte)(index % 4 == 0 ? 128 : 255);
+}
+
+typedef struct pixel_source {
+    int palette;
+    int salt;
+} pixel_source;
+
+static void fill_row(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr) {
+    const pixel_source* src = (const pixel_source*)user_ptr;
+    png_uint_32 width = (png_uint_32)(src->palette ? rowbytes : rowbytes / 4);
+    for (png_uint_32 x = 0; x < width; x++) {
+        if (src->palette)
+            row[x] = color_index(x, y);
+        else
+            make_color(color_index(x, y), src->salt, row + x * 4);
+    }
+}
+
+// Writes the same pixels as RGBA, or as a palette with tRNS.
+static mem_buffer make_png(png_uint_32 width, png_uint_32 height, int palette, int interlace, int salt) {
+    mem_buffer buf = { NULL, 0 };
+    png_infop info;
+    png_structp png = start_png(&buf, &info, width, height, 8,
+                                palette ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_RGB_ALPHA, interlace);
+    if (palette) {
+        png_color colors[16];
+        png_byte trans[16];
+        for (int i = 0; i < 16; i++) {
+            png_byte rgba[4];
+            make_color(i, salt, rgba);
+            colors[i].red = rgba[0];
+            colors[i].green = rgba[1];
+            colors[i].blue = rgba[2];
+            trans[i] = rgba[3];
+        }
+        png_set_PLTE(png, info, colors, 16);
+        png_set_tRNS(png, info, trans, 16, NULL);
+    }
+    png_write_info(png, info);
+    pixel_source src = { palette, salt };
+    finish_png(png, info, fill_row, &src);
+    return buf;
+}
+
+// Decodes with a row stride padded by `padding` bytes and returns the digest.
+static int decode_digest(const mem_buffer* buf, png_uint_32 width, png_uint_32 height,
+                         png_util_format format, size_t padding, png_util_digest* digest) {
+    png_util_dest dest;
+    memset(&dest, 0, sizeof(dest));
+    dest.width = width;
+    dest.height = height;
+    dest.format = format;
+    dest.alignment = 1;
+    dest.row_stride = width * png_util_format_size(format) + padding;
+    dest.size = dest.row_stride * height;
+    dest.pixels = malloc(dest.size);
+    png_util_error err = png_decode_into_digest(buf->data, buf->size, &dest, digest);
+    free(dest.pixels);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_decode_into_digest: error: %u\n", err);
+        return 1;
+    }
+    return 0;
+}
+
+static int same_digest(const png_util_digest* a, const png_util_digest* b) {
+    return memcmp(a->bytes, b->bytes, PNG_UTIL_DIGEST_SIZE) == 0;
+}
+
+static int test_digest(png_util_format format) {
+    const png_uint_32 width = 45, height = 19;
+    mem_buffer encodings[3] = {
+        make_png(width, height, 0, PNG_INTERLACE_NONE, 0),
+        make_png(width, height, 1, PNG_INTERLACE_NONE, 0),
+        make_png(width, height, 0, PNG_INTERLACE_ADAM7, 0),
+    };
+    mem_buffer other = make_png(width, height, 0, PNG_INTERLACE_NONE, 1);
+    png_util_digest expected, digest;
+    int ret = decode_digest(&encodings[0], width, height, format, 0, &expected);
+
+    // The digest depends on the pixels only, not on the encoding, the stride or the mode.
+    for (int i = 0; i < 3 && ret == 0; i++) {
+        ret = decode_digest(&encodings[i], width, height, format, (size_t)i * 7, &digest);
+        if (ret == 0 && !same_digest(&digest, &expected)) {
+            fprintf(stderr, "png_decode_into_digest: digest of encoding %d differs\n", i);
+            ret = 1;
+        }
+        png_util_error err = png_hash_pixels(encodings[i].data, encodings[i].size, format, &digest);
+        if (ret == 0 && (err != PNG_UTIL_SUCCESS || !same_digest(&digest, &expected))) {
+            fprintf(stderr, "png_hash_pixels: digest of encoding %d differs: %u\n", i, err);
+            ret = 1;
+        }
+    }
+    // Other pixels or another format give another digest.
+    png_util_error err = png_hash_pixels(other.data, other.size, format, &digest);
+    if (ret == 0 && (err != PNG_UTIL_SUCCESS || same_digest(&digest, &expected))) {
+        fprintf(stderr, "png_hash_pixels: other pixels were not detected: %u\n", err);
+        ret = 1;
+    }
+    png_util_format other_format = format == PNG_UTIL_FORMAT_RGBA8 ? PNG_UTIL_FORMAT_BGRA8 : PNG_UTIL_FORMAT_RGBA8;
+    err = png_hash_pixels(encodings[0].data, encodings[0].size, other_format, &digest);
+    if (ret == 0 && (err != PNG_UTIL_SUCCESS || same_digest(&digest, &expected))) {
+        fprintf(stderr, "png_hash_pixels: other format was not detected: %u\n", err);
+        ret = 1;
+    }
+    for (int i = 0; i < 3; i++)
+        free(encodings[i].data);
+    free(other.data);
+    return ret;
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_digest(PNG_UTIL_FORMAT_RGBA8);
+    if (ret == 0)
+        ret = test_digest(PNG_UTIL_FORMAT_BGRA8_PREMULTIPLIED);
+    if (ret == 0)
+        ret = test_digest(PNG_UTIL_FORMAT_RGBA32F);
+    if (ret == 0)
+        ret = test_digest(PNG_UTIL_FORMAT_RGB8);
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
@@ -0,0 +1,197 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void fill_row(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr) {
+    png_uint_32 salt = (png_uint_32)*(const int*)user_ptr;
+    for (size_t x = 0; x < rowbytes; x++)
+        row[x] = (png_byte)(x * 7 + y * 3 + salt * 50);
+}
+
+static mem_buffer make_png(png_uint_32 width, png_uint_32 height, int salt) {
+    return write_png(width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, fill_row, &salt);
+}
+
+// Compares a cached image with png_decode_into().
+static int check_image(const png_util_cached_image* image, const mem_buffer* buf, png_uint_32 width,
+                       png_uint_32 height) {
+    png_util_dest dest;
+    memset(&dest, 0, sizeof(dest));
+    dest.width = width;
+    dest.height = height;
+    dest.format = image->format;
+    dest.alignment = 1;
+    dest.row_stride = width * png_util_format_size(image->format);
+    dest.size = dest.row_stride * height;
+    dest.pixels = malloc(dest.size);
+    int ret = png_decode_into(buf->data, buf->size, &dest) != PNG_UTIL_SUCCESS ||
+              image->width != width || image->height != height || ((size_t)image->pixels & 63) != 0;
+    for (png_uint_32 y = 0; y < height && ret == 0; y++) {
+        ret = memcmp(image->pixels + image->row_stride * y, (png_byte*)dest.pixels + dest.row_stride * y,
+                     dest.row_stride) != 0;
+    }
+    if (ret)
+        fprintf(stderr, "unexpected cached image\n");
+    free(dest.pixels);
+    return ret;
+}
+
+static int expect_stats(png_util_image_cache* cache, size_t hits, size_t misses, size_t evictions, size_t entries) {
+    png_util_image_cache_stats stats;
+    png_image_cache_stats(cache, &stats);
+    if (stats.hits != hits || stats.misses != misses || stats.evictions != evictions || stats.entries != entries) {
+        fprintf(stderr, "unexpected stats: hits=%zu, misses=%zu, evictions=%zu, entries=%zu\n",
+                stats.hits, stats.misses, stats.evictions, stats.entries);
+        return 1;
+    }
+    return 0;
+}
+
+static int test_content(void) {
+    mem_buffer a = make_png(64, 32, 0);
+    mem_buffer b = make_png(64, 32, 1);
+    png_util_image_cache* cache;
+    png_image_cache_create(1 << 20, &cache);
+    const png_util_cached_image *first, *second, *other, *bgra;
+    png_image_cache_decode(cache, a.data, a.size, PNG_UTIL_FORMAT_RGBA8, &first);
+    png_image_cache_decode(cache, a.data, a.size, PNG_UTIL_FORMAT_RGBA8, &second);
+    png_image_cache_decode(cache, b.data, b.size, PNG_UTIL_FORMAT_RGBA8, &other);
+    png_image_cache_decode(cache, a.data, a.size, PNG_UTIL_FORMAT_BGRA8, &bgra);
+    int ret = expect_stats(cache, 1, 3, 0, 3);
+    if (ret == 0 && (first != second || first == other || first == bgra)) {
+        fprintf(stderr, "png_image_cache_decode: unexpected entries\n");
+        ret = 1;
+    }
+    if (ret == 0)
+        ret = check_image(first, &a, 64, 32) || check_image(other, &b, 64, 32) || check_image(bgra, &a, 64, 32);
+
+    // Released images go away with the cache, and held ones outlive it.
+    png_image_cache_release(first);
+    png_image_cache_release(second);
+    png_image_cache_release(bgra);
+    png_image_cache_destroy(cache);
+    if (ret == 0)
+        ret = check_image(other, &b, 64, 32);
+    png_image_cache_release(other);
+    free(a.data);
+    free(b.data);
+    return ret;
+}
+
+static int test_eviction(void) {
+    mem_buffer bufs[4];
+    for (int i = 0; i < 4; i++)
+        bufs[i] = make_png(64, 32, i);
+    png_util_image_cache* cache;
+    // 64x32 RGBA is 8 KiB, so three images fit.
+    png_image_cache_create(30000, &cache);
+    const png_util_cached_image* images[4];
+    for (int i = 0; i < 4; i++)
+        png_image_cache_decode(cache, bufs[i].data, bufs[i].size, PNG_UTIL_FORMAT_RGBA8, &images[i]);
+    int ret = expect_stats(cache, 0, 4, 1, 3);
+    // The first image was evicted, but it is still valid.
+    if (ret == 0)
+        ret = check_image(images[0], &bufs[0], 64, 32);
+    for (int i = 0; i < 4; i++)
+        png_image_cache_release(images[i]);
+    const png_util_cached_image* image;
+    png_image_cache_decode(cache, bufs[3].data, bufs[3].size, PNG_UTIL_FORMAT_RGBA8, &image);
+    png_image_cache_release(image);
+    png_image_cache_decode(cache, bufs[0].data, bufs[0].size, PNG_UTIL_FORMAT_RGBA8, &image);
+    png_image_cache_release(image);
+    if (ret == 0)
+        ret = expect_stats(cache, 1, 5, 2, 3);
+
+    // Images over the budget are not cached.
+    mem_buffer large = make_png(256, 256, 0);
+    png_util_error err = png_image_cache_decode(cache, large.data, large.size, PNG_UTIL_FORMAT_RGBA8, &image);
+    if (ret == 0 && (err != PNG_UTIL_SUCCESS || check_image(image, &large, 256, 256)))
+        ret = 1;
+    png_image_cache_release(image);
+    if (ret == 0)
+        ret = expect_stats(cache, 1, 6, 2, 3);
+    png_image_cache_destroy(cache);
+    for (int i = 0; i < 4; i++)
+        free(bufs[i].data);
+    free(large.data);
+    return ret;
+}
+
+static int test_file(void) {
+    mem_buffer a = make_png(64, 32, 0);
+    mem_buffer b = make_png(80, 32, 1);
+    png_util_image_cache* cache;
+    png_image_cache_create(1 << 20, &cache);
+    const png_util_cached_image *first, *second, *changed;
+    int ret = write_file("image_cache.png", &a);
+    if (ret == 0 && (png_image_cache_decode_file(cache, "image_cache.png", PNG_UTIL_FORMAT_RGBA8, &first) ||
+                     png_image_cache_decode_file(cache, "image_cache.png", PNG_UTIL_FORMAT_RGBA8, &second))) {
+        fprintf(stderr, "png_image_cache_decode_file failed\n");
+        return 1;
+    }
+    if (ret == 0)
+        ret = first != second || check_image(first, &a, 64, 32) || expect_stats(cache, 1, 1, 0, 1);
+    // A rewritten file has another size, so it is decoded again.
+    if (ret == 0)
+        ret = write_file("image_cache.png", &b);
+    if (ret == 0 && png_image_cache_decode_file(cache, "image_cache.png", PNG_UTIL_FORMAT_RGBA8, &changed)) {
+        fprintf(stderr, "png_image_cache_decode_file failed\n");
+        ret = 1;
+    } else if (ret == 0) {
+        ret = check_image(changed, &b, 80, 32) || expect_stats(cache, 1, 2, 0, 2);
+        png_image_cache_release(changed);
+    }
+    if (ret == 0 && png_image_cache_decode_file(cache, "missing.png", PNG_UTIL_FORMAT_RGBA8, &changed) !=
+                    PNG_UTIL_ERROR_IO) {
+        fprintf(stderr, "png_image_cache_decode_file: missing file was accepted\n");
+        ret = 1;
+    }
+    png_image_cache_release(first);
+    png_image_cache_release(second);
+    png_image_cache_destroy(cache);
+    free(a.data);
+    free(b.data);
+    return ret;
+}
+
+static void run_benchmark(void) {
+    mem_buffer buf = make_png(512, 512, 0);
+    png_util_image_cache* cache;
+    png_image_cache_create(16 << 20, &cache);
+    const png_util_cached_image* image;
+    clock_t start = clock();
+    png_image_cache_decode(cache, buf.data, buf.size, PNG_UTIL_FORMAT_RGBA8, &image);
+    png_image_cache_release(image);
+    double miss_ms = elapsed_ms(start);
+    start = clock();
+    const int count = 1000;
+    for (int i = 0; i < count; i++) {
+        png_image_cache_decode(cache, buf.data, buf.size, PNG_UTIL_FORMAT_RGBA8, &image);
+        png_image_cache_release(image);
+    }
+    double hit_ms = elapsed_ms(start) / count;
+    printf("512x512 RGBA8  miss (decode): %.2f ms, hit (hash of %zu bytes): %.2f us\n",
+           miss_ms, buf.size, hit_ms * 1000);
+    png_image_cache_destroy(cache);
+    free(buf.data);
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_content();
+    if (ret == 0)
+        ret = test_eviction();
+    if (ret == 0)
+        ret = test_file();
+    if (ret == 0)
+        run_benchmark();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
@@ -0,0 +1,222 @@
+#include "test_utils.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Color tags of test images
+enum { TAG_NONE, TAG_SRGB, TAG_GAMMA, TAG_CICP_LINEAR };
+
+// Sample c of pixel (x, y) for the bit depth
+static unsigned int sample(png_uint_32 x, png_uint_32 y, int c, int bit_depth) {
+    unsigned int v = x * 977 + y * 331 + (unsigned int)c * 7919;
+    return bit_depth == 16 ? (v * 40503) & 0xffff : v & 0xff;
+}
+
+// Writes RGBA (or RGB when channels is 3) with a color tag.
+typedef struct sample_layout {
+    int bit_depth;
+    int channels;
+} sample_layout;
+
+static void fill_row(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr) {
+    const sample_layout* layout = (const sample_layout*)user_ptr;
+    int channels = layout->channels;
+    png_uint_32 width = (png_uint_32)(rowbytes / ((size_t)channels * (layout->bit_depth / 8)));
+    for (png_uint_32 x = 0; x < width; x++) {
+        for (int c = 0; c < channels; c++) {
+            unsigned int v = sample(x, y, c, layout->bit_depth);
+            if (layout->bit_depth == 16) {
+                row[(x * channels + c) * 2] = (png_byte)(v >> 8);
+                row[(x * channels + c) * 2 + 1] = (png_byte)v;
+            } else {
+                row[x * channels + c] = (png_byte)v;
+            }
+        }
+    }
+}
+
+static mem_buffer make_png(png_uint_32 width, png_uint_32 height, int bit_depth, int channels,
+                           int tag, int interlace) {
+    mem_buffer buf = { NULL, 0 };
+    png_infop info;
+    png_structp png = start_png(&buf, &info, width, height, bit_depth,
+                                channels == 4 ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB, interlace);
+    png_set_compression_level(png, 1);
+    if (tag == TAG_SRGB || tag == TAG_CICP_LINEAR)
+        png_set_sRGB(png, info, PNG_sRGB_INTENT_PERCEPTUAL);
+    else if (tag == TAG_GAMMA)
+        png_set_gAMA_fixed(png, info, 45455);
+    png_write_info(png, info);
+    if (tag == TAG_CICP_LINEAR) {
+        // BT.709 primaries, linear transfer, RGB, full range. It overrides sRGB.
+        png_byte cicp[4] = { 1, 8, 0, 1 };
+        png_write_chunk(png, (png_const_bytep)"cICP", cicp, 4);
+    }
+    sample_layout layout = { bit_depth, channels };
+    finish_png(png, info, fill_row, &layout);
+    return buf;
+}
+
+static double linearize(int tag, double x) {
+    if (tag == TAG_GAMMA)
+        return pow(x, 1 / 0.45455);
+    if (tag == TAG_CICP_LINEAR)
+        return x;
+    return x <= 0.04045 ? x / 12.92 : pow((x + 0.055) / 1.055, 2.4);
+}
+
+static void* decode_into(const mem_buffer* buf, png_uint_32 width, png_uint_32 height, png_util_format format) {
+    png_util_dest dest;
+    memset(&dest, 0, sizeof(dest));
+    dest.width = width;
+    dest.height = height;
+    dest.format = format;
+    dest.alignment = 16;
+    if (png_dest_layout(width, height, format, 16, &dest.row_stride, &dest.size) != PNG_UTIL_SUCCESS)
+        return NULL;
+    // rows are packed because width * 16 is a multiple of 16
+    dest.pixels = malloc(dest.size);
+    if (!dest.pixels)
+        return NULL;
+    png_util_error err = png_decode_into(buf->data, buf->size, &dest);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_decode_into: error: %u\n", err);
+        free(dest.pixels);
+        return NULL;
+    }
+    return dest.pixels;
+}
+
+static float half_to_float(png_uint_16 h) {
+    int exponent = (h >> 10) & 0x1f;
+    int mantissa = h & 0x3ff;
+    float v = exponent == 0 ? ldexpf((float)mantissa, -24) : ldexpf((float)(mantissa | 0x400), exponent - 25);
+    return (h & 0x8000) ? -v : v;
+}
+
+static int test_linear(int bit_depth, int channels, int tag) {
+    const png_uint_32 width = 38, height = 9;
+    mem_buffer buf = make_png(width, height, bit_depth, channels, tag, PNG_INTERLACE_NONE);
+    mem_buffer interlaced = make_png(width, height, bit_depth, channels, tag, PNG_INTERLACE_ADAM7);
+    size_t count = (size_t)width * height * 4;
+    float* pixels = (float*)decode_into(&buf, width, height, PNG_UTIL_FORMAT_RGBA32F);
+    float* pixels_adam7 = (float*)decode_into(&interlaced, width, height, PNG_UTIL_FORMAT_RGBA32F);
+    png_uint_16* halves = (png_uint_16*)decode_into(&buf, width, height, PNG_UTIL_FORMAT_RGBA16F);
+    png_util_set_cpu_mask(0);
+    float* scalar = (float*)decode_into(&buf, width, height, PNG_UTIL_FORMAT_RGBA32F);
+    png_uint_16* scalar_halves = (png_uint_16*)decode_into(&buf, width, height, PNG_UTIL_FORMAT_RGBA16F);
+    png_util_set_cpu_mask(~0U);
+    int ret = 0;
+    if (!pixels || !pixels_adam7 || !halves || !scalar || !scalar_halves) {
+        ret = 1;
+    } else if (memcmp(pixels, scalar, count * 4) != 0 || memcmp(halves, scalar_halves, count * 2) != 0) {
+        fprintf(stderr, "SIMD and scalar results differ\n");
+        ret = 1;
+    } else if (memcmp(pixels, pixels_adam7, count * 4) != 0) {
+        fprintf(stderr, "interlaced image was decoded differently\n");
+        ret = 1;
+    }
+    // 16-bit inputs are interpolated between 1025 entries.
+    double tolerance = bit_depth == 16 ? 1e-4 : 1e-6;
+    double max_value = bit_depth == 16 ? 65535.0 : 255.0;
+    for (size_t i = 0; i < count && ret == 0; i++) {
+        png_uint_32 x = (png_uint_32)(i / 4 % width), y = (png_uint_32)(i / 4 / width);
+        int c = (int)(i % 4);
+        double expected = 1.0;
+        if (c < channels) {
+            double v = sample(x, y, c, bit_depth) / max_value;
+            expected = c == 3 ? v : linearize(tag, v);
+        }
+        float h = half_to_float(halves[i]);
+        if (fabs(pixels[i] - expected) > tolerance || fabs(h - pixels[i]) > pixels[i] / 1024 + 1e-7) {
+            fprintf(stderr, "unexpected value at (%u, %u, %d): %f, %f (expected %f)\n",
+                    x, y, c, pixels[i], h, expected);
+            ret = 1;
+        }
+    }
+    free(pixels);
+    free(pixels_adam7);
+    free(halves);
+    free(scalar);
+    free(scalar_halves);
+    free(buf.data);
+    free(interlaced.data);
+    return ret;
+}
+
+static void set_linear(png_struct* png, png_info* info, void* user_ptr) {
+    (void)info;
+    (void)user_ptr;
+    png_set_alpha_mode(png, PNG_ALPHA_STANDARD, PNG_GAMMA_LINEAR);
+    png_set_expand_16(png);
+}
+
+// libpng's gamma path to 16-bit linear light, and a float conversion of count samples.
+static float* decode_libpng_linear(const mem_buffer* buf, size_t count) {
+    size_t rowbytes;
+    png_byte* samples = decode_libpng(buf->data, buf->size, set_linear, NULL, &rowbytes);
+    float* pixels = (float*)malloc(sizeof(float) * count);
+    for (size_t i = 0; i < count; i++)
+        pixels[i] = (float)((samples[i * 2] << 8) | samples[i * 2 + 1]) / 65535.0f;
+    free(samples);
+    return pixels;
+}
+
+static void run_benchmark(void) {
+    const png_uint_32 size = 1024;
+    mem_buffer buf = make_png(size, size, 8, 4, TAG_SRGB, PNG_INTERLACE_NONE);
+    double best[3] = { 0, 0, 0 };
+    for (int i = 0; i < 3; i++) {
+        double ms[3];
+        clock_t start = clock();
+        free(decode_libpng_linear(&buf, (size_t)size * size * 4));
+        ms[0] = elapsed_ms(start);
+        start = clock();
+        free(decode_into(&buf, size, size, PNG_UTIL_FORMAT_RGBA32F));
+        ms[1] = elapsed_ms(start);
+        start = clock();
+        free(decode_into(&buf, size, size, PNG_UTIL_FORMAT_RGBA16F));
+        ms[2] = elapsed_ms(start);
+        for (int j = 0; j < 3; j++) {
+            if (i == 0 || ms[j] < best[j])
+                best[j] = ms[j];
+        }
+    }
+    printf("sRGB8 -> linear  libpng gamma + float: %.2f ms, RGBA32F: %.2f ms, RGBA16F: %.2f ms\n",
+           best[0], best[1], best[2]);
+    free(buf.data);
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    size_t hits0, misses0;
+    png_util_transfer_cache_stats(&hits0, &misses0);
+    int ret = test_linear(8, 4, TAG_SRGB);
+    if (ret == 0)
+        ret = test_linear(8, 3, TAG_NONE);
+    if (ret == 0)
+        ret = test_linear(16, 4, TAG_GAMMA);
+    if (ret == 0)
+        ret = test_linear(16, 3, TAG_SRGB);
+    if (ret == 0)
+        ret = test_linear(8, 4, TAG_CICP_LINEAR);
+
+    // sRGB is used by the first two images, so its table is reused.
+    size_t hits1, misses1;
+    png_util_transfer_cache_stats(&hits1, &misses1);
+    if (ret == 0 && (misses1 - misses0 != 3 || hits1 - hits0 < 20)) {
+        fprintf(stderr, "unexpected cache stats: hits=%zu, misses=%zu\n", hits1 - hits0, misses1 - misses0);
+        ret = 1;
+    }
+    if (ret == 0)
+        run_benchmark();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
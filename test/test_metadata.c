@@ -0,0 +1,226 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const png_byte cicp[4] = { 9, 16, 0, 1 };
+static const png_byte clli[8] = { 0, 0x98, 0x96, 0x80, 0, 0x0f, 0x42, 0x40 };
+static const png_byte exif[10] = { 'M', 'M', 0, 42, 0, 0, 0, 8, 0, 0 };
+
+// A small RGB display profile. libpng checks the header and the tag table,
+// and ignores iCCP chunks shorter than 92 bytes, so a noisy private tag is added.
+#define ICC_SIZE 240
+static void make_icc_profile(png_byte* profile) {
+    memset(profile, 0, ICC_SIZE);
+    profile[3] = ICC_SIZE;
+    memcpy(profile + 12, "mntr", 4);
+    memcpy(profile + 16, "RGB ", 4);
+    memcpy(profile + 20, "XYZ ", 4);
+    memcpy(profile + 36, "acsp", 4);
+    // D50 illuminant
+    const png_byte d50[12] = { 0, 0, 0xf6, 0xd6, 0, 1, 0, 0, 0, 0, 0xd3, 0x2d };
+    memcpy(profile + 68, d50, 12);
+    // tag table
+    profile[131] = 2;
+    memcpy(profile + 132, "wtpt", 4);
+    profile[139] = 156;
+    profile[143] = 20;
+    memcpy(profile + 144, "test", 4);
+    profile[151] = 176;
+    profile[155] = 64;
+    memcpy(profile + 156, "XYZ ", 4);
+    memcpy(profile + 164, d50, 12);
+    unsigned int seed = 1;
+    for (int i = 176; i < ICC_SIZE; i++) {
+        seed = seed * 1103515245 + 12345;
+        profile[i] = (png_byte)(seed >> 16);
+    }
+}
+
+static void fill_row(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr) {
+    (void)y;
+    (void)user_ptr;
+    memset(row, 0x80, rowbytes);
+}
+
+static mem_buffer make_png(void) {
+    mem_buffer buf = { NULL, 0 };
+    png_infop info;
+    png_structp png = start_png(&buf, &info, 16, 8, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_ADAM7);
+
+    png_text text[3];
+    memset(text, 0, sizeof(text));
+    text[0].compression = PNG_TEXT_COMPRESSION_NONE;
+    text[0].key = (png_charp)"Title";
+    text[0].text = (png_charp)"metadata test";
+    text[1].compression = PNG_TEXT_COMPRESSION_zTXt;
+    text[1].key = (png_charp)"Comment";
+    text[1].text = (png_charp)"compressed comment compressed comment compressed comment";
+    text[2].compression = PNG_ITXT_COMPRESSION_NONE;
+    text[2].key = (png_charp)"Author";
+    text[2].text = (png_charp)"\xe5\xa4\xaa\xe9\x83\x8e";
+    text[2].lang = (png_charp)"ja";
+    text[2].lang_key = (png_charp)"\xe8\x91\x97\xe8\x80\x85";
+    png_set_text(png, info, text, 3);
+
+    png_byte profile[ICC_SIZE];
+    make_icc_profile(profile);
+    png_set_iCCP(png, info, "test profile", PNG_COMPRESSION_TYPE_BASE, profile, sizeof(profile));
+    png_set_pHYs(png, info, 3780, 3780, PNG_RESOLUTION_METER);
+    png_time time = { 2024, 2, 29, 12, 34, 56 };
+    png_set_tIME(png, info, &time);
+    png_write_info(png, info);
+
+    // These chunks are written raw because png_set_cICP and friends may be NULL.
+    png_byte mdcv[24];
+    for (int i = 0; i < 8; i++) {
+        mdcv[i * 2] = (png_byte)(i + 1);
+        mdcv[i * 2 + 1] = (png_byte)(i * 16);
+    }
+    memcpy(mdcv + 16, clli, 8);
+    png_write_chunk(png, (png_const_bytep)"cICP", cicp, sizeof(cicp));
+    png_write_chunk(png, (png_const_bytep)"cLLI", clli, sizeof(clli));
+    png_write_chunk(png, (png_const_bytep)"mDCV", mdcv, sizeof(mdcv));
+    png_write_chunk(png, (png_const_bytep)"eXIf", exif, sizeof(exif));
+    png_write_chunk(png, (png_const_bytep)"prVt", exif, sizeof(exif));
+
+    // Text after IDAT is not reported.
+    png_text late;
+    memset(&late, 0, sizeof(late));
+    late.compression = PNG_TEXT_COMPRESSION_NONE;
+    late.key = (png_charp)"Late";
+    late.text = (png_charp)"after IDAT";
+    png_set_text(png, info, &late, 1);
+    finish_png(png, info, fill_row, NULL);
+    return buf;
+}
+
+static int check_metadata(const png_util_metadata* meta) {
+    const png_util_header* h = &meta->header;
+    if (h->width != 16 || h->height != 8 || h->bit_depth != 8 ||
+            h->color_type != PNG_COLOR_TYPE_RGB || h->interlace_type != PNG_INTERLACE_ADAM7) {
+        fprintf(stderr, "unexpected header\n");
+        return 1;
+    }
+    png_uint_32 expected = PNG_INFO_iCCP | PNG_INFO_eXIf | PNG_INFO_cICP | PNG_INFO_cLLI |
+                           PNG_INFO_mDCV | PNG_INFO_pHYs | PNG_INFO_tIME;
+    if (meta->valid != expected) {
+        fprintf(stderr, "unexpected valid flags: %x\n", meta->valid);
+        return 1;
+    }
+    if (meta->num_text != 3 ||
+            strcmp(meta->text[0].key, "Title") != 0 ||
+            strcmp(meta->text[0].text, "metadata test") != 0 ||
+            meta->text[1].compression != PNG_TEXT_COMPRESSION_zTXt ||
+            strcmp(meta->text[1].text, "compressed comment compressed comment compressed comment") != 0 ||
+            meta->text[2].compression != PNG_ITXT_COMPRESSION_NONE ||
+            strcmp(meta->text[2].text, "\xe5\xa4\xaa\xe9\x83\x8e") != 0 ||
+            meta->text[2].itxt_length != 6 ||
+            strcmp(meta->text[2].lang, "ja") != 0 ||
+            strcmp(meta->text[2].lang_key, "\xe8\x91\x97\xe8\x80\x85") != 0) {
+        fprintf(stderr, "unexpected text chunks: %d\n", meta->num_text);
+        return 1;
+    }
+    png_byte profile[ICC_SIZE];
+    make_icc_profile(profile);
+    if (strcmp(meta->iccp_name, "test profile") != 0 || meta->iccp_size != ICC_SIZE ||
+            memcmp(meta->iccp_profile, profile, ICC_SIZE) != 0) {
+        fprintf(stderr, "unexpected iCCP\n");
+        return 1;
+    }
+    if (meta->exif_size != sizeof(exif) || memcmp(meta->exif, exif, sizeof(exif)) != 0 ||
+            memcmp(meta->cicp, cicp, 4) != 0 ||
+            meta->clli_max_cll != 10000000 || meta->clli_max_fall != 1000000 ||
+            meta->mdcv_chromaticities[0] != 0x0100 || meta->mdcv_chromaticities[7] != 0x0870 ||
+            meta->mdcv_max_luminance != 10000000 || meta->mdcv_min_luminance != 1000000) {
+        fprintf(stderr, "unexpected eXIf, cICP, cLLI or mDCV\n");
+        return 1;
+    }
+    if (meta->phys_x != 3780 || meta->phys_y != 3780 || meta->phys_unit != PNG_RESOLUTION_METER ||
+            meta->time.year != 2024 || meta->time.month != 2 || meta->time.day != 29 ||
+            meta->time.second != 56) {
+        fprintf(stderr, "unexpected pHYs or tIME\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int test_metadata(void) {
+    mem_buffer buf = make_png();
+    if (write_file("metadata.png", &buf)) {
+        fprintf(stderr, "failed to write metadata.png\n");
+        free(buf.data);
+        return 1;
+    }
+    png_util_metadata meta;
+    png_util_error err = png_read_metadata_file("metadata.png", &meta);
+    int ret = 0;
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_read_metadata_file: error: %u\n", err);
+        ret = 1;
+    } else {
+        ret = check_metadata(&meta);
+        png_util_metadata_free(&meta);
+    }
+
+    // The image data is never read.
+    size_t idat = find_chunk(buf.data, buf.size, "IDAT");
+    if (ret == 0 && idat == 0) {
+        fprintf(stderr, "IDAT not found\n");
+        ret = 1;
+    }
+    if (ret == 0) {
+        err = png_read_metadata(buf.data, idat + 8, &meta);
+        if (err != PNG_UTIL_SUCCESS) {
+            fprintf(stderr, "png_read_metadata: error: %u\n", err);
+            ret = 1;
+        } else {
+            ret = check_metadata(&meta);
+            png_util_metadata_free(&meta);
+        }
+    }
+
+    if (ret == 0 && png_read_metadata(buf.data, 40, &meta) != PNG_UTIL_ERROR_LIBPNG) {
+        fprintf(stderr, "png_read_metadata: not PNG_UTIL_ERROR_LIBPNG\n");
+        ret = 1;
+    }
+    free(buf.data);
+    return ret;
+}
+
+static int test_batch(void) {
+    const char* paths[] = { "metadata.png", "not-found.png", "input.png" };
+    png_util_metadata metas[3];
+    png_util_error errors[3];
+    png_util_error err = png_read_metadata_files(paths, 3, 2, metas, errors);
+    int ret = 0;
+    if (err != PNG_UTIL_ERROR_IO || errors[0] != PNG_UTIL_SUCCESS ||
+            errors[1] != PNG_UTIL_ERROR_IO || errors[2] != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_read_metadata_files: unexpected results: %u\n", err);
+        ret = 1;
+    }
+    if (ret == 0)
+        ret = check_metadata(&metas[0]);
+    if (ret == 0 && (metas[2].header.width != 300 || metas[2].header.height != 250)) {
+        fprintf(stderr, "png_read_metadata_files: unexpected header for input.png\n");
+        ret = 1;
+    }
+    for (int i = 0; i < 3; i++)
+        png_util_metadata_free(&metas[i]);
+    return ret;
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_metadata();
+    if (ret == 0)
+        ret = test_batch();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
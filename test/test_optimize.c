@@ -0,0 +1,127 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void fill_row(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr) {
+    int palette = *(const int*)user_ptr;
+    for (size_t x = 0; x < rowbytes; x++)
+        row[x] = palette ? (png_byte)((x / 5 + y / 3) % 4) : (png_byte)(x * 3 + y * 2 + ((x * y) >> 7));
+}
+
+// Writes a fast-compressed image with a text chunk. palette selects a 2-bit palette image.
+static mem_buffer make_png(png_uint_32 width, png_uint_32 height, int palette, int interlace) {
+    mem_buffer buf = { NULL, 0 };
+    png_infop info;
+    png_structp png = start_png(&buf, &info, width, height, palette ? 2 : 8,
+                                palette ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_RGB, interlace);
+    png_set_compression_level(png, 1);
+    if (palette) {
+        png_color colors[4] = { { 0, 0, 0 }, { 255, 0, 0 }, { 0, 255, 0 }, { 0, 0, 255 } };
+        png_set_PLTE(png, info, colors, 4);
+    }
+    png_text text;
+    memset(&text, 0, sizeof(text));
+    text.compression = PNG_TEXT_COMPRESSION_NONE;
+    text.key = (png_charp)"Comment";
+    text.text = (png_charp)"kept";
+    png_set_text(png, info, &text, 1);
+    png_write_info(png, info);
+    finish_png(png, info, fill_row, &palette);
+    return buf;
+}
+
+static int test_optimize(int palette, int interlace) {
+    mem_buffer buf = make_png(97, 61, palette, interlace);
+    png_util_optimize_result results[PNG_UTIL_OPTIMIZE_DEFAULT_TRIALS];
+    png_util_buffer out;
+    png_util_error err = png_optimize(buf.data, buf.size, NULL, &out, results);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_optimize: error: %u\n", err);
+        free(buf.data);
+        return 1;
+    }
+    int ret = 0;
+    size_t best = 0;
+    for (int i = 0; i < PNG_UTIL_OPTIMIZE_DEFAULT_TRIALS; i++) {
+        if ((results[i].size == 0) != (results[i].aborted != 0)) {
+            fprintf(stderr, "png_optimize: unexpected result of trial %d\n", i);
+            ret = 1;
+        }
+        if (results[i].size > 0 && (best == 0 || results[i].size < best))
+            best = results[i].size;
+    }
+    png_util_metadata meta;
+    if (ret == 0 && (out.size != best || out.size >= buf.size)) {
+        fprintf(stderr, "png_optimize: unexpected size %zu (best %zu, original %zu)\n", out.size, best, buf.size);
+        ret = 1;
+    } else if (ret == 0 && png_validate(out.data, out.size, PNG_UTIL_VALIDATE_DECODE, NULL) != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_optimize: invalid output\n");
+        ret = 1;
+    } else if (ret == 0 && !same_pixels(buf.data, buf.size, out.data, out.size)) {
+        fprintf(stderr, "png_optimize: unexpected pixels\n");
+        ret = 1;
+    } else if (ret == 0 && png_read_metadata(out.data, out.size, &meta) == PNG_UTIL_SUCCESS) {
+        if (meta.num_text != 1) {
+            fprintf(stderr, "png_optimize: text chunk was lost\n");
+            ret = 1;
+        }
+        png_util_metadata_free(&meta);
+    }
+
+    // An optimized PNG is copied as it is when no trial beats it.
+    png_util_encode_options trial;
+    memset(&trial, 0, sizeof(trial));
+    trial.compression_level = 1;
+    png_util_optimize_options options = { &trial, 1, 1 };
+    png_util_buffer again;
+    if (ret == 0 && (png_optimize(out.data, out.size, &options, &again, NULL) != PNG_UTIL_SUCCESS ||
+                     again.size != out.size || memcmp(again.data, out.data, out.size) != 0)) {
+        fprintf(stderr, "png_optimize: the optimized PNG was replaced\n");
+        ret = 1;
+    }
+    png_util_buffer_free(&again);
+    trial.window_bits = 16;
+    if (ret == 0 && png_optimize(out.data, out.size, &options, &again, NULL) != PNG_UTIL_ERROR_INVALID_ARGUMENT) {
+        fprintf(stderr, "png_optimize: invalid window bits were accepted\n");
+        ret = 1;
+    }
+    png_util_buffer_free(&out);
+    free(buf.data);
+    return ret;
+}
+
+static void run_benchmark(void) {
+    mem_buffer buf = make_png(256, 256, 0, PNG_INTERLACE_NONE);
+    png_util_optimize_result results[PNG_UTIL_OPTIMIZE_DEFAULT_TRIALS];
+    png_util_buffer out;
+    clock_t start = clock();
+    png_optimize(buf.data, buf.size, NULL, &out, results);
+    double ms = elapsed_ms(start);
+    int aborted = 0;
+    for (int i = 0; i < PNG_UTIL_OPTIMIZE_DEFAULT_TRIALS; i++)
+        aborted += results[i].aborted;
+    printf("256x256 RGB8  %zu -> %zu bytes, %d trials (%d aborted): %.2f ms CPU\n", buf.size, out.size,
+           PNG_UTIL_OPTIMIZE_DEFAULT_TRIALS, aborted, ms);
+    png_util_buffer_free(&out);
+    free(buf.data);
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_optimize(0, PNG_INTERLACE_NONE);
+    if (ret == 0)
+        ret = test_optimize(0, PNG_INTERLACE_ADAM7);
+    if (ret == 0)
+        ret = test_optimize(1, PNG_INTERLACE_NONE);
+    if (ret == 0)
+        run_benchmark();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
@@ -0,0 +1,133 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static png_byte sample(png_uint_32 x, png_uint_32 y) {
+    return (png_byte)(x * 5 + y * 3 + ((x * y) >> 6));
+}
+
+// Writes a raw file of RGB rows with a header and padded rows.
+static void write_raw(const char* filename, png_uint_32 width, png_uint_32 height, size_t offset, size_t stride) {
+    FILE* fp = fopen(filename, "wb");
+    png_byte* row = (png_byte*)calloc(stride > offset ? stride : offset, 1);
+    fwrite(row, 1, offset, fp);
+    for (png_uint_32 y = 0; y < height; y++) {
+        for (size_t x = 0; x < (size_t)width * 3; x++)
+            row[x] = sample((png_uint_32)x, y);
+        fwrite(row, 1, y + 1 < height ? stride : (size_t)width * 3, fp);
+    }
+    free(row);
+    fclose(fp);
+}
+
+static int fill_row(png_uint_32 y, png_byte* row, void* user_ptr) {
+    png_uint_32 width = *(const png_uint_32*)user_ptr;
+    for (size_t x = 0; x < (size_t)width * 3; x++)
+        row[x] = sample((png_uint_32)x, y);
+    return 1;
+}
+
+static int fail_row(png_uint_32 y, png_byte* row, void* user_ptr) {
+    return y < 5 && fill_row(y, row, user_ptr);
+}
+
+// Checks that a PNG file holds the sample pattern.
+static int check_file(const char* filename, png_uint_32 width, png_uint_32 height) {
+    mem_buffer buf = read_file(filename);
+    png_util_image expected = alloc_image(width, height, 8, PNG_COLOR_TYPE_RGB, 0);
+    for (png_uint_32 y = 0; y < height; y++)
+        fill_row(y, expected.pixels + expected.row_stride * y, &width);
+    int ret = !buf.data || check_png(filename, &expected, buf.data, buf.size);
+    png_util_image_free(&expected);
+    free(buf.data);
+    return ret;
+}
+
+static int test_raw_file(void) {
+    png_util_header header = { 211, 157, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE };
+    write_raw("raw.bin", 211, 157, 100, 211 * 3 + 13);
+    png_util_stream_options options;
+    memset(&options, 0, sizeof(options));
+    options.write_buffer = 1000;
+    options.readahead = 4096;
+    png_util_error err = png_encode_raw_file("raw.bin", 100, 211 * 3 + 13, &header, "raw.png", &options);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_encode_raw_file: error: %u\n", err);
+        return 1;
+    }
+    if (check_file("raw.png", 211, 157))
+        return 1;
+    // The file is one byte short of the last row.
+    header.height = 158;
+    err = png_encode_raw_file("raw.bin", 100, 211 * 3 + 13, &header, "raw.png", &options);
+    if (err != PNG_UTIL_ERROR_INVALID_ARGUMENT) {
+        fprintf(stderr, "png_encode_raw_file accepted a short file: %u\n", err);
+        return 1;
+    }
+    return 0;
+}
+
+static int test_row_source(void) {
+    png_uint_32 width = 300;
+    png_util_header header = { 300, 200, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE };
+    png_util_stream_options options;
+    memset(&options, 0, sizeof(options));
+    options.preallocate = 4 << 20;
+    png_util_error err = png_encode_row_source(fill_row, &width, &header, "rows.png", &options);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_encode_row_source: error: %u\n", err);
+        return 1;
+    }
+    if (check_file("rows.png", 300, 200))
+        return 1;
+
+    // A failing source removes the output.
+    err = png_encode_row_source(fail_row, &width, &header, "rows_failed.png", NULL);
+    FILE* fp = fopen("rows_failed.png", "rb");
+    if (err != PNG_UTIL_ERROR_IO || fp) {
+        fprintf(stderr, "png_encode_row_source: unexpected result of a failing source: %u\n", err);
+        if (fp)
+            fclose(fp);
+        return 1;
+    }
+    return 0;
+}
+
+static void run_benchmark(void) {
+    png_uint_32 width = 4096, height = 2048;
+    png_util_header header = { 4096, 2048, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE };
+    write_raw("raw_bench.bin", width, height, 0, (size_t)width * 3);
+    png_util_encode_options encode;
+    memset(&encode, 0, sizeof(encode));
+    encode.compression_level = 1;
+    png_util_stream_options options;
+    memset(&options, 0, sizeof(options));
+    options.encode = &encode;
+    clock_t start = clock();
+    png_encode_raw_file("raw_bench.bin", 0, 0, &header, "raw_bench.png", &options);
+    double seconds = elapsed_ms(start) / 1000;
+    printf("4096x2048 RGB8  mapped: %.2f ms (%.1f MB/s),", seconds * 1000, 24.0 / seconds);
+    start = clock();
+    png_encode_row_source(fill_row, &width, &header, "rows_bench.png", &options);
+    seconds = elapsed_ms(start) / 1000;
+    printf(" callback: %.2f ms (%.1f MB/s)\n", seconds * 1000, 24.0 / seconds);
+    remove("raw_bench.bin");
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_raw_file();
+    if (ret == 0)
+        ret = test_row_source();
+    if (ret == 0)
+        run_benchmark();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
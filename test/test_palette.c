@@ -0,0 +1,254 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct palette_desc {
+    png_color colors[256];
+    png_byte trans[256];
+    int num_palette;
+    int num_trans;
+} palette_desc;
+
+static void make_palette(palette_desc* palette, int num_palette, int num_trans) {
+    for (int i = 0; i < 256; i++) {
+        palette->colors[i].red = random_byte();
+        palette->colors[i].green = random_byte();
+        palette->colors[i].blue = random_byte();
+        palette->trans[i] = random_byte();
+    }
+    palette->num_palette = num_palette;
+    palette->num_trans = num_trans;
+}
+
+// Index of pixel (x, y). It is always less than num_palette.
+static png_byte pixel_index(png_uint_32 x, png_uint_32 y, int num_palette) {
+    return (png_byte)((x * 7 + y * 3 + (x * y >> 4)) % (png_uint_32)num_palette);
+}
+
+static void fill_row(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr) {
+    int num_palette = *(const int*)user_ptr;
+    for (png_uint_32 x = 0; x < rowbytes; x++)
+        row[x] = pixel_index(x, y, num_palette);
+}
+
+static mem_buffer make_png(png_uint_32 width, png_uint_32 height, int bit_depth, int interlace,
+                           const palette_desc* palette) {
+    mem_buffer buf = { NULL, 0 };
+    png_infop info;
+    png_structp png = start_png(&buf, &info, width, height, bit_depth, PNG_COLOR_TYPE_PALETTE, interlace);
+    png_set_PLTE(png, info, palette->colors, palette->num_palette);
+    if (palette->num_trans > 0)
+        png_set_tRNS(png, info, palette->trans, palette->num_trans, NULL);
+    png_write_info(png, info);
+    int num_palette = palette->num_palette;
+    finish_png(png, info, fill_row, &num_palette);
+    return buf;
+}
+
+static int test_indexed(int bit_depth, int interlace) {
+    const png_uint_32 width = 77, height = 21;
+    palette_desc palette;
+    make_palette(&palette, (1 << bit_depth) - 1, bit_depth > 1 ? 3 : 1);
+    mem_buffer buf = make_png(width, height, bit_depth, interlace, &palette);
+    png_util_indexed_image image;
+    png_util_error err = png_decode_indexed(buf.data, buf.size, &image);
+    free(buf.data);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_decode_indexed: error: %u\n", err);
+        return 1;
+    }
+    int ret = 0;
+    if (image.indices.width != width || image.indices.height != height ||
+            image.num_palette != palette.num_palette) {
+        fprintf(stderr, "png_decode_indexed: unexpected size\n");
+        ret = 1;
+    }
+    for (png_uint_32 y = 0; y < height && ret == 0; y++) {
+        for (png_uint_32 x = 0; x < width && ret == 0; x++) {
+            if (image.indices.pixels[image.indices.row_stride * y + x] != pixel_index(x, y, palette.num_palette)) {
+                fprintf(stderr, "png_decode_indexed: unexpected index at (%u, %u)\n", x, y);
+                ret = 1;
+            }
+        }
+    }
+    for (int i = 0; i < 256 && ret == 0; i++) {
+        png_byte expected[4] = { 0, 0, 0, 255 };
+        if (i < palette.num_palette) {
+            expected[0] = palette.colors[i].red;
+            expected[1] = palette.colors[i].green;
+            expected[2] = palette.colors[i].blue;
+            if (i < palette.num_trans)
+                expected[3] = palette.trans[i];
+        }
+        if (memcmp(image.palette + i * 4, expected, 4) != 0) {
+            fprintf(stderr, "png_decode_indexed: unexpected palette entry %d\n", i);
+            ret = 1;
+        }
+    }
+    png_util_image_free(&image.indices);
+    return ret;
+}
+
+static png_byte* decode_into(const mem_buffer* buf, png_uint_32 width, png_uint_32 height,
+                             png_util_format format) {
+    png_util_dest dest;
+    memset(&dest, 0, sizeof(dest));
+    dest.width = width;
+    dest.height = height;
+    dest.format = format;
+    dest.alignment = 1;
+    dest.row_stride = width * png_util_format_size(format);
+    dest.size = dest.row_stride * height;
+    dest.pixels = malloc(dest.size);
+    if (!dest.pixels)
+        return NULL;
+    png_util_error err = png_decode_into(buf->data, buf->size, &dest);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_decode_into: error: %u\n", err);
+        free(dest.pixels);
+        return NULL;
+    }
+    return (png_byte*)dest.pixels;
+}
+
+// Images with the same palette reuse the table.
+static int test_cache(void) {
+    const png_uint_32 width = 40, height = 8;
+    palette_desc palette_a, palette_b;
+    make_palette(&palette_a, 200, 50);
+    make_palette(&palette_b, 200, 50);
+    mem_buffer a = make_png(width, height, 8, PNG_INTERLACE_NONE, &palette_a);
+    mem_buffer b = make_png(width, height, 8, PNG_INTERLACE_NONE, &palette_b);
+    size_t hits0, misses0, hits1, misses1;
+    png_util_palette_cache_stats(&hits0, &misses0);
+
+    // The SIMD expansion must match the scalar one.
+    png_byte* simd = decode_into(&a, width, height, PNG_UTIL_FORMAT_BGRA8);
+    png_util_set_cpu_mask(0);
+    png_byte* scalar = decode_into(&a, width, height, PNG_UTIL_FORMAT_BGRA8);
+    png_util_set_cpu_mask(~0U);
+    png_byte* other = decode_into(&b, width, height, PNG_UTIL_FORMAT_BGRA8);
+    png_util_palette_cache_stats(&hits1, &misses1);
+    int ret = 0;
+    if (!simd || !scalar || !other || memcmp(simd, scalar, width * height * 4) != 0) {
+        fprintf(stderr, "png_decode_into: unexpected pixels\n");
+        ret = 1;
+    } else if (hits1 - hits0 != 1 || misses1 - misses0 != 2) {
+        fprintf(stderr, "unexpected cache stats: hits=%zu, misses=%zu\n", hits1 - hits0, misses1 - misses0);
+        ret = 1;
+    }
+    free(simd);
+    free(scalar);
+    free(other);
+    free(a.data);
+    free(b.data);
+    return ret;
+}
+
+// The libpng reference expands with png_set_palette_to_rgb and png_set_tRNS_to_alpha.
+static void expand_palette(png_struct* png, png_info* info, void* user_ptr) {
+    (void)info;
+    (void)user_ptr;
+    png_set_palette_to_rgb(png);
+    png_set_tRNS_to_alpha(png);
+}
+
+// More palettes than the cache holds. Evicted and replaced tables must stay correct.
+static int test_eviction(void) {
+    const png_uint_32 width = 40, height = 8;
+    mem_buffer bufs[20];
+    for (int i = 0; i < 20; i++) {
+        palette_desc palette;
+        make_palette(&palette, 16 + i, 1 + i);
+        bufs[i] = make_png(width, height, 8, PNG_INTERLACE_NONE, &palette);
+    }
+    int ret = 0;
+    for (int round = 0; round < 2 && ret == 0; round++) {
+        for (int i = 0; i < 20 && ret == 0; i++) {
+            size_t rowbytes;
+            png_byte* expected = decode_libpng(bufs[i].data, bufs[i].size, expand_palette, NULL, &rowbytes);
+            png_byte* actual = decode_into(&bufs[i], width, height, PNG_UTIL_FORMAT_RGBA8);
+            if (!actual || memcmp(expected, actual, width * height * 4) != 0) {
+                fprintf(stderr, "palette %d: unexpected pixels after eviction\n", i);
+                ret = 1;
+            }
+            free(expected);
+            free(actual);
+        }
+    }
+    for (int i = 0; i < 20; i++)
+        free(bufs[i].data);
+    return ret;
+}
+
+static int run_benchmark(void) {
+    const png_uint_32 size = 1024;
+    palette_desc palette;
+    make_palette(&palette, 256, 256);
+    mem_buffer buf = make_png(size, size, 8, PNG_INTERLACE_NONE, &palette);
+    double best[2] = { 0, 0 };
+    int ret = 0;
+    for (int i = 0; i < 3; i++) {
+        size_t rowbytes;
+        clock_t start = clock();
+        png_byte* expected = decode_libpng(buf.data, buf.size, expand_palette, NULL, &rowbytes);
+        double libpng = elapsed_ms(start);
+        start = clock();
+        png_byte* actual = decode_into(&buf, size, size, PNG_UTIL_FORMAT_RGBA8);
+        double lut = elapsed_ms(start);
+        if (!actual || memcmp(expected, actual, (size_t)size * size * 4) != 0) {
+            fprintf(stderr, "png_decode_into: unexpected pixels\n");
+            ret = 1;
+        }
+        free(expected);
+        free(actual);
+        if (i == 0 || libpng < best[0])
+            best[0] = libpng;
+        if (i == 0 || lut < best[1])
+            best[1] = lut;
+    }
+    printf("PLTE8 -> RGBA8  libpng transforms: %.2f ms, lookup table: %.2f ms\n",
+           best[0], best[1]);
+    free(buf.data);
+    return ret;
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = 0;
+    static const int depths[] = { 1, 2, 4, 8 };
+    for (int i = 0; i < 4 && ret == 0; i++) {
+        ret = test_indexed(depths[i], PNG_INTERLACE_NONE);
+        if (ret == 0)
+            ret = test_indexed(depths[i], PNG_INTERLACE_ADAM7);
+    }
+    if (ret == 0)
+        ret = test_cache();
+    if (ret == 0)
+        ret = test_eviction();
+    if (ret == 0)
+        ret = run_benchmark();
+
+    // Other color types are rejected.
+    if (ret == 0) {
+        FILE *fp = fopen("input.png", "rb");
+        png_byte data[4096];
+        size_t size = fp ? fread(data, 1, sizeof(data), fp) : 0;
+        if (fp)
+            fclose(fp);
+        png_util_indexed_image image;
+        if (png_decode_indexed(data, size, &image) != PNG_UTIL_ERROR_UNSUPPORTED) {
+            fprintf(stderr, "png_decode_indexed: RGBA image was accepted\n");
+            ret = 1;
+        }
+    }
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
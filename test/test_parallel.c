@@ -0,0 +1,167 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int make_image(png_util_image* image, int bit_depth, int color_type) {
+    *image = alloc_image(301, 203, bit_depth, color_type, 0);
+    if (!image->pixels) {
+        fprintf(stderr, "failed to allocate pixels.\n");
+        return 1;
+    }
+    // gradients with some noise to exercise all filters
+    unsigned int seed = 1;
+    for (png_uint_32 y = 0; y < image->height; y++) {
+        png_byte* row = image->pixels + image->row_stride * y;
+        for (size_t x = 0; x < image->row_stride; x++) {
+            seed = seed * 1103515245 + 12345;
+            row[x] = (png_byte)(x + y * 3 + ((seed >> 16) & 7));
+        }
+    }
+    // libpng doesn't overwrite the padding bits
+    clear_padding_bits(image);
+    return 0;
+}
+
+// Decodes a PNG in the serial way to make sure other readers accept it.
+static int compare_with_libpng(const mem_buffer* buf, const png_util_image* image) {
+    size_t rowbytes;
+    png_byte* pixels = decode_libpng(buf->data, buf->size, NULL, NULL, &rowbytes);
+    int ret = 0;
+    for (png_uint_32 y = 0; y < image->height; y++) {
+        if (memcmp(pixels + rowbytes * y, image->pixels + image->row_stride * y, image->row_stride) != 0) {
+            fprintf(stderr, "libpng: unexpected pixel data detected at row %u.\n", y);
+            ret = 1;
+            break;
+        }
+    }
+    free(pixels);
+    return ret;
+}
+
+static int test_roundtrip(int bit_depth, int color_type) {
+    png_util_image image;
+    if (make_image(&image, bit_depth, color_type))
+        return 1;
+
+    FILE *fp = fopen("parallel.png", "wb");
+    if (!fp) {
+        fprintf(stderr, "failed to open parallel.png\n");
+        png_util_image_free(&image);
+        return 1;
+    }
+    png_util_parallel_options options = {0};
+    options.rows_per_segment = 16;
+    options.threads = 4;
+    png_util_error err = png_write_parallel(fp, &image, &options);
+    fclose(fp);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_write_parallel: error: %u\n", err);
+        png_util_image_free(&image);
+        return 1;
+    }
+
+    mem_buffer buf = read_file("parallel.png");
+    png_byte* data = buf.data;
+    size_t size = buf.size;
+    if (!data) {
+        png_util_image_free(&image);
+        return 1;
+    }
+    int ret = compare_with_libpng(&buf, &image);
+
+    png_util_image decoded;
+    err = png_read_parallel(data, size, 4, &decoded);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_read_parallel: error: %u\n", err);
+        ret = 1;
+    } else {
+        for (png_uint_32 y = 0; y < image.height && ret == 0; y++) {
+            if (memcmp(decoded.pixels + decoded.row_stride * y,
+                       image.pixels + image.row_stride * y, image.row_stride) != 0) {
+                fprintf(stderr, "png_read_parallel: unexpected pixel data detected at row %u.\n", y);
+                ret = 1;
+            }
+        }
+        png_util_image_free(&decoded);
+    }
+
+    // A broken index must fall back to the serial path.
+    png_byte* index = NULL;
+    for (size_t i = 0; i + 4 <= size; i++) {
+        if (memcmp(data + i, PNG_UTIL_PARALLEL_CHUNK, 4) == 0) {
+            index = data + i + 4;
+            break;
+        }
+    }
+    if (!index) {
+        fprintf(stderr, "%s chunk not found.\n", PNG_UTIL_PARALLEL_CHUNK);
+        ret = 1;
+    } else if (ret == 0) {
+        index[0] = 0xff;  // unknown version
+        err = png_read_parallel(data, size, 4, &decoded);
+        if (err != PNG_UTIL_SUCCESS ||
+                memcmp(decoded.pixels, image.pixels, image.row_stride * image.height) != 0) {
+            fprintf(stderr, "png_read_parallel: fallback failed: %u\n", err);
+            ret = 1;
+        }
+        png_util_image_free(&decoded);
+    }
+
+    free(data);
+    png_util_image_free(&image);
+    return ret;
+}
+
+// input.png has no restart points. It should be decoded with libpng.
+static int test_fallback(void) {
+    mem_buffer buf = read_file("input.png");
+    if (!buf.data)
+        return 1;
+    png_util_image image;
+    png_util_error err = png_read_parallel(buf.data, buf.size, 0, &image);
+    free(buf.data);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_read_parallel: error: %u\n", err);
+        return 1;
+    }
+    if (image.color_type != PNG_COLOR_TYPE_RGB_ALPHA || image.bit_depth != 8) {
+        fprintf(stderr, "png_read_parallel: unexpected format\n");
+        png_util_image_free(&image);
+        return 1;
+    }
+    for (png_uint_32 y = 0; y < image.height; y++) {
+        png_byte* row = image.pixels + image.row_stride * y;
+        for (png_uint_32 x = 0; x < image.width; x++) {
+            if (row[x*4 + 0] != (png_byte)((double)x / (double)image.width * 255) ||
+                row[x*4 + 1] != 255 ||
+                row[x*4 + 2] != (png_byte)((double)y / (double)image.height * 255) ||
+                row[x*4 + 3] != 255) {
+                fprintf(stderr, "unexpected pixel data detected.\n");
+                png_util_image_free(&image);
+                return 1;
+            }
+        }
+    }
+    png_util_image_free(&image);
+    return 0;
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_roundtrip(8, PNG_COLOR_TYPE_RGB_ALPHA);
+    if (ret == 0)
+        ret = test_roundtrip(16, PNG_COLOR_TYPE_GRAY);
+    if (ret == 0)
+        ret = test_roundtrip(4, PNG_COLOR_TYPE_GRAY);
+    if (ret == 0)
+        ret = test_fallback();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
@@ -0,0 +1,224 @@
+#include "test_utils.h"
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static png_byte sample(png_uint_32 x, png_uint_32 y) {
+    return (png_byte)(x * 7 + y * 3 + ((x * y) >> 5));
+}
+
+// Fills rows whose packed bytes are sample() bytes.
+static void fill_row(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr) {
+    int bit_depth = *(const int*)user_ptr;
+    for (size_t x = 0; x < rowbytes; x++) {
+        if (bit_depth < 8) {
+            size_t bit = x * bit_depth;
+            row[x] = (png_byte)((sample((png_uint_32)(bit / 8), y) >> (8 - bit_depth - bit % 8)) &
+                                ((1 << bit_depth) - 1));
+        } else {
+            row[x] = sample((png_uint_32)x, y);
+        }
+    }
+}
+
+static void make_png(const char* filename, png_uint_32 width, png_uint_32 height, int bit_depth, int color_type,
+                     int interlace) {
+    mem_buffer buf = write_png(width, height, bit_depth, color_type, interlace, fill_row, &bit_depth);
+    write_file(filename, &buf);
+    free(buf.data);
+}
+
+static int test_pipe(const char* name, png_uint_32 width, png_uint_32 height, int bit_depth, int color_type,
+                     size_t depth) {
+    make_png("pipe_read.png", width, height, bit_depth, color_type, PNG_INTERLACE_NONE);
+    FILE* fp = fopen("pipe_read.png", "rb");
+    png_util_pipe_reader* reader;
+    png_util_header header;
+    png_util_error err = png_pipe_reader_create(fp, depth, &header, &reader);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "%s: png_pipe_reader_create: error: %u\n", name, err);
+        fclose(fp);
+        return 1;
+    }
+    int ret = header.width != width || header.height != height || header.bit_depth != bit_depth ||
+              header.color_type != color_type;
+    size_t rowbytes = ((size_t)width * (color_type == PNG_COLOR_TYPE_RGB ? 3 : 1) * bit_depth + 7) / 8;
+    for (png_uint_32 y = 0; y < height && ret == 0; y++) {
+        const png_byte* row;
+        err = png_pipe_reader_next(reader, &row);
+        for (size_t x = 0; x < rowbytes && err == PNG_UTIL_SUCCESS && ret == 0; x++)
+            ret = row[x] != sample((png_uint_32)x, y);
+        ret = ret || err != PNG_UTIL_SUCCESS;
+    }
+    const png_byte* row;
+    if (ret == 0 && png_pipe_reader_next(reader, &row) != PNG_UTIL_ERROR_INVALID_ARGUMENT)
+        ret = 1;
+    png_util_pipe_stats stats;
+    err = png_pipe_reader_finish(reader, &stats);
+    fclose(fp);
+    if (ret != 0 || err != PNG_UTIL_SUCCESS || stats.rows != height) {
+        fprintf(stderr, "%s: unexpected rows\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+// A mem_reader that read errors jump out of.
+typedef struct jmp_reader {
+    mem_reader src;
+    jmp_buf jmp;
+} jmp_reader;
+
+static void on_error(png_struct* png, const char* message) {
+    (void)message;
+    longjmp(((jmp_reader*)png_get_io_ptr(png))->jmp, 1);
+}
+
+static void on_warning(png_struct* png, const char* message) {
+    (void)png;
+    (void)message;
+}
+
+// Rows a png_read_row() loop gets from a truncated PNG.
+static png_uint_32 count_rows(const png_byte* data, size_t size) {
+    jmp_reader src;
+    memset(&src, 0, sizeof(src));
+    src.src.data = data;
+    src.src.size = size;
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, on_error, on_warning);
+    png_infop info = png_create_info_struct(png);
+    png_set_read_fn(png, &src, read_mem);
+    png_byte* volatile row = NULL;
+    volatile png_uint_32 rows = 0;
+    if (setjmp(src.jmp) == 0) {
+        png_read_info(png, info);
+        row = (png_byte*)malloc(png_get_rowbytes(png, info));
+        for (png_uint_32 height = png_get_image_height(png, info); rows < height; rows++)
+            png_read_row(png, row, NULL);
+    }
+    free(row);
+    png_destroy_read_struct(&png, &info, NULL);
+    return rows;
+}
+
+static int test_errors(void) {
+    // Interlaced images are rejected.
+    make_png("pipe_read.png", 40, 40, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_ADAM7);
+    FILE* fp = fopen("pipe_read.png", "rb");
+    png_util_pipe_reader* reader;
+    png_util_error err = png_pipe_reader_create(fp, 0, NULL, &reader);
+    fclose(fp);
+    if (err != PNG_UTIL_ERROR_UNSUPPORTED) {
+        fprintf(stderr, "png_pipe_reader_create accepted an interlaced image: %u\n", err);
+        return 1;
+    }
+
+    // A truncated file fails on the decode thread, and the error reaches the consumer.
+    make_png("pipe_read.png", 500, 800, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE);
+    mem_buffer buf = read_file("pipe_read.png");
+    buf.size /= 2;
+    write_file("pipe_read_truncated.png", &buf);
+    png_uint_32 expected = count_rows(buf.data, buf.size);
+    free(buf.data);
+    // The rows decoded before the error are not dropped, with a small ring or
+    // with one that holds them all.
+    const png_byte* row;
+    png_util_error finish;
+    for (size_t depth = 4; depth <= 1024; depth *= 256) {
+        fp = fopen("pipe_read_truncated.png", "rb");
+        err = png_pipe_reader_create(fp, depth, NULL, &reader);
+        // Give the decode thread time to fail first.
+        for (clock_t start = clock(); clock() - start < CLOCKS_PER_SEC / 20;) {
+        }
+        png_uint_32 rows = 0;
+        while (err == PNG_UTIL_SUCCESS && png_pipe_reader_next(reader, &row) == PNG_UTIL_SUCCESS)
+            rows++;
+        finish = err == PNG_UTIL_SUCCESS ? png_pipe_reader_finish(reader, NULL) : err;
+        fclose(fp);
+        if (err != PNG_UTIL_SUCCESS || finish != PNG_UTIL_ERROR_IO || rows == 0 || rows != expected) {
+            fprintf(stderr, "png_pipe_reader: truncated file: %u, %u after %u of %u rows\n", err, finish, rows,
+                    expected);
+            return 1;
+        }
+    }
+
+    // Finishing early cancels the decode thread.
+    fp = fopen("pipe_read.png", "rb");
+    err = png_pipe_reader_create(fp, 2, NULL, &reader);
+    for (int i = 0; i < 10 && err == PNG_UTIL_SUCCESS; i++)
+        err = png_pipe_reader_next(reader, &row);
+    png_util_pipe_stats stats;
+    finish = png_pipe_reader_finish(reader, &stats);
+    fclose(fp);
+    if (err != PNG_UTIL_SUCCESS || finish != PNG_UTIL_SUCCESS || stats.rows != 10) {
+        fprintf(stderr, "png_pipe_reader: cancel failed: %u, %u, %zu rows\n", err, finish, stats.rows);
+        return 1;
+    }
+    return 0;
+}
+
+// Heavy per-row work after decode.
+static unsigned int process_row(const png_byte* row, size_t size) {
+    unsigned int sum = 0;
+    for (size_t x = 0; x < size; x++) {
+        unsigned int v = row[x];
+        for (int i = 0; i < 24; i++)
+            v = v * 1103515245U + 12345U;
+        sum += v >> 16;
+    }
+    return sum;
+}
+
+static void run_benchmark(void) {
+    png_uint_32 width = 2048, height = 1024;
+    make_png("pipe_read_bench.png", width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE);
+    mem_buffer buf = read_file("pipe_read_bench.png");
+
+    // Decode, then process on the same thread.
+    unsigned int sum = 0;
+    clock_t start = clock();
+    png_util_image image;
+    png_read_parallel(buf.data, buf.size, 1, &image);
+    double decode_ms = elapsed_ms(start);
+    for (png_uint_32 y = 0; y < height; y++)
+        sum += process_row(image.pixels + image.row_stride * y, image.row_stride);
+    double process_ms = elapsed_ms(start) - decode_ms;
+    png_util_image_free(&image);
+    free(buf.data);
+    printf("2048x1024 RGB8  serial: decode %.2f ms + process %.2f ms,", decode_ms, process_ms);
+
+    FILE* fp = fopen("pipe_read_bench.png", "rb");
+    png_util_pipe_reader* reader;
+    png_pipe_reader_create(fp, 0, NULL, &reader);
+    const png_byte* row;
+    while (png_pipe_reader_next(reader, &row) == PNG_UTIL_SUCCESS)
+        sum += process_row(row, (size_t)width * 3);
+    png_util_pipe_stats stats;
+    png_pipe_reader_finish(reader, &stats);
+    fclose(fp);
+    printf(" pipelined: %.2f ms (decoder waited %zu times %.2f ms, consumer %zu times %.2f ms) %08x\n",
+           stats.seconds * 1000, stats.producer_waits, stats.producer_wait_seconds * 1000,
+           stats.consumer_waits, stats.consumer_wait_seconds * 1000, sum);
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_pipe("RGB8", 301, 203, 8, PNG_COLOR_TYPE_RGB, 0);
+    if (ret == 0)
+        ret = test_pipe("RGB16 depth 1", 77, 150, 16, PNG_COLOR_TYPE_RGB, 1);
+    if (ret == 0)
+        ret = test_pipe("gray1", 88, 64, 1, PNG_COLOR_TYPE_GRAY, 3);
+    if (ret == 0)
+        ret = test_errors();
+    if (ret == 0)
+        run_benchmark();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
@@ -0,0 +1,160 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Makes a row of RGB pixels. rounds adds work like a renderer's.
+static void render_row(png_byte* row, png_uint_32 width, png_uint_32 y, int rounds) {
+    for (png_uint_32 x = 0; x < width; x++) {
+        unsigned int v = x * 2654435761U ^ y * 40503U;
+        for (int i = 0; i < rounds; i++)
+            v = v * 1103515245U + 12345U;
+        row[x * 3] = (png_byte)(x + y);
+        row[x * 3 + 1] = (png_byte)(x * y >> 6);
+        row[x * 3 + 2] = (png_byte)((v >> 24) & 0x0f);
+    }
+}
+
+static int check_file(const char* filename, png_uint_32 width, png_uint_32 height) {
+    mem_buffer buf = read_file(filename);
+    if (!buf.data)
+        return 1;
+    png_util_image image = alloc_image(width, height, 8, PNG_COLOR_TYPE_RGB, 0);
+    for (png_uint_32 y = 0; y < height; y++)
+        render_row(image.pixels + image.row_stride * y, width, y, 0);
+    int ret = check_png(filename, &image, buf.data, buf.size);
+    png_util_image_free(&image);
+    free(buf.data);
+    return ret;
+}
+
+static int test_pipe(size_t depth) {
+    png_uint_32 width = 301, height = 203;
+    FILE* fp = fopen("pipe.png", "wb");
+    png_util_pipe_writer* writer;
+    png_util_encode_options options;
+    memset(&options, 0, sizeof(options));
+    options.compression_level = 3;
+    png_util_error err = png_pipe_writer_create(fp, width, height, 8, PNG_COLOR_TYPE_RGB, &options, depth, &writer);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_pipe_writer_create: error: %u\n", err);
+        fclose(fp);
+        return 1;
+    }
+    size_t free_rows = png_pipe_writer_free_rows(writer);
+    png_byte* row = (png_byte*)malloc((size_t)width * 3);
+    for (png_uint_32 y = 0; y < height && err == PNG_UTIL_SUCCESS; y++) {
+        render_row(row, width, y, 0);
+        err = png_pipe_writer_push(writer, row);
+    }
+    png_util_error extra = png_pipe_writer_push(writer, row);
+    png_util_pipe_stats stats;
+    if (err == PNG_UTIL_SUCCESS)
+        err = png_pipe_writer_finish(writer, &stats);
+    else
+        png_pipe_writer_finish(writer, NULL);
+    free(row);
+    fclose(fp);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_pipe_writer: error: %u\n", err);
+        return 1;
+    }
+    if (free_rows != (depth ? depth : PNG_UTIL_PIPE_DEFAULT_DEPTH) || extra != PNG_UTIL_ERROR_INVALID_ARGUMENT ||
+            stats.rows != height) {
+        fprintf(stderr, "png_pipe_writer: unexpected state: %zu free rows, %zu rows\n", free_rows, stats.rows);
+        return 1;
+    }
+    return check_file("pipe.png", width, height);
+}
+
+static int test_cancel(void) {
+    FILE* fp = fopen("pipe_cancel.png", "wb");
+    png_util_pipe_writer* writer;
+    if (png_pipe_writer_create(fp, 64, 64, 8, PNG_COLOR_TYPE_RGB, NULL, 4, &writer) != PNG_UTIL_SUCCESS) {
+        fclose(fp);
+        return 1;
+    }
+    png_byte row[64 * 3];
+    render_row(row, 64, 0, 0);
+    for (int y = 0; y < 10; y++)
+        png_pipe_writer_push(writer, row);
+    png_util_error err = png_pipe_writer_finish(writer, NULL);
+    fclose(fp);
+    if (err != PNG_UTIL_ERROR_INVALID_ARGUMENT) {
+        fprintf(stderr, "png_pipe_writer_finish: canceled writer returned %u\n", err);
+        return 1;
+    }
+
+    // Write errors reach the producer.
+    fp = fopen("pipe_cancel.png", "rb");
+    if (png_pipe_writer_create(fp, 64, 5000, 8, PNG_COLOR_TYPE_RGB, NULL, 4, &writer) != PNG_UTIL_SUCCESS) {
+        fclose(fp);
+        return 1;
+    }
+    err = PNG_UTIL_SUCCESS;
+    for (int y = 0; y < 5000 && err == PNG_UTIL_SUCCESS; y++)
+        err = png_pipe_writer_push(writer, row);
+    png_util_error finish = png_pipe_writer_finish(writer, NULL);
+    fclose(fp);
+    if (err != PNG_UTIL_ERROR_IO || finish != PNG_UTIL_ERROR_IO) {
+        fprintf(stderr, "png_pipe_writer: write error was not reported: %u, %u\n", err, finish);
+        return 1;
+    }
+    return 0;
+}
+
+static void run_benchmark(void) {
+    png_uint_32 width = 2048, height = 1024;
+    int rounds = 64;
+    png_util_encode_options options;
+    memset(&options, 0, sizeof(options));
+    options.compression_level = 1;
+
+    // Render every row, then encode on the same thread.
+    png_util_image image = alloc_image(width, height, 8, PNG_COLOR_TYPE_RGB, 0);
+    clock_t start = clock();
+    for (png_uint_32 y = 0; y < height; y++)
+        render_row(image.pixels + image.row_stride * y, width, y, rounds);
+    double render_ms = elapsed_ms(start);
+    png_util_buffer out;
+    png_encode(&image, &options, &out);
+    double encode_ms = elapsed_ms(start) - render_ms;
+    png_util_buffer_free(&out);
+    png_util_image_free(&image);
+    printf("2048x1024 RGB8  serial: render %.2f ms + encode %.2f ms,", render_ms, encode_ms);
+
+    FILE* fp = fopen("pipe_bench.png", "wb");
+    png_util_pipe_writer* writer;
+    png_pipe_writer_create(fp, width, height, 8, PNG_COLOR_TYPE_RGB, &options, 0, &writer);
+    png_byte* row = (png_byte*)malloc((size_t)width * 3);
+    for (png_uint_32 y = 0; y < height; y++) {
+        render_row(row, width, y, rounds);
+        png_pipe_writer_push(writer, row);
+    }
+    png_util_pipe_stats stats;
+    png_pipe_writer_finish(writer, &stats);
+    fclose(fp);
+    free(row);
+    printf(" pipelined: %.2f ms (producer waited %zu times %.2f ms, encoder %zu times %.2f ms)\n",
+           stats.seconds * 1000, stats.producer_waits, stats.producer_wait_seconds * 1000,
+           stats.consumer_waits, stats.consumer_wait_seconds * 1000);
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_pipe(0);
+    if (ret == 0)
+        ret = test_pipe(1);
+    if (ret == 0)
+        ret = test_cancel();
+    if (ret == 0)
+        run_benchmark();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
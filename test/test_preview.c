@@ -0,0 +1,141 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WIDTH 64
+#define HEIGHT 40
+
+static void source_pixel(png_uint_32 x, png_uint_32 y, png_byte* rgba) {
+    rgba[0] = (png_byte)(x * 4);
+    rgba[1] = (png_byte)(y * 6);
+    rgba[2] = (png_byte)(x ^ y);
+    rgba[3] = 255;
+}
+
+static void fill_row(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr) {
+    (void)user_ptr;
+    for (png_uint_32 x = 0; x < rowbytes / 3; x++) {
+        png_byte rgba[4];
+        source_pixel(x, y, rgba);
+        memcpy(row + x * 3, rgba, 3);
+    }
+}
+
+typedef struct preview_state {
+    int passes[8];
+    int count;
+    size_t fed;  // bytes fed before the current chunk
+    size_t fed_after_pass0;
+    int errors;
+} preview_state;
+
+static void on_preview(const png_util_image* surface, int pass, void* user_ptr) {
+    preview_state* state = (preview_state*)user_ptr;
+    if (state->count < 8)
+        state->passes[state->count] = pass;
+    state->count++;
+    if (pass == 0)
+        state->fed_after_pass0 = state->fed;
+    // After pass 0, each 8x8 block has the color of its top-left pixel.
+    png_uint_32 mask = pass == 0 ? ~7U : ~0U;
+    if (pass != 0 && pass != 6)
+        return;
+    for (png_uint_32 y = 0; y < surface->height; y++) {
+        for (png_uint_32 x = 0; x < surface->width; x++) {
+            png_byte expected[4];
+            source_pixel(x & mask, y & mask, expected);
+            if (memcmp(surface->pixels + surface->row_stride * y + x * 4, expected, 4) != 0) {
+                if (state->errors++ == 0)
+                    fprintf(stderr, "unexpected pixel at (%u, %u) after pass %d\n", x, y, pass);
+            }
+        }
+    }
+}
+
+static int test_preview(int interlace) {
+    mem_buffer png = write_png(WIDTH, HEIGHT, 8, PNG_COLOR_TYPE_RGB, interlace, fill_row, NULL);
+    preview_state state;
+    memset(&state, 0, sizeof(state));
+    png_util_preview_decoder* decoder;
+    png_util_error err = png_preview_decoder_create(on_preview, &state, &decoder);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_preview_decoder_create: error: %u\n", err);
+        free(png.data);
+        return 1;
+    }
+    // Simulate a slow link.
+    for (size_t pos = 0; pos < png.size && err == PNG_UTIL_SUCCESS; pos += 64) {
+        size_t size = png.size - pos < 64 ? png.size - pos : 64;
+        state.fed = pos + size;
+        err = png_preview_decoder_feed(decoder, png.data + pos, size);
+    }
+    int ret = 0;
+    if (err != PNG_UTIL_SUCCESS || state.errors > 0) {
+        fprintf(stderr, "png_preview_decoder_feed: error: %u\n", err);
+        ret = 1;
+    }
+    int expected_count = interlace ? 7 : 1;
+    if (state.count != expected_count || state.passes[expected_count - 1] != 6) {
+        fprintf(stderr, "unexpected passes: %d\n", state.count);
+        ret = 1;
+    }
+    for (int i = 0; interlace && i < 7 && ret == 0; i++) {
+        if (state.passes[i] != i) {
+            fprintf(stderr, "unexpected pass order\n");
+            ret = 1;
+        }
+    }
+    if (interlace && ret == 0) {
+        printf("pass 0 preview after %zu of %zu bytes\n", state.fed_after_pass0, png.size);
+        if (state.fed_after_pass0 >= png.size / 2) {
+            fprintf(stderr, "pass 0 arrived too late\n");
+            ret = 1;
+        }
+    }
+    const png_util_image* surface = png_preview_decoder_surface(decoder);
+    if (ret == 0 && (!surface || surface->width != WIDTH || surface->height != HEIGHT)) {
+        fprintf(stderr, "png_preview_decoder_surface: unexpected surface\n");
+        ret = 1;
+    }
+    png_preview_decoder_destroy(decoder);
+    free(png.data);
+    return ret;
+}
+
+static int test_broken(void) {
+    png_util_preview_decoder* decoder;
+    png_util_error err = png_preview_decoder_create(NULL, NULL, &decoder);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_preview_decoder_create: error: %u\n", err);
+        return 1;
+    }
+    const png_byte garbage[16] = { 'n', 'o', 't', ' ', 'a', ' ', 'p', 'n', 'g' };
+    png_util_error err1 = png_preview_decoder_feed(decoder, garbage, sizeof(garbage));
+    png_util_error err2 = png_preview_decoder_feed(decoder, garbage, sizeof(garbage));
+    int ret = 0;
+    if (err1 != PNG_UTIL_ERROR_LIBPNG || err2 != PNG_UTIL_ERROR_LIBPNG ||
+            png_preview_decoder_surface(decoder) != NULL) {
+        fprintf(stderr, "png_preview_decoder_feed: unexpected results: %u, %u\n", err1, err2);
+        ret = 1;
+    }
+    png_preview_decoder_destroy(decoder);
+    return ret;
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_preview(PNG_INTERLACE_ADAM7);
+    if (ret == 0)
+        ret = test_preview(PNG_INTERLACE_NONE);
+    if (ret == 0)
+        ret = test_broken();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
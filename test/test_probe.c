@@ -0,0 +1,70 @@
+#include "libpng-loader-utils.h"
+#include <stdio.h>
+#include <string.h>
+
+static int check_header(const png_util_header* header) {
+    if (header->width != 300 || header->height != 250 || header->bit_depth != 8 ||
+            header->color_type != PNG_COLOR_TYPE_RGB_ALPHA ||
+            header->interlace_type != PNG_INTERLACE_NONE) {
+        fprintf(stderr, "unexpected header: %ux%u depth=%d type=%d interlace=%d\n",
+                header->width, header->height, header->bit_depth,
+                header->color_type, header->interlace_type);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void) {
+    // png_probe_header doesn't need libpng
+    png_util_header header;
+    png_util_error err = png_probe_header_file("input.png", &header);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_probe_header_file: error: %u\n", err);
+        return 1;
+    }
+    if (check_header(&header))
+        return 1;
+
+    // Test with a broken CRC
+    png_byte data[PNG_UTIL_PROBE_SIZE];
+    FILE *fp = fopen("input.png", "rb");
+    if (!fp || fread(data, 1, sizeof(data), fp) != sizeof(data)) {
+        fprintf(stderr, "failed to read input.png\n");
+        if (fp)
+            fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    err = png_probe_header(data, sizeof(data), &header);
+    if (err != PNG_UTIL_SUCCESS || check_header(&header)) {
+        fprintf(stderr, "png_probe_header: error: %u\n", err);
+        return 1;
+    }
+    data[20] ^= 1;
+    err = png_probe_header(data, sizeof(data), &header);
+    if (err != PNG_UTIL_ERROR_INVALID_PNG) {
+        fprintf(stderr, "png_probe_header: not PNG_UTIL_ERROR_INVALID_PNG: %u\n", err);
+        return 1;
+    }
+    err = png_probe_header(data, 32, &header);
+    if (err != PNG_UTIL_ERROR_INVALID_PNG) {
+        fprintf(stderr, "png_probe_header: not PNG_UTIL_ERROR_INVALID_PNG: %u\n", err);
+        return 1;
+    }
+
+    // Test the batch form
+    const char* paths[] = { "input.png", "not-found.png", "input.png" };
+    png_util_header headers[3];
+    png_util_error errors[3];
+    err = png_probe_headers(paths, 3, 2, headers, errors);
+    if (err != PNG_UTIL_ERROR_IO || errors[0] != PNG_UTIL_SUCCESS ||
+            errors[1] != PNG_UTIL_ERROR_IO || errors[2] != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_probe_headers: unexpected results: %u\n", err);
+        return 1;
+    }
+    if (check_header(&headers[0]) || check_header(&headers[2]))
+        return 1;
+
+    printf("Test passed!\n");
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Noise with gradients. user_ptr is the seed, which restarts with every pass.
+static void fill_row(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr) {
+    unsigned int* seed = (unsigned int*)user_ptr;
+    if (y == 0)
+        *seed = 1;
+    for (size_t x = 0; x < rowbytes; x++) {
+        *seed = *seed * 1103515245 + 12345;
+        row[x] = (png_byte)(x + y * 5 + ((*seed >> 16) & 15));
+    }
+}
+
+static mem_buffer make_png(int bit_depth, int color_type, int interlace) {
+    unsigned int seed;
+    return write_png(517, 389, bit_depth, color_type, interlace, fill_row, &seed);
+}
+
+static int same_pixel(const png_util_image* a, png_uint_32 ax, png_uint_32 ay,
+                      const png_util_image* b, png_uint_32 bx, png_uint_32 by, int bits) {
+    const png_byte* row_a = a->pixels + a->row_stride * ay;
+    const png_byte* row_b = b->pixels + b->row_stride * by;
+    if (bits >= 8)
+        return memcmp(row_a + ax * (bits / 8), row_b + bx * (bits / 8), bits / 8) == 0;
+    size_t sa = (size_t)ax * bits;
+    size_t sb = (size_t)bx * bits;
+    unsigned int mask = (1U << bits) - 1;
+    return ((row_a[sa / 8] >> (8 - bits - sa % 8)) & mask) ==
+           ((row_b[sb / 8] >> (8 - bits - sb % 8)) & mask);
+}
+
+static int test_region(int bit_depth, int color_type, int channels) {
+    mem_buffer buf = make_png(bit_depth, color_type, PNG_INTERLACE_NONE);
+    png_byte* data = buf.data;
+    size_t size = buf.size;
+    png_util_image full;
+    png_util_error err = png_read_parallel(data, size, 1, &full);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_read_parallel: error: %u\n", err);
+        free(data);
+        return 1;
+    }
+
+    const png_uint_32 regions[][4] = {
+        { 0, 0, 517, 389 }, { 3, 10, 101, 7 }, { 516, 388, 1, 1 }, { 7, 120, 250, 40 },
+    };
+    int bits = bit_depth * channels;
+    int ret = 0;
+    for (int i = 0; i < 4 && ret == 0; i++) {
+        const png_uint_32* r = regions[i];
+        png_util_image image;
+        png_util_region_stats stats;
+        err = png_decode_region(data, size, r[0], r[1], r[2], r[3], &image, &stats);
+        if (err != PNG_UTIL_SUCCESS) {
+            fprintf(stderr, "png_decode_region: error: %u\n", err);
+            ret = 1;
+            break;
+        }
+        if (image.width != r[2] || image.height != r[3] ||
+                stats.rows_decoded != r[1] + r[3] || stats.image_height != 389 ||
+                stats.bytes_read > size || (r[1] + r[3] < 389 && stats.bytes_read == size)) {
+            fprintf(stderr, "png_decode_region: unexpected size or stats\n");
+            ret = 1;
+        }
+        for (png_uint_32 y = 0; y < r[3] && ret == 0; y++) {
+            for (png_uint_32 x = 0; x < r[2]; x++) {
+                if (!same_pixel(&image, x, y, &full, r[0] + x, r[1] + y, bits)) {
+                    fprintf(stderr, "png_decode_region: unexpected pixel at (%u, %u)\n", x, y);
+                    ret = 1;
+                    break;
+                }
+            }
+        }
+        printf("region (%u, %u, %u, %u): %u/%u rows, %zu/%zu bytes, %.3f ms\n",
+               r[0], r[1], r[2], r[3], stats.rows_decoded, stats.image_height,
+               stats.bytes_read, size, stats.seconds * 1000.0);
+        png_util_image_free(&image);
+    }
+
+    png_util_image image;
+    err = png_decode_region(data, size, 500, 0, 18, 1, &image, NULL);
+    if (ret == 0 && err != PNG_UTIL_ERROR_INVALID_ARGUMENT) {
+        fprintf(stderr, "png_decode_region: not PNG_UTIL_ERROR_INVALID_ARGUMENT: %u\n", err);
+        ret = 1;
+    }
+    png_util_image_free(&full);
+    free(data);
+    return ret;
+}
+
+static int test_interlaced(void) {
+    mem_buffer buf = make_png(8, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_ADAM7);
+    png_util_image image;
+    png_util_error err = png_decode_region(buf.data, buf.size, 0, 0, 1, 1, &image, NULL);
+    free(buf.data);
+    if (err != PNG_UTIL_ERROR_UNSUPPORTED) {
+        fprintf(stderr, "png_decode_region: not PNG_UTIL_ERROR_UNSUPPORTED: %u\n", err);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_region(8, PNG_COLOR_TYPE_RGB_ALPHA, 4);
+    if (ret == 0)
+        ret = test_region(16, PNG_COLOR_TYPE_GRAY, 1);
+    if (ret == 0)
+        ret = test_region(2, PNG_COLOR_TYPE_GRAY, 1);
+    if (ret == 0)
+        ret = test_interlaced();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
@@ -0,0 +1,178 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void fill_row(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr) {
+    int palette = *(const int*)user_ptr;
+    for (size_t x = 0; x < rowbytes; x++)
+        row[x] = palette ? (png_byte)((x + y) % 4) : (png_byte)(x * 13 + y * 7 + (x * y >> 5));
+}
+
+// Writes a palette image with text, eXIf and pHYs, or an RGB image without metadata.
+static mem_buffer make_png(png_uint_32 width, png_uint_32 height, int palette) {
+    mem_buffer buf = { NULL, 0 };
+    png_infop info;
+    png_structp png = start_png(&buf, &info, width, height, 8, palette ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_RGB,
+                                PNG_INTERLACE_NONE);
+    if (palette) {
+        png_color colors[4] = { { 0, 0, 0 }, { 255, 0, 0 }, { 0, 255, 0 }, { 0, 0, 255 } };
+        png_byte trans[1] = { 0 };
+        png_set_PLTE(png, info, colors, 4);
+        png_set_tRNS(png, info, trans, 1, NULL);
+        png_text text;
+        memset(&text, 0, sizeof(text));
+        text.compression = PNG_TEXT_COMPRESSION_NONE;
+        text.key = (png_charp)"Comment";
+        text.text = (png_charp)"secret location";
+        png_set_text(png, info, &text, 1);
+        png_set_pHYs(png, info, 2835, 2835, PNG_RESOLUTION_METER);
+    }
+    png_write_info(png, info);
+    if (palette) {
+        png_byte exif[8] = { 'M', 'M', 0, 42, 0, 0, 0, 8 };
+        png_write_chunk(png, (png_const_bytep)"eXIf", exif, sizeof(exif));
+    }
+    finish_png(png, info, fill_row, &palette);
+    return buf;
+}
+
+static int check_rewritten(const mem_buffer* original, const png_byte* data, size_t size) {
+    png_util_metadata meta;
+    if (png_read_metadata(data, size, &meta) != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_read_metadata failed\n");
+        return 1;
+    }
+    // Metadata is gone, pHYs is replaced and the new CRCs are valid.
+    int ret = meta.num_text != 0 || (meta.valid & PNG_INFO_eXIf) || !(meta.valid & PNG_INFO_pHYs) ||
+              meta.phys_x != 3780 || meta.phys_y != 3780;
+    png_util_metadata_free(&meta);
+    if (ret) {
+        fprintf(stderr, "unexpected metadata\n");
+        return 1;
+    }
+    size_t pos = find_chunk(data, size, "pHYs");
+    size_t plte = find_chunk(data, size, "PLTE");
+    size_t idat = find_chunk(data, size, "IDAT");
+    size_t original_idat = find_chunk(original->data, original->size, "IDAT");
+    if (pos == 0 || pos > plte || find_chunk(data, size, "tRNS") < plte || idat == 0 ||
+            size - idat != original->size - original_idat ||
+            memcmp(data + idat, original->data + original_idat, size - idat) != 0) {
+        fprintf(stderr, "unexpected chunk layout\n");
+        return 1;
+    }
+    if (!same_pixels(original->data, original->size, data, size)) {
+        fprintf(stderr, "unexpected pixels\n");
+        return 1;
+    }
+    return 0;
+}
+
+static png_util_rewrite_options make_options(png_util_chunk* phys) {
+    png_util_rewrite_options options;
+    memset(&options, 0, sizeof(options));
+    static const png_byte body[9] = { 0, 0, 0x0e, 0xc4, 0, 0, 0x0e, 0xc4, 1 };
+    memset(phys, 0, sizeof(*phys));
+    memcpy(phys->type, "pHYs", 5);
+    phys->size = sizeof(body);
+    phys->data = body;
+    options.strip_metadata = 1;
+    options.insert = phys;
+    options.insert_count = 1;
+    return options;
+}
+
+static int test_memory(void) {
+    mem_buffer buf = make_png(50, 30, 1);
+    png_util_chunk phys;
+    png_util_rewrite_options options = make_options(&phys);
+    png_util_buffer out;
+    int ret = 0;
+    if (png_rewrite_chunks(buf.data, buf.size, &options, &out) != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_rewrite_chunks failed\n");
+        ret = 1;
+    } else {
+        ret = check_rewritten(&buf, out.data, out.size);
+        png_util_buffer_free(&out);
+    }
+    // Without options, the PNG is copied as it is.
+    if (ret == 0 && (png_rewrite_chunks(buf.data, buf.size, NULL, &out) != PNG_UTIL_SUCCESS ||
+                     out.size != buf.size || memcmp(out.data, buf.data, buf.size) != 0)) {
+        fprintf(stderr, "png_rewrite_chunks: the copy differs\n");
+        ret = 1;
+    }
+    png_util_buffer_free(&out);
+    // Critical chunks can't be dropped.
+    const char* idat[1] = { "IDAT" };
+    options.drop = idat;
+    options.drop_count = 1;
+    if (ret == 0 && png_rewrite_chunks(buf.data, buf.size, &options, &out) != PNG_UTIL_ERROR_INVALID_ARGUMENT) {
+        fprintf(stderr, "png_rewrite_chunks dropped IDAT\n");
+        ret = 1;
+    }
+    free(buf.data);
+    return ret;
+}
+
+static int test_files(void) {
+    mem_buffer buf = make_png(50, 30, 1);
+    const char* src[3] = { "rewrite0.png", "rewrite1.png", "rewrite_missing.png" };
+    const char* dst[3] = { "rewrite0_out.png", "rewrite1.png", "rewrite2_out.png" };
+    write_file(src[0], &buf);
+    write_file(src[1], &buf);
+    png_util_chunk phys;
+    png_util_rewrite_options options = make_options(&phys);
+    png_util_error errors[3];
+    // The second file is rewritten in place.
+    png_util_error err = png_rewrite_chunks_files(src, dst, 3, 2, &options, errors);
+    int ret = 0;
+    if (err == PNG_UTIL_SUCCESS || errors[0] != PNG_UTIL_SUCCESS || errors[1] != PNG_UTIL_SUCCESS ||
+            errors[2] != PNG_UTIL_ERROR_IO) {
+        fprintf(stderr, "png_rewrite_chunks_files: unexpected results: %u, %u, %u\n", errors[0], errors[1], errors[2]);
+        ret = 1;
+    }
+    for (int i = 0; i < 2 && ret == 0; i++) {
+        mem_buffer out = read_file(dst[i]);
+        ret = check_rewritten(&buf, out.data, out.size);
+        free(out.data);
+    }
+    free(buf.data);
+    return ret;
+}
+
+static void run_benchmark(void) {
+    mem_buffer buf = make_png(2048, 2048, 0);
+    write_file("rewrite_large.png", &buf);
+    png_util_chunk phys;
+    png_util_rewrite_options options = make_options(&phys);
+    clock_t start = clock();
+    png_rewrite_chunks_file("rewrite_large.png", "rewrite_large_out.png", &options);
+    double rewrite_ms = elapsed_ms(start);
+    // A full transcode inflates and deflates every row.
+    png_util_image image;
+    png_util_buffer out;
+    png_read_parallel(buf.data, buf.size, 1, &image);
+    png_encode(&image, NULL, &out);
+    printf("2048x2048 RGB8 (%zu bytes)  chunk rewrite: %.2f ms, decode + encode: %.2f ms\n", buf.size,
+           rewrite_ms, elapsed_ms(start) - rewrite_ms);
+    png_util_image_free(&image);
+    png_util_buffer_free(&out);
+    free(buf.data);
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_memory();
+    if (ret == 0)
+        ret = test_files();
+    if (ret == 0)
+        run_benchmark();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
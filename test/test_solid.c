@@ -0,0 +1,213 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Fills the image with one color.
+static void fill_solid(png_util_image* image, png_byte value) {
+    size_t pixel = image->bit_depth < 8 ? 1 : image->row_stride / image->width;
+    for (size_t i = 0; i < image->row_stride * image->height; i++)
+        image->pixels[i] = (png_byte)(value + i % pixel);
+}
+
+// A binary mask of rectangles.
+static void fill_mask(png_util_image* image) {
+    for (png_uint_32 y = 0; y < image->height; y++) {
+        for (png_uint_32 x = 0; x < image->width; x++) {
+            int inside = (x / 64 + y / 48) % 3 == 0 || (x > image->width / 3 && y < image->height / 2);
+            image->pixels[image->row_stride * y + x] = inside ? 255 : 0;
+        }
+    }
+}
+
+// Flat panels and a title bar with lines of noisy "text".
+static void fill_screenshot(png_util_image* image) {
+    unsigned int seed = 1;
+    for (png_uint_32 y = 0; y < image->height; y++) {
+        png_byte* row = image->pixels + image->row_stride * y;
+        int text = y % 24 < 12 && y > 40;
+        for (png_uint_32 x = 0; x < image->width; x++) {
+            png_byte* p = row + (size_t)x * 4;
+            int panel = x < image->width / 5;
+            p[0] = panel ? 40 : 240;
+            p[1] = panel ? 44 : 240;
+            p[2] = panel ? 52 : 240;
+            p[3] = 255;
+            if (y < 32) {
+                p[0] = 30, p[1] = 90, p[2] = 200;
+            } else if (text && x % 400 < 300 && !panel) {
+                seed = seed * 1103515245 + 12345;
+                if ((seed >> 16) % 3 == 0)
+                    p[0] = p[1] = p[2] = (png_byte)(seed >> 24);
+            }
+        }
+    }
+}
+
+// Encodes with the fast path and with all filters, which turns it off.
+// The fast path may add a few bytes of flush markers.
+static int check_encode(const char* name, const png_util_image* image, const png_util_encode_options* options,
+                        int compare) {
+    png_util_encode_options all_filters;
+    memset(&all_filters, 0, sizeof(all_filters));
+    if (options)
+        all_filters = *options;
+    all_filters.filters = PNG_ALL_FILTERS;
+    png_util_buffer out, reference;
+    if (png_encode(image, options, &out) != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "%s: png_encode failed\n", name);
+        return 1;
+    }
+    int ret = check_png(name, image, out.data, out.size);
+    if (ret == 0 && png_encode(image, &all_filters, &reference) == PNG_UTIL_SUCCESS) {
+        if (compare && out.size > reference.size + reference.size / 16 + 64) {
+            fprintf(stderr, "%s: %zu bytes, %zu bytes with all filters\n", name, out.size, reference.size);
+            ret = 1;
+        }
+        png_util_buffer_free(&reference);
+    }
+    png_util_buffer_free(&out);
+    return ret;
+}
+
+static int test_solid(void) {
+    int ret = 0;
+    png_util_image image = alloc_image(300, 200, 8, PNG_COLOR_TYPE_RGB_ALPHA, 0);
+    fill_solid(&image, 10);
+    png_util_encode_options options;
+    memset(&options, 0, sizeof(options));
+    ret = check_encode("RGBA8", &image, NULL, 1);
+    // window bits 8 fall back to 9, and one row is larger than a repeated block.
+    options.compression_level = 9;
+    options.window_bits = 8;
+    if (ret == 0)
+        ret = check_encode("RGBA8 window 8", &image, &options, 0);
+    png_util_image_free(&image);
+
+    image = alloc_image(70000, 5, 8, PNG_COLOR_TYPE_RGB, 0);
+    fill_solid(&image, 200);
+    if (ret == 0)
+        ret = check_encode("wide RGB8", &image, NULL, 1);
+    png_util_image_free(&image);
+
+    image = alloc_image(1000, 1000, 16, PNG_COLOR_TYPE_GRAY_ALPHA, 0);
+    fill_solid(&image, 7);
+    options.window_bits = 0;
+    options.strategy = PNG_UTIL_STRATEGY_RLE;
+    if (ret == 0)
+        ret = check_encode("gray-alpha16", &image, &options, 0);
+    png_util_image_free(&image);
+
+    image = alloc_image(64, 33, 2, PNG_COLOR_TYPE_GRAY, 0);
+    fill_solid(&image, 0x55);
+    if (ret == 0)
+        ret = check_encode("gray2", &image, NULL, 0);
+    png_util_image_free(&image);
+    return ret;
+}
+
+// Largest IDAT chunk, and the number of IDAT chunks in count.
+static size_t max_idat(const png_util_buffer* png_data, int* count) {
+    size_t pos = 8, largest = 0;
+    *count = 0;
+    while (pos + 12 <= png_data->size) {
+        const png_byte* p = png_data->data + pos;
+        size_t length = ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3];
+        if (memcmp(p + 4, "IDAT", 4) == 0) {
+            (*count)++;
+            if (length > largest)
+                largest = length;
+        }
+        pos += length + 12;
+    }
+    return largest;
+}
+
+// IDAT chunks of the fast path have the same size as libpng's.
+static int test_idat_size(void) {
+    png_util_image image = alloc_image(1024, 1024, 8, PNG_COLOR_TYPE_RGB_ALPHA, 0);
+    fill_solid(&image, 33);
+    png_util_encode_options options;
+    memset(&options, 0, sizeof(options));
+    int ret = 0;
+    for (int i = 0; i < 2 && ret == 0; i++) {
+        options.buffer_size = i == 0 ? 0 : 1024;
+        size_t limit = i == 0 ? 8192 : 1024;
+        png_util_buffer out;
+        if (png_encode(&image, &options, &out) != PNG_UTIL_SUCCESS)
+            return 1;
+        int count;
+        size_t largest = max_idat(&out, &count);
+        if (largest > limit || (out.size > limit * 2 && count < 2)) {
+            fprintf(stderr, "buffer size %zu: %d IDAT chunks of up to %zu bytes\n", options.buffer_size, count,
+                    largest);
+            ret = 1;
+        }
+        if (ret == 0)
+            ret = check_png("IDAT size", &image, out.data, out.size);
+        png_util_buffer_free(&out);
+    }
+    png_util_image_free(&image);
+    return ret;
+}
+
+static int test_rows(void) {
+    png_util_image mask = alloc_image(333, 257, 8, PNG_COLOR_TYPE_GRAY, 0);
+    fill_mask(&mask);
+    int ret = check_encode("mask", &mask, NULL, 1);
+    png_util_image_free(&mask);
+    png_util_image screenshot = alloc_image(640, 480, 8, PNG_COLOR_TYPE_RGB_ALPHA, 0);
+    fill_screenshot(&screenshot);
+    if (ret == 0)
+        ret = check_encode("screenshot", &screenshot, NULL, 0);
+    png_util_image_free(&screenshot);
+    return ret;
+}
+
+static void run_benchmark(const char* name, const png_util_image* image) {
+    png_util_encode_options all_filters;
+    memset(&all_filters, 0, sizeof(all_filters));
+    all_filters.filters = PNG_ALL_FILTERS;
+    png_util_buffer out;
+    clock_t start = clock();
+    png_encode(image, &all_filters, &out);
+    double ms = elapsed_ms(start);
+    printf("%s  all filters: %zu bytes %.2f ms,", name, out.size, ms);
+    png_util_buffer_free(&out);
+    start = clock();
+    png_encode(image, NULL, &out);
+    ms = elapsed_ms(start);
+    printf(" default: %zu bytes %.2f ms\n", out.size, ms);
+    png_util_buffer_free(&out);
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_solid();
+    if (ret == 0)
+        ret = test_idat_size();
+    if (ret == 0)
+        ret = test_rows();
+    if (ret == 0) {
+        png_util_image image = alloc_image(2048, 2048, 8, PNG_COLOR_TYPE_RGB_ALPHA, 0);
+        fill_solid(&image, 128);
+        run_benchmark("2048x2048 RGBA8 solid     ", &image);
+        png_util_image_free(&image);
+        image = alloc_image(4096, 4096, 8, PNG_COLOR_TYPE_GRAY, 0);
+        fill_mask(&image);
+        run_benchmark("4096x4096 gray8 mask      ", &image);
+        png_util_image_free(&image);
+        image = alloc_image(1920, 1080, 8, PNG_COLOR_TYPE_RGB_ALPHA, 0);
+        fill_screenshot(&image);
+        run_benchmark("1920x1080 RGBA8 screenshot", &image);
+        png_util_image_free(&image);
+    }
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
@@ -0,0 +1,143 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// An image with a row stride larger than its rows.
+static png_util_image make_image(png_uint_32 width, png_uint_32 height, int bit_depth, int color_type) {
+    png_util_image image = alloc_image(width, height, bit_depth, color_type, 5);
+    for (png_uint_32 y = 0; y < height; y++) {
+        for (size_t x = 0; x < image.row_stride; x++)
+            image.pixels[image.row_stride * y + x] = (png_byte)(x * 7 + y * 3 + (x * y >> 4));
+    }
+    clear_padding_bits(&image);
+    return image;
+}
+
+static int test_stored(const char* name, png_uint_32 width, png_uint_32 height, int bit_depth, int color_type) {
+    png_util_image image = make_image(width, height, bit_depth, color_type);
+    png_util_buffer out;
+    int ret = 0;
+    png_util_error err = png_encode_stored(&image, &out);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "%s: png_encode_stored: error: %u\n", name, err);
+        ret = 1;
+    } else {
+        ret = check_png(name, &image, out.data, out.size);
+    }
+
+    // The file version writes the same bytes.
+    if (ret == 0) {
+        err = png_encode_stored_file(&image, "stored.png");
+        FILE* fp = fopen("stored.png", "rb");
+        png_byte* data = (png_byte*)malloc(out.size + 1);
+        size_t size = fp ? fread(data, 1, out.size + 1, fp) : 0;
+        if (fp)
+            fclose(fp);
+        if (err != PNG_UTIL_SUCCESS || size != out.size || memcmp(data, out.data, size) != 0) {
+            fprintf(stderr, "%s: png_encode_stored_file: unexpected output: %u\n", name, err);
+            ret = 1;
+        }
+        free(data);
+        remove("stored.png");
+    }
+    if (err == PNG_UTIL_SUCCESS)
+        png_util_buffer_free(&out);
+    png_util_image_free(&image);
+    return ret;
+}
+
+static int test_invalid(void) {
+    png_util_image image = make_image(10, 10, 8, PNG_COLOR_TYPE_GRAY);
+    png_util_buffer out;
+    int ret = 0;
+    image.color_type = PNG_COLOR_TYPE_PALETTE;
+    if (png_encode_stored(&image, &out) != PNG_UTIL_ERROR_UNSUPPORTED) {
+        fprintf(stderr, "png_encode_stored accepted a palette image\n");
+        ret = 1;
+    }
+    image.color_type = PNG_COLOR_TYPE_GRAY;
+    image.row_stride = 9;
+    if (ret == 0 && png_encode_stored(&image, &out) != PNG_UTIL_ERROR_INVALID_ARGUMENT) {
+        fprintf(stderr, "png_encode_stored accepted a short row stride\n");
+        ret = 1;
+    }
+    png_util_image_free(&image);
+    return ret;
+}
+
+// The AVX2 kernel must match the scalar one.
+static int test_adler(void) {
+    png_byte data[20000];
+    for (int i = 0; i < 20000; i++)
+        data[i] = (png_byte)(i < 10000 ? 0xff : i * 7 + (i >> 5));
+    for (size_t size = 0; size <= 19000; size += 97) {
+        png_uint_32 simd = png_util_adler32(0x12345678, data + 1, size);
+        png_util_set_cpu_mask(0);
+        png_uint_32 scalar = png_util_adler32(0x12345678, data + 1, size);
+        png_util_set_cpu_mask(~0U);
+        if (simd != scalar) {
+            fprintf(stderr, "png_util_adler32: SIMD and scalar results differ\n");
+            return 1;
+        }
+    }
+    if (png_util_adler32(1, (const png_byte*)"Wikipedia", 9) != 0x11e60398) {
+        fprintf(stderr, "png_util_adler32: unexpected check value\n");
+        return 1;
+    }
+    return 0;
+}
+
+static void run_benchmark(void) {
+    png_util_image image = make_image(2048, 2048, 8, PNG_COLOR_TYPE_RGB_ALPHA);
+    size_t size = image.row_stride * image.height;
+    png_byte* copy = (png_byte*)malloc(size);
+    clock_t start = clock();
+    memcpy(copy, image.pixels, size);
+    double ms = elapsed_ms(start);
+    printf("2048x2048 RGBA8  memcpy: %.2f ms,", ms);
+    free(copy);
+
+    png_util_buffer out;
+    start = clock();
+    png_encode_stored(&image, &out);
+    ms = elapsed_ms(start);
+    printf(" stored: %zu bytes %.2f ms,", out.size, ms);
+    png_util_buffer_free(&out);
+
+    png_util_encode_options options;
+    memset(&options, 0, sizeof(options));
+    options.compression_level = 1;
+    start = clock();
+    png_encode(&image, &options, &out);
+    ms = elapsed_ms(start);
+    printf(" level 1: %zu bytes %.2f ms\n", out.size, ms);
+    png_util_buffer_free(&out);
+    png_util_image_free(&image);
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_adler();
+    if (ret == 0)
+        ret = test_stored("RGB8", 97, 61, 8, PNG_COLOR_TYPE_RGB);
+    if (ret == 0)
+        ret = test_stored("gray1", 83, 7, 1, PNG_COLOR_TYPE_GRAY);
+    if (ret == 0)
+        ret = test_stored("gray-alpha16", 33, 40, 16, PNG_COLOR_TYPE_GRAY_ALPHA);
+    // Rows cross 64 KiB stored blocks and 1 MiB IDAT chunks.
+    if (ret == 0)
+        ret = test_stored("RGBA16", 3001, 50, 16, PNG_COLOR_TYPE_RGB_ALPHA);
+    if (ret == 0)
+        ret = test_invalid();
+    if (ret == 0)
+        run_benchmark();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
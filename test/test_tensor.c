@@ -0,0 +1,141 @@
+#include "test_utils.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static png_byte sample(png_uint_32 x, png_uint_32 y, int c) {
+    return (png_byte)(x * 3 + y * 5 + (png_uint_32)c * 40);
+}
+
+static void fill_row(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr) {
+    (void)user_ptr;
+    for (png_uint_32 x = 0; x < rowbytes / 3; x++) {
+        for (int c = 0; c < 3; c++)
+            row[x * 3 + c] = sample(x, y, c);
+    }
+}
+
+static png_util_tensor_options make_options(png_uint_32 width, png_uint_32 height, int fit) {
+    png_util_tensor_options options;
+    memset(&options, 0, sizeof(options));
+    options.channels = 3;
+    options.width = width;
+    options.height = height;
+    options.fit = fit;
+    const float mean[3] = { 0.485f, 0.456f, 0.406f };
+    const float std[3] = { 0.229f, 0.224f, 0.225f };
+    memcpy(options.mean, mean, sizeof(mean));
+    memcpy(options.std, std, sizeof(std));
+    return options;
+}
+
+// Checks the tensor against the average of `box` x `box` source pixels from (x0, y0).
+static int check_tensor(const float* tensor, const png_util_tensor_options* options,
+                        png_uint_32 x0, png_uint_32 y0, png_uint_32 box) {
+    for (int c = 0; c < 3; c++) {
+        for (png_uint_32 y = 0; y < options->height; y++) {
+            for (png_uint_32 x = 0; x < options->width; x++) {
+                double sum = 0;
+                for (png_uint_32 dy = 0; dy < box; dy++) {
+                    for (png_uint_32 dx = 0; dx < box; dx++)
+                        sum += sample(x0 + x * box + dx, y0 + y * box + dy, c);
+                }
+                double expected = (sum / (box * box) / 255.0 - options->mean[c]) / options->std[c];
+                float actual = tensor[((size_t)c * options->height + y) * options->width + x];
+                if (fabs(actual - expected) > 1e-4) {
+                    fprintf(stderr, "unexpected value at (%d, %u, %u): %f (expected %f)\n",
+                            c, y, x, actual, expected);
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static int test_fit(int interlace) {
+    mem_buffer buf = write_png(40, 24, 8, PNG_COLOR_TYPE_RGB, interlace, fill_row, NULL);
+    float* tensor = (float*)malloc(sizeof(float) * 3 * 40 * 24);
+    int ret = 0;
+
+    png_util_tensor_options options = make_options(40, 24, PNG_UTIL_TENSOR_EXACT);
+    png_util_error err = png_decode_tensor(buf.data, buf.size, &options, tensor);
+    if (err != PNG_UTIL_SUCCESS || check_tensor(tensor, &options, 0, 0, 1)) {
+        fprintf(stderr, "PNG_UTIL_TENSOR_EXACT failed: %u\n", err);
+        ret = 1;
+    }
+    options = make_options(20, 12, PNG_UTIL_TENSOR_CENTER_CROP);
+    err = png_decode_tensor(buf.data, buf.size, &options, tensor);
+    if (ret == 0 && (err != PNG_UTIL_SUCCESS || check_tensor(tensor, &options, 10, 6, 1))) {
+        fprintf(stderr, "PNG_UTIL_TENSOR_CENTER_CROP failed: %u\n", err);
+        ret = 1;
+    }
+    // Halving the size averages 2x2 blocks.
+    options = make_options(20, 12, PNG_UTIL_TENSOR_RESIZE);
+    err = png_decode_tensor(buf.data, buf.size, &options, tensor);
+    if (ret == 0 && (err != PNG_UTIL_SUCCESS || check_tensor(tensor, &options, 0, 0, 2))) {
+        fprintf(stderr, "PNG_UTIL_TENSOR_RESIZE failed: %u\n", err);
+        ret = 1;
+    }
+    // 40x24 covers 12x12 at half size, leaving a 24x24 window at (8, 0).
+    options = make_options(12, 12, PNG_UTIL_TENSOR_RESIZE_CROP);
+    err = png_decode_tensor(buf.data, buf.size, &options, tensor);
+    if (ret == 0 && (err != PNG_UTIL_SUCCESS || check_tensor(tensor, &options, 8, 0, 2))) {
+        fprintf(stderr, "PNG_UTIL_TENSOR_RESIZE_CROP failed: %u\n", err);
+        ret = 1;
+    }
+    options = make_options(41, 24, PNG_UTIL_TENSOR_EXACT);
+    err = png_decode_tensor(buf.data, buf.size, &options, tensor);
+    if (ret == 0 && err != PNG_UTIL_ERROR_INVALID_ARGUMENT) {
+        fprintf(stderr, "PNG_UTIL_TENSOR_EXACT accepted a wrong size: %u\n", err);
+        ret = 1;
+    }
+    free(tensor);
+    free(buf.data);
+    return ret;
+}
+
+static int test_batch(void) {
+    mem_buffer a = write_png(40, 24, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, fill_row, NULL);
+    mem_buffer b = write_png(40, 24, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_ADAM7, fill_row, NULL);
+    png_byte broken[8] = { 0 };
+    const void* data[4] = { a.data, b.data, broken, a.data };
+    size_t sizes[4] = { a.size, b.size, sizeof(broken), a.size };
+    png_util_tensor_options options = make_options(20, 12, PNG_UTIL_TENSOR_RESIZE);
+    size_t slot = 3 * 20 * 12;
+    float* tensors = (float*)malloc(sizeof(float) * slot * 4);
+    png_util_error errors[4];
+    png_util_error err = png_decode_tensors(data, sizes, 4, 2, &options, tensors, errors);
+    int ret = 0;
+    if (err == PNG_UTIL_SUCCESS || errors[0] != PNG_UTIL_SUCCESS || errors[1] != PNG_UTIL_SUCCESS ||
+            errors[2] == PNG_UTIL_SUCCESS || errors[3] != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_decode_tensors: unexpected results: %u\n", err);
+        ret = 1;
+    }
+    for (int i = 0; i < 4 && ret == 0; i++) {
+        if (i != 2)
+            ret = check_tensor(tensors + slot * i, &options, 0, 0, 2);
+    }
+    free(tensors);
+    free(a.data);
+    free(b.data);
+    return ret;
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_fit(PNG_INTERLACE_NONE);
+    if (ret == 0)
+        ret = test_fit(PNG_INTERLACE_ADAM7);
+    if (ret == 0)
+        ret = test_batch();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
@@ -0,0 +1,164 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Color of the 4x4 block (x, y)
+static void block_color(png_uint_32 x, png_uint_32 y, png_byte* rgba) {
+    rgba[0] = (png_byte)(x * 16);
+    rgba[1] = (png_byte)(y * 20);
+    rgba[2] = (png_byte)((x * 7 + y * 13) & 0xff);
+    rgba[3] = 255;
+}
+
+static int check_pixel(const png_util_image* image, png_uint_32 x, png_uint_32 y,
+                       const png_byte* expected) {
+    const png_byte* p = image->pixels + image->row_stride * y + (size_t)x * 4;
+    for (int c = 0; c < 4; c++) {
+        int diff = p[c] - expected[c];
+        if (diff < -1 || diff > 1) {
+            fprintf(stderr, "unexpected pixel at (%u, %u): %d %d %d %d\n",
+                    x, y, p[0], p[1], p[2], p[3]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int test_blocks(int interlace, int filter) {
+    png_byte pixels[64 * 48 * 4];
+    for (png_uint_32 y = 0; y < 48; y++) {
+        for (png_uint_32 x = 0; x < 64; x++)
+            block_color(x / 4, y / 4, pixels + (y * 64 + x) * 4);
+    }
+    mem_buffer png = write_png(64, 48, 8, PNG_COLOR_TYPE_RGB_ALPHA, interlace, copy_row, pixels);
+
+    // Exactly one block per pixel
+    png_util_image thumbnail;
+    png_util_error err = png_decode_thumbnail(png.data, png.size, 16, 12, filter, &thumbnail);
+    int ret = 0;
+    if (err != PNG_UTIL_SUCCESS || thumbnail.width != 16 || thumbnail.height != 12 ||
+            thumbnail.bit_depth != 8 || thumbnail.color_type != PNG_COLOR_TYPE_RGB_ALPHA) {
+        fprintf(stderr, "png_decode_thumbnail: error: %u\n", err);
+        ret = 1;
+    }
+    for (png_uint_32 y = 0; y < 12 && ret == 0; y++) {
+        for (png_uint_32 x = 0; x < 16 && ret == 0; x++) {
+            png_byte expected[4];
+            block_color(x, y, expected);
+            ret = check_pixel(&thumbnail, x, y, expected);
+        }
+    }
+    png_util_image_free(&thumbnail);
+
+    // Height keeps the aspect ratio. Box averages 2x2 blocks.
+    // Interlaced images only read pass 1, which has the top-left pixel of each 8x8 tile.
+    err = png_decode_thumbnail(png.data, png.size, 8, 0, filter, &thumbnail);
+    if (ret == 0 && (err != PNG_UTIL_SUCCESS || thumbnail.width != 8 || thumbnail.height != 6)) {
+        fprintf(stderr, "png_decode_thumbnail: unexpected size: %u\n", err);
+        ret = 1;
+    }
+    if (ret == 0 && interlace) {
+        for (png_uint_32 y = 0; y < 6 && ret == 0; y++) {
+            for (png_uint_32 x = 0; x < 8 && ret == 0; x++) {
+                png_byte expected[4];
+                block_color(x * 2, y * 2, expected);
+                ret = check_pixel(&thumbnail, x, y, expected);
+            }
+        }
+    } else if (ret == 0 && filter == PNG_UTIL_THUMBNAIL_BOX) {
+        for (png_uint_32 y = 0; y < 6 && ret == 0; y++) {
+            for (png_uint_32 x = 0; x < 8 && ret == 0; x++) {
+                png_byte expected[4];
+                int sum[3] = { 0, 0, 0 };
+                for (int i = 0; i < 4; i++) {
+                    block_color(x * 2 + (i & 1), y * 2 + (i >> 1), expected);
+                    for (int c = 0; c < 3; c++)
+                        sum[c] += expected[c];
+                }
+                for (int c = 0; c < 3; c++)
+                    expected[c] = (png_byte)((sum[c] + 2) / 4);
+                ret = check_pixel(&thumbnail, x, y, expected);
+            }
+        }
+    }
+    png_util_image_free(&thumbnail);
+
+    // Interlaced images read at most passes 0-4. Their grid of even pixels is scaled up,
+    // which repeats each pixel of the 4x4 blocks.
+    if (ret == 0 && interlace && filter == PNG_UTIL_THUMBNAIL_BOX) {
+        err = png_decode_thumbnail(png.data, png.size, 64, 48, filter, &thumbnail);
+        if (err != PNG_UTIL_SUCCESS || thumbnail.width != 64 || thumbnail.height != 48) {
+            fprintf(stderr, "png_decode_thumbnail: full size: %u\n", err);
+            ret = 1;
+        }
+        for (png_uint_32 y = 0; y < 48 && ret == 0; y++) {
+            for (png_uint_32 x = 0; x < 64 && ret == 0; x++)
+                ret = check_pixel(&thumbnail, x, y, pixels + (y * 64 + x) * 4);
+        }
+        png_util_image_free(&thumbnail);
+    }
+    free(png.data);
+    return ret;
+}
+
+// Transparent pixels must not bleed into the color.
+static int test_alpha(void) {
+    png_byte pixels[8] = { 255, 0, 0, 0, 0, 0, 255, 255 };
+    mem_buffer png = write_png(2, 1, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, copy_row, pixels);
+    png_util_image thumbnail;
+    png_util_error err = png_decode_thumbnail(png.data, png.size, 1, 1,
+                                              PNG_UTIL_THUMBNAIL_BOX, &thumbnail);
+    free(png.data);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_decode_thumbnail: error: %u\n", err);
+        return 1;
+    }
+    const png_byte expected[4] = { 0, 0, 255, 128 };
+    int ret = check_pixel(&thumbnail, 0, 0, expected);
+    png_util_image_free(&thumbnail);
+    return ret;
+}
+
+// Gray images are expanded to RGBA.
+static int test_gray(void) {
+    png_byte pixels[4 * 4];
+    for (int i = 0; i < 16; i++)
+        pixels[i] = (png_byte)((i % 4) < 2 ? 10 : 200);
+    mem_buffer png = write_png(4, 4, 8, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_ADAM7, copy_row, pixels);
+    png_util_image thumbnail;
+    png_util_error err = png_decode_thumbnail(png.data, png.size, 2, 2,
+                                              PNG_UTIL_THUMBNAIL_BOX, &thumbnail);
+    free(png.data);
+    if (err != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_decode_thumbnail: error: %u\n", err);
+        return 1;
+    }
+    const png_byte dark[4] = { 10, 10, 10, 255 };
+    const png_byte light[4] = { 200, 200, 200, 255 };
+    int ret = check_pixel(&thumbnail, 0, 0, dark) || check_pixel(&thumbnail, 1, 1, light);
+    png_util_image_free(&thumbnail);
+    return ret;
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = 0;
+    for (int interlace = 0; interlace < 2 && ret == 0; interlace++) {
+        ret = test_blocks(interlace, PNG_UTIL_THUMBNAIL_BOX);
+        if (ret == 0)
+            ret = test_blocks(interlace, PNG_UTIL_THUMBNAIL_BILINEAR);
+    }
+    if (ret == 0)
+        ret = test_alpha();
+    if (ret == 0)
+        ret = test_gray();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
@@ -0,0 +1,134 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// An RGB or gray image with gradients and some texture.
+static png_util_image make_image(png_uint_32 width, png_uint_32 height, int color_type) {
+    png_util_image image = alloc_image(width, height, 8, color_type, 0);
+    int channels = color_type == PNG_COLOR_TYPE_RGB ? 3 : 1;
+    unsigned int seed = 1;
+    for (png_uint_32 y = 0; y < height; y++) {
+        for (size_t x = 0; x < image.row_stride; x++) {
+            seed = seed * 1103515245 + 12345;
+            image.pixels[image.row_stride * y + x] = (png_byte)(x / channels + y / 2 + ((seed >> 16) & 7));
+        }
+    }
+    return image;
+}
+
+static int test_presets(void) {
+    png_util_image image = make_image(120, 90, PNG_COLOR_TYPE_RGB);
+    int ret = 0;
+    for (int preset = PNG_UTIL_PRESET_REALTIME; preset <= PNG_UTIL_PRESET_ARCHIVAL && ret == 0; preset++) {
+        png_util_encode_options options;
+        png_util_buffer out;
+        if (png_encode_preset(preset, &options) != PNG_UTIL_SUCCESS ||
+                png_encode(&image, &options, &out) != PNG_UTIL_SUCCESS) {
+            fprintf(stderr, "preset %d failed\n", preset);
+            ret = 1;
+            break;
+        }
+        ret = check_png("preset", &image, out.data, out.size);
+        png_util_buffer_free(&out);
+    }
+    png_util_encode_options options;
+    if (ret == 0 && png_encode_preset(0, &options) != PNG_UTIL_ERROR_INVALID_ARGUMENT) {
+        fprintf(stderr, "png_encode_preset accepted an unknown preset\n");
+        ret = 1;
+    }
+    png_util_image_free(&image);
+    return ret;
+}
+
+static int test_auto(void) {
+    png_util_tune_cache* cache;
+    if (png_tune_cache_create(8, &cache) != PNG_UTIL_SUCCESS)
+        return 1;
+    png_util_image a = make_image(300, 400, PNG_COLOR_TYPE_RGB);
+    png_util_image b = make_image(280, 500, PNG_COLOR_TYPE_RGB);  // same class as a
+    png_util_image gray = make_image(300, 400, PNG_COLOR_TYPE_GRAY);
+    png_util_tune_target smallest = { 0, 0 };
+    png_util_tune_target fastest = { 0, 1e-9 };
+    png_util_tune_decision first, second, other, fast;
+    png_util_buffer out_a, out_b, out_gray, out_fast;
+    int ret = 0;
+    if (png_encode_auto(cache, &a, &smallest, &out_a, &first) != PNG_UTIL_SUCCESS ||
+            png_encode_auto(cache, &b, &smallest, &out_b, &second) != PNG_UTIL_SUCCESS ||
+            png_encode_auto(cache, &gray, &smallest, &out_gray, &other) != PNG_UTIL_SUCCESS ||
+            png_encode_auto(NULL, &a, &fastest, &out_fast, &fast) != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "png_encode_auto failed\n");
+        png_tune_cache_destroy(cache);
+        return 1;
+    }
+    png_util_tune_cache_stats stats;
+    png_tune_cache_stats(cache, &stats);
+    if (first.cached || !second.cached || other.cached || stats.hits != 1 || stats.misses != 2 ||
+            stats.entries != 2) {
+        fprintf(stderr, "unexpected cache stats: hits=%zu, misses=%zu\n", stats.hits, stats.misses);
+        ret = 1;
+    } else if (check_png("png_encode_auto", &a, out_a.data, out_a.size) ||
+               check_png("png_encode_auto", &b, out_b.data, out_b.size) ||
+               check_png("png_encode_auto", &gray, out_gray.data, out_gray.size) ||
+               check_png("png_encode_auto", &a, out_fast.data, out_fast.size)) {
+        ret = 1;
+    } else if (first.predicted_size < out_a.size / 2 || first.predicted_size > out_a.size * 2) {
+        fprintf(stderr, "png_encode_auto: predicted %zu bytes, got %zu\n", first.predicted_size, out_a.size);
+        ret = 1;
+    } else if (fast.options.compression_level > 3 || out_fast.size < out_a.size) {
+        fprintf(stderr, "png_encode_auto: a slow candidate was picked for a time limit\n");
+        ret = 1;
+    }
+    png_util_buffer_free(&out_a);
+    png_util_buffer_free(&out_b);
+    png_util_buffer_free(&out_gray);
+    png_util_buffer_free(&out_fast);
+    png_util_image_free(&a);
+    png_util_image_free(&b);
+    png_util_image_free(&gray);
+    png_tune_cache_destroy(cache);
+    return ret;
+}
+
+static void run_benchmark(void) {
+    png_util_image image = make_image(1024, 1024, PNG_COLOR_TYPE_RGB);
+    static const char* names[3] = { "realtime", "balanced", "archival" };
+    printf("1024x1024 RGB8 ");
+    for (int preset = PNG_UTIL_PRESET_REALTIME; preset <= PNG_UTIL_PRESET_ARCHIVAL; preset++) {
+        png_util_encode_options options;
+        png_util_buffer out;
+        png_encode_preset(preset, &options);
+        clock_t start = clock();
+        png_encode(&image, &options, &out);
+        double ms = elapsed_ms(start);
+        printf(" %s: %zu bytes %.2f ms,", names[preset - 1], out.size, ms);
+        png_util_buffer_free(&out);
+    }
+    png_util_tune_target target = { 1e6, 0 };  // a second is worth a megabyte
+    png_util_tune_decision decision;
+    png_util_buffer out;
+    clock_t start = clock();
+    png_encode_auto(NULL, &image, &target, &out, &decision);
+    double ms = elapsed_ms(start);
+    printf(" auto: level %d, %zu bytes (predicted %zu) %.2f ms\n", decision.options.compression_level, out.size,
+           decision.predicted_size, ms);
+    png_util_buffer_free(&out);
+    png_util_image_free(&image);
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_presets();
+    if (ret == 0)
+        ret = test_auto();
+    if (ret == 0)
+        run_benchmark();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}
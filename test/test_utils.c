@@ -0,0 +1,214 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void write_mem(png_struct* png, png_byte* data, size_t length) {
+    mem_buffer* buf = (mem_buffer*)png_get_io_ptr(png);
+    buf->data = (png_byte*)realloc(buf->data, buf->size + length);
+    memcpy(buf->data + buf->size, data, length);
+    buf->size += length;
+}
+
+void flush_mem(png_struct* png) {
+    (void)png;
+}
+
+void read_mem(png_struct* png, png_byte* data, size_t length) {
+    mem_reader* src = (mem_reader*)png_get_io_ptr(png);
+    if (length > src->size - src->pos)
+        png_error(png, "Read error");
+    memcpy(data, src->data + src->pos, length);
+    src->pos += length;
+}
+
+png_struct* start_png(mem_buffer* buf, png_info** info, png_uint_32 width, png_uint_32 height,
+                      int bit_depth, int color_type, int interlace) {
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    *info = png_create_info_struct(png);
+    png_set_write_fn(png, buf, write_mem, flush_mem);
+    png_set_IHDR(png, *info, width, height, bit_depth, color_type, interlace,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    return png;
+}
+
+void finish_png(png_struct* png, png_info* info, fill_row_fn fill, void* user_ptr) {
+    int bit_depth = png_get_bit_depth(png, info);
+    png_uint_32 height = png_get_image_height(png, info);
+    size_t rowbytes = (size_t)png_get_image_width(png, info) * png_get_channels(png, info) * (bit_depth > 8 ? 2 : 1);
+    if (bit_depth < 8)
+        png_set_packing(png);
+    png_byte* row = (png_byte*)malloc(rowbytes);
+    int passes = png_set_interlace_handling(png);
+    for (int pass = 0; pass < passes; pass++) {
+        for (png_uint_32 y = 0; y < height; y++) {
+            fill(row, rowbytes, y, user_ptr);
+            png_write_row(png, row);
+        }
+    }
+    free(row);
+    png_write_end(png, info);
+    png_destroy_write_struct(&png, &info);
+}
+
+mem_buffer write_png(png_uint_32 width, png_uint_32 height, int bit_depth, int color_type, int interlace,
+                     fill_row_fn fill, void* user_ptr) {
+    mem_buffer buf = { NULL, 0 };
+    png_infop info;
+    png_structp png = start_png(&buf, &info, width, height, bit_depth, color_type, interlace);
+    png_write_info(png, info);
+    finish_png(png, info, fill, user_ptr);
+    return buf;
+}
+
+void copy_row(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr) {
+    memcpy(row, (const png_byte*)user_ptr + rowbytes * y, rowbytes);
+}
+
+png_byte* decode_libpng(const png_byte* data, size_t size, transform_fn transform, void* user_ptr,
+                        size_t* rowbytes) {
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png_create_info_struct(png);
+    mem_reader src = { data, size, 0 };
+    png_set_read_fn(png, &src, read_mem);
+    png_read_info(png, info);
+    if (transform)
+        transform(png, info, user_ptr);
+    png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+    png_uint_32 height = png_get_image_height(png, info);
+    *rowbytes = png_get_rowbytes(png, info);
+    // libpng keeps the padding bits of the last byte, so they start cleared.
+    png_byte* pixels = (png_byte*)calloc(*rowbytes, height);
+    png_byte** rows = (png_byte**)malloc(sizeof(png_byte*) * height);
+    for (png_uint_32 y = 0; y < height; y++)
+        rows[y] = pixels + *rowbytes * y;
+    png_read_image(png, rows);
+    png_read_end(png, NULL);
+    png_destroy_read_struct(&png, &info, NULL);
+    free(rows);
+    return pixels;
+}
+
+png_util_image alloc_image(png_uint_32 width, png_uint_32 height, int bit_depth, int color_type, size_t padding) {
+    png_util_image image;
+    memset(&image, 0, sizeof(image));
+    image.width = width;
+    image.height = height;
+    image.bit_depth = bit_depth;
+    image.color_type = color_type;
+    image.row_stride = image_rowbytes(&image) + padding;
+    image.pixels = (png_byte*)calloc(image.row_stride, height);
+    return image;
+}
+
+static size_t row_bits(const png_util_image* image) {
+    int channels = image->color_type == PNG_COLOR_TYPE_RGB_ALPHA ? 4 : image->color_type == PNG_COLOR_TYPE_RGB ? 3 :
+                   image->color_type == PNG_COLOR_TYPE_GRAY_ALPHA ? 2 : 1;
+    return (size_t)image->width * channels * image->bit_depth;
+}
+
+size_t image_rowbytes(const png_util_image* image) {
+    return (row_bits(image) + 7) / 8;
+}
+
+void clear_padding_bits(png_util_image* image) {
+    size_t bits = row_bits(image);
+    if (bits % 8 == 0)
+        return;
+    for (png_uint_32 y = 0; y < image->height; y++)
+        image->pixels[image->row_stride * y + bits / 8] &= (png_byte)(0xff00 >> (bits % 8));
+}
+
+int check_png(const char* name, const png_util_image* image, const png_byte* data, size_t size) {
+    png_util_validation result;
+    if (png_validate(data, size, PNG_UTIL_VALIDATE_DECODE, &result) != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "%s: invalid PNG (%s)\n", name, result.reason);
+        return 1;
+    }
+    png_util_image decoded;
+    if (png_read_parallel(data, size, 1, &decoded) != PNG_UTIL_SUCCESS) {
+        fprintf(stderr, "%s: failed to decode\n", name);
+        return 1;
+    }
+    int ret = 0;
+    if (decoded.width != image->width || decoded.height != image->height ||
+            decoded.bit_depth != image->bit_depth || decoded.color_type != image->color_type) {
+        fprintf(stderr, "%s: unexpected header\n", name);
+        ret = 1;
+    }
+    size_t rowbytes = image_rowbytes(image);
+    for (png_uint_32 y = 0; y < image->height && ret == 0; y++) {
+        if (memcmp(decoded.pixels + decoded.row_stride * y, image->pixels + image->row_stride * y, rowbytes) != 0) {
+            fprintf(stderr, "%s: unexpected pixels at row %u\n", name, y);
+            ret = 1;
+        }
+    }
+    png_util_image_free(&decoded);
+    return ret;
+}
+
+int same_pixels(const png_byte* a, size_t a_size, const png_byte* b, size_t b_size) {
+    png_util_image x, y;
+    if (png_read_parallel(a, a_size, 1, &x) != PNG_UTIL_SUCCESS)
+        return 0;
+    if (png_read_parallel(b, b_size, 1, &y) != PNG_UTIL_SUCCESS) {
+        png_util_image_free(&x);
+        return 0;
+    }
+    int same = x.width == y.width && x.height == y.height && x.row_stride == y.row_stride &&
+               memcmp(x.pixels, y.pixels, x.row_stride * x.height) == 0;
+    png_util_image_free(&x);
+    png_util_image_free(&y);
+    return same;
+}
+
+size_t find_chunk(const png_byte* data, size_t size, const char* type) {
+    size_t pos = 8;
+    while (pos + 12 <= size) {
+        png_uint_32 length = ((png_uint_32)data[pos] << 24) | (data[pos + 1] << 16) | (data[pos + 2] << 8) | data[pos + 3];
+        if (memcmp(data + pos + 4, type, 4) == 0)
+            return pos;
+        pos += (size_t)length + 12;
+    }
+    return 0;
+}
+
+mem_buffer read_file(const char* filename) {
+    mem_buffer buf = { NULL, 0 };
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "failed to open %s\n", filename);
+        return buf;
+    }
+    fseek(fp, 0, SEEK_END);
+    buf.size = (size_t)ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buf.data = (png_byte*)malloc(buf.size ? buf.size : 1);
+    if (buf.data && fread(buf.data, 1, buf.size, fp) != buf.size) {
+        free(buf.data);
+        buf.data = NULL;
+    }
+    fclose(fp);
+    return buf;
+}
+
+int write_file(const char* filename, const mem_buffer* buf) {
+    FILE* fp = fopen(filename, "wb");
+    if (!fp)
+        return 1;
+    size_t written = fwrite(buf->data, 1, buf->size, fp);
+    fclose(fp);
+    return written != buf->size;
+}
+
+static unsigned int seed = 1;
+
+png_byte random_byte(void) {
+    seed = seed * 1103515245 + 12345;
+    return (png_byte)(seed >> 16);
+}
+
+double elapsed_ms(clock_t start) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC * 1000;
+}
@@ -0,0 +1,86 @@
+// Fixtures shared by the libpng-loader-utils tests.
+// Every add_png_utils_test target links test_utils.c.
+#ifndef TEST_UTILS_H
+#define TEST_UTILS_H
+
+#include "libpng-loader-utils.h"
+#include <time.h>
+
+// A growable PNG stream. Free data when done.
+typedef struct mem_buffer {
+    png_byte* data;
+    size_t size;
+} mem_buffer;
+
+// A read position in a PNG stream.
+typedef struct mem_reader {
+    const png_byte* data;
+    size_t size;
+    size_t pos;
+} mem_reader;
+
+// libpng I/O callbacks. write_mem appends to a mem_buffer, read_mem consumes a mem_reader.
+void write_mem(png_struct* png, png_byte* data, size_t length);
+void flush_mem(png_struct* png);
+void read_mem(png_struct* png, png_byte* data, size_t length);
+
+// Fills row y of an image being encoded.
+// Samples are one byte each below 8 bits and two big-endian bytes at 16 bits.
+// Interlaced images call it once per row in every pass.
+typedef void (*fill_row_fn)(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr);
+
+// Creates a write struct that writes to buf, and sets IHDR.
+// Set more chunks on info, call png_write_info and then finish_png.
+png_struct* start_png(mem_buffer* buf, png_info** info, png_uint_32 width, png_uint_32 height,
+                      int bit_depth, int color_type, int interlace);
+
+// Writes every row from fill and the end of the stream, then destroys png.
+void finish_png(png_struct* png, png_info* info, fill_row_fn fill, void* user_ptr);
+
+// Encodes an image without ancillary chunks.
+mem_buffer write_png(png_uint_32 width, png_uint_32 height, int bit_depth, int color_type, int interlace,
+                     fill_row_fn fill, void* user_ptr);
+
+// A fill_row_fn that copies rows from contiguous pixels at user_ptr.
+void copy_row(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr);
+
+// Decodes a PNG with libpng as the reference reader.
+// transform can set up transformations after png_read_info, and may be NULL.
+// Returns contiguous rows of rowbytes bytes, or NULL. Free with free().
+typedef void (*transform_fn)(png_struct* png, png_info* info, void* user_ptr);
+png_byte* decode_libpng(const png_byte* data, size_t size, transform_fn transform, void* user_ptr,
+                        size_t* rowbytes);
+
+// Allocates a zero-filled image whose rows are padded by padding bytes.
+// Free with png_util_image_free().
+png_util_image alloc_image(png_uint_32 width, png_uint_32 height, int bit_depth, int color_type, size_t padding);
+
+// Bytes of pixels in a row of image, without the padding.
+size_t image_rowbytes(const png_util_image* image);
+
+// Clears the bits after the last sample of every row, which decoders don't keep.
+void clear_padding_bits(png_util_image* image);
+
+// Validates a PNG and checks that it decodes to image. Messages start with name.
+// Returns 0 on success.
+int check_png(const char* name, const png_util_image* image, const png_byte* data, size_t size);
+
+// Checks that two PNGs decode to the same pixels.
+int same_pixels(const png_byte* a, size_t a_size, const png_byte* b, size_t b_size);
+
+// Offset of the first chunk of a type, or 0.
+size_t find_chunk(const png_byte* data, size_t size, const char* type);
+
+// Reads a whole file. data is NULL on failure.
+mem_buffer read_file(const char* filename);
+
+// Writes a whole file. Returns 0 on success.
+int write_file(const char* filename, const mem_buffer* buf);
+
+// Deterministic pseudo-random bytes. Every test process starts from the same seed.
+png_byte random_byte(void);
+
+// Milliseconds of CPU time since start.
+double elapsed_ms(clock_t start);
+
+#endif  // TEST_UTILS_H
@@ -0,0 +1,210 @@
+#include "test_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void fill_row(png_byte* row, size_t rowbytes, png_uint_32 y, void* user_ptr) {
+    int palette = *(const int*)user_ptr;
+    for (size_t x = 0; x < rowbytes; x++)
+        row[x] = palette ? (png_byte)((x + y) % 4) : (png_byte)(x * 13 + y * 7 + (x * y >> 5));
+}
+
+// Writes an RGB image, or a palette image with four colors.
+static mem_buffer make_png(png_uint_32 width, png_uint_32 height, int palette, int interlace) {
+    mem_buffer buf = { NULL, 0 };
+    png_infop info;
+    png_structp png = start_png(&buf, &info, width, height, 8, palette ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_RGB,
+                                interlace);
+    if (palette) {
+        png_color colors[4] = { { 0, 0, 0 }, { 255, 0, 0 }, { 0, 255, 0 }, { 0, 0, 255 } };
+        png_set_PLTE(png, info, colors, 4);
+    }
+    png_write_info(png, info);
+    finish_png(png, info, fill_row, &palette);
+    return buf;
+}
+
+// Recomputes the CRC of the chunk at pos.
+static void fix_crc(png_byte* data, size_t pos) {
+    png_uint_32 length = ((png_uint_32)data[pos] << 24) | (data[pos + 1] << 16) | (data[pos + 2] << 8) | data[pos + 3];
+    png_uint_32 crc = png_util_crc32(0, data + pos + 4, (size_t)length + 4);
+    png_byte* p = data + pos + 8 + length;
+    p[0] = (png_byte)(crc >> 24);
+    p[1] = (png_byte)(crc >> 16);
+    p[2] = (png_byte)(crc >> 8);
+    p[3] = (png_byte)crc;
+}
+
+// Checks the result of each level. expected[i] is for level i + 1.
+static int check_levels(const char* name, const png_byte* data, size_t size, const png_util_error expected[3],
+                        size_t offset) {
+    for (int level = 1; level <= 3; level++) {
+        png_util_validation result;
+        png_util_error err = png_validate(data, size, level, &result);
+        if (err != expected[level - 1]) {
+            fprintf(stderr, "%s: level %d returned %u (%s)\n", name, level, err, result.reason);
+            return 1;
+        }
+        if (err == PNG_UTIL_SUCCESS && (result.reason[0] != '\0' || result.bytes != size)) {
+            fprintf(stderr, "%s: level %d: unexpected result\n", name, level);
+            return 1;
+        }
+        if (err == PNG_UTIL_ERROR_INVALID_PNG && level == 1 && result.offset != offset) {
+            fprintf(stderr, "%s: unexpected offset %llu (%s)\n", name, result.offset, result.reason);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int test_valid(void) {
+    static const png_util_error valid[3] = { PNG_UTIL_SUCCESS, PNG_UTIL_SUCCESS, PNG_UTIL_SUCCESS };
+    int ret = 0;
+    for (int i = 0; i < 4 && ret == 0; i++) {
+        mem_buffer buf = make_png(67, 45, i & 1, i >> 1);
+        ret = check_levels("valid", buf.data, buf.size, valid, 0);
+        free(buf.data);
+    }
+    return ret;
+}
+
+static int test_invalid(void) {
+    static const png_util_error all[3] = {
+        PNG_UTIL_ERROR_INVALID_PNG, PNG_UTIL_ERROR_INVALID_PNG, PNG_UTIL_ERROR_INVALID_PNG
+    };
+    static const png_util_error inflate[3] = {
+        PNG_UTIL_SUCCESS, PNG_UTIL_ERROR_INVALID_PNG, PNG_UTIL_ERROR_INVALID_PNG
+    };
+    mem_buffer buf = make_png(67, 45, 0, PNG_INTERLACE_ADAM7);
+    png_byte* copy = (png_byte*)malloc(buf.size);
+    size_t idat = find_chunk(buf.data, buf.size, "IDAT");
+    size_t iend = find_chunk(buf.data, buf.size, "IEND");
+    int ret = 0;
+
+    // A flipped bit in IDAT
+    memcpy(copy, buf.data, buf.size);
+    copy[idat + 20] ^= 0x10;
+    ret = check_levels("IDAT CRC", copy, buf.size, all, idat);
+
+    // Truncated at IEND
+    if (ret == 0)
+        ret = check_levels("truncated", buf.data, iend, all, iend);
+
+    // A corrupted zlib stream with a valid CRC
+    memcpy(copy, buf.data, buf.size);
+    memset(copy + idat + 20, 0xff, 16);
+    fix_crc(copy, idat);
+    if (ret == 0)
+        ret = check_levels("zlib stream", copy, buf.size, inflate, 0);
+
+    // IHDR claims fewer or more rows than the image data has.
+    for (int delta = -1; delta <= 1 && ret == 0; delta += 2) {
+        memcpy(copy, buf.data, buf.size);
+        copy[8 + 8 + 7] = (png_byte)(45 + delta);
+        fix_crc(copy, 8);
+        ret = check_levels(delta < 0 ? "extra rows" : "missing rows", copy, buf.size, inflate, 0);
+    }
+
+    // An unknown critical chunk
+    memcpy(copy, buf.data, buf.size);
+    memcpy(copy + iend + 4, "IENX", 4);
+    fix_crc(copy, iend);
+    if (ret == 0)
+        ret = check_levels("critical chunk", copy, buf.size, all, iend);
+    free(copy);
+    free(buf.data);
+
+    // A palette image without PLTE
+    buf = make_png(20, 20, 1, PNG_INTERLACE_NONE);
+    size_t plte = find_chunk(buf.data, buf.size, "PLTE");
+    memcpy(buf.data + plte + 4, "sPLT", 4);
+    fix_crc(buf.data, plte);
+    if (ret == 0)
+        ret = check_levels("PLTE", buf.data, buf.size, all, find_chunk(buf.data, buf.size, "IDAT"));
+    free(buf.data);
+    return ret;
+}
+
+// The PCLMULQDQ kernel must match the table.
+static int test_crc(void) {
+    png_byte data[1000];
+    for (int i = 0; i < 1000; i++)
+        data[i] = (png_byte)(i * 7 + (i >> 5));
+    for (size_t size = 0; size <= 1000; size += 13) {
+        png_uint_32 simd = png_util_crc32(0x12345678, data + 1, size - (size > 0));
+        png_util_set_cpu_mask(0);
+        png_uint_32 scalar = png_util_crc32(0x12345678, data + 1, size - (size > 0));
+        png_util_set_cpu_mask(~0U);
+        if (simd != scalar) {
+            fprintf(stderr, "png_util_crc32: SIMD and scalar results differ\n");
+            return 1;
+        }
+    }
+    if (png_util_crc32(0, (const png_byte*)"123456789", 9) != 0xcbf43926) {
+        fprintf(stderr, "png_util_crc32: unexpected check value\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int test_files(void) {
+    mem_buffer buf = make_png(50, 30, 0, PNG_INTERLACE_NONE);
+    write_file("validate0.png", &buf);
+    buf.size /= 2;
+    write_file("validate1.png", &buf);
+    free(buf.data);
+    const char* paths[3] = { "validate0.png", "validate1.png", "validate_missing.png" };
+    png_util_error errors[3];
+    png_util_validate_stats stats;
+    png_util_error err = png_validate_files(paths, 3, 2, PNG_UTIL_VALIDATE_INFLATE, errors, &stats);
+    if (err == PNG_UTIL_SUCCESS || errors[0] != PNG_UTIL_SUCCESS || errors[1] != PNG_UTIL_ERROR_INVALID_PNG ||
+            errors[2] != PNG_UTIL_ERROR_IO || stats.files != 3 || stats.invalid != 1) {
+        fprintf(stderr, "png_validate_files: unexpected results: %u, %u, %u\n", errors[0], errors[1], errors[2]);
+        return 1;
+    }
+    png_util_validation result;
+    if (png_validate_file(paths[1], PNG_UTIL_VALIDATE_DECODE, &result) != PNG_UTIL_ERROR_INVALID_PNG ||
+            result.reason[0] == '\0') {
+        fprintf(stderr, "png_validate_file accepted a truncated file\n");
+        return 1;
+    }
+    return 0;
+}
+
+static void run_benchmark(void) {
+    mem_buffer buf = make_png(1024, 1024, 0, PNG_INTERLACE_NONE);
+    write_file("validate_large.png", &buf);
+    free(buf.data);
+    const char* paths[16];
+    png_util_error errors[16];
+    for (int i = 0; i < 16; i++)
+        paths[i] = "validate_large.png";
+    printf("1024x1024 RGB8 ");
+    for (int level = 1; level <= 3; level++) {
+        png_util_validate_stats stats;
+        png_validate_files(paths, 16, 0, level, errors, &stats);
+        printf(" level %d: %.1f files/s", level, stats.files_per_second);
+    }
+    printf("\n");
+}
+
+int main(void) {
+    libpng_load_error err = libpng_load(LIBPNG_LOAD_FLAGS_DEFAULT | LIBPNG_LOAD_FLAGS_PRINT_ERRORS);
+    if (err != LIBPNG_SUCCESS) {
+        fprintf(stderr, "libpng_load: error: %d\n", err);
+        return 1;
+    }
+    int ret = test_crc();
+    if (ret == 0)
+        ret = test_valid();
+    if (ret == 0)
+        ret = test_invalid();
+    if (ret == 0)
+        ret = test_files();
+    if (ret == 0)
+        run_benchmark();
+    libpng_free();
+    if (ret == 0)
+        printf("Test passed!\n");
+    return ret;
+}